@@ -0,0 +1,527 @@
+/*
+ * One UDP socket for many ICE sessions.
+ *
+ * A session is found by the local half of the USERNAME in the peer's STUN
+ * binding requests, which every ICE check carries before any DTLS or SRTP
+ * can flow; the address the check came from is then bound to that session,
+ * so everything else from it (DTLS, SRTP, SRTCP, STUN responses) is routed
+ * by address alone. A later check from the same address for another ufrag
+ * moves the address, as a restarted peer would. Only checks whose
+ * MESSAGE-INTEGRITY verifies with the session's password bind or move an
+ * address; anyone can put a ufrag in a USERNAME, so an unsigned check would
+ * let a spoofed source take over another session's media.
+ *
+ * The receive thread drains the socket with recvmmsg(), taking the session
+ * table's lock once per batch rather than once per packet.
+ */
+
+#include "udp_mux.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define STUN_MAGIC_COOKIE 0x2112A442
+#define STUN_HEADER_SIZE 20
+#define STUN_ATTR_USERNAME 0x0006
+#define STUN_ATTR_MESSAGE_INTEGRITY 0x0008
+#define STUN_HMAC_SIZE 20
+
+/* Anything larger than a path MTU is not ours */
+#define UDP_MUX_PACKET_SIZE 2048
+
+struct UdpMuxSession {
+    std::string ufrag;
+    std::string password;
+    UdpMuxDeliverFunc deliver;
+};
+
+struct UdpMux {
+    int fd = -1;
+    int wake[2] = { -1, -1 };
+    unsigned port = 0;
+    unsigned batch = 0;
+    std::thread thread;
+
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<UdpMuxSession>> by_ufrag;
+    std::unordered_map<std::string, std::shared_ptr<UdpMuxSession>> by_address;
+
+    std::atomic<uint64_t> packets{ 0 };
+    std::atomic<uint64_t> bytes{ 0 };
+    std::atomic<uint64_t> batches{ 0 };
+    std::atomic<uint64_t> dropped{ 0 };
+    std::atomic<uint64_t> unauthenticated{ 0 };
+    std::atomic<int64_t> cpu_ns{ 0 };
+};
+
+UdpPacketKind
+udp_mux_classify(const uint8_t* data, size_t size)
+{
+    if (size == 0)
+        return UDP_PACKET_OTHER;
+    const uint8_t b = data[0];
+    if (b <= 3)
+        return UDP_PACKET_STUN;
+    if (b >= 20 && b <= 63)
+        return UDP_PACKET_DTLS;
+    if (b >= 128 && b <= 191)
+        return UDP_PACKET_RTP;
+    return UDP_PACKET_OTHER;
+}
+
+static uint16_t
+read_u16(const uint8_t* p)
+{
+    return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+bool
+udp_mux_stun_local_ufrag(const uint8_t* data, size_t size, std::string* ufrag)
+{
+    if (size < STUN_HEADER_SIZE || (data[0] & 0xc0) != 0)
+        return false;
+    const uint32_t cookie = (uint32_t) data[4] << 24 | data[5] << 16 | data[6] << 8 | data[7];
+    if (cookie != STUN_MAGIC_COOKIE)
+        return false;
+
+    /* Requests only: class bits 0b00 */
+    if ((read_u16(data) & 0x0110) != 0)
+        return false;
+
+    size_t end = STUN_HEADER_SIZE + read_u16(data + 2);
+    if (end > size)
+        end = size;
+    for (size_t pos = STUN_HEADER_SIZE; pos + 4 <= end;) {
+        const uint16_t type = read_u16(data + pos);
+        const uint16_t length = read_u16(data + pos + 2);
+        if (pos + 4 + length > end)
+            return false;
+        if (type == STUN_ATTR_USERNAME) {
+            const char *value = (const char *) data + pos + 4;
+            const void *colon = memchr(value, ':', length);
+            if (!colon || colon == value)
+                return false;
+            ufrag->assign(value, (const char *) colon - value);
+            return true;
+        }
+        pos += 4 + ((length + 3) & ~3u);
+    }
+    return false;
+}
+
+static uint32_t
+rotl32(uint32_t x, int n)
+{
+    return x << n | x >> (32 - n);
+}
+
+/* FIPS 180-4; the mux is plain POSIX and links no crypto library */
+struct Sha1 {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    uint8_t block[64];
+    size_t used = 0;
+    uint64_t length = 0;
+
+    void compress()
+    {
+        uint32_t w[80];
+        for (int i = 0; i < 16; ++i)
+            w[i] = (uint32_t) block[4 * i] << 24 | block[4 * i + 1] << 16
+                | block[4 * i + 2] << 8 | block[4 * i + 3];
+        for (int i = 16; i < 80; ++i)
+            w[i] = rotl32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; ++i) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            }
+            else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            }
+            else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            }
+            else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            const uint32_t t = rotl32(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotl32(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    void update(const uint8_t* data, size_t size)
+    {
+        length += size;
+        while (size > 0) {
+            const size_t n = std::min(size, sizeof(block) - used);
+            memcpy(block + used, data, n);
+            used += n;
+            data += n;
+            size -= n;
+            if (used == sizeof(block)) {
+                compress();
+                used = 0;
+            }
+        }
+    }
+
+    void finish(uint8_t digest[20])
+    {
+        const uint64_t bits = length * 8;
+        const uint8_t pad = 0x80;
+        update(&pad, 1);
+        const uint8_t zero = 0;
+        while (used != 56)
+            update(&zero, 1);
+        uint8_t size_be[8];
+        for (int i = 0; i < 8; ++i)
+            size_be[i] = (uint8_t) (bits >> (56 - 8 * i));
+        update(size_be, 8);
+        for (int i = 0; i < 5; ++i) {
+            digest[4 * i] = (uint8_t) (h[i] >> 24);
+            digest[4 * i + 1] = (uint8_t) (h[i] >> 16);
+            digest[4 * i + 2] = (uint8_t) (h[i] >> 8);
+            digest[4 * i + 3] = (uint8_t) h[i];
+        }
+    }
+};
+
+void
+udp_mux_hmac_sha1(const std::string& key, const uint8_t* data, size_t size, uint8_t digest[20])
+{
+    uint8_t k[64] = {};
+    if (key.size() > sizeof(k)) {
+        Sha1 hash;
+        hash.update((const uint8_t *) key.data(), key.size());
+        hash.finish(k);
+    }
+    else {
+        memcpy(k, key.data(), key.size());
+    }
+
+    uint8_t pad[64];
+    for (size_t i = 0; i < sizeof(pad); ++i)
+        pad[i] = k[i] ^ 0x36;
+    Sha1 inner;
+    inner.update(pad, sizeof(pad));
+    inner.update(data, size);
+    uint8_t inner_digest[20];
+    inner.finish(inner_digest);
+
+    for (size_t i = 0; i < sizeof(pad); ++i)
+        pad[i] = k[i] ^ 0x5c;
+    Sha1 outer;
+    outer.update(pad, sizeof(pad));
+    outer.update(inner_digest, sizeof(inner_digest));
+    outer.finish(digest);
+}
+
+bool
+udp_mux_stun_check_integrity(const uint8_t* data, size_t size, const std::string& password)
+{
+    if (size < STUN_HEADER_SIZE)
+        return false;
+    size_t end = STUN_HEADER_SIZE + read_u16(data + 2);
+    if (end > size)
+        return false;
+
+    bool username = false;
+    for (size_t pos = STUN_HEADER_SIZE; pos + 4 <= end;) {
+        const uint16_t type = read_u16(data + pos);
+        const uint16_t length = read_u16(data + pos + 2);
+        if (pos + 4 + length > end)
+            return false;
+        if (type == STUN_ATTR_USERNAME)
+            username = true;
+        else if (type == STUN_ATTR_MESSAGE_INTEGRITY) {
+            if (!username || length != STUN_HMAC_SIZE)
+                return false;
+
+            /* The HMAC covers the message up to the attribute, with the
+             * header's length as if the attribute ended it (RFC 5389, 15.4) */
+            std::vector<uint8_t> covered(data, data + pos);
+            const size_t covered_length = pos + 4 + STUN_HMAC_SIZE - STUN_HEADER_SIZE;
+            covered[2] = (uint8_t) (covered_length >> 8);
+            covered[3] = (uint8_t) covered_length;
+
+            uint8_t digest[STUN_HMAC_SIZE];
+            udp_mux_hmac_sha1(password, covered.data(), covered.size(), digest);
+            uint8_t diff = 0;
+            for (size_t i = 0; i < STUN_HMAC_SIZE; ++i)
+                diff |= digest[i] ^ data[pos + 4 + i];
+            return diff == 0;
+        }
+        pos += 4 + ((length + 3) & ~3u);
+    }
+    return false;
+}
+
+/* Family, port and address bytes, usable as a map key */
+static std::string
+address_key(const struct sockaddr* address)
+{
+    if (address->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *) address;
+        std::string key(1, '4');
+        key.append((const char *) &in->sin_port, sizeof(in->sin_port));
+        key.append((const char *) &in->sin_addr, sizeof(in->sin_addr));
+        return key;
+    }
+    if (address->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) address;
+        std::string key(1, '6');
+        key.append((const char *) &in6->sin6_port, sizeof(in6->sin6_port));
+        key.append((const char *) &in6->sin6_addr, sizeof(in6->sin6_addr));
+        return key;
+    }
+    return std::string();
+}
+
+/* Under mux->mutex */
+static void
+route(UdpMux * mux, const uint8_t* data, size_t size, const struct sockaddr* from, socklen_t from_len)
+{
+    const UdpPacketKind kind = udp_mux_classify(data, size);
+    const std::string key = address_key(from);
+    UdpMuxSession *session = NULL;
+
+    std::string ufrag;
+    if (kind == UDP_PACKET_STUN && udp_mux_stun_local_ufrag(data, size, &ufrag)) {
+        auto it = mux->by_ufrag.find(ufrag);
+        if (it != mux->by_ufrag.end()) {
+            if (!udp_mux_stun_check_integrity(data, size, it->second->password)) {
+                mux->unauthenticated.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            session = it->second.get();
+            mux->by_address[key] = it->second;
+        }
+    }
+    else {
+        auto it = mux->by_address.find(key);
+        if (it != mux->by_address.end())
+            session = it->second.get();
+    }
+
+    if (!session) {
+        mux->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    session->deliver(kind, data, size, from, from_len);
+}
+
+static int64_t
+thread_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+receive_loop(UdpMux * mux)
+{
+    const unsigned n = mux->batch;
+    std::vector<uint8_t> buffers((size_t) n * UDP_MUX_PACKET_SIZE);
+    std::vector<struct sockaddr_storage> addresses(n);
+    std::vector<struct iovec> iov(n);
+    std::vector<struct mmsghdr> messages(n);
+
+    const int64_t cpu_start = thread_cpu_ns();
+    struct pollfd fds[2] = { { mux->fd, POLLIN, 0 }, { mux->wake[0], POLLIN, 0 } };
+    for (;;) {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            break;
+        if (fds[1].revents)
+            break;
+
+        /* Until the socket is empty, a batch at a time */
+        for (;;) {
+            for (unsigned i = 0; i < n; ++i) {
+                iov[i].iov_base = &buffers[(size_t) i * UDP_MUX_PACKET_SIZE];
+                iov[i].iov_len = UDP_MUX_PACKET_SIZE;
+                memset(&messages[i].msg_hdr, 0, sizeof(messages[i].msg_hdr));
+                messages[i].msg_hdr.msg_iov = &iov[i];
+                messages[i].msg_hdr.msg_iovlen = 1;
+                messages[i].msg_hdr.msg_name = &addresses[i];
+                messages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+            }
+            const int got = recvmmsg(mux->fd, messages.data(), n, MSG_DONTWAIT, NULL);
+            if (got <= 0)
+                break;
+
+            uint64_t bytes = 0;
+            {
+                std::lock_guard<std::mutex> lock(mux->mutex);
+                for (int i = 0; i < got; ++i) {
+                    if (messages[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                        mux->dropped.fetch_add(1, std::memory_order_relaxed);
+                        continue;
+                    }
+                    route(mux, (const uint8_t *) iov[i].iov_base, messages[i].msg_len,
+                        (const struct sockaddr *) &addresses[i], messages[i].msg_hdr.msg_namelen);
+                    bytes += messages[i].msg_len;
+                }
+            }
+            mux->packets.fetch_add(got, std::memory_order_relaxed);
+            mux->bytes.fetch_add(bytes, std::memory_order_relaxed);
+            mux->batches.fetch_add(1, std::memory_order_relaxed);
+            mux->cpu_ns.store(thread_cpu_ns() - cpu_start, std::memory_order_relaxed);
+            if ((unsigned) got < n)
+                break;
+        }
+    }
+    mux->cpu_ns.store(thread_cpu_ns() - cpu_start, std::memory_order_relaxed);
+}
+
+UdpMux *
+udp_mux_new(const char* address, unsigned port, unsigned batch)
+{
+    struct sockaddr_storage storage = {};
+    socklen_t length;
+    struct sockaddr_in *in = (struct sockaddr_in *) &storage;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &storage;
+
+    if (!address || inet_pton(AF_INET, address, &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        length = sizeof(*in);
+    }
+    else if (inet_pton(AF_INET6, address, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        length = sizeof(*in6);
+    }
+    else {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    const int fd = socket(storage.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return NULL;
+
+    /* Every session's media lands here; give bursts room */
+    const int buffer = 4 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+    if (bind(fd, (struct sockaddr *) &storage, length) != 0
+        || getsockname(fd, (struct sockaddr *) &storage, &length) != 0) {
+        const int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+
+    UdpMux *mux = new UdpMux;
+    mux->fd = fd;
+    mux->port = ntohs(storage.ss_family == AF_INET ? in->sin_port : in6->sin6_port);
+    mux->batch = batch ? batch : 1;
+    if (pipe2(mux->wake, O_CLOEXEC) != 0) {
+        const int saved = errno;
+        close(fd);
+        delete mux;
+        errno = saved;
+        return NULL;
+    }
+    mux->thread = std::thread(receive_loop, mux);
+    return mux;
+}
+
+void
+udp_mux_free(UdpMux* mux)
+{
+    if (!mux)
+        return;
+
+    const char stop = 0;
+    while (write(mux->wake[1], &stop, 1) < 0 && errno == EINTR)
+        ;
+    mux->thread.join();
+    close(mux->wake[0]);
+    close(mux->wake[1]);
+    close(mux->fd);
+    delete mux;
+}
+
+unsigned
+udp_mux_get_port(UdpMux* mux)
+{
+    return mux->port;
+}
+
+void
+udp_mux_add_session(UdpMux* mux, const std::string& local_ufrag,
+    const std::string& local_password, UdpMuxDeliverFunc deliver)
+{
+    auto session = std::make_shared<UdpMuxSession>();
+    session->ufrag = local_ufrag;
+    session->password = local_password;
+    session->deliver = std::move(deliver);
+
+    std::lock_guard<std::mutex> lock(mux->mutex);
+    mux->by_ufrag[local_ufrag] = session;
+}
+
+void
+udp_mux_remove_session(UdpMux* mux, const std::string& local_ufrag)
+{
+    std::lock_guard<std::mutex> lock(mux->mutex);
+    mux->by_ufrag.erase(local_ufrag);
+    for (auto it = mux->by_address.begin(); it != mux->by_address.end();) {
+        if (it->second->ufrag == local_ufrag)
+            it = mux->by_address.erase(it);
+        else
+            ++it;
+    }
+}
+
+ssize_t
+udp_mux_send(UdpMux* mux, const uint8_t* data, size_t size,
+    const struct sockaddr* to, socklen_t to_len)
+{
+    return sendto(mux->fd, data, size, 0, to, to_len);
+}
+
+UdpMuxStats
+udp_mux_get_stats(UdpMux* mux)
+{
+    UdpMuxStats stats;
+    stats.packets = mux->packets.load(std::memory_order_relaxed);
+    stats.bytes = mux->bytes.load(std::memory_order_relaxed);
+    stats.batches = mux->batches.load(std::memory_order_relaxed);
+    stats.dropped = mux->dropped.load(std::memory_order_relaxed);
+    stats.unauthenticated = mux->unauthenticated.load(std::memory_order_relaxed);
+    stats.cpu_ns = mux->cpu_ns.load(std::memory_order_relaxed);
+    return stats;
+}
@@ -0,0 +1,93 @@
+/*
+ * One UDP socket shared by many ICE sessions: STUN, DTLS and SRTP arriving
+ * on it are told apart by their first byte (RFC 7983) and handed to the
+ * session whose local ufrag the STUN USERNAME names, or which last sent an
+ * authenticated STUN check from the same remote address. Linux only, for
+ * recvmmsg().
+ *
+ * A prototype for udp-mux-bench: libnice agents own their sockets and
+ * webrtcbin can't hand them a shared one, so the receiver doesn't use it.
+ */
+
+#ifndef UDP_MUX_H
+#define UDP_MUX_H
+
+#include <sys/socket.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+
+enum UdpPacketKind {
+    UDP_PACKET_STUN,            /* first byte 0..3 */
+    UDP_PACKET_DTLS,            /* 20..63 */
+    UDP_PACKET_RTP,             /* 128..191, RTP and RTCP */
+    UDP_PACKET_OTHER,
+};
+
+UdpPacketKind udp_mux_classify(const uint8_t* data, size_t size);
+
+/*
+ * The receiver's ufrag from a STUN request's USERNAME ("local:remote").
+ */
+bool udp_mux_stun_local_ufrag(const uint8_t* data, size_t size, std::string* ufrag);
+
+/*
+ * HMAC-SHA1, as STUN MESSAGE-INTEGRITY uses it.
+ */
+void udp_mux_hmac_sha1(const std::string& key, const uint8_t* data, size_t size,
+    uint8_t digest[20]);
+
+/*
+ * Checks a STUN message's MESSAGE-INTEGRITY with a short-term credential,
+ * the ICE password of the receiving side (RFC 8445, 7.2.2). False when the
+ * attribute is missing, or doesn't cover the USERNAME.
+ */
+bool udp_mux_stun_check_integrity(const uint8_t* data, size_t size, const std::string& password);
+
+/*
+ * Runs on the mux's receive thread; must not block.
+ */
+typedef std::function<void(UdpPacketKind kind, const uint8_t* data, size_t size,
+    const struct sockaddr* from, socklen_t from_len)> UdpMuxDeliverFunc;
+
+struct UdpMuxStats {
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t batches = 0;       /* recvmmsg() calls that returned packets */
+    uint64_t dropped = 0;       /* no session for the ufrag or address */
+    uint64_t unauthenticated = 0;   /* checks that failed MESSAGE-INTEGRITY, not bound */
+    int64_t cpu_ns = 0;         /* receive thread */
+};
+
+struct UdpMux;
+
+/*
+ * Binds address:port (port 0 picks one); batch is the most packets one
+ * recvmmsg() returns. NULL with errno set on failure.
+ */
+UdpMux* udp_mux_new(const char* address, unsigned port, unsigned batch);
+void udp_mux_free(UdpMux* mux);
+
+unsigned udp_mux_get_port(UdpMux* mux);
+
+/*
+ * local_password authenticates the peer's checks; only those move an
+ * address to the session.
+ */
+void udp_mux_add_session(UdpMux* mux, const std::string& local_ufrag,
+    const std::string& local_password, UdpMuxDeliverFunc deliver);
+void udp_mux_remove_session(UdpMux* mux, const std::string& local_ufrag);
+
+/*
+ * Replies leave from the shared port, so the peer's checks and DTLS see one
+ * address per session whatever the number of sessions.
+ */
+ssize_t udp_mux_send(UdpMux* mux, const uint8_t* data, size_t size,
+    const struct sockaddr* to, socklen_t to_len);
+
+UdpMuxStats udp_mux_get_stats(UdpMux* mux);
+
+#endif
@@ -0,0 +1,343 @@
+/*
+ * Compares receiving many loopback sessions on one multiplexed UDP port
+ * (recvmmsg, demultiplexed by ufrag and address) with one socket per
+ * session read by poll() and recvfrom(), as libnice does.
+ *
+ * udp-mux-bench [SESSIONS [SECONDS [RATE]]]
+ *
+ * Every session first sends a STUN binding request naming its ufrag, signed
+ * with its password, then RTP-sized packets; on the mux one more check, for
+ * the first session but signed with the wrong password, comes from the
+ * second session's address and must not move it. Each layout is run unpaced, which shows the most one
+ * receive thread can take, and at RATE packets per second per session,
+ * which shows the CPU the same load costs. Sender CPU is not counted.
+ */
+
+#include "udp_mux.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define PACKET_SIZE 1200
+#define SENDER_THREADS 4
+
+struct Sender {
+    int fd;
+    struct sockaddr_in to;
+    std::string ufrag;
+    std::string password;
+};
+
+static int64_t
+thread_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+udp_socket(unsigned port, struct sockaddr_in* bound)
+{
+    const int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    socklen_t length = sizeof(address);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0
+        || getsockname(fd, (struct sockaddr *) &address, &length) != 0) {
+        perror("udp-mux-bench: socket");
+        exit(1);
+    }
+    if (bound)
+        *bound = address;
+    return fd;
+}
+
+/* A binding request with USERNAME "ufrag:peer" and MESSAGE-INTEGRITY */
+static std::vector<uint8_t>
+stun_request(const std::string& ufrag, const std::string& password)
+{
+    const std::string username = ufrag + ":peer";
+    const size_t padded = (username.size() + 3) & ~(size_t) 3;
+    const size_t length = 4 + padded + 4 + 20;
+    std::vector<uint8_t> packet(20 + length, 0);
+    packet[1] = 0x01;
+    packet[2] = (uint8_t) (length >> 8);
+    packet[3] = (uint8_t) length;
+    packet[4] = 0x21; packet[5] = 0x12; packet[6] = 0xa4; packet[7] = 0x42;
+    for (int i = 8; i < 20; ++i)
+        packet[i] = (uint8_t) rand();
+    packet[21] = 0x06;
+    packet[22] = (uint8_t) (username.size() >> 8);
+    packet[23] = (uint8_t) username.size();
+    memcpy(&packet[24], username.data(), username.size());
+
+    const size_t integrity = 24 + padded;
+    packet[integrity + 1] = 0x08;
+    packet[integrity + 3] = 20;
+    udp_mux_hmac_sha1(password, packet.data(), integrity, &packet[integrity + 4]);
+    return packet;
+}
+
+static void
+send_check(const Sender& from, const std::string& ufrag, const std::string& password)
+{
+    const std::vector<uint8_t> check = stun_request(ufrag, password);
+    sendto(from.fd, check.data(), check.size(), 0, (const struct sockaddr *) &from.to,
+        sizeof(from.to));
+}
+
+static void
+send_checks(const std::vector<Sender>& senders)
+{
+    for (const auto& s : senders)
+        send_check(s, s.ufrag, s.password);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+}
+
+/* Round robin over this thread's sessions, rounds per second = rate */
+static void
+send_loop(const std::vector<Sender>& senders, size_t first, size_t step, int rate,
+    std::chrono::steady_clock::time_point end, std::atomic<uint64_t>* sent)
+{
+    uint8_t packet[PACKET_SIZE] = { 0x80, 96 };
+    auto next = std::chrono::steady_clock::now();
+    const auto interval = std::chrono::nanoseconds(rate > 0 ? 1000000000 / rate : 0);
+    uint64_t count = 0;
+    uint16_t seq = 0;
+
+    while (std::chrono::steady_clock::now() < end) {
+        packet[2] = (uint8_t) (seq >> 8);
+        packet[3] = (uint8_t) seq++;
+        for (size_t i = first; i < senders.size(); i += step) {
+            const Sender& s = senders[i];
+            if (sendto(s.fd, packet, sizeof(packet), 0, (const struct sockaddr *) &s.to, sizeof(s.to)) > 0)
+                ++count;
+        }
+        if (rate > 0) {
+            next += interval;
+            std::this_thread::sleep_until(next);
+        }
+    }
+    sent->fetch_add(count);
+}
+
+struct Result {
+    uint64_t sent;
+    uint64_t received;
+    int64_t cpu_ns;
+    double seconds;
+};
+
+static Result
+run_senders(std::vector<Sender>& senders, double seconds, int rate,
+    const std::function<void()>& stop_receiver, const std::function<void(Result*)>& collect)
+{
+    std::atomic<uint64_t> sent{ 0 };
+    const auto start = std::chrono::steady_clock::now();
+    const auto end = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(seconds));
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < SENDER_THREADS; ++t)
+        threads.emplace_back(send_loop, std::cref(senders), (size_t) t, (size_t) SENDER_THREADS, rate, end, &sent);
+    for (auto& thread : threads)
+        thread.join();
+
+    /* Let the receiver drain what is queued */
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    stop_receiver();
+
+    Result result = {};
+    result.sent = sent.load();
+    result.seconds = seconds;
+    collect(&result);
+    return result;
+}
+
+static Result
+run_per_session(int sessions, double seconds, int rate)
+{
+    std::vector<int> receivers;
+    std::vector<Sender> senders;
+    for (int i = 0; i < sessions; ++i) {
+        Sender s;
+        const int fd = udp_socket(0, &s.to);
+        const int buffer = 256 * 1024;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+        receivers.push_back(fd);
+        s.fd = udp_socket(0, NULL);
+        s.ufrag = "s" + std::to_string(i);
+        s.password = "password-of-s" + std::to_string(i);
+        senders.push_back(s);
+    }
+
+    int wake[2];
+    if (pipe(wake) != 0) {
+        perror("udp-mux-bench: pipe");
+        exit(1);
+    }
+    std::atomic<uint64_t> received{ 0 };
+    std::atomic<int64_t> cpu{ 0 };
+    std::thread receiver([&] {
+        std::vector<struct pollfd> fds;
+        for (int fd : receivers)
+            fds.push_back({ fd, POLLIN, 0 });
+        fds.push_back({ wake[0], POLLIN, 0 });
+        std::vector<uint64_t> per_session(receivers.size());
+        uint8_t buffer[2048];
+        const int64_t cpu_start = thread_cpu_ns();
+        for (;;) {
+            if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+                break;
+            if (fds.back().revents)
+                break;
+            for (size_t i = 0; i < receivers.size(); ++i) {
+                if (!(fds[i].revents & POLLIN))
+                    continue;
+                struct sockaddr_storage from;
+                socklen_t from_len = sizeof(from);
+                while (recvfrom(fds[i].fd, buffer, sizeof(buffer), MSG_DONTWAIT,
+                        (struct sockaddr *) &from, &from_len) > 0) {
+                    ++per_session[i];
+                    from_len = sizeof(from);
+                }
+            }
+        }
+        uint64_t total = 0;
+        for (uint64_t n : per_session)
+            total += n;
+        received = total;
+        cpu = thread_cpu_ns() - cpu_start;
+    });
+
+    send_checks(senders);
+    Result result = run_senders(senders, seconds, rate, [&] {
+        const char stop = 0;
+        if (write(wake[1], &stop, 1) != 1)
+            perror("udp-mux-bench: wake");
+        receiver.join();
+    }, [&](Result* r) {
+        r->received = received.load();
+        r->cpu_ns = cpu.load();
+    });
+
+    for (int fd : receivers)
+        close(fd);
+    for (const auto& s : senders)
+        close(s.fd);
+    close(wake[0]);
+    close(wake[1]);
+    return result;
+}
+
+static Result
+run_mux(int sessions, double seconds, int rate, uint64_t* batches)
+{
+    UdpMux *mux = udp_mux_new("127.0.0.1", 0, 64);
+    if (!mux) {
+        perror("udp-mux-bench: mux");
+        exit(1);
+    }
+
+    std::vector<uint64_t> per_session(sessions);
+    std::vector<Sender> senders;
+    for (int i = 0; i < sessions; ++i) {
+        Sender s;
+        s.fd = udp_socket(0, NULL);
+        s.to.sin_family = AF_INET;
+        s.to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        s.to.sin_port = htons(udp_mux_get_port(mux));
+        s.ufrag = "s" + std::to_string(i);
+        s.password = "password-of-s" + std::to_string(i);
+        senders.push_back(s);
+        uint64_t *count = &per_session[i];
+        udp_mux_add_session(mux, s.ufrag, s.password, [count](UdpPacketKind, const uint8_t*, size_t,
+            const struct sockaddr*, socklen_t) { ++*count; });
+    }
+
+    send_checks(senders);
+    if (sessions > 1) {
+        send_check(senders[1], senders[0].ufrag, "not-" + senders[0].password);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    const UdpMuxStats before = udp_mux_get_stats(mux);
+    UdpMuxStats after;
+    Result result = run_senders(senders, seconds, rate, [&] {
+        after = udp_mux_get_stats(mux);
+        for (int i = 0; i < sessions; ++i)
+            udp_mux_remove_session(mux, senders[i].ufrag);
+        udp_mux_free(mux);
+    }, [&](Result* r) {
+        uint64_t total = 0;
+        for (uint64_t n : per_session)
+            total += n;
+        r->received = total;
+        r->cpu_ns = after.cpu_ns - before.cpu_ns;
+        *batches = after.batches - before.batches;
+        if (after.dropped)
+            fprintf(stderr, "udp-mux-bench: %llu packets without a session\n",
+                (unsigned long long) after.dropped);
+        if (after.unauthenticated != (sessions > 1 ? 1u : 0u))
+            fprintf(stderr, "udp-mux-bench: %llu checks failed MESSAGE-INTEGRITY\n",
+                (unsigned long long) after.unauthenticated);
+    });
+
+    for (const auto& s : senders)
+        close(s.fd);
+    return result;
+}
+
+static void
+report(const char* layout, int rate, const Result& r, uint64_t batches)
+{
+    const double pps = r.received / r.seconds;
+    char pace[32];
+    if (rate > 0)
+        snprintf(pace, sizeof(pace), "%d pps/session", rate);
+    else
+        snprintf(pace, sizeof(pace), "unpaced");
+    printf("%-12s %-16s %10.0f pps  %5.1f%% lost  %5.1f%% cpu  %6.0f ns/packet",
+        layout, pace, pps, r.sent ? 100.0 * (r.sent - std::min(r.received, r.sent)) / r.sent : 0.0,
+        100.0 * r.cpu_ns / (r.seconds * 1e9), r.received ? (double) r.cpu_ns / r.received : 0.0);
+    if (batches)
+        printf("  %.1f packets/batch", (double) r.received / batches);
+    printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    const int sessions = argc > 1 ? std::max(atoi(argv[1]), 1) : 100;
+    const double seconds = argc > 2 ? std::max(atof(argv[2]), 0.1) : 3.0;
+    const int rate = argc > 3 ? std::max(atoi(argv[3]), 1) : 500;
+
+    printf("%d sessions, %d-byte packets, %.1f s per run\n", sessions, PACKET_SIZE, seconds);
+    for (int pace : { 0, rate }) {
+        report("per-session", pace, run_per_session(sessions, seconds, pace), 0);
+        uint64_t batches = 0;
+        const Result mux = run_mux(sessions, seconds, pace, &batches);
+        report("mux", pace, mux, batches);
+    }
+    return 0;
+}
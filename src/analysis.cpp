@@ -0,0 +1,305 @@
+/*
+ * Analysis frames.
+ *
+ * A probe on the decoded video takes each I420 frame through the downscaler
+ * on the streaming thread, before the frame goes on to the sink. The output
+ * is a few tens of kilobytes, so it is cheaper to produce right there than
+ * to tee the full frame into another branch and scale it there.
+ *
+ * The motion gate sits in front of the downscaler, so a skipped frame costs
+ * a sparse SAD over the luma plane and nothing else. The sink still gets
+ * every frame.
+ */
+
+#include "analysis.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define GST_CAT_DEFAULT analysis_debug
+GST_DEBUG_CATEGORY_STATIC(GST_CAT_DEFAULT);
+
+struct AnalysisConsumer {
+    AnalysisConsumerFunc func;
+    gpointer user_data;
+};
+
+struct AnalysisSession;
+
+/* Streaming thread only, but for the counters */
+struct AnalysisStream {
+    AnalysisSession *session;
+    GstVideoInfo in_info;
+    GstVideoInfo out_info;
+    Downscaler *scaler = nullptr;
+    MotionGate *gate = nullptr;
+    bool warned = false;
+
+    std::atomic<guint64> frames{ 0 };
+    std::atomic<guint64> skipped{ 0 };
+    std::atomic<gint64> busy_us{ 0 };   /* downscaling and consumers */
+    std::atomic<gint64> gate_us{ 0 };
+
+    ~AnalysisStream() {
+        downscaler_free(scaler);
+        motion_gate_free(gate);
+    }
+};
+
+struct AnalysisSession {
+    std::string name;
+    AnalysisConfig config;
+
+    std::mutex mutex;           // guards the lists
+    std::vector<std::unique_ptr<AnalysisStream>> streams;
+    std::vector<AnalysisConsumer> consumers;
+};
+
+static std::mutex registry_mutex;
+static std::vector<AnalysisSession*> sessions;
+
+static void
+collect_analysis_metrics(GString * out, gpointer unused)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    g_string_append(out,
+        "# HELP media_receiver_analysis_frames_total Decoded frames downscaled for analysis\n"
+        "# TYPE media_receiver_analysis_frames_total counter\n");
+    for (auto session : sessions) {
+        std::lock_guard<std::mutex> session_lock(session->mutex);
+        guint64 frames = 0;
+        for (const auto& stream : session->streams)
+            frames += stream->frames.load(std::memory_order_relaxed);
+        g_string_append_printf(out,
+            "media_receiver_analysis_frames_total{session=\"%s\",kernel=\"%s\"} %"
+            G_GUINT64_FORMAT "\n", session->name.c_str(), downscale_kernel(), frames);
+    }
+
+    g_string_append(out,
+        "# HELP media_receiver_analysis_seconds_total Time spent downscaling for analysis\n"
+        "# TYPE media_receiver_analysis_seconds_total counter\n");
+    for (auto session : sessions) {
+        std::lock_guard<std::mutex> session_lock(session->mutex);
+        gint64 busy_us = 0;
+        for (const auto& stream : session->streams)
+            busy_us += stream->busy_us.load(std::memory_order_relaxed);
+        g_string_append_printf(out,
+            "media_receiver_analysis_seconds_total{session=\"%s\"} %g\n",
+            session->name.c_str(), busy_us / 1e6);
+    }
+
+    g_string_append(out,
+        "# HELP media_receiver_analysis_skipped_total Decoded frames the motion gate kept from analysis\n"
+        "# TYPE media_receiver_analysis_skipped_total counter\n");
+    for (auto session : sessions) {
+        std::lock_guard<std::mutex> session_lock(session->mutex);
+        guint64 skipped = 0;
+        for (const auto& stream : session->streams)
+            skipped += stream->skipped.load(std::memory_order_relaxed);
+        g_string_append_printf(out,
+            "media_receiver_analysis_skipped_total{session=\"%s\",kernel=\"%s\"} %"
+            G_GUINT64_FORMAT "\n", session->name.c_str(), motion_kernel(), skipped);
+    }
+}
+
+AnalysisSession*
+analysis_session_new(const char* name, const AnalysisConfig& config)
+{
+    static std::once_flag once;
+    std::call_once(once, [] {
+        GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "analysis", 0, "Analysis frames");
+        metrics_register_collector(collect_analysis_metrics, NULL);
+    });
+
+    auto session = new AnalysisSession;
+    session->name = name;
+    session->config = config;
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    sessions.push_back(session);
+    return session;
+}
+
+void
+analysis_session_free(AnalysisSession* session)
+{
+    if (!session)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        sessions.erase(std::remove(sessions.begin(), sessions.end(), session), sessions.end());
+    }
+    delete session;
+}
+
+void
+analysis_session_add_consumer(AnalysisSession* session, AnalysisConsumerFunc func,
+    gpointer user_data)
+{
+    std::lock_guard<std::mutex> lock(session->mutex);
+    session->consumers.push_back({ func, user_data });
+}
+
+static void
+configure(AnalysisSession * session, AnalysisStream * stream, GstCaps * caps)
+{
+    downscaler_free(stream->scaler);
+    stream->scaler = nullptr;
+
+    if (!gst_video_info_from_caps(&stream->in_info, caps)
+        || GST_VIDEO_INFO_FORMAT(&stream->in_info) != GST_VIDEO_FORMAT_I420) {
+        if (!stream->warned)
+            GST_WARNING("%s: no analysis frames from %" GST_PTR_FORMAT,
+                session->name.c_str(), caps);
+        stream->warned = true;
+        return;
+    }
+
+    const GstVideoColorMatrix matrix = stream->in_info.colorimetry.matrix;
+    stream->scaler = downscaler_new(GST_VIDEO_INFO_WIDTH(&stream->in_info),
+        GST_VIDEO_INFO_HEIGHT(&stream->in_info), session->config.width,
+        session->config.height, session->config.format,
+        matrix == GST_VIDEO_COLOR_MATRIX_BT709 ? DOWNSCALE_BT709 : DOWNSCALE_BT601);
+    if (!stream->scaler)
+        return;
+
+    gint width, height;
+    downscaler_get_size(stream->scaler, &width, &height);
+    gst_video_info_set_format(&stream->out_info,
+        session->config.format == DOWNSCALE_RGB ? GST_VIDEO_FORMAT_RGB : GST_VIDEO_FORMAT_GRAY8,
+        width, height);
+    GST_DEBUG("%s: %dx%d analysis frames with the %s kernel", session->name.c_str(),
+        width, height, downscale_kernel());
+}
+
+static GstPadProbeReturn
+on_decoded(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    auto stream = static_cast<AnalysisStream *>(user_data);
+    AnalysisSession *session = stream->session;
+
+    if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+            GstCaps *caps;
+            gst_event_parse_caps(event, &caps);
+            configure(session, stream, caps);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    if (!stream->scaler)
+        return GST_PAD_PROBE_OK;
+
+    GstVideoFrame frame;
+    if (!gst_video_frame_map(&frame, &stream->in_info, GST_PAD_PROBE_INFO_BUFFER(info),
+            GST_MAP_READ))
+        return GST_PAD_PROBE_OK;
+
+    if (stream->gate) {
+        const gint64 gate_start = g_get_monotonic_time();
+        const gboolean pass = motion_gate_check(stream->gate,
+            static_cast<const guint8 *>(GST_VIDEO_FRAME_PLANE_DATA(&frame, 0)),
+            GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0), GST_VIDEO_FRAME_WIDTH(&frame),
+            GST_VIDEO_FRAME_HEIGHT(&frame), GST_BUFFER_PTS(frame.buffer));
+        stream->gate_us.fetch_add(g_get_monotonic_time() - gate_start,
+            std::memory_order_relaxed);
+        if (!pass) {
+            stream->skipped.fetch_add(1, std::memory_order_relaxed);
+            gst_video_frame_unmap(&frame);
+            return GST_PAD_PROBE_OK;
+        }
+    }
+
+    const gint64 start = g_get_monotonic_time();
+
+    DownscalePlanes planes;
+    for (int i = 0; i < 3; ++i) {
+        planes.data[i] = static_cast<const guint8 *>(GST_VIDEO_FRAME_PLANE_DATA(&frame, i));
+        planes.stride[i] = GST_VIDEO_FRAME_PLANE_STRIDE(&frame, i);
+    }
+
+    GstBuffer *out = gst_buffer_new_allocate(NULL, GST_VIDEO_INFO_SIZE(&stream->out_info), NULL);
+    GstMapInfo map;
+    gst_buffer_map(out, &map, GST_MAP_WRITE);
+    downscaler_process(stream->scaler, planes, map.data,
+        GST_VIDEO_INFO_PLANE_STRIDE(&stream->out_info, 0));
+    gst_buffer_unmap(out, &map);
+
+    GST_BUFFER_PTS(out) = GST_BUFFER_PTS(frame.buffer);
+    gst_video_frame_unmap(&frame);
+
+    {
+        std::lock_guard<std::mutex> lock(session->mutex);
+        for (const auto& consumer : session->consumers)
+            consumer.func(out, &stream->out_info, consumer.user_data);
+    }
+    gst_buffer_unref(out);
+
+    stream->frames.fetch_add(1, std::memory_order_relaxed);
+    stream->busy_us.fetch_add(g_get_monotonic_time() - start, std::memory_order_relaxed);
+
+    return GST_PAD_PROBE_OK;
+}
+
+void
+analysis_session_watch(AnalysisSession* session, GstPad* pad)
+{
+    auto stream = new AnalysisStream;
+    stream->session = session;
+    if (session->config.motion_gate)
+        stream->gate = motion_gate_new(session->config.motion);
+    gst_video_info_init(&stream->in_info);
+    gst_video_info_init(&stream->out_info);
+    {
+        std::lock_guard<std::mutex> lock(session->mutex);
+        session->streams.emplace_back(stream);
+    }
+
+    /* The pad may already have caps when the branch is linked late */
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    if (caps) {
+        configure(session, stream, caps);
+        gst_caps_unref(caps);
+    }
+
+    /* The session owns the stream, and outlives the pipeline */
+    gst_pad_add_probe(pad,
+        (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+        on_decoded, stream, NULL);
+}
+
+void
+analysis_session_print(AnalysisSession* session)
+{
+    std::lock_guard<std::mutex> lock(session->mutex);
+
+    for (size_t i = 0; i < session->streams.size(); ++i) {
+        const AnalysisStream& stream = *session->streams[i];
+        const guint64 frames = stream.frames.load(std::memory_order_relaxed);
+        const guint64 skipped = stream.skipped.load(std::memory_order_relaxed);
+        const gint64 busy_us = stream.busy_us.load(std::memory_order_relaxed);
+        const gint64 gate_us = stream.gate_us.load(std::memory_order_relaxed);
+        const guint64 total = frames + skipped;
+        if (!total)
+            continue;
+
+        gst_print("analysis %zu: %" G_GUINT64_FORMAT " frames, %.2f ms each (%s)",
+            i, frames, frames ? busy_us / 1e3 / frames : 0.0, downscale_kernel());
+        if (stream.gate) {
+            /* Skipped frames would have cost what forwarded ones did on average */
+            const double saved_ms = frames ? skipped * (busy_us / 1e3 / frames) : 0.0;
+            gst_print(", %" G_GUINT64_FORMAT " skipped (%.1f%%), gate %.3f ms per frame (%s), "
+                "%.0f ms saved net", skipped, 100.0 * skipped / total,
+                gate_us / 1e3 / total, motion_kernel(), saved_ms - gate_us / 1e3);
+        }
+        gst_print("\n");
+    }
+}
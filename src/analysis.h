@@ -0,0 +1,54 @@
+/*
+ * Analysis frames: decoded I420 video turned into small luma or RGB frames
+ * in one pass, handed to consumers on the streaming thread, optionally only
+ * when the picture moved.
+ */
+
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include "downscale.h"
+#include "motion.h"
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+struct AnalysisConfig {
+    DownscaleFormat format = DOWNSCALE_GRAY8;
+    gint width = 160;
+    gint height = 90;
+    bool motion_gate = false;   /* only frames that moved, and heartbeats, go on */
+    MotionConfig motion;
+};
+
+/*
+ * Called with each analysis frame, which is only valid during the call
+ * (ref it to keep it).
+ */
+typedef void (*AnalysisConsumerFunc)(GstBuffer* frame, const GstVideoInfo* info,
+    gpointer user_data);
+
+struct AnalysisSession;
+
+AnalysisSession* analysis_session_new(const char* name, const AnalysisConfig& config);
+
+/*
+ * Only once the pipeline it watches is in NULL state.
+ */
+void analysis_session_free(AnalysisSession* session);
+
+/*
+ * Watches the decoded frames leaving this src pad.
+ */
+void analysis_session_watch(AnalysisSession* session, GstPad* pad);
+
+void analysis_session_add_consumer(AnalysisSession* session, AnalysisConsumerFunc func,
+    gpointer user_data);
+
+/*
+ * Prints one line per stream: frames, how many the motion gate skipped, and
+ * the time that saved.
+ */
+void analysis_session_print(AnalysisSession* session);
+
+#endif
@@ -0,0 +1,295 @@
+/*
+ * Low-latency Opus receive.
+ *
+ * Lost packets reach the decoder as GAP events once the jitterbuffer is told
+ * to report them; opusdec then recovers the frame from the in-band FEC of
+ * the next packet when the sender put one there, and conceals it otherwise.
+ * The sinks keep the pipeline's clock sync, so rtpbin's RTCP based lip sync
+ * still lines audio up with video; only their own buffering is cut down.
+ */
+
+#include "audio.h"
+#include "metrics.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define GST_CAT_DEFAULT audio_debug
+GST_DEBUG_CATEGORY_STATIC(GST_CAT_DEFAULT);
+
+struct AudioDecoder {
+    std::string name;
+
+    /* Streaming thread only: the decoder runs its chain function there */
+    gint64 chain_start_ns = -1;
+
+    std::atomic<gint64> cpu_ns{ 0 };
+    std::atomic<guint64> frames{ 0 };
+    std::atomic<guint64> concealed{ 0 };
+};
+
+struct AudioSession {
+    std::string name;
+    AudioConfig config;
+
+    std::mutex mutex;           // guards the lists
+    std::vector<std::unique_ptr<AudioDecoder>> decoders;
+    std::vector<GstElement*> sinks;
+};
+
+static std::mutex registry_mutex;
+static std::vector<AudioSession*> sessions;
+
+static gint64
+thread_cpu_time_ns()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+        return 0;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (gint64) (k.QuadPart + u.QuadPart) * 100;
+#else
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return (gint64) ts.tv_sec * GST_SECOND + ts.tv_nsec;
+#endif
+}
+
+static GstPadProbeReturn
+on_decoder_sink(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    auto decoder = static_cast<AudioDecoder *>(user_data);
+
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+        decoder->chain_start_ns = thread_cpu_time_ns();
+    }
+    else if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) == GST_EVENT_GAP) {
+        decoder->concealed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+/* Pushed from within the chain function, so this closes the decode */
+static GstPadProbeReturn
+on_decoder_src(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    auto decoder = static_cast<AudioDecoder *>(user_data);
+
+    decoder->frames.fetch_add(1, std::memory_order_relaxed);
+    if (decoder->chain_start_ns >= 0) {
+        decoder->cpu_ns.fetch_add(thread_cpu_time_ns() - decoder->chain_start_ns,
+            std::memory_order_relaxed);
+        decoder->chain_start_ns = -1;
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+static void
+watch_decoder(AudioSession * session, GstElement * element)
+{
+    g_object_set(element, "plc", TRUE, "use-inband-fec", TRUE, NULL);
+
+    auto decoder = std::make_unique<AudioDecoder>();
+    decoder->name = GST_ELEMENT_NAME(element);
+
+    GstPad *pad = gst_element_get_static_pad(element, "sink");
+    gst_pad_add_probe(pad,
+        (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+        on_decoder_sink, decoder.get(), NULL);
+    gst_object_unref(pad);
+
+    pad = gst_element_get_static_pad(element, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_decoder_src,
+        decoder.get(), NULL);
+    gst_object_unref(pad);
+
+    std::lock_guard<std::mutex> lock(session->mutex);
+    session->decoders.push_back(std::move(decoder));
+}
+
+static bool
+is_audio_sink(GstElement * element)
+{
+    /* Avoids linking gstaudio just for GST_IS_AUDIO_BASE_SINK */
+    return GST_OBJECT_FLAG_IS_SET(element, GST_ELEMENT_FLAG_SINK)
+        && g_object_class_find_property(G_OBJECT_GET_CLASS(element), "buffer-time")
+        && g_object_class_find_property(G_OBJECT_GET_CLASS(element), "latency-time");
+}
+
+static void
+on_deep_element_added(GstBin * bin, GstBin * sub_bin, GstElement * element,
+    AudioSession * session)
+{
+    GstElementFactory *factory = gst_element_get_factory(element);
+    if (!factory || GST_IS_BIN(element))
+        return;
+
+    const gchar *name = GST_OBJECT_NAME(factory);
+    if (g_str_equal(name, "rtpjitterbuffer")) {
+        /* Without lost-packet events the decoder has nothing to conceal */
+        g_object_set(element, "do-lost", TRUE, NULL);
+    }
+    else if (g_str_equal(name, "opusdec")) {
+        watch_decoder(session, element);
+    }
+    else if (is_audio_sink(element)) {
+        g_object_set(element,
+            "buffer-time", (gint64) session->config.buffer_ms * 1000,
+            "latency-time", (gint64) session->config.period_ms * 1000, NULL);
+        GST_INFO_OBJECT(element, "%u ms buffer in %u ms periods",
+            session->config.buffer_ms, session->config.period_ms);
+
+        std::lock_guard<std::mutex> lock(session->mutex);
+        session->sinks.push_back(GST_ELEMENT(gst_object_ref(element)));
+    }
+}
+
+/* What the sink reports for the whole path up to the jitterbuffer, -1 if unknown */
+static double
+sink_latency_seconds(GstElement * sink)
+{
+    GstQuery *query = gst_query_new_latency();
+    double seconds = -1;
+
+    if (gst_element_query(sink, query)) {
+        gboolean live;
+        GstClockTime min, max;
+        gst_query_parse_latency(query, &live, &min, &max);
+        if (GST_CLOCK_TIME_IS_VALID(min))
+            seconds = (double) min / GST_SECOND;
+    }
+
+    gst_query_unref(query);
+    return seconds;
+}
+
+static void
+collect_audio_metrics(GString * out, gpointer unused)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    g_string_append(out,
+        "# HELP media_receiver_audio_latency_seconds Latency an audio sink reports for its path\n"
+        "# TYPE media_receiver_audio_latency_seconds gauge\n");
+    for (auto session : sessions) {
+        std::lock_guard<std::mutex> session_lock(session->mutex);
+        for (auto sink : session->sinks) {
+            const double seconds = sink_latency_seconds(sink);
+            if (seconds >= 0) {
+                g_string_append_printf(out,
+                    "media_receiver_audio_latency_seconds{session=\"%s\",sink=\"%s\"} %g\n",
+                    session->name.c_str(), GST_ELEMENT_NAME(sink), seconds);
+            }
+        }
+    }
+
+    struct Series {
+        const char *name;
+        const char *help;
+    };
+    static const Series series[] = {
+        { "media_receiver_audio_decode_cpu_seconds_total", "CPU time spent decoding audio" },
+        { "media_receiver_audio_frames_decoded_total", "Audio frames decoded" },
+        { "media_receiver_audio_concealed_total", "Lost audio packets concealed or recovered from FEC" },
+    };
+
+    for (guint i = 0; i < G_N_ELEMENTS(series); ++i) {
+        g_string_append_printf(out, "# HELP %s %s\n# TYPE %s counter\n",
+            series[i].name, series[i].help, series[i].name);
+        for (auto session : sessions) {
+            std::lock_guard<std::mutex> session_lock(session->mutex);
+            for (const auto& decoder : session->decoders) {
+                double value;
+                if (i == 0)
+                    value = decoder->cpu_ns.load(std::memory_order_relaxed) / 1e9;
+                else if (i == 1)
+                    value = (double) decoder->frames.load(std::memory_order_relaxed);
+                else
+                    value = (double) decoder->concealed.load(std::memory_order_relaxed);
+                g_string_append_printf(out, "%s{session=\"%s\",decoder=\"%s\"} %.17g\n",
+                    series[i].name, session->name.c_str(), decoder->name.c_str(), value);
+            }
+        }
+    }
+}
+
+AudioSession*
+audio_session_new(const char* name, const AudioConfig& config)
+{
+    static std::once_flag once;
+    std::call_once(once, [] {
+        GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "audio", 0, "Low-latency audio receive");
+        metrics_register_collector(collect_audio_metrics, NULL);
+    });
+
+    auto session = new AudioSession;
+    session->name = name;
+    session->config = config;
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    sessions.push_back(session);
+    return session;
+}
+
+void
+audio_session_free(AudioSession* session)
+{
+    if (!session)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        sessions.erase(std::remove(sessions.begin(), sessions.end(), session),
+            sessions.end());
+    }
+
+    for (auto sink : session->sinks)
+        gst_object_unref(sink);
+    delete session;
+}
+
+void
+audio_session_attach(AudioSession* session, GstBin* bin)
+{
+    g_signal_connect(bin, "deep-element-added",
+        G_CALLBACK(on_deep_element_added), session);
+}
+
+void
+audio_session_print(AudioSession* session)
+{
+    std::lock_guard<std::mutex> lock(session->mutex);
+
+    for (auto sink : session->sinks) {
+        const double seconds = sink_latency_seconds(sink);
+        if (seconds >= 0)
+            gst_print("audio %s: path latency %.1f ms\n", GST_ELEMENT_NAME(sink), seconds * 1000);
+    }
+
+    for (const auto& decoder : session->decoders) {
+        const guint64 frames = decoder->frames.load(std::memory_order_relaxed);
+        const gint64 cpu_ns = decoder->cpu_ns.load(std::memory_order_relaxed);
+        gst_print("audio %s: %" G_GUINT64_FORMAT " frames, %.1f us CPU per frame, %"
+            G_GUINT64_FORMAT " concealed\n", decoder->name.c_str(), frames,
+            frames ? cpu_ns / 1000.0 / frames : 0.0,
+            decoder->concealed.load(std::memory_order_relaxed));
+    }
+}
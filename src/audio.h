@@ -0,0 +1,36 @@
+/*
+ * Low-latency Opus receive: concealment in the decoder, a small bounded
+ * buffer in the sink, and per-stream latency and decode CPU accounting.
+ */
+
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <gst/gst.h>
+
+struct AudioConfig {
+    guint buffer_ms = 40;       /* audio sink ring buffer */
+    guint period_ms = 10;       /* audio sink segment, the unit the device is fed in */
+};
+
+struct AudioSession;
+
+AudioSession* audio_session_new(const char* name, const AudioConfig& config);
+
+/*
+ * Only once the pipeline it is attached to is in NULL state.
+ */
+void audio_session_free(AudioSession* session);
+
+/*
+ * Configures jitterbuffers, Opus decoders and audio sinks as they get added
+ * anywhere below the bin. Attach before adding children.
+ */
+void audio_session_attach(AudioSession* session, GstBin* bin);
+
+/*
+ * Prints one line per audio stream: latency, decode CPU, concealed gaps.
+ */
+void audio_session_print(AudioSession* session);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * Session churn through one pipeline: connect a VP8 stream, render a few
+ * frames, disconnect, repeat.
+ *
+ * branch-churn-bench [CYCLES [FRAMES]]
+ *
+ * Each cycle adds an appsrc standing in for a webrtcbin src pad, links it
+ * through the branch pool, pushes the packets of FRAMES frames (from a
+ * keyframe) and waits for them to render, then releases the branch and
+ * removes the appsrc. The run is done with branches rebuilt for every
+ * stream (max-idle 0) and then with recycled ones. Prints connect/disconnect
+ * cycles per second, how many branches were built, and the resident size
+ * at the start, after a tenth of the cycles and at the end, which should
+ * stay flat once the pool is warm. Each run ends with one more stream that
+ * is sent EOS while another branch is parked, and fails unless the EOS
+ * reaches the pipeline's bus.
+ */
+
+#include "branch_pool.h"
+
+#include <gst/gst.h>
+#include <gst/app/app.h>
+#include <gst/rtp/rtp.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#define SENDER_PACKETS \
+    "videotestsrc num-buffers=%d pattern=ball ! video/x-raw,width=640,height=360,framerate=30/1 " \
+    "! vp8enc deadline=1 keyframe-max-dist=300 target-bitrate=800000 " \
+    "! rtpvp8pay picture-id-mode=15-bit ! appsink name=sink sync=false"
+
+#define RTP_CAPS \
+    "application/x-rtp,media=video,clock-rate=90000,encoding-name=VP8,payload=96"
+
+#define RENDER_TIMEOUT_US (2 * G_USEC_PER_SEC)
+
+struct Churn {
+    std::atomic<guint64> rendered{ 0 };
+    std::atomic<guint> built{ 0 };
+};
+
+static std::vector<GstBuffer*>
+encode_packets(gint frames)
+{
+    std::vector<GstBuffer*> packets;
+    GError *error = NULL;
+
+    gchar *description = g_strdup_printf(SENDER_PACKETS, frames);
+    GstElement *pipe = gst_parse_launch(description, &error);
+    g_free(description);
+    if (!pipe) {
+        fprintf(stderr, "Can't build the sender: %s\n", error->message);
+        g_clear_error(&error);
+        return packets;
+    }
+
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipe), "sink");
+    gst_element_set_state(pipe, GST_STATE_PLAYING);
+    while (GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(sink))) {
+        packets.push_back(gst_buffer_ref(gst_sample_get_buffer(sample)));
+        gst_sample_unref(sample);
+    }
+    gst_element_set_state(pipe, GST_STATE_NULL);
+    gst_object_unref(sink);
+    gst_object_unref(pipe);
+    return packets;
+}
+
+/* Packets up to and including the marker of the last frame */
+static size_t
+packets_for_frames(const std::vector<GstBuffer*>& packets, gint frames)
+{
+    gint seen = 0;
+    for (size_t i = 0; i < packets.size(); ++i) {
+        GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+        if (!gst_rtp_buffer_map(packets[i], GST_MAP_READ, &rtp))
+            continue;
+        const gboolean marker = gst_rtp_buffer_get_marker(&rtp);
+        gst_rtp_buffer_unmap(&rtp);
+        if (marker && ++seen == frames)
+            return i + 1;
+    }
+    return packets.size();
+}
+
+static gdouble
+resident_mb()
+{
+    unsigned long size = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f)
+        return 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * (gdouble) sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+static GstPadProbeReturn
+on_rendered(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    static_cast<Churn *>(user_data)->rendered.fetch_add(1, std::memory_order_relaxed);
+    return GST_PAD_PROBE_OK;
+}
+
+static void
+on_output(const char *media, GstElement * queue, GstElement * convert, GstElement * sink,
+    gpointer user_data)
+{
+    auto churn = static_cast<Churn *>(user_data);
+    churn->built.fetch_add(1, std::memory_order_relaxed);
+
+    GstPad *pad = gst_element_get_static_pad(sink, "sink");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_rendered, churn, NULL);
+    gst_object_unref(pad);
+}
+
+/* Nothing watches the bus, so its messages are dropped here */
+static gboolean
+drain_bus(GstElement * pipe)
+{
+    gboolean ok = TRUE;
+    GstBus *bus = gst_element_get_bus(pipe);
+    while (GstMessage *msg = gst_bus_pop(bus)) {
+        if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+            GError *error = NULL;
+            gst_message_parse_error(msg, &error, NULL);
+            fprintf(stderr, "Error from %s: %s\n", GST_OBJECT_NAME(msg->src), error->message);
+            g_clear_error(&error);
+            ok = FALSE;
+        }
+        gst_message_unref(msg);
+    }
+    gst_object_unref(bus);
+    return ok;
+}
+
+static gboolean
+cycle(BranchPool * pool, GstElement * pipe, GstCaps * caps, Churn * churn,
+    const std::vector<GstBuffer*>& packets, size_t count, gint frames)
+{
+    GstElement *src = gst_element_factory_make("appsrc", NULL);
+    g_object_set(src, "is-live", TRUE, "format", GST_FORMAT_TIME, "do-timestamp", TRUE,
+        "caps", caps, NULL);
+    gst_bin_add(GST_BIN(pipe), src);
+    gst_element_sync_state_with_parent(src);
+
+    GstPad *srcpad = gst_element_get_static_pad(src, "src");
+    gboolean ok = branch_pool_acquire(pool, srcpad);
+
+    const guint64 target = churn->rendered.load() + frames;
+    if (ok) {
+        for (size_t i = 0; i < count; ++i)
+            gst_app_src_push_buffer(GST_APP_SRC(src), gst_buffer_ref(packets[i]));
+
+        const gint64 deadline = g_get_monotonic_time() + RENDER_TIMEOUT_US;
+        while (churn->rendered.load() < target && g_get_monotonic_time() < deadline)
+            g_usleep(200);
+        if (churn->rendered.load() < target) {
+            fprintf(stderr, "Only %" G_GUINT64_FORMAT " of %d frames rendered\n",
+                frames - (target - churn->rendered.load()), frames);
+            ok = FALSE;
+        }
+    }
+
+    branch_pool_release(pool, srcpad);
+    gst_object_unref(srcpad);
+    gst_element_set_state(src, GST_STATE_NULL);
+    gst_bin_remove(GST_BIN(pipe), src);
+    return drain_bus(pipe) && ok;
+}
+
+/* The last stream ends with EOS next to a parked branch */
+static gboolean
+check_eos(BranchPool * pool, GstElement * pipe, GstCaps * caps,
+    const std::vector<GstBuffer*>& packets, size_t count)
+{
+    if (branch_pool_prebuild(pool, caps, 2) == 0)
+        return FALSE;
+
+    GstElement *src = gst_element_factory_make("appsrc", NULL);
+    g_object_set(src, "is-live", TRUE, "format", GST_FORMAT_TIME, "do-timestamp", TRUE,
+        "caps", caps, NULL);
+    gst_bin_add(GST_BIN(pipe), src);
+    gst_element_sync_state_with_parent(src);
+
+    GstPad *srcpad = gst_element_get_static_pad(src, "src");
+    gboolean ok = branch_pool_acquire(pool, srcpad);
+    if (ok) {
+        for (size_t i = 0; i < count; ++i)
+            gst_app_src_push_buffer(GST_APP_SRC(src), gst_buffer_ref(packets[i]));
+        gst_app_src_end_of_stream(GST_APP_SRC(src));
+
+        GstBus *bus = gst_element_get_bus(pipe);
+        GstMessage *msg = gst_bus_timed_pop_filtered(bus, RENDER_TIMEOUT_US * GST_USECOND,
+            (GstMessageType) (GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+        ok = msg && GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS;
+        if (!ok)
+            fprintf(stderr, "No EOS on the bus with a branch parked\n");
+        if (msg)
+            gst_message_unref(msg);
+        gst_object_unref(bus);
+    }
+
+    branch_pool_release(pool, srcpad);
+    gst_object_unref(srcpad);
+    gst_element_set_state(src, GST_STATE_NULL);
+    gst_bin_remove(GST_BIN(pipe), src);
+    return drain_bus(pipe) && ok;
+}
+
+static gboolean
+run(const char *label, guint max_idle, gint cycles, const std::vector<GstBuffer*>& packets,
+    size_t count, gint frames)
+{
+    Churn churn;
+    GstElement *pipe = gst_pipeline_new(NULL);
+    GstCaps *caps = gst_caps_from_string(RTP_CAPS);
+
+    BranchPoolConfig config;
+    config.video_sink = "fakesink";
+    config.max_idle = max_idle;
+    BranchPool *pool = branch_pool_new(label, GST_BIN(pipe), config, on_output, &churn);
+    gst_element_set_state(pipe, GST_STATE_PLAYING);
+
+    const gdouble rss_start = resident_mb();
+    gdouble rss_warm = rss_start;
+    const gint warm = std::max(cycles / 10, 1);
+    gboolean ok = TRUE;
+
+    const gint64 start = g_get_monotonic_time();
+    for (gint i = 0; i < cycles && ok; ++i) {
+        ok = cycle(pool, pipe, caps, &churn, packets, count, frames);
+        if (i + 1 == warm)
+            rss_warm = resident_mb();
+    }
+    const gdouble seconds = (g_get_monotonic_time() - start) / (gdouble) G_USEC_PER_SEC;
+    const gdouble rss_end = resident_mb();
+    const gboolean eos = ok && check_eos(pool, pipe, caps, packets, count);
+
+    gst_element_set_state(pipe, GST_STATE_NULL);
+    branch_pool_free(pool);
+    gst_caps_unref(caps);
+    gst_object_unref(pipe);
+
+    printf("%-8s %6.1f cycles/s  %4u branches built  RSS %.1f -> %.1f (after %d) -> %.1f MB\n",
+        label, cycles / seconds, churn.built.load(), rss_start, rss_warm, warm, rss_end);
+    if (eos)
+        printf("%-8s EOS reached the bus with a branch parked\n", label);
+    return eos;
+}
+
+int
+main(int argc, char *argv[])
+{
+    gst_init(&argc, &argv);
+
+    const gint cycles = argc > 1 ? std::max(atoi(argv[1]), 1) : 500;
+    const gint frames = argc > 2 ? std::max(atoi(argv[2]), 1) : 5;
+
+    std::vector<GstBuffer*> packets = encode_packets(frames);
+    if (packets.empty())
+        return 1;
+    const size_t count = packets_for_frames(packets, frames);
+
+    printf("%d cycles of %d frames (%zu RTP packets) each\n", cycles, frames, count);
+
+    gboolean ok = run("rebuilt", 0, cycles, packets, count, frames);
+    ok = run("recycled", BranchPoolConfig().max_idle, cycles, packets, count, frames) && ok;
+
+    for (auto packet : packets)
+        gst_buffer_unref(packet);
+    return ok ? 0 : 1;
+}
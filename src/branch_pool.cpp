@@ -0,0 +1,537 @@
+/*
+ * Recycled decode/output branches.
+ *
+ * Building a branch costs element construction, plugin lookups and, for
+ * autovideosink, probing for a working sink; that is what a branch keeps.
+ * A parked branch sits in the pipeline with its state locked to READY, so
+ * pipeline state changes pass it by, and since it never leaves the
+ * pipeline the modules watching deep-element-added see its elements only
+ * once. It does leave the sink flag the branch's sink gave its bin, which
+ * would make the pipeline wait for an EOS the parked branch never posts;
+ * the flag is cleared while parked so EOS aggregation passes it by too.
+ * READY resets the depayloader and decoder, so the next stream starts
+ * clean. State changes on release run through gst_element_call_async(),
+ * as pad-removed can come from a streaming thread.
+ *
+ * decodebin drops its decoders on the way to READY, so formats that need
+ * it get a branch that is destroyed rather than parked. Destroyed branches
+ * go to NULL and leave the pipeline, instead of being left linked to
+ * nothing as before.
+ */
+
+#include "branch_pool.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#define GST_CAT_DEFAULT branch_pool_debug
+GST_DEBUG_CATEGORY_STATIC(GST_CAT_DEFAULT);
+
+static const struct {
+    const char *media;
+    const char *encoding;
+    const char *depayloader;
+    const char *decoder;
+} formats[] = {
+    { "video", "VP8", "rtpvp8depay", "vp8dec" },
+    { "video", "VP9", "rtpvp9depay", "vp9dec" },
+    { "video", "H264", "rtph264depay", "avdec_h264" },
+    { "audio", "OPUS", "rtpopusdepay", "opusdec" },
+};
+
+struct Branch {
+    std::string key;            /* "video/VP8"; empty for decodebin branches */
+    GstElement *bin;
+    GstPad *ghost;              /* the bin's sink pad */
+    GstPad *srcpad = NULL;      /* while linked */
+    guint uses = 0;
+};
+
+struct BranchPool {
+    std::string name;
+    GstBin *pipe;
+    BranchPoolConfig config;
+    BranchOutputFunc on_output;
+    gpointer user_data;
+
+    std::mutex mutex;           // guards the lists and the count below
+    std::condition_variable recycled;
+    std::vector<Branch*> branches;
+    std::map<std::string, std::vector<Branch*>> idle;
+    std::map<GstPad*, Branch*> active;
+    guint recycling = 0;
+
+    std::atomic<guint64> reused{ 0 };
+    std::atomic<guint64> built{ 0 };
+    std::atomic<guint64> decodebins{ 0 };
+    std::atomic<guint64> parked{ 0 };
+    std::atomic<guint64> destroyed{ 0 };
+};
+
+static std::mutex registry_mutex;
+static std::vector<BranchPool*> pools;
+
+static int
+find_format(const std::string& key)
+{
+    for (guint i = 0; i < G_N_ELEMENTS(formats); ++i) {
+        if (key == std::string(formats[i].media) + "/" + formats[i].encoding) {
+            GstElementFactory *depay = gst_element_factory_find(formats[i].depayloader);
+            GstElementFactory *dec = gst_element_factory_find(formats[i].decoder);
+            const bool available = depay && dec;
+            if (depay)
+                gst_object_unref(depay);
+            if (dec)
+                gst_object_unref(dec);
+            return available ? (int) i : -1;
+        }
+    }
+    return -1;
+}
+
+/* "video/VP8" from RTP caps, or the media alone without an encoding-name */
+static std::string
+format_key(const GstCaps* caps)
+{
+    if (!caps || gst_caps_is_empty(caps) || gst_caps_is_any(caps))
+        return std::string();
+
+    const GstStructure *s = gst_caps_get_structure(caps, 0);
+    const gchar *media = gst_structure_get_string(s, "media");
+    const gchar *encoding = gst_structure_get_string(s, "encoding-name");
+    if (!media)
+        return std::string();
+
+    std::string key = media;
+    if (encoding) {
+        gchar *upper = g_ascii_strup(encoding, -1);
+        key += std::string("/") + upper;
+        g_free(upper);
+    }
+    return key;
+}
+
+static std::string
+pad_format_key(GstPad * pad)
+{
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    if (!caps)
+        caps = gst_pad_query_caps(pad, NULL);
+    const std::string key = format_key(caps);
+    gst_caps_unref(caps);
+    return key;
+}
+
+static void
+add_to(GstBin * bin, GstElement * element, gboolean sync)
+{
+    gst_bin_add(bin, element);
+    if (sync)
+        gst_element_sync_state_with_parent(element);
+}
+
+/*
+ * queue ! [converter] ! sink inside the branch bin. With the decoder's caps
+ * known (decodebin branches), video is only converted when the sink can't
+ * take it as is; built ahead of time it always is, as a passthrough
+ * videoconvert costs nothing when it turns out not to be needed.
+ */
+static GstElement *
+build_output(BranchPool * pool, GstBin * bin, const char* media, GstCaps * decoded,
+    gboolean sync)
+{
+    const gboolean video = g_str_equal(media, "video");
+    const char *convert_name = video ? "videoconvert" : "audioconvert";
+    const std::string& sink_name = video ? pool->config.video_sink : pool->config.audio_sink;
+    GstElement *conv = NULL;
+
+    gst_println("Trying to handle stream with %s ! %s", convert_name, sink_name.c_str());
+
+    GstElement *q = gst_element_factory_make("queue", NULL);
+    g_assert_nonnull(q);
+    GstElement *sink = gst_element_factory_make(sink_name.c_str(), NULL);
+    g_assert_nonnull(sink);
+    if (sink_name == "fakesink")
+        g_object_set(sink, "sync", FALSE, NULL);
+
+    if (!video) {
+        /* Might also need to resample, so add it just in case.
+         * Will be a no-op if it's not required. */
+        conv = gst_element_factory_make(convert_name, NULL);
+        g_assert_nonnull(conv);
+        GstElement *resample = gst_element_factory_make("audioresample", NULL);
+        g_assert_nonnull(resample);
+        add_to(bin, q, sync);
+        add_to(bin, conv, sync);
+        add_to(bin, resample, sync);
+        add_to(bin, sink, sync);
+        gst_element_link_many(q, conv, resample, sink, NULL);
+    }
+    else {
+        add_to(bin, q, sync);
+        /* autovideosink only picks its actual sink on the way to READY */
+        add_to(bin, sink, sync);
+
+        gboolean direct = FALSE;
+        if (decoded) {
+            GstPad *sinkpad = gst_element_get_static_pad(sink, "sink");
+            direct = gst_pad_query_accept_caps(sinkpad, decoded);
+            gst_object_unref(sinkpad);
+        }
+
+        if (direct) {
+            gst_element_link(q, sink);
+        }
+        else {
+            conv = gst_element_factory_make(convert_name, NULL);
+            g_assert_nonnull(conv);
+            add_to(bin, conv, sync);
+            gst_element_link_many(q, conv, sink, NULL);
+        }
+        gst_println("Video goes to %s %s", sink_name.c_str(),
+            direct ? "unconverted" : decoded ? "converted" : "through a converter");
+    }
+
+    if (pool->on_output)
+        pool->on_output(media, q, conv, sink, pool->user_data);
+    return q;
+}
+
+static void
+on_decodebin_pad(GstElement * decodebin, GstPad * pad, Branch * branch)
+{
+    auto pool = static_cast<BranchPool *>(g_object_get_data(G_OBJECT(decodebin), "branch-pool"));
+
+    if (!gst_pad_has_current_caps(pad)) {
+        gst_printerr("Pad '%s' has no caps, can't do anything, ignoring\n",
+            GST_PAD_NAME(pad));
+        return;
+    }
+
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    const gchar *name = gst_structure_get_name(gst_caps_get_structure(caps, 0));
+    const char *media = g_str_has_prefix(name, "video") ? "video"
+        : g_str_has_prefix(name, "audio") ? "audio" : NULL;
+    if (!media) {
+        gst_printerr("Unknown pad %s, ignoring", GST_PAD_NAME(pad));
+        gst_caps_unref(caps);
+        return;
+    }
+
+    GstElement *q = build_output(pool, GST_BIN(branch->bin), media, caps, TRUE);
+    gst_caps_unref(caps);
+
+    GstPad *qpad = gst_element_get_static_pad(q, "sink");
+    GstPadLinkReturn ret = gst_pad_link(pad, qpad);
+    g_assert_cmphex(ret, == , GST_PAD_LINK_OK);
+    gst_object_unref(qpad);
+}
+
+static Branch *
+new_branch(GstElement * bin, GstElement * first, const std::string& key)
+{
+    auto branch = new Branch;
+    branch->key = key;
+    branch->bin = GST_ELEMENT(gst_object_ref_sink(bin));
+
+    GstPad *target = gst_element_get_static_pad(first, "sink");
+    branch->ghost = gst_ghost_pad_new("sink", target);
+    gst_object_unref(target);
+    gst_element_add_pad(bin, branch->ghost);
+    return branch;
+}
+
+/* Out of the pipeline's EOS aggregation while parked */
+static void
+set_parked(GstElement * bin, gboolean parked)
+{
+    GST_OBJECT_LOCK(bin);
+    if (parked)
+        GST_OBJECT_FLAG_UNSET(bin, GST_ELEMENT_FLAG_SINK);
+    else
+        GST_OBJECT_FLAG_SET(bin, GST_ELEMENT_FLAG_SINK);
+    GST_OBJECT_UNLOCK(bin);
+}
+
+/* Parked in READY; the caller lists it */
+static Branch *
+build_branch(BranchPool * pool, int format, const std::string& key)
+{
+    GstElement *bin = gst_bin_new(NULL);
+    GstElement *depay = gst_element_factory_make(formats[format].depayloader, NULL);
+    /* Decoding on a thread of its own, as behind decodebin's multiqueue */
+    GstElement *mq = gst_element_factory_make("multiqueue", NULL);
+    GstElement *dec = gst_element_factory_make(formats[format].decoder, NULL);
+    gst_bin_add_many(GST_BIN(bin), depay, mq, dec, NULL);
+    GstElement *q = build_output(pool, GST_BIN(bin), formats[format].media, NULL, FALSE);
+    gst_element_link_many(depay, mq, dec, q, NULL);
+
+    Branch *branch = new_branch(bin, depay, key);
+    gst_element_set_locked_state(bin, TRUE);
+    set_parked(bin, TRUE);
+    gst_bin_add(pool->pipe, bin);
+    gst_element_set_state(bin, GST_STATE_READY);
+    pool->built.fetch_add(1, std::memory_order_relaxed);
+    GST_INFO("%s: built a %s branch", pool->name.c_str(), key.c_str());
+    return branch;
+}
+
+static Branch *
+build_decodebin_branch(BranchPool * pool)
+{
+    GstElement *bin = gst_bin_new(NULL);
+    GstElement *decodebin = gst_element_factory_make("decodebin", NULL);
+    g_object_set_data(G_OBJECT(decodebin), "branch-pool", pool);
+    gst_bin_add(GST_BIN(bin), decodebin);
+
+    Branch *branch = new_branch(bin, decodebin, std::string());
+    g_signal_connect(decodebin, "pad-added", G_CALLBACK(on_decodebin_pad), branch);
+    gst_element_set_locked_state(bin, TRUE);
+    gst_bin_add(pool->pipe, bin);
+    pool->decodebins.fetch_add(1, std::memory_order_relaxed);
+    return branch;
+}
+
+static void
+destroy_branch(Branch * branch)
+{
+    gst_element_set_locked_state(branch->bin, FALSE);
+    gst_element_set_state(branch->bin, GST_STATE_NULL);
+    GstObject *parent = gst_object_get_parent(GST_OBJECT(branch->bin));
+    if (parent) {
+        gst_bin_remove(GST_BIN(parent), branch->bin);
+        gst_object_unref(parent);
+    }
+    if (branch->srcpad)
+        gst_object_unref(branch->srcpad);
+    gst_object_unref(branch->bin);
+    delete branch;
+}
+
+static void
+recycle_branch(GstElement * bin, gpointer user_data)
+{
+    auto branch = static_cast<Branch *>(user_data);
+    auto pool = static_cast<BranchPool *>(g_object_get_data(G_OBJECT(bin), "branch-pool"));
+
+    gst_element_set_locked_state(bin, TRUE);
+    gst_element_set_state(bin, GST_STATE_READY);
+    /* Before it is listed, where acquire could take it straight back */
+    set_parked(bin, TRUE);
+
+    bool keep = false;
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if (!branch->key.empty() && pool->idle[branch->key].size() < pool->config.max_idle) {
+            pool->idle[branch->key].push_back(branch);
+            keep = true;
+        }
+        else {
+            pool->branches.erase(std::remove(pool->branches.begin(), pool->branches.end(),
+                branch), pool->branches.end());
+        }
+    }
+
+    if (keep) {
+        pool->parked.fetch_add(1, std::memory_order_relaxed);
+    }
+    else {
+        destroy_branch(branch);
+        pool->destroyed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->recycling--;
+    pool->recycled.notify_all();
+}
+
+static void
+collect_branch_metrics(GString * out, gpointer unused)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    g_string_append(out,
+        "# HELP media_receiver_branches Decode/output branches, linked or parked\n"
+        "# TYPE media_receiver_branches gauge\n");
+    for (auto pool : pools) {
+        std::lock_guard<std::mutex> pool_lock(pool->mutex);
+        guint idle = 0;
+        for (const auto& entry : pool->idle)
+            idle += entry.second.size();
+        g_string_append_printf(out,
+            "media_receiver_branches{session=\"%s\",state=\"active\"} %u\n"
+            "media_receiver_branches{session=\"%s\",state=\"idle\"} %u\n",
+            pool->name.c_str(), (guint) pool->active.size(), pool->name.c_str(), idle);
+    }
+
+    g_string_append(out,
+        "# HELP media_receiver_branch_acquisitions_total Streams linked to a branch, by where it came from\n"
+        "# TYPE media_receiver_branch_acquisitions_total counter\n");
+    for (auto pool : pools) {
+        const struct {
+            const char *source;
+            guint64 count;
+        } rows[] = {
+            { "reused", pool->reused.load(std::memory_order_relaxed) },
+            { "built", pool->built.load(std::memory_order_relaxed) },
+            { "decodebin", pool->decodebins.load(std::memory_order_relaxed) },
+        };
+        for (const auto& row : rows) {
+            g_string_append_printf(out,
+                "media_receiver_branch_acquisitions_total{session=\"%s\",source=\"%s\"} %"
+                G_GUINT64_FORMAT "\n", pool->name.c_str(), row.source, row.count);
+        }
+    }
+
+    g_string_append(out,
+        "# HELP media_receiver_branch_releases_total Ended streams, by what became of their branch\n"
+        "# TYPE media_receiver_branch_releases_total counter\n");
+    for (auto pool : pools) {
+        g_string_append_printf(out,
+            "media_receiver_branch_releases_total{session=\"%s\",outcome=\"parked\"} %"
+            G_GUINT64_FORMAT "\n"
+            "media_receiver_branch_releases_total{session=\"%s\",outcome=\"destroyed\"} %"
+            G_GUINT64_FORMAT "\n",
+            pool->name.c_str(), pool->parked.load(std::memory_order_relaxed),
+            pool->name.c_str(), pool->destroyed.load(std::memory_order_relaxed));
+    }
+}
+
+BranchPool*
+branch_pool_new(const char* name, GstBin* pipe, const BranchPoolConfig& config,
+    BranchOutputFunc on_output, gpointer user_data)
+{
+    static std::once_flag once;
+    std::call_once(once, [] {
+        GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "branchpool", 0, "Recycled decode branches");
+        metrics_register_collector(collect_branch_metrics, NULL);
+    });
+
+    auto pool = new BranchPool;
+    pool->name = name;
+    pool->pipe = pipe;
+    pool->config = config;
+    pool->on_output = on_output;
+    pool->user_data = user_data;
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    pools.push_back(pool);
+    return pool;
+}
+
+void
+branch_pool_free(BranchPool* pool)
+{
+    if (!pool)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        pools.erase(std::remove(pools.begin(), pools.end(), pool), pools.end());
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(pool->mutex);
+        pool->recycled.wait(lock, [pool] { return pool->recycling == 0; });
+    }
+
+    for (auto branch : pool->branches)
+        destroy_branch(branch);
+    delete pool;
+}
+
+guint
+branch_pool_prebuild(BranchPool* pool, const GstCaps* rtp_caps, guint count)
+{
+    const std::string key = format_key(rtp_caps);
+    const int format = find_format(key);
+    if (format < 0)
+        return 0;
+
+    for (guint i = 0; i < count; ++i) {
+        Branch *branch = build_branch(pool, format, key);
+        g_object_set_data(G_OBJECT(branch->bin), "branch-pool", pool);
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->branches.push_back(branch);
+        pool->idle[key].push_back(branch);
+    }
+    return count;
+}
+
+gboolean
+branch_pool_acquire(BranchPool* pool, GstPad* srcpad)
+{
+    const std::string key = pad_format_key(srcpad);
+    Branch *branch = NULL;
+
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        auto it = pool->idle.find(key);
+        if (it != pool->idle.end() && !it->second.empty()) {
+            branch = it->second.back();
+            it->second.pop_back();
+        }
+    }
+
+    if (branch) {
+        pool->reused.fetch_add(1, std::memory_order_relaxed);
+    }
+    else {
+        const int format = find_format(key);
+        branch = format >= 0 ? build_branch(pool, format, key) : build_decodebin_branch(pool);
+        g_object_set_data(G_OBJECT(branch->bin), "branch-pool", pool);
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->branches.push_back(branch);
+    }
+
+    /* Running before linked, so the first buffer isn't refused as flushing */
+    if (!branch->key.empty())
+        set_parked(branch->bin, FALSE);
+    gst_element_set_locked_state(branch->bin, FALSE);
+    gst_element_sync_state_with_parent(branch->bin);
+
+    if (gst_pad_link(srcpad, branch->ghost) != GST_PAD_LINK_OK) {
+        GST_WARNING("%s: can't link %" GST_PTR_FORMAT " to a %s branch", pool->name.c_str(),
+            srcpad, key.empty() ? "decodebin" : key.c_str());
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->recycling++;
+        gst_element_call_async(branch->bin, recycle_branch, branch, NULL);
+        return FALSE;
+    }
+
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    branch->srcpad = GST_PAD(gst_object_ref(srcpad));
+    branch->uses++;
+    pool->active[srcpad] = branch;
+    GST_INFO("%s: %s branch linked, use %u", pool->name.c_str(),
+        key.empty() ? "decodebin" : key.c_str(), branch->uses);
+    return TRUE;
+}
+
+void
+branch_pool_release(BranchPool* pool, GstPad* srcpad)
+{
+    Branch *branch;
+
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        auto it = pool->active.find(srcpad);
+        if (it == pool->active.end())
+            return;
+        branch = it->second;
+        pool->active.erase(it);
+        pool->recycling++;
+    }
+
+    if (gst_pad_is_linked(srcpad))
+        gst_pad_unlink(srcpad, branch->ghost);
+    gst_object_unref(branch->srcpad);
+    branch->srcpad = NULL;
+
+    gst_element_call_async(branch->bin, recycle_branch, branch, NULL);
+}
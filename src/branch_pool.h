@@ -0,0 +1,62 @@
+/*
+ * Decode/output branches kept across streams: depayloader, decoder, queue,
+ * converter and sink for one RTP format in a bin, parked in READY when its
+ * stream ends and relinked to the next stream of that format.
+ */
+
+#ifndef BRANCH_POOL_H
+#define BRANCH_POOL_H
+
+#include <gst/gst.h>
+
+#include <string>
+
+struct BranchPoolConfig {
+    std::string video_sink = "autovideosink";
+    std::string audio_sink = "autoaudiosink";
+    guint max_idle = 2;         /* parked branches per format, beyond that they are destroyed */
+};
+
+/*
+ * Called once per branch as it is built, from the thread building it, to
+ * instrument the output; convert is NULL when the decoder's output goes to
+ * the sink as is.
+ */
+typedef void (*BranchOutputFunc)(const char* media, GstElement* queue,
+    GstElement* convert, GstElement* sink, gpointer user_data);
+
+struct BranchPool;
+
+/*
+ * Branches are added to pipe, which must outlive the pool.
+ */
+BranchPool* branch_pool_new(const char* name, GstBin* pipe, const BranchPoolConfig& config,
+    BranchOutputFunc on_output, gpointer user_data);
+
+/*
+ * Only once the pipeline is in NULL state.
+ */
+void branch_pool_free(BranchPool* pool);
+
+/*
+ * Builds branches for RTP caps with media and encoding-name and parks them
+ * in READY, so the first stream of that format doesn't wait for them.
+ * Returns how many were built; 0 for formats only decodebin handles.
+ */
+guint branch_pool_prebuild(BranchPool* pool, const GstCaps* rtp_caps, guint count);
+
+/*
+ * Links an RTP src pad to a parked branch of its format, or to a new one.
+ * Formats without a known depayloader and decoder get a decodebin branch,
+ * which is not recycled. Safe from streaming threads.
+ */
+gboolean branch_pool_acquire(BranchPool* pool, GstPad* srcpad);
+
+/*
+ * When the pad's stream ended or the pad is being removed: unlinks the
+ * branch and parks it, asynchronously. Pads the pool didn't link are
+ * ignored.
+ */
+void branch_pool_release(BranchPool* pool, GstPad* srcpad);
+
+#endif
@@ -0,0 +1,336 @@
+/*
+ * Capture-to-render latency from the abs-capture-time RTP header extension.
+ *
+ * The sender stamps (some) packets with the NTP time the frame was captured
+ * at; packets in between are interpolated from the RTP timestamp, like
+ * libwebrtc does. The result travels with the frame as a reference timestamp
+ * meta, with a table keyed by PTS as fallback for depayloaders that drop it,
+ * and is compared against our wall clock once the frame reaches the sink.
+ * That only means something when both hosts keep NTP-synchronised clocks.
+ */
+
+#include "capture_time.h"
+#include "metrics.h"
+
+#include <gst/rtp/rtp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Seconds between 1900 and 1970 */
+#define NTP_UNIX_OFFSET G_GUINT64_CONSTANT(2208988800)
+
+static const int kSlots = 64;
+/* Percentiles are taken over that many recent frames */
+static const int kSamples = 1024;
+/* libwebrtc stops interpolating after that long without an explicit value */
+static const GstClockTime kMaxInterpolation = 5 * GST_SECOND;
+
+struct CaptureTimeSession {
+    std::string name;
+    guint ext_id;
+
+    /* Touched by the RTP streaming thread only */
+    bool have_anchor = false;
+    guint32 anchor_ssrc = 0;
+    guint32 anchor_rtp = 0;
+    guint64 anchor_ns = 0;
+    guint clock_rate = 90000;
+    GstClockTime last_pts = GST_CLOCK_TIME_NONE;
+
+    struct Slot {
+        std::atomic<guint64> pts_key{ 0 };    /* 0 marks an empty slot */
+        std::atomic<guint64> capture_ns{ 0 };
+    } slots[kSlots];
+
+    std::atomic<gint32> samples_us[kSamples];
+    std::atomic<guint32> sample_index{ 0 };
+    std::atomic<guint64> frames_measured{ 0 };
+    std::atomic<guint64> frames_unmatched{ 0 };
+    std::atomic<gint64> latency_sum_us{ 0 };
+
+    CaptureTimeSession() { for (auto& s : samples_us) s = 0; }
+};
+
+static std::mutex registry_mutex;
+static std::vector<CaptureTimeSession*> sessions;
+static GstCaps *meta_caps;
+
+guint64
+capture_time_ntp_now()
+{
+    return (g_get_real_time() + NTP_UNIX_OFFSET * G_USEC_PER_SEC) * GST_USECOND;
+}
+
+/* UQ32.32 seconds to nanoseconds */
+static guint64
+ntp64_to_ns(guint64 ntp)
+{
+    return (ntp >> 32) * GST_SECOND + (((ntp & G_MAXUINT32) * GST_SECOND) >> 32);
+}
+
+static bool
+read_extension(GstRTPBuffer * rtp, guint8 id, guint64 * capture_ns)
+{
+    gpointer data;
+    guint size;
+    guint8 appbits;
+
+    if (!gst_rtp_buffer_get_extension_onebyte_header(rtp, id, 0, &data, &size)
+        && !gst_rtp_buffer_get_extension_twobytes_header(rtp, &appbits, id, 0,
+            &data, &size))
+        return false;
+    if (size < 8)
+        return false;
+
+    const guint8 *bytes = static_cast<const guint8 *>(data);
+    gint64 ns = ntp64_to_ns(GST_READ_UINT64_BE(bytes));
+
+    /* Optional estimated offset of the capture clock against the sender's */
+    if (size >= 16) {
+        const gint64 offset = (gint64) GST_READ_UINT64_BE(bytes + 8);
+        ns += (offset >> 32) * (gint64) GST_SECOND
+            + (gint64) (((offset & G_MAXUINT32) * GST_SECOND) >> 32);
+    }
+
+    *capture_ns = ns;
+    return true;
+}
+
+static void
+remember(CaptureTimeSession * session, GstClockTime pts, guint64 capture_ns)
+{
+    auto& slot = session->slots[(pts / GST_MSECOND) % kSlots];
+    slot.capture_ns.store(capture_ns, std::memory_order_relaxed);
+    slot.pts_key.store(pts + 1, std::memory_order_release);
+}
+
+static guint64
+recall(CaptureTimeSession * session, GstClockTime pts)
+{
+    auto& slot = session->slots[(pts / GST_MSECOND) % kSlots];
+    if (slot.pts_key.load(std::memory_order_acquire) != pts + 1)
+        return 0;
+    return slot.capture_ns.load(std::memory_order_relaxed);
+}
+
+/* Returns the capture time to attach to the buffer, 0 for none */
+static guint64
+on_rtp_buffer(CaptureTimeSession * session, GstBuffer * buffer)
+{
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+        return 0;
+
+    const guint32 ssrc = gst_rtp_buffer_get_ssrc(&rtp);
+    const guint32 rtp_ts = gst_rtp_buffer_get_timestamp(&rtp);
+    guint64 capture_ns = 0;
+
+    if (read_extension(&rtp, session->ext_id, &capture_ns)) {
+        session->have_anchor = true;
+        session->anchor_ssrc = ssrc;
+        session->anchor_rtp = rtp_ts;
+        session->anchor_ns = capture_ns;
+    }
+    else if (session->have_anchor && session->anchor_ssrc == ssrc) {
+        const gint64 ticks = (gint32) (rtp_ts - session->anchor_rtp);
+        const gint64 ns = ticks * (gint64) GST_SECOND / session->clock_rate;
+        if ((guint64) ABS(ns) <= kMaxInterpolation)
+            capture_ns = session->anchor_ns + ns;
+    }
+    gst_rtp_buffer_unmap(&rtp);
+
+    /* Only the first packet of each frame carries it on */
+    const GstClockTime pts = GST_BUFFER_PTS(buffer);
+    if (!capture_ns || !GST_CLOCK_TIME_IS_VALID(pts) || pts == session->last_pts)
+        return 0;
+    session->last_pts = pts;
+
+    remember(session, pts, capture_ns);
+    return capture_ns;
+}
+
+static GstPadProbeReturn
+on_rtp_probe(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    auto session = static_cast<CaptureTimeSession *>(user_data);
+
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+        GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+        const guint64 capture_ns = on_rtp_buffer(session, buffer);
+        if (capture_ns) {
+            buffer = gst_buffer_make_writable(buffer);
+            gst_buffer_add_reference_timestamp_meta(buffer, meta_caps, capture_ns,
+                GST_CLOCK_TIME_NONE);
+            GST_PAD_PROBE_INFO_DATA(info) = buffer;
+        }
+    }
+    else if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        const guint n = gst_buffer_list_length(list);
+        for (guint i = 0; i < n; ++i) {
+            const guint64 capture_ns =
+                on_rtp_buffer(session, gst_buffer_list_get(list, i));
+            if (capture_ns) {
+                list = gst_buffer_list_make_writable(list);
+                gst_buffer_add_reference_timestamp_meta(
+                    gst_buffer_list_get_writable(list, i), meta_caps, capture_ns,
+                    GST_CLOCK_TIME_NONE);
+            }
+        }
+        GST_PAD_PROBE_INFO_DATA(info) = list;
+    }
+    else if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+            GstCaps *caps;
+            gint clock_rate;
+            gst_event_parse_caps(event, &caps);
+            if (gst_structure_get_int(gst_caps_get_structure(caps, 0),
+                "clock-rate", &clock_rate) && clock_rate > 0)
+                session->clock_rate = clock_rate;
+        }
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+on_render_probe(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    auto session = static_cast<CaptureTimeSession *>(user_data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    const guint64 now = capture_time_ntp_now();
+
+    guint64 capture_ns = 0;
+    GstReferenceTimestampMeta *meta =
+        gst_buffer_get_reference_timestamp_meta(buffer, meta_caps);
+    if (meta)
+        capture_ns = meta->timestamp;
+    else if (GST_BUFFER_PTS_IS_VALID(buffer))
+        capture_ns = recall(session, GST_BUFFER_PTS(buffer));
+
+    if (!capture_ns) {
+        session->frames_unmatched.fetch_add(1, std::memory_order_relaxed);
+        return GST_PAD_PROBE_OK;
+    }
+
+    /* Clock skew between hosts can make this negative; keep it visible */
+    const gint64 latency_us = ((gint64) now - (gint64) capture_ns) / (gint64) GST_USECOND;
+    const guint32 index = session->sample_index.fetch_add(1, std::memory_order_relaxed);
+    session->samples_us[index % kSamples].store(
+        (gint32) CLAMP(latency_us, G_MININT32, G_MAXINT32), std::memory_order_relaxed);
+    session->frames_measured.fetch_add(1, std::memory_order_relaxed);
+    session->latency_sum_us.fetch_add(latency_us, std::memory_order_relaxed);
+
+    return GST_PAD_PROBE_OK;
+}
+
+gboolean
+capture_time_get_percentiles(CaptureTimeSession* session,
+    double* p50, double* p95, double* p99)
+{
+    const guint32 written = session->sample_index.load(std::memory_order_relaxed);
+    const guint32 n = MIN(written, (guint32) kSamples);
+    if (!n)
+        return FALSE;
+
+    gint32 samples[kSamples];
+    for (guint32 i = 0; i < n; ++i)
+        samples[i] = session->samples_us[i].load(std::memory_order_relaxed);
+    std::sort(samples, samples + n);
+
+    auto at = [&](double q) { return samples[(guint32) (q * (n - 1))] / 1000.0; };
+    *p50 = at(0.50);
+    *p95 = at(0.95);
+    *p99 = at(0.99);
+    return TRUE;
+}
+
+static void
+collect_capture_time_metrics(GString * out, gpointer unused)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    g_string_append(out,
+        "# HELP media_receiver_capture_to_render_seconds Capture to render latency over recent frames\n"
+        "# TYPE media_receiver_capture_to_render_seconds summary\n");
+    for (auto session : sessions) {
+        double p50, p95, p99;
+        const char *name = session->name.c_str();
+        if (capture_time_get_percentiles(session, &p50, &p95, &p99)) {
+            g_string_append_printf(out,
+                "media_receiver_capture_to_render_seconds{session=\"%s\",quantile=\"0.5\"} %g\n"
+                "media_receiver_capture_to_render_seconds{session=\"%s\",quantile=\"0.95\"} %g\n"
+                "media_receiver_capture_to_render_seconds{session=\"%s\",quantile=\"0.99\"} %g\n",
+                name, p50 / 1000, name, p95 / 1000, name, p99 / 1000);
+        }
+        g_string_append_printf(out,
+            "media_receiver_capture_to_render_seconds_sum{session=\"%s\"} %g\n"
+            "media_receiver_capture_to_render_seconds_count{session=\"%s\"} %"
+            G_GUINT64_FORMAT "\n",
+            name, session->latency_sum_us.load(std::memory_order_relaxed) / 1e6,
+            name, session->frames_measured.load(std::memory_order_relaxed));
+    }
+
+    g_string_append(out,
+        "# HELP media_receiver_capture_time_missing_total Rendered frames without a capture time\n"
+        "# TYPE media_receiver_capture_time_missing_total counter\n");
+    for (auto session : sessions) {
+        g_string_append_printf(out,
+            "media_receiver_capture_time_missing_total{session=\"%s\"} %"
+            G_GUINT64_FORMAT "\n", session->name.c_str(),
+            session->frames_unmatched.load(std::memory_order_relaxed));
+    }
+}
+
+CaptureTimeSession*
+capture_time_session_new(const char* name, guint ext_id)
+{
+    static std::once_flag once;
+    std::call_once(once, [] {
+        meta_caps = gst_caps_new_empty_simple("timestamp/x-abs-capture-time");
+        metrics_register_collector(collect_capture_time_metrics, NULL);
+    });
+
+    auto session = new CaptureTimeSession;
+    session->name = name;
+    session->ext_id = ext_id;
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    sessions.push_back(session);
+    return session;
+}
+
+void
+capture_time_session_free(CaptureTimeSession* session)
+{
+    if (!session)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        sessions.erase(std::remove(sessions.begin(), sessions.end(), session),
+            sessions.end());
+    }
+    delete session;
+}
+
+void
+capture_time_watch_rtp(CaptureTimeSession* session, GstPad* pad)
+{
+    gst_pad_add_probe(pad,
+        (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST
+            | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+        on_rtp_probe, session, NULL);
+}
+
+void
+capture_time_watch_render(CaptureTimeSession* session, GstPad* pad)
+{
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_render_probe,
+        session, NULL);
+}
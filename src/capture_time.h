@@ -0,0 +1,45 @@
+/*
+ * Capture-to-render latency from the abs-capture-time RTP header extension.
+ */
+
+#ifndef CAPTURE_TIME_H
+#define CAPTURE_TIME_H
+
+#include <gst/gst.h>
+
+#define ABS_CAPTURE_TIME_URI "http://www.webrtc.org/experiments/rtp-hdrext/abs-capture-time"
+
+struct CaptureTimeSession;
+
+CaptureTimeSession* capture_time_session_new(const char* name, guint ext_id);
+
+/*
+ * Must only be freed once the watched pads are gone.
+ */
+void capture_time_session_free(CaptureTimeSession* session);
+
+/*
+ * Reads the extension from RTP leaving webrtcbin (decrypted, after the
+ * jitterbuffer) and attaches the capture time to each frame's first packet.
+ */
+void capture_time_watch_rtp(CaptureTimeSession* session, GstPad* pad);
+
+/*
+ * Measures every buffer reaching the sink pad against the wall clock.
+ */
+void capture_time_watch_render(CaptureTimeSession* session, GstPad* pad);
+
+/*
+ * Percentiles over the most recent frames, in milliseconds. FALSE when
+ * nothing has been measured yet.
+ */
+gboolean capture_time_get_percentiles(CaptureTimeSession* session,
+    double* p50, double* p95, double* p99);
+
+/*
+ * Wall clock as NTP time in nanoseconds since 1900, the clock the extension
+ * is expressed in.
+ */
+guint64 capture_time_ntp_now();
+
+#endif
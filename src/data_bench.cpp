@@ -0,0 +1,221 @@
+/*
+ * Bulk transfer benchmark over a data channel.
+ *
+ * Every message starts with the size phase it belongs to and its send time,
+ * so the receiver needs no other coordination.
+ */
+
+#include "data_bench.h"
+
+#define GST_USE_UNSTABLE_API
+#include <gst/webrtc/webrtc.h>
+
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+/* Phase index, send time in microseconds */
+static const guint kHeaderSize = 4 + 8;
+/* Latency samples kept per size */
+static const size_t kMaxSamples = 1 << 20;
+/* For the last messages to arrive after the last size was sent */
+static const guint kDrainMs = 1000;
+
+struct DataBenchResult {
+    guint64 messages = 0;
+    guint64 bytes = 0;
+    gint64 first_us = 0;
+    gint64 last_us = 0;
+    std::vector<gint32> latency_us;
+};
+
+struct DataBench {
+    std::vector<guint> sizes;
+    guint seconds;
+
+    /* Sending side, main context only */
+    DataChannel *channel = nullptr;
+    gulong open_handler = 0;
+    size_t phase = 0;
+    gint64 phase_start = 0;
+    bool finished = false;
+    DataBenchDoneFunc on_done = nullptr;
+    gpointer user_data = nullptr;
+    guint done_source = 0;
+
+    std::mutex mutex;           // guards the results
+    std::map<guint32, DataBenchResult> results;
+};
+
+DataBench*
+data_bench_new(const std::vector<guint>& sizes, guint seconds,
+    DataBenchDoneFunc on_done, gpointer user_data)
+{
+    auto bench = new DataBench;
+    bench->sizes = sizes;
+    bench->seconds = MAX(seconds, 1);
+    bench->on_done = on_done;
+    bench->user_data = user_data;
+    return bench;
+}
+
+void
+data_bench_free(DataBench* bench)
+{
+    if (!bench)
+        return;
+
+    if (bench->done_source)
+        g_source_remove(bench->done_source);
+    if (bench->channel) {
+        data_channel_set_writable_callback(bench->channel, NULL, NULL);
+        if (bench->open_handler)
+            g_signal_handler_disconnect(data_channel_get_object(bench->channel),
+                bench->open_handler);
+    }
+    delete bench;
+}
+
+std::vector<guint>
+data_bench_parse_sizes(const char* text)
+{
+    std::vector<guint> sizes;
+    gchar **parts = g_strsplit(text, ",", -1);
+    for (gchar **part = parts; *part; ++part) {
+        const guint64 size = g_ascii_strtoull(*part, NULL, 10);
+        if (size)
+            sizes.push_back((guint) CLAMP(size, kHeaderSize, G_MAXUINT16 * 4));
+    }
+    g_strfreev(parts);
+    return sizes;
+}
+
+static GBytes *
+make_message(guint32 phase, guint size)
+{
+    guint8 *data = static_cast<guint8 *>(g_malloc(size));
+    GST_WRITE_UINT32_LE(data, phase);
+    GST_WRITE_UINT64_LE(data + 4, (guint64) g_get_monotonic_time());
+    memset(data + kHeaderSize, 0x5a, size - kHeaderSize);
+    return g_bytes_new_take(data, size);
+}
+
+static gboolean
+on_drained(gpointer user_data)
+{
+    auto bench = static_cast<DataBench *>(user_data);
+    bench->done_source = 0;
+    if (bench->on_done)
+        bench->on_done(bench, bench->user_data);
+    return G_SOURCE_REMOVE;
+}
+
+/* Sends until the channel pushes back, the writable callback resumes it */
+static void
+pump(DataChannel * channel, gpointer user_data)
+{
+    auto bench = static_cast<DataBench *>(user_data);
+
+    while (!bench->finished) {
+        const gint64 now = g_get_monotonic_time();
+        if (now - bench->phase_start >= (gint64) bench->seconds * G_USEC_PER_SEC) {
+            if (bench->phase_start && ++bench->phase == bench->sizes.size()) {
+                bench->finished = true;
+                gst_print("Data channel benchmark sent all sizes\n");
+                bench->done_source = g_timeout_add(kDrainMs, on_drained, bench);
+                break;
+            }
+            bench->phase_start = now;
+        }
+
+        GBytes *message = make_message((guint32) bench->phase, bench->sizes[bench->phase]);
+        const gboolean more = data_channel_send(channel, message);
+        g_bytes_unref(message);
+        if (!more)
+            break;
+    }
+}
+
+static gboolean
+start_pump(gpointer user_data)
+{
+    auto bench = static_cast<DataBench *>(user_data);
+    pump(bench->channel, bench);
+    return G_SOURCE_REMOVE;
+}
+
+/* Emitted from webrtcbin's thread */
+static void
+on_open(GObject * object, DataBench * bench)
+{
+    g_idle_add(start_pump, bench);
+}
+
+void
+data_bench_send(DataBench* bench, DataChannel* channel)
+{
+    if (bench->sizes.empty())
+        return;
+
+    bench->channel = channel;
+    data_channel_set_writable_callback(channel, pump, bench);
+
+    GstWebRTCDataChannelState state;
+    g_object_get(data_channel_get_object(channel), "ready-state", &state, NULL);
+    if (state == GST_WEBRTC_DATA_CHANNEL_STATE_OPEN) {
+        pump(channel, bench);
+    }
+    else {
+        bench->open_handler = g_signal_connect(data_channel_get_object(channel),
+            "on-open", G_CALLBACK(on_open), bench);
+    }
+}
+
+void
+data_bench_receive(GBytes* message, gpointer user_data)
+{
+    auto bench = static_cast<DataBench *>(user_data);
+    const gint64 now = g_get_monotonic_time();
+
+    gsize size;
+    const guint8 *data = static_cast<const guint8 *>(g_bytes_get_data(message, &size));
+    if (size < kHeaderSize)
+        return;
+
+    const guint32 phase = GST_READ_UINT32_LE(data);
+    const gint64 sent_us = (gint64) GST_READ_UINT64_LE(data + 4);
+
+    std::lock_guard<std::mutex> lock(bench->mutex);
+    DataBenchResult& result = bench->results[phase];
+    if (!result.messages)
+        result.first_us = now;
+    result.last_us = now;
+    result.messages++;
+    result.bytes += size;
+    if (result.latency_us.size() < kMaxSamples)
+        result.latency_us.push_back((gint32) MIN(now - sent_us, G_MAXINT32));
+}
+
+void
+data_bench_print(DataBench* bench)
+{
+    std::lock_guard<std::mutex> lock(bench->mutex);
+
+    for (auto& entry : bench->results) {
+        DataBenchResult& result = entry.second;
+        const guint size = entry.first < bench->sizes.size() ? bench->sizes[entry.first] : 0;
+        const double seconds = (result.last_us - result.first_us) / (double) G_USEC_PER_SEC;
+
+        std::vector<gint32>& samples = result.latency_us;
+        std::sort(samples.begin(), samples.end());
+        auto at = [&samples](double q) {
+            return samples.empty() ? 0.0 : samples[(size_t) (q * (samples.size() - 1))] / 1000.0;
+        };
+
+        gst_print("data %6u B: %" G_GUINT64_FORMAT " messages, %.2f MB/s, "
+            "latency p50 %.2f ms, p99 %.2f ms\n", size, result.messages,
+            seconds > 0 ? result.bytes / seconds / 1e6 : 0.0, at(0.50), at(0.99));
+    }
+}
@@ -0,0 +1,44 @@
+/*
+ * Bulk transfer benchmark over a data channel: one side sends as fast as
+ * backpressure allows, the other measures throughput and message latency.
+ * Both ends must share a monotonic clock, i.e. run in the same process.
+ */
+
+#ifndef DATA_BENCH_H
+#define DATA_BENCH_H
+
+#include "data_channel.h"
+
+#include <vector>
+
+struct DataBench;
+
+typedef void (*DataBenchDoneFunc)(DataBench* bench, gpointer user_data);
+
+/*
+ * Each message size is sent for that many seconds, in order. on_done is
+ * called from the main context once the last size is sent and messages
+ * still in flight have had a second to arrive.
+ */
+DataBench* data_bench_new(const std::vector<guint>& sizes, guint seconds,
+    DataBenchDoneFunc on_done, gpointer user_data);
+void data_bench_free(DataBench* bench);
+
+/*
+ * Parses "1024,16384,65536"; sizes below the message header are raised to it.
+ */
+std::vector<guint> data_bench_parse_sizes(const char* text);
+
+/*
+ * Starts sending once the channel is open. Main context only.
+ */
+void data_bench_send(DataBench* bench, DataChannel* channel);
+
+/*
+ * A DataConsumerFunc for the receiving channel, with the bench as user data.
+ */
+void data_bench_receive(GBytes* message, gpointer bench);
+
+void data_bench_print(DataBench* bench);
+
+#endif
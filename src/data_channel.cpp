@@ -0,0 +1,241 @@
+/*
+ * Binary data channel transport.
+ *
+ * Incoming messages are handed on as the GBytes webrtcbin produced, so
+ * consumers share the SCTP receive buffer instead of copying it. Outgoing
+ * messages queue in the channel's buffer; crossing the high watermark stops
+ * the sender until "on-buffered-amount-low" reports it drained below the low
+ * one, which bounds memory no matter how fast the producer is.
+ */
+
+#include "data_channel.h"
+#include "metrics.h"
+
+#define GST_USE_UNSTABLE_API
+#include <gst/webrtc/webrtc.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct DataChannel {
+    GObject *channel;
+    DataChannelConfig config;
+    std::string label;
+    gulong message_handler;
+    gulong low_handler;
+
+    std::mutex mutex;           // guards the callbacks and the idle source
+    std::vector<std::pair<DataConsumerFunc, gpointer>> consumers;
+    DataWritableFunc writable = nullptr;
+    gpointer writable_data = nullptr;
+    guint writable_source = 0;
+
+    std::atomic<guint64> messages_received{ 0 };
+    std::atomic<guint64> bytes_received{ 0 };
+    std::atomic<guint64> messages_sent{ 0 };
+    std::atomic<guint64> bytes_sent{ 0 };
+    std::atomic<guint64> stalls{ 0 };
+    std::atomic<bool> stalled{ false };
+};
+
+static std::mutex registry_mutex;
+static std::vector<DataChannel*> channels;
+
+static void
+on_message_data(GObject * object, GBytes * message, DataChannel * channel)
+{
+    /* Text arrives on "on-message-string"; an empty binary message has no bytes */
+    if (!message)
+        return;
+
+    channel->messages_received.fetch_add(1, std::memory_order_relaxed);
+    channel->bytes_received.fetch_add(g_bytes_get_size(message), std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(channel->mutex);
+    for (const auto& consumer : channel->consumers)
+        consumer.first(message, consumer.second);
+}
+
+static gboolean
+notify_writable(gpointer user_data)
+{
+    auto channel = static_cast<DataChannel *>(user_data);
+
+    DataWritableFunc func;
+    gpointer func_data;
+    {
+        std::lock_guard<std::mutex> lock(channel->mutex);
+        func = channel->writable;
+        func_data = channel->writable_data;
+        channel->writable_source = 0;
+    }
+
+    if (func && channel->stalled.exchange(false))
+        func(channel, func_data);
+    return G_SOURCE_REMOVE;
+}
+
+/* Emitted from webrtcbin's own thread; senders get called back on the main loop */
+static void
+on_buffered_amount_low(GObject * object, DataChannel * channel)
+{
+    std::lock_guard<std::mutex> lock(channel->mutex);
+    if (!channel->writable_source)
+        channel->writable_source = g_idle_add(notify_writable, channel);
+}
+
+struct DataChannelSeries {
+    const char *name;
+    const char *help;
+    std::atomic<guint64> DataChannel::*member;
+};
+
+static const DataChannelSeries series[] = {
+    { "media_receiver_data_messages_received_total",
+        "Binary data channel messages received", &DataChannel::messages_received },
+    { "media_receiver_data_bytes_received_total",
+        "Binary data channel bytes received", &DataChannel::bytes_received },
+    { "media_receiver_data_messages_sent_total",
+        "Data channel messages sent", &DataChannel::messages_sent },
+    { "media_receiver_data_bytes_sent_total",
+        "Data channel bytes sent", &DataChannel::bytes_sent },
+    { "media_receiver_data_send_stalls_total",
+        "Times a sender hit the high watermark", &DataChannel::stalls },
+};
+
+static void
+collect_data_channel_metrics(GString * out, gpointer unused)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    for (const auto& s : series) {
+        g_string_append_printf(out, "# HELP %s %s\n# TYPE %s counter\n",
+            s.name, s.help, s.name);
+        for (auto channel : channels) {
+            g_string_append_printf(out, "%s{channel=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                s.name, channel->label.c_str(),
+                (channel->*s.member).load(std::memory_order_relaxed));
+        }
+    }
+}
+
+static DataChannel*
+data_channel_new(GObject* object, const DataChannelConfig& config)
+{
+    static std::once_flag once;
+    std::call_once(once, [] {
+        metrics_register_collector(collect_data_channel_metrics, NULL);
+    });
+
+    auto channel = new DataChannel;
+    channel->channel = object;
+    channel->config = config;
+
+    gchar *label = NULL;
+    g_object_get(object, "label", &label, NULL);
+    channel->label = label ? label : "";
+    g_free(label);
+
+    g_object_set(object, "buffered-amount-low-threshold", config.low_watermark, NULL);
+    channel->message_handler = g_signal_connect(object, "on-message-data",
+        G_CALLBACK(on_message_data), channel);
+    channel->low_handler = g_signal_connect(object, "on-buffered-amount-low",
+        G_CALLBACK(on_buffered_amount_low), channel);
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    channels.push_back(channel);
+    return channel;
+}
+
+DataChannel*
+data_channel_create(GstElement* webrtc, const char* label, const DataChannelConfig& config)
+{
+    GstStructure *options = gst_structure_new("options",
+        "ordered", G_TYPE_BOOLEAN, config.ordered, NULL);
+    if (config.max_retransmits >= 0)
+        gst_structure_set(options, "max-retransmits", G_TYPE_INT, config.max_retransmits, NULL);
+    else if (config.max_packet_lifetime >= 0)
+        gst_structure_set(options, "max-packet-lifetime", G_TYPE_INT,
+            config.max_packet_lifetime, NULL);
+
+    GObject *object = NULL;
+    g_signal_emit_by_name(webrtc, "create-data-channel", label, options, &object);
+    gst_structure_free(options);
+
+    if (!object) {
+        gst_printerr("Failed to create data channel '%s'\n", label);
+        return nullptr;
+    }
+
+    return data_channel_new(object, config);
+}
+
+DataChannel*
+data_channel_wrap(GObject* object, const DataChannelConfig& config)
+{
+    return data_channel_new(G_OBJECT(g_object_ref(object)), config);
+}
+
+void
+data_channel_free(DataChannel* channel)
+{
+    if (!channel)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        channels.erase(std::remove(channels.begin(), channels.end(), channel),
+            channels.end());
+    }
+
+    g_signal_handler_disconnect(channel->channel, channel->message_handler);
+    g_signal_handler_disconnect(channel->channel, channel->low_handler);
+    if (channel->writable_source)
+        g_source_remove(channel->writable_source);
+
+    g_object_unref(channel->channel);
+    delete channel;
+}
+
+GObject*
+data_channel_get_object(DataChannel* channel)
+{
+    return channel->channel;
+}
+
+void
+data_channel_add_consumer(DataChannel* channel, DataConsumerFunc func, gpointer user_data)
+{
+    std::lock_guard<std::mutex> lock(channel->mutex);
+    channel->consumers.emplace_back(func, user_data);
+}
+
+void
+data_channel_set_writable_callback(DataChannel* channel, DataWritableFunc func,
+    gpointer user_data)
+{
+    std::lock_guard<std::mutex> lock(channel->mutex);
+    channel->writable = func;
+    channel->writable_data = user_data;
+}
+
+gboolean
+data_channel_send(DataChannel* channel, GBytes* message)
+{
+    g_signal_emit_by_name(channel->channel, "send-data", message);
+    channel->messages_sent.fetch_add(1, std::memory_order_relaxed);
+    channel->bytes_sent.fetch_add(g_bytes_get_size(message), std::memory_order_relaxed);
+
+    guint64 buffered = 0;
+    g_object_get(channel->channel, "buffered-amount", &buffered, NULL);
+    if (buffered < channel->config.high_watermark)
+        return TRUE;
+
+    channel->stalled = true;
+    channel->stalls.fetch_add(1, std::memory_order_relaxed);
+    return FALSE;
+}
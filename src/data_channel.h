@@ -0,0 +1,60 @@
+/*
+ * Binary data channel transport: zero-copy delivery of incoming messages to
+ * registered consumers, and sends with backpressure from the SCTP buffer.
+ */
+
+#ifndef DATA_CHANNEL_H
+#define DATA_CHANNEL_H
+
+#include <gst/gst.h>
+
+struct DataChannelConfig {
+    bool ordered = true;
+    gint max_retransmits = -1;          /* partial reliability by count, -1 for reliable */
+    gint max_packet_lifetime = -1;      /* or by time in milliseconds, -1 for reliable */
+    guint64 low_watermark = 256 * 1024; /* sending resumes below that many buffered bytes */
+    guint64 high_watermark = 1024 * 1024; /* and stops at that many */
+};
+
+struct DataChannel;
+
+/*
+ * Receives the channel's GBytes as is, from the SCTP thread. Take a
+ * reference to keep it.
+ */
+typedef void (*DataConsumerFunc)(GBytes* message, gpointer user_data);
+
+/*
+ * Called from the main context once a stopped sender may go on.
+ */
+typedef void (*DataWritableFunc)(DataChannel* channel, gpointer user_data);
+
+/*
+ * Creates a channel on the webrtcbin; must be in READY and before the offer.
+ */
+DataChannel* data_channel_create(GstElement* webrtc, const char* label,
+    const DataChannelConfig& config);
+
+/*
+ * Takes over a channel the remote side created. The config's reliability
+ * settings are the remote's business and ignored.
+ */
+DataChannel* data_channel_wrap(GObject* channel, const DataChannelConfig& config);
+
+void data_channel_free(DataChannel* channel);
+
+GObject* data_channel_get_object(DataChannel* channel);
+
+void data_channel_add_consumer(DataChannel* channel, DataConsumerFunc func,
+    gpointer user_data);
+
+void data_channel_set_writable_callback(DataChannel* channel, DataWritableFunc func,
+    gpointer user_data);
+
+/*
+ * Queues the message. Returns FALSE once the high watermark is reached; the
+ * caller should then wait for the writable callback before sending more.
+ */
+gboolean data_channel_send(DataChannel* channel, GBytes* message);
+
+#endif
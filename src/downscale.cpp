@@ -0,0 +1,277 @@
+/*
+ * Box filtered I420 downscale.
+ *
+ * Every source row is read once: the rows of an output row's box are added
+ * into a 16 bit accumulator row, which is where the SIMD kernels work, and
+ * the accumulator is then summed across each output column's box. Outputs
+ * are a few hundred pixels wide, so that second step and the RGB matrix stay
+ * scalar. Both kernels compute exact integer sums, so they agree bit for bit.
+ */
+
+#include "downscale.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNEL 1
+#endif
+
+#include <string.h>
+
+#include <vector>
+
+/* 257 * 255 still fits in 16 bits */
+static const gint kMaxBoxRows = 257;
+
+struct Span {
+    gint start;
+    gint count;
+};
+
+struct PlaneScaler {
+    gint width;
+    gint height;
+    std::vector<Span> rows;     /* one per output row */
+    std::vector<Span> cols;     /* one per output column */
+    std::vector<guint16> acc;
+    std::vector<guint8> out;    /* scratch for chroma and RGB luma */
+};
+
+struct Downscaler {
+    gint out_width;
+    gint out_height;
+    DownscaleFormat format;
+    DownscaleMatrix matrix;
+    PlaneScaler planes[3];
+    guint8 gray[256];           /* limited to full range luma */
+};
+
+typedef void (*AccumulateFunc)(guint16 *acc, const guint8 *src, gint n);
+
+static void
+accumulate_scalar(guint16 * acc, const guint8 * src, gint n)
+{
+    for (gint i = 0; i < n; ++i)
+        acc[i] += src[i];
+}
+
+#ifdef HAVE_AVX2_KERNEL
+__attribute__((target("avx2")))
+static void
+accumulate_avx2(guint16 * acc, const guint8 * src, gint n)
+{
+    gint i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m256i s = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (src + i)));
+        const __m256i a = _mm256_loadu_si256((const __m256i *) (acc + i));
+        _mm256_storeu_si256((__m256i *) (acc + i), _mm256_add_epi16(a, s));
+    }
+    accumulate_scalar(acc + i, src + i, n - i);
+}
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+static void
+accumulate_neon(guint16 * acc, const guint8 * src, gint n)
+{
+    gint i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const uint8x16_t s = vld1q_u8(src + i);
+        vst1q_u16(acc + i, vaddw_u8(vld1q_u16(acc + i), vget_low_u8(s)));
+        vst1q_u16(acc + i + 8, vaddw_u8(vld1q_u16(acc + i + 8), vget_high_u8(s)));
+    }
+    accumulate_scalar(acc + i, src + i, n - i);
+}
+#endif
+
+static AccumulateFunc simd_accumulate;
+static const char *simd_name;
+static gboolean use_simd = TRUE;
+
+static void
+select_kernel()
+{
+    static gsize once = 0;
+    if (!g_once_init_enter(&once))
+        return;
+
+    simd_accumulate = accumulate_scalar;
+    simd_name = "scalar";
+#if defined(HAVE_AVX2_KERNEL)
+    if (__builtin_cpu_supports("avx2")) {
+        simd_accumulate = accumulate_avx2;
+        simd_name = "avx2";
+    }
+#elif defined(HAVE_NEON_KERNEL)
+    simd_accumulate = accumulate_neon;
+    simd_name = "neon";
+#endif
+    g_once_init_leave(&once, 1);
+}
+
+/* Output i covers [i * in / out, (i + 1) * in / out), at least one sample */
+static std::vector<Span>
+make_spans(gint in, gint out)
+{
+    std::vector<Span> spans(out);
+    for (gint i = 0; i < out; ++i) {
+        const gint start = MIN((gint) ((gint64) i * in / out), in - 1);
+        const gint end = (gint) ((gint64) (i + 1) * in / out);
+        spans[i] = { start, MAX(end - start, 1) };
+    }
+    return spans;
+}
+
+static void
+plane_init(PlaneScaler * plane, gint width, gint height, gint out_width, gint out_height)
+{
+    plane->width = width;
+    plane->height = height;
+    plane->rows = make_spans(height, out_height);
+    plane->cols = make_spans(width, out_width);
+    plane->acc.resize(width);
+    plane->out.resize((size_t) out_width * out_height);
+}
+
+static void
+plane_process(PlaneScaler * plane, const guint8 * src, gint stride, guint8 * out,
+    gint out_stride, const guint8 * lut, AccumulateFunc accumulate)
+{
+    guint16 *acc = plane->acc.data();
+    const gint out_width = (gint) plane->cols.size();
+
+    for (size_t y = 0; y < plane->rows.size(); ++y) {
+        const Span rows = plane->rows[y];
+        memset(acc, 0, plane->width * sizeof(guint16));
+        for (gint r = 0; r < rows.count; ++r)
+            accumulate(acc, src + (gsize) (rows.start + r) * stride, plane->width);
+
+        guint8 *dst = out + y * out_stride;
+        for (gint x = 0; x < out_width; ++x) {
+            const Span cols = plane->cols[x];
+            guint32 sum = 0;
+            for (gint c = 0; c < cols.count; ++c)
+                sum += acc[cols.start + c];
+            const guint32 area = (guint32) cols.count * rows.count;
+            const guint8 average = (guint8) ((sum + area / 2) / area);
+            dst[x] = lut ? lut[average] : average;
+        }
+    }
+}
+
+static inline guint8
+clamp_u8(gint v)
+{
+    return (guint8) CLAMP(v, 0, 255);
+}
+
+/* Full range like RGB, which is what videoconvert makes GRAY8 */
+static void
+gray_init(guint8 * lut)
+{
+    for (gint y = 0; y < 256; ++y)
+        lut[y] = clamp_u8((298 * (y - 16) + 128) >> 8);
+}
+
+/* Limited range YUV to full range RGB, coefficients scaled by 256 */
+static void
+yuv_to_rgb(const Downscaler * scaler, guint8 * out, gint out_stride)
+{
+    const gint ky = 298;
+    const gint krv = scaler->matrix == DOWNSCALE_BT709 ? 459 : 409;
+    const gint kgu = scaler->matrix == DOWNSCALE_BT709 ? 55 : 100;
+    const gint kgv = scaler->matrix == DOWNSCALE_BT709 ? 136 : 208;
+    const gint kbu = scaler->matrix == DOWNSCALE_BT709 ? 541 : 516;
+
+    const guint8 *ys = scaler->planes[0].out.data();
+    const guint8 *us = scaler->planes[1].out.data();
+    const guint8 *vs = scaler->planes[2].out.data();
+
+    for (gint y = 0; y < scaler->out_height; ++y) {
+        guint8 *dst = out + (gsize) y * out_stride;
+        for (gint x = 0; x < scaler->out_width; ++x) {
+            const gsize i = (gsize) y * scaler->out_width + x;
+            const gint c = ky * (ys[i] - 16) + 128;
+            const gint d = us[i] - 128;
+            const gint e = vs[i] - 128;
+            dst[3 * x] = clamp_u8((c + krv * e) >> 8);
+            dst[3 * x + 1] = clamp_u8((c - kgu * d - kgv * e) >> 8);
+            dst[3 * x + 2] = clamp_u8((c + kbu * d) >> 8);
+        }
+    }
+}
+
+Downscaler*
+downscaler_new(gint width, gint height, gint out_width, gint out_height,
+    DownscaleFormat format, DownscaleMatrix matrix)
+{
+    select_kernel();
+
+    if (width <= 0 || height <= 0)
+        return NULL;
+
+    auto scaler = new Downscaler;
+    scaler->out_width = CLAMP(out_width, 1, width);
+    scaler->out_height = CLAMP(out_height, (height + kMaxBoxRows - 1) / kMaxBoxRows, height);
+    scaler->format = format;
+    scaler->matrix = matrix;
+
+    plane_init(&scaler->planes[0], width, height, scaler->out_width, scaler->out_height);
+    gray_init(scaler->gray);
+    if (format == DOWNSCALE_RGB) {
+        for (int i = 1; i < 3; ++i) {
+            plane_init(&scaler->planes[i], (width + 1) / 2, (height + 1) / 2,
+                scaler->out_width, scaler->out_height);
+        }
+    }
+    return scaler;
+}
+
+void
+downscaler_free(Downscaler* scaler)
+{
+    delete scaler;
+}
+
+void
+downscaler_get_size(Downscaler* scaler, gint* out_width, gint* out_height)
+{
+    *out_width = scaler->out_width;
+    *out_height = scaler->out_height;
+}
+
+void
+downscaler_process(Downscaler* scaler, const DownscalePlanes& in, guint8* out,
+    gint out_stride)
+{
+    const AccumulateFunc accumulate = use_simd ? simd_accumulate : accumulate_scalar;
+
+    if (scaler->format == DOWNSCALE_GRAY8) {
+        plane_process(&scaler->planes[0], in.data[0], in.stride[0], out, out_stride,
+            scaler->gray, accumulate);
+        return;
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        PlaneScaler *plane = &scaler->planes[i];
+        plane_process(plane, in.data[i], in.stride[i], plane->out.data(),
+            scaler->out_width, NULL, accumulate);
+    }
+    yuv_to_rgb(scaler, out, out_stride);
+}
+
+const char*
+downscale_kernel(void)
+{
+    select_kernel();
+    return use_simd ? simd_name : "scalar";
+}
+
+void
+downscale_set_simd(gboolean enabled)
+{
+    use_simd = enabled;
+}
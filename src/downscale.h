@@ -0,0 +1,52 @@
+/*
+ * One-pass I420 to small luma or RGB downscale for analytics, box filtered,
+ * with AVX2 and NEON kernels and a scalar fallback that gives the same bytes.
+ */
+
+#ifndef DOWNSCALE_H
+#define DOWNSCALE_H
+
+#include <glib.h>
+
+enum DownscaleFormat {
+    DOWNSCALE_GRAY8,            /* full range */
+    DOWNSCALE_RGB,              /* packed R, G, B, full range */
+};
+
+enum DownscaleMatrix {
+    DOWNSCALE_BT601,
+    DOWNSCALE_BT709,
+};
+
+struct DownscalePlanes {
+    const guint8 *data[3];      /* Y, U, V */
+    gint stride[3];
+};
+
+struct Downscaler;
+
+/*
+ * The output may not be larger than the input, and is made tall enough for
+ * a box to fit the 16 bit row accumulators (at most 257 source rows).
+ */
+Downscaler* downscaler_new(gint width, gint height, gint out_width, gint out_height,
+    DownscaleFormat format, DownscaleMatrix matrix);
+
+void downscaler_free(Downscaler* scaler);
+
+void downscaler_get_size(Downscaler* scaler, gint* out_width, gint* out_height);
+
+void downscaler_process(Downscaler* scaler, const DownscalePlanes& in, guint8* out,
+    gint out_stride);
+
+/*
+ * "avx2", "neon" or "scalar", whichever downscaler_process uses.
+ */
+const char* downscale_kernel(void);
+
+/*
+ * Forces the scalar kernel, to compare against it.
+ */
+void downscale_set_simd(gboolean enabled);
+
+#endif
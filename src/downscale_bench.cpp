@@ -0,0 +1,198 @@
+/*
+ * Checks the analysis downscaler against GstVideoConverter, the code behind
+ * videoconvert and videoscale, and times both per frame.
+ *
+ * downscale-bench [WxH [OUTWxOUTH [FRAMES]]]
+ *
+ * Exits 1 when the SIMD kernel differs from the scalar one by a single byte,
+ * or when either strays from the reference by more than kMaxMeanError on
+ * average (box versus linear filtering accounts for small differences).
+ */
+
+#include "downscale.h"
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+static const double kMaxMeanError = 3.0;
+
+/* Gradients, a moving box and some noise, so that both filters have work */
+static void
+fill_frame(GstVideoFrame * frame, gint index)
+{
+    const gint width = GST_VIDEO_FRAME_WIDTH(frame);
+    const gint height = GST_VIDEO_FRAME_HEIGHT(frame);
+    guint32 seed = 0x9e3779b9u * (index + 1);
+
+    for (int plane = 0; plane < 3; ++plane) {
+        guint8 *data = static_cast<guint8 *>(GST_VIDEO_FRAME_PLANE_DATA(frame, plane));
+        const gint stride = GST_VIDEO_FRAME_PLANE_STRIDE(frame, plane);
+        const gint w = plane ? (width + 1) / 2 : width;
+        const gint h = plane ? (height + 1) / 2 : height;
+        const gint box_x = (index * 7) % MAX(w / 2, 1);
+        const gint box_y = h / 4;
+
+        for (gint y = 0; y < h; ++y) {
+            for (gint x = 0; x < w; ++x) {
+                seed = seed * 1664525u + 1013904223u;
+                gint v = plane == 0 ? 16 + 219 * x / w : 128 + (plane == 1 ? 1 : -1) * 100 * y / h;
+                if (x >= box_x && x < box_x + w / 4 && y >= box_y && y < box_y + h / 4)
+                    v = plane == 0 ? 235 - v / 2 : 256 - v;
+                v += (gint) (seed >> 29) - 4;
+                data[(gsize) y * stride + x] = (guint8) CLAMP(v, 0, 255);
+            }
+        }
+    }
+}
+
+static gint64
+run_downscaler(Downscaler * scaler, GstVideoFrame * in, GstVideoFrame * out)
+{
+    DownscalePlanes planes;
+    for (int i = 0; i < 3; ++i) {
+        planes.data[i] = static_cast<const guint8 *>(GST_VIDEO_FRAME_PLANE_DATA(in, i));
+        planes.stride[i] = GST_VIDEO_FRAME_PLANE_STRIDE(in, i);
+    }
+
+    const gint64 start = g_get_monotonic_time();
+    downscaler_process(scaler, planes, static_cast<guint8 *>(GST_VIDEO_FRAME_PLANE_DATA(out, 0)),
+        GST_VIDEO_FRAME_PLANE_STRIDE(out, 0));
+    return g_get_monotonic_time() - start;
+}
+
+static double
+median_us(std::vector<gint64>& samples)
+{
+    std::sort(samples.begin(), samples.end());
+    return samples.empty() ? 0.0 : (double) samples[samples.size() / 2];
+}
+
+/* Mean and max absolute difference over the visible pixels */
+static void
+compare(GstVideoFrame * a, GstVideoFrame * b, double *mean, gint * max)
+{
+    const gint row_bytes = GST_VIDEO_FRAME_COMP_PSTRIDE(a, 0) * GST_VIDEO_FRAME_WIDTH(a);
+    guint64 sum = 0;
+    *max = 0;
+
+    for (gint y = 0; y < GST_VIDEO_FRAME_HEIGHT(a); ++y) {
+        const guint8 *pa = static_cast<guint8 *>(GST_VIDEO_FRAME_PLANE_DATA(a, 0))
+            + (gsize) y * GST_VIDEO_FRAME_PLANE_STRIDE(a, 0);
+        const guint8 *pb = static_cast<guint8 *>(GST_VIDEO_FRAME_PLANE_DATA(b, 0))
+            + (gsize) y * GST_VIDEO_FRAME_PLANE_STRIDE(b, 0);
+        for (gint x = 0; x < row_bytes; ++x) {
+            const gint d = ABS((gint) pa[x] - (gint) pb[x]);
+            sum += d;
+            *max = MAX(*max, d);
+        }
+    }
+    *mean = (double) sum / ((double) row_bytes * GST_VIDEO_FRAME_HEIGHT(a));
+}
+
+static gboolean
+bench_format(DownscaleFormat format, gint width, gint height, gint out_width,
+    gint out_height, gint frames)
+{
+    Downscaler *scaler = downscaler_new(width, height, out_width, out_height, format,
+        DOWNSCALE_BT601);
+    downscaler_get_size(scaler, &out_width, &out_height);
+
+    GstVideoInfo in_info, out_info;
+    gst_video_info_set_format(&in_info, GST_VIDEO_FORMAT_I420, width, height);
+    gst_video_colorimetry_from_string(&in_info.colorimetry, GST_VIDEO_COLORIMETRY_BT601);
+    gst_video_info_set_format(&out_info,
+        format == DOWNSCALE_RGB ? GST_VIDEO_FORMAT_RGB : GST_VIDEO_FORMAT_GRAY8,
+        out_width, out_height);
+
+    GstVideoConverter *converter = gst_video_converter_new(&in_info, &out_info,
+        gst_structure_new("GstVideoConverter",
+            GST_VIDEO_CONVERTER_OPT_RESAMPLER_METHOD, GST_TYPE_VIDEO_RESAMPLER_METHOD,
+            GST_VIDEO_RESAMPLER_METHOD_LINEAR,
+            GST_VIDEO_CONVERTER_OPT_DITHER_METHOD, GST_TYPE_VIDEO_DITHER_METHOD,
+            GST_VIDEO_DITHER_NONE,
+            GST_VIDEO_CONVERTER_OPT_THREADS, G_TYPE_UINT, 1, NULL));
+
+    GstBuffer *in_buf = gst_buffer_new_allocate(NULL, GST_VIDEO_INFO_SIZE(&in_info), NULL);
+    GstBuffer *out_bufs[3];
+    for (auto& buf : out_bufs)
+        buf = gst_buffer_new_allocate(NULL, GST_VIDEO_INFO_SIZE(&out_info), NULL);
+
+    std::vector<gint64> simd_us, scalar_us, reference_us;
+    double worst_mean = 0;
+    gint worst_max = 0;
+    gboolean identical = TRUE;
+
+    for (gint i = 0; i < frames; ++i) {
+        GstVideoFrame in, simd, scalar, reference;
+        gst_video_frame_map(&in, &in_info, in_buf, GST_MAP_READWRITE);
+        fill_frame(&in, i);
+        gst_video_frame_map(&simd, &out_info, out_bufs[0], GST_MAP_WRITE);
+        gst_video_frame_map(&scalar, &out_info, out_bufs[1], GST_MAP_WRITE);
+        gst_video_frame_map(&reference, &out_info, out_bufs[2], GST_MAP_WRITE);
+
+        downscale_set_simd(TRUE);
+        simd_us.push_back(run_downscaler(scaler, &in, &simd));
+        downscale_set_simd(FALSE);
+        scalar_us.push_back(run_downscaler(scaler, &in, &scalar));
+
+        const gint64 start = g_get_monotonic_time();
+        gst_video_converter_frame(converter, &in, &reference);
+        reference_us.push_back(g_get_monotonic_time() - start);
+
+        double mean;
+        gint max;
+        compare(&simd, &scalar, &mean, &max);
+        identical &= max == 0;
+        compare(&simd, &reference, &mean, &max);
+        worst_mean = MAX(worst_mean, mean);
+        worst_max = MAX(worst_max, max);
+
+        gst_video_frame_unmap(&reference);
+        gst_video_frame_unmap(&scalar);
+        gst_video_frame_unmap(&simd);
+        gst_video_frame_unmap(&in);
+    }
+    downscale_set_simd(TRUE);
+
+    printf("%s %dx%d -> %dx%d: %s %.0f us, scalar %.0f us, videoconvert/videoscale %.0f us "
+        "per frame; vs reference mean %.2f max %d%s\n",
+        format == DOWNSCALE_RGB ? "rgb " : "gray", width, height, out_width, out_height,
+        downscale_kernel(), median_us(simd_us), median_us(scalar_us),
+        median_us(reference_us), worst_mean, worst_max,
+        identical ? "" : ", SIMD and scalar DIFFER");
+
+    for (auto buf : out_bufs)
+        gst_buffer_unref(buf);
+    gst_buffer_unref(in_buf);
+    gst_video_converter_free(converter);
+    downscaler_free(scaler);
+
+    return identical && worst_mean <= kMaxMeanError;
+}
+
+int
+main(int argc, char *argv[])
+{
+    gint width = 1280, height = 720, out_width = 160, out_height = 90, frames = 300;
+
+    gst_init(&argc, &argv);
+
+    if ((argc > 1 && sscanf(argv[1], "%dx%d", &width, &height) != 2)
+        || (argc > 2 && sscanf(argv[2], "%dx%d", &out_width, &out_height) != 2)
+        || (argc > 3 && (frames = atoi(argv[3])) <= 0) || argc > 4
+        || width <= 0 || height <= 0 || out_width <= 0 || out_height <= 0) {
+        fprintf(stderr, "usage: %s [WxH [OUTWxOUTH [FRAMES]]]\n", argv[0]);
+        return 2;
+    }
+
+    gboolean ok = bench_format(DOWNSCALE_GRAY8, width, height, out_width, out_height, frames);
+    ok &= bench_format(DOWNSCALE_RGB, width, height, out_width, out_height, frames);
+    return ok ? 0 : 1;
+}
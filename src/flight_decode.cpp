@@ -0,0 +1,113 @@
+/*
+ * Prints a flight recorder dump as a timeline.
+ *
+ * flight-decode <dump.mrfr>
+ */
+
+#include "flight_recorder_format.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+static const char*
+state_kind_name(uint16_t kind)
+{
+    switch (kind) {
+    case FLIGHT_STATE_ICE_GATHERING: return "ice-gathering";
+    case FLIGHT_STATE_ICE_CONNECTION: return "ice-connection";
+    case FLIGHT_STATE_PEER_CONNECTION: return "peer-connection";
+    default: return "unknown";
+    }
+}
+
+static void
+print_details(const FlightDumpEvent& e)
+{
+    switch (e.type) {
+    case FLIGHT_EVENT_RTP_BATCH:
+        printf("packets=%u last_seq=%u", e.extra, e.value);
+        break;
+    case FLIGHT_EVENT_FRAME_DECODED:
+    case FLIGHT_EVENT_FRAME_RENDERED:
+        if (e.value == UINT32_MAX)
+            printf("pts=none");
+        else
+            printf("pts=%u.%03us", e.value / 1000, e.value % 1000);
+        break;
+    case FLIGHT_EVENT_DROP:
+    case FLIGHT_EVENT_NACK:
+        printf("seq=%u", e.value);
+        break;
+    case FLIGHT_EVENT_STATE:
+        printf("%s=%u", state_kind_name(e.extra), e.value);
+        break;
+    case FLIGHT_EVENT_STALL:
+        printf("no frame for %u ms", e.value);
+        break;
+    case FLIGHT_EVENT_ERROR:
+        printf("code=%u", e.value);
+        break;
+    default:
+        break;
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <dump.mrfr>\n", argv[0]);
+        return 2;
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if (!file) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    FlightDumpHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, FLIGHT_RECORDER_MAGIC, sizeof(header.magic)) != 0
+        || header.version != FLIGHT_RECORDER_VERSION) {
+        fprintf(stderr, "%s: not a flight recorder dump\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+    header.session[sizeof(header.session) - 1] = '\0';
+    header.reason[sizeof(header.reason) - 1] = '\0';
+
+    std::vector<FlightDumpEvent> events(header.event_count);
+    const size_t read = fread(events.data(), sizeof(FlightDumpEvent), events.size(), file);
+    fclose(file);
+    if (read != events.size()) {
+        fprintf(stderr, "%s: truncated, %zu of %u events\n", argv[1], read,
+            header.event_count);
+        events.resize(read);
+    }
+
+    const time_t dumped = (time_t) (header.realtime_us / 1000000);
+    char when[64];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&dumped));
+    printf("session %s, dumped %s.%06d on %s, %zu events (%u overwritten)\n",
+        header.session, when, (int) (header.realtime_us % 1000000), header.reason,
+        events.size(), header.overwritten);
+
+    /* Times are relative to the dump, so the anomaly is at the bottom near 0 */
+    uint64_t previous = 0;
+    for (const auto& e : events) {
+        const double before_ms = (header.monotonic_ns - (int64_t) e.time_ns) / 1e6;
+        const double delta_ms = previous ? ((int64_t) (e.time_ns - previous)) / 1e6 : 0;
+        previous = e.time_ns;
+
+        printf("%12.3f ms  %+9.3f  %-9s ", -before_ms, delta_ms, flight_event_name(e.type));
+        print_details(e);
+        printf("\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,380 @@
+/*
+ * Per-session in-memory ring of compact events, dumped to a file when a
+ * stall or an error is detected, or on SIGUSR1.
+ *
+ * Writers claim a slot with one fetch_add and publish it by storing its
+ * sequence number last, so any thread may record without locks and the
+ * dumper can skip slots that are being overwritten while it reads.
+ */
+
+#include "flight_recorder.h"
+
+#define GST_USE_UNSTABLE_API
+#include <gst/webrtc/webrtc.h>
+
+#ifndef _WIN32
+#include <glib-unix.h>
+#include <signal.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* 384 KiB per session, about ten seconds of a busy 30 fps stream */
+static const guint32 kCapacity = 16384;
+
+struct FlightSlot {
+    std::atomic<guint32> seq{ 0 };  /* index + 1 of the event in the slot */
+    guint32 value;
+    guint64 time_ns;
+    guint16 extra;
+    guint8 type;
+};
+
+static_assert(sizeof(FlightSlot) == 24, "slots are 24 bytes");
+
+struct FlightRecorder {
+    std::string name;
+
+    std::atomic<guint64> head{ 0 };
+    FlightSlot slots[kCapacity];
+
+    std::atomic<GstClockTime> last_render{ GST_CLOCK_TIME_NONE };
+    bool stalled = false;       /* main thread only */
+    guint dumps = 0;            /* main thread only */
+};
+
+static std::mutex registry_mutex;
+static std::vector<FlightRecorder*> recorders;
+static std::string dump_dir;
+static guint stall_threshold_ms;
+
+void
+flight_recorder_record(FlightRecorder* recorder, FlightEventType type,
+    guint32 value, guint16 extra)
+{
+    const guint64 index = recorder->head.fetch_add(1, std::memory_order_relaxed);
+    FlightSlot& slot = recorder->slots[index % kCapacity];
+
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.time_ns = gst_util_get_timestamp();
+    slot.value = value;
+    slot.extra = extra;
+    slot.type = type;
+    slot.seq.store((guint32) index + 1, std::memory_order_release);
+}
+
+static guint32
+rtp_seqnum(GstBuffer * buffer)
+{
+    guint8 header[4];
+    if (gst_buffer_extract(buffer, 0, header, sizeof(header)) != sizeof(header))
+        return 0;
+    return header[2] << 8 | header[3];
+}
+
+static guint32
+pts_ms(GstBuffer * buffer)
+{
+    return GST_BUFFER_PTS_IS_VALID(buffer)
+        ? (guint32) (GST_BUFFER_PTS(buffer) / GST_MSECOND) : G_MAXUINT32;
+}
+
+static GstPadProbeReturn
+on_rtp_probe(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    auto recorder = static_cast<FlightRecorder *>(user_data);
+
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+        flight_recorder_record(recorder, FLIGHT_EVENT_RTP_BATCH,
+            rtp_seqnum(GST_PAD_PROBE_INFO_BUFFER(info)), 1);
+    }
+    else if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        const guint n = gst_buffer_list_length(list);
+        if (n) {
+            flight_recorder_record(recorder, FLIGHT_EVENT_RTP_BATCH,
+                rtp_seqnum(gst_buffer_list_get(list, n - 1)), (guint16) MIN(n, G_MAXUINT16));
+        }
+    }
+    else if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        guint seqnum;
+        if (GST_EVENT_TYPE(event) == GST_EVENT_CUSTOM_DOWNSTREAM
+            && gst_event_has_name(event, "GstRTPPacketLost")
+            && gst_structure_get_uint(gst_event_get_structure(event), "seqnum", &seqnum))
+            flight_recorder_record(recorder, FLIGHT_EVENT_DROP, seqnum, 0);
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+/* Upstream requests passing the jitterbuffer on their way to the RTP session */
+static GstPadProbeReturn
+on_jitterbuffer_upstream(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    auto recorder = static_cast<FlightRecorder *>(user_data);
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+    guint seqnum;
+
+    if (gst_event_has_name(event, "GstRTPRetransmissionRequest")) {
+        if (!gst_structure_get_uint(gst_event_get_structure(event), "seqnum", &seqnum))
+            seqnum = 0;
+        flight_recorder_record(recorder, FLIGHT_EVENT_NACK, seqnum, 0);
+    }
+    else if (gst_event_has_name(event, "GstForceKeyUnit")) {
+        flight_recorder_record(recorder, FLIGHT_EVENT_PLI, 0, 0);
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+on_decoded_probe(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    flight_recorder_record(static_cast<FlightRecorder *>(user_data),
+        FLIGHT_EVENT_FRAME_DECODED, pts_ms(GST_PAD_PROBE_INFO_BUFFER(info)), 0);
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+on_render_probe(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    auto recorder = static_cast<FlightRecorder *>(user_data);
+    recorder->last_render.store(gst_util_get_timestamp(), std::memory_order_relaxed);
+    flight_recorder_record(recorder, FLIGHT_EVENT_FRAME_RENDERED,
+        pts_ms(GST_PAD_PROBE_INFO_BUFFER(info)), 0);
+    return GST_PAD_PROBE_OK;
+}
+
+static void
+on_deep_element_added(GstBin * bin, GstBin * sub_bin, GstElement * element,
+    FlightRecorder * recorder)
+{
+    GstElementFactory *factory = gst_element_get_factory(element);
+    if (!factory || GST_IS_BIN(element))
+        return;
+
+    if (g_str_equal(GST_OBJECT_NAME(factory), "rtpjitterbuffer")) {
+        GstPad *pad = gst_element_get_static_pad(element, "sink");
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM,
+            on_jitterbuffer_upstream, recorder, NULL);
+        gst_object_unref(pad);
+        return;
+    }
+
+    const gchar *klass =
+        gst_element_factory_get_metadata(factory, GST_ELEMENT_METADATA_KLASS);
+    if (klass && strstr(klass, "Decoder")) {
+        GstPad *pad = gst_element_get_static_pad(element, "src");
+        if (pad) {
+            gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_decoded_probe,
+                recorder, NULL);
+            gst_object_unref(pad);
+        }
+    }
+}
+
+static void
+on_state_notify(GstElement * webrtcbin, GParamSpec * pspec, FlightRecorder * recorder)
+{
+    gint state = 0;
+    g_object_get(webrtcbin, pspec->name, &state, NULL);
+
+    FlightStateKind kind;
+    if (g_str_equal(pspec->name, "ice-gathering-state"))
+        kind = FLIGHT_STATE_ICE_GATHERING;
+    else if (g_str_equal(pspec->name, "ice-connection-state"))
+        kind = FLIGHT_STATE_ICE_CONNECTION;
+    else
+        kind = FLIGHT_STATE_PEER_CONNECTION;
+
+    flight_recorder_record(recorder, FLIGHT_EVENT_STATE, state, kind);
+
+    if ((kind == FLIGHT_STATE_ICE_CONNECTION
+            && state == GST_WEBRTC_ICE_CONNECTION_STATE_FAILED)
+        || (kind == FLIGHT_STATE_PEER_CONNECTION
+            && state == GST_WEBRTC_PEER_CONNECTION_STATE_FAILED)) {
+        /* Notifications come from webrtcbin's thread, dump from the main one */
+        g_idle_add([](gpointer data) -> gboolean {
+            flight_recorder_dump(static_cast<FlightRecorder *>(data), "connection-failed");
+            return G_SOURCE_REMOVE;
+        }, recorder);
+    }
+}
+
+FlightRecorder*
+flight_recorder_new(const char* name)
+{
+    auto recorder = new FlightRecorder;
+    recorder->name = name;
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    recorders.push_back(recorder);
+    return recorder;
+}
+
+void
+flight_recorder_free(FlightRecorder* recorder)
+{
+    if (!recorder)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        recorders.erase(std::remove(recorders.begin(), recorders.end(), recorder),
+            recorders.end());
+    }
+    delete recorder;
+}
+
+void
+flight_recorder_attach(FlightRecorder* recorder, GstBin* bin)
+{
+    g_signal_connect(bin, "deep-element-added",
+        G_CALLBACK(on_deep_element_added), recorder);
+}
+
+void
+flight_recorder_watch_rtp(FlightRecorder* recorder, GstPad* pad)
+{
+    gst_pad_add_probe(pad,
+        (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST
+            | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+        on_rtp_probe, recorder, NULL);
+}
+
+void
+flight_recorder_watch_render(FlightRecorder* recorder, GstPad* pad)
+{
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_render_probe,
+        recorder, NULL);
+}
+
+void
+flight_recorder_watch_webrtcbin(FlightRecorder* recorder, GstElement* webrtcbin)
+{
+    g_signal_connect(webrtcbin, "notify::ice-gathering-state",
+        G_CALLBACK(on_state_notify), recorder);
+    g_signal_connect(webrtcbin, "notify::ice-connection-state",
+        G_CALLBACK(on_state_notify), recorder);
+    g_signal_connect(webrtcbin, "notify::connection-state",
+        G_CALLBACK(on_state_notify), recorder);
+}
+
+gboolean
+flight_recorder_dump(FlightRecorder* recorder, const char* reason)
+{
+    FlightDumpHeader header{};
+    memcpy(header.magic, FLIGHT_RECORDER_MAGIC, sizeof(header.magic));
+    header.version = FLIGHT_RECORDER_VERSION;
+    header.monotonic_ns = gst_util_get_timestamp();
+    header.realtime_us = g_get_real_time();
+    g_strlcpy(header.session, recorder->name.c_str(), sizeof(header.session));
+    g_strlcpy(header.reason, reason, sizeof(header.reason));
+
+    /* Snapshot first, writers keep going meanwhile */
+    const guint64 head = recorder->head.load(std::memory_order_acquire);
+    const guint64 first = head > kCapacity ? head - kCapacity : 0;
+    std::vector<FlightDumpEvent> events;
+    events.reserve(head - first);
+    for (guint64 i = first; i < head; ++i) {
+        const FlightSlot& slot = recorder->slots[i % kCapacity];
+        if (slot.seq.load(std::memory_order_acquire) != (guint32) i + 1)
+            continue;
+        FlightDumpEvent event{};
+        event.time_ns = slot.time_ns;
+        event.value = slot.value;
+        event.extra = slot.extra;
+        event.type = slot.type;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != (guint32) i + 1)
+            continue;
+        events.push_back(event);
+    }
+    header.event_count = events.size();
+    header.overwritten = first;
+
+    gchar *filename = g_strdup_printf("flight-%s-%" G_GINT64_FORMAT "-%u.mrfr",
+        recorder->name.c_str(), header.realtime_us / G_USEC_PER_SEC, recorder->dumps++);
+    gchar *path = g_build_filename(
+        dump_dir.empty() ? g_get_tmp_dir() : dump_dir.c_str(), filename, NULL);
+    g_free(filename);
+
+    FILE *file = fopen(path, "wb");
+    gboolean ok = file
+        && fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(events.data(), sizeof(FlightDumpEvent), events.size(), file)
+            == events.size();
+    if (file)
+        ok = fclose(file) == 0 && ok;
+
+    if (ok)
+        gst_print("Flight recorder dumped %u events to %s (%s)\n",
+            header.event_count, path, reason);
+    else
+        gst_printerr("Failed to write flight recorder dump %s\n", path);
+
+    g_free(path);
+    return ok;
+}
+
+static gboolean
+check_stalls(gpointer unused)
+{
+    const GstClockTime now = gst_util_get_timestamp();
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto recorder : recorders) {
+        const GstClockTime last = recorder->last_render.load(std::memory_order_relaxed);
+        if (!GST_CLOCK_TIME_IS_VALID(last))
+            continue;   /* nothing to stall yet */
+
+        const GstClockTime since = now > last ? now - last : 0;
+        if (since < stall_threshold_ms * GST_MSECOND) {
+            recorder->stalled = false;
+        }
+        else if (!recorder->stalled) {
+            recorder->stalled = true;
+            flight_recorder_record(recorder, FLIGHT_EVENT_STALL,
+                (guint32) (since / GST_MSECOND), 0);
+            flight_recorder_dump(recorder, "stall");
+        }
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+#ifndef _WIN32
+static gboolean
+on_dump_signal(gpointer unused)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto recorder : recorders)
+        flight_recorder_dump(recorder, "signal");
+    return G_SOURCE_CONTINUE;
+}
+#endif
+
+void
+flight_recorder_start(const char* dir, guint stall_ms)
+{
+    if (dir)
+        dump_dir = dir;
+
+    if (stall_ms) {
+        stall_threshold_ms = stall_ms;
+        g_timeout_add(MAX(stall_ms / 4, 50), check_stalls, NULL);
+    }
+
+#ifndef _WIN32
+    g_unix_signal_add(SIGUSR1, on_dump_signal, NULL);
+#endif
+}
@@ -0,0 +1,59 @@
+/*
+ * Per-session in-memory ring of compact events, dumped to a file when a
+ * stall or an error is detected, or on SIGUSR1. Decode dumps with
+ * flight-decode.
+ */
+
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include "flight_recorder_format.h"
+
+#include <gst/gst.h>
+
+struct FlightRecorder;
+
+FlightRecorder* flight_recorder_new(const char* name);
+
+/*
+ * Must only be freed once the watched pipeline is in NULL state.
+ */
+void flight_recorder_free(FlightRecorder* recorder);
+
+/*
+ * Lock-free, callable from any thread.
+ */
+void flight_recorder_record(FlightRecorder* recorder, FlightEventType type,
+    guint32 value, guint16 extra);
+
+/*
+ * Records decoded frames and NACKs/PLIs leaving the jitterbuffer as those
+ * elements get added anywhere below the bin.
+ */
+void flight_recorder_attach(FlightRecorder* recorder, GstBin* bin);
+
+/*
+ * Records RTP batches and packet loss on a webrtcbin src pad.
+ */
+void flight_recorder_watch_rtp(FlightRecorder* recorder, GstPad* pad);
+
+void flight_recorder_watch_render(FlightRecorder* recorder, GstPad* pad);
+
+/*
+ * Records ICE and peer connection state changes, and dumps when the
+ * connection fails.
+ */
+void flight_recorder_watch_webrtcbin(FlightRecorder* recorder, GstElement* webrtcbin);
+
+/*
+ * Writes the ring to a new file in the dump directory. Main thread only.
+ */
+gboolean flight_recorder_dump(FlightRecorder* recorder, const char* reason);
+
+/*
+ * Sets where dumps go (the temp directory when NULL), starts stall detection
+ * and installs the SIGUSR1 handler.
+ */
+void flight_recorder_start(const char* dir, guint stall_ms);
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * On-disk layout of flight recorder dumps, shared with the offline decoder.
+ * Dumps are written in host byte order.
+ */
+
+#ifndef FLIGHT_RECORDER_FORMAT_H
+#define FLIGHT_RECORDER_FORMAT_H
+
+#include <stdint.h>
+
+#define FLIGHT_RECORDER_MAGIC   "MRFR"
+#define FLIGHT_RECORDER_VERSION 1
+
+enum FlightEventType : uint8_t
+{
+    FLIGHT_EVENT_NONE = 0,
+    FLIGHT_EVENT_RTP_BATCH,         /* value: last seqnum, extra: packets */
+    FLIGHT_EVENT_FRAME_DECODED,     /* value: PTS in ms */
+    FLIGHT_EVENT_FRAME_RENDERED,    /* value: PTS in ms */
+    FLIGHT_EVENT_DROP,              /* value: seqnum the jitterbuffer gave up on */
+    FLIGHT_EVENT_NACK,              /* value: seqnum requested again */
+    FLIGHT_EVENT_PLI,               /* a keyframe was requested */
+    FLIGHT_EVENT_STATE,             /* value: new state, extra: FlightStateKind */
+    FLIGHT_EVENT_STALL,             /* value: ms since the last rendered frame */
+    FLIGHT_EVENT_ERROR,             /* value: GError code */
+};
+
+enum FlightStateKind : uint16_t
+{
+    FLIGHT_STATE_ICE_GATHERING = 0,
+    FLIGHT_STATE_ICE_CONNECTION,
+    FLIGHT_STATE_PEER_CONNECTION,
+};
+
+struct FlightDumpHeader {
+    char magic[4];
+    uint32_t version;
+    int64_t monotonic_ns;       /* taken together with realtime_us, */
+    int64_t realtime_us;        /* to put event times on the wall clock */
+    uint32_t event_count;
+    uint32_t overwritten;       /* events lost to wrap-around */
+    char session[64];
+    char reason[32];
+};
+
+struct FlightDumpEvent {
+    uint64_t time_ns;           /* monotonic */
+    uint32_t value;
+    uint16_t extra;
+    uint8_t type;
+    uint8_t reserved;
+};
+
+static_assert(sizeof(FlightDumpEvent) == 16, "dump events are 16 bytes");
+
+inline const char*
+flight_event_name(uint8_t type)
+{
+    switch (type) {
+    case FLIGHT_EVENT_RTP_BATCH: return "rtp";
+    case FLIGHT_EVENT_FRAME_DECODED: return "decoded";
+    case FLIGHT_EVENT_FRAME_RENDERED: return "rendered";
+    case FLIGHT_EVENT_DROP: return "drop";
+    case FLIGHT_EVENT_NACK: return "nack";
+    case FLIGHT_EVENT_PLI: return "pli";
+    case FLIGHT_EVENT_STATE: return "state";
+    case FLIGHT_EVENT_STALL: return "stall";
+    case FLIGHT_EVENT_ERROR: return "error";
+    default: return "unknown";
+    }
+}
+
+#endif
@@ -0,0 +1,460 @@
+/*
+ * Preallocated frame pools on a shared, size-bucketed allocator.
+ *
+ * Every branch still gets its own GstBufferPool, since a pool can only be
+ * configured and activated by one producer at a time; what is shared is the
+ * memory behind it. Blocks come in 2^k and 1.5 * 2^k sizes and are page
+ * aligned, so a block released by one session (on teardown, renegotiation or
+ * a simulcast resolution change) is picked up by the next pool that needs
+ * the same bucket instead of going back to the system.
+ */
+
+#include "frame_pool.h"
+#include "metrics.h"
+
+#include <gst/video/video.h>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <malloc.h>
+#else
+#include <stdlib.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#define GST_CAT_DEFAULT frame_pool_debug
+GST_DEBUG_CATEGORY_STATIC(GST_CAT_DEFAULT);
+
+#define BUCKET_ALLOCATOR_NAME "media-receiver-frames"
+
+/* Buffers each pool allocates up front */
+static const guint kPreallocated = 4;
+static const gsize kPageSize = 4096;
+static const gsize kHugePageSize = 2 * 1024 * 1024;
+
+struct Block {
+    guint8 *data;
+    gsize size;                 /* the bucket size */
+    gsize mapped;               /* what to munmap, 0 for heap blocks */
+};
+
+struct BucketMemory {
+    GstMemory mem;
+    Block block;                /* owned unless mem.parent is set */
+};
+
+typedef struct {
+    GstAllocator parent;
+} BucketAllocator;
+
+typedef struct {
+    GstAllocatorClass parent_class;
+} BucketAllocatorClass;
+
+GType bucket_allocator_get_type(void);
+G_DEFINE_TYPE(BucketAllocator, bucket_allocator, GST_TYPE_ALLOCATOR)
+
+static GstAllocator *allocator;
+static FrameMemory backing;
+static guint64 cache_limit;
+
+static std::mutex cache_mutex;  // guards the free lists and cached_bytes
+static std::map<gsize, std::vector<Block>> free_blocks;
+static guint64 cached_bytes;
+
+static std::atomic<guint64> system_allocations{ 0 };
+static std::atomic<guint64> reused_allocations{ 0 };
+static std::atomic<guint64> system_bytes{ 0 };
+
+/* Next 2^k or 1.5 * 2^k at or above size, at least a page */
+static gsize
+bucket_size(gsize size)
+{
+    gsize bucket = kPageSize;
+    while (bucket < size) {
+        if (bucket + bucket / 2 >= size)
+            return bucket + bucket / 2;
+        bucket *= 2;
+    }
+    return bucket;
+}
+
+static bool
+system_alloc(gsize size, Block * block)
+{
+    block->size = size;
+    block->mapped = 0;
+
+#if defined(__linux__)
+    if (backing == FRAME_MEMORY_MEMFD) {
+        const int fd = memfd_create("frame", MFD_CLOEXEC);
+        if (fd >= 0) {
+            void *p = MAP_FAILED;
+            if (ftruncate(fd, size) == 0)
+                p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (p != MAP_FAILED) {
+                block->data = static_cast<guint8 *>(p);
+                block->mapped = size;
+                return true;
+            }
+        }
+        GST_WARNING("memfd allocation of %" G_GSIZE_FORMAT " bytes failed", size);
+    }
+    else if (backing == FRAME_MEMORY_HUGEPAGE) {
+        const gsize length = (size + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+        void *p = mmap(NULL, length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            block->data = static_cast<guint8 *>(p);
+            block->mapped = length;
+            return true;
+        }
+
+        /* No reserved huge pages: ask for transparent ones instead */
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, size, MADV_HUGEPAGE);
+            block->data = static_cast<guint8 *>(p);
+            block->mapped = size;
+            return true;
+        }
+    }
+#endif
+
+#ifdef _WIN32
+    block->data = static_cast<guint8 *>(_aligned_malloc(size, kPageSize));
+    return block->data != NULL;
+#else
+    void *p = NULL;
+    if (posix_memalign(&p, kPageSize, size) != 0)
+        return false;
+    block->data = static_cast<guint8 *>(p);
+    return true;
+#endif
+}
+
+static void
+system_free(const Block& block)
+{
+#if defined(__linux__)
+    if (block.mapped) {
+        munmap(block.data, block.mapped);
+        return;
+    }
+#endif
+#ifdef _WIN32
+    _aligned_free(block.data);
+#else
+    free(block.data);
+#endif
+}
+
+static bool
+take_block(gsize size, Block * block)
+{
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto it = free_blocks.find(size);
+        if (it != free_blocks.end() && !it->second.empty()) {
+            *block = it->second.back();
+            it->second.pop_back();
+            cached_bytes -= size;
+            reused_allocations.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    if (!system_alloc(size, block))
+        return false;
+    system_allocations.fetch_add(1, std::memory_order_relaxed);
+    system_bytes.fetch_add(size, std::memory_order_relaxed);
+    return true;
+}
+
+static void
+release_block(const Block& block)
+{
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (cached_bytes + block.size <= cache_limit) {
+            free_blocks[block.size].push_back(block);
+            cached_bytes += block.size;
+            return;
+        }
+    }
+
+    system_free(block);
+    system_bytes.fetch_sub(block.size, std::memory_order_relaxed);
+}
+
+static GstMemory *
+bucket_alloc(GstAllocator * alloc, gsize size, GstAllocationParams * params)
+{
+    /* Blocks are page aligned, so only the prefix can misalign the data */
+    const gsize align = params->align | gst_memory_alignment;
+    const gsize offset = (params->prefix + align) & ~align;
+    const gsize needed = offset + size + params->padding;
+
+    auto mem = new BucketMemory;
+    if (align >= kPageSize || !take_block(bucket_size(needed), &mem->block)) {
+        delete mem;
+        return NULL;
+    }
+
+    gst_memory_init(GST_MEMORY_CAST(mem), params->flags, alloc, NULL,
+        mem->block.size, align, offset, size);
+
+    if ((params->flags & GST_MEMORY_FLAG_ZERO_PREFIXED) && offset)
+        memset(mem->block.data, 0, offset);
+    if (params->flags & GST_MEMORY_FLAG_ZERO_PADDED)
+        memset(mem->block.data + offset + size, 0, mem->block.size - offset - size);
+
+    return GST_MEMORY_CAST(mem);
+}
+
+static void
+bucket_free(GstAllocator * alloc, GstMemory * memory)
+{
+    auto mem = reinterpret_cast<BucketMemory *>(memory);
+    if (!memory->parent)
+        release_block(mem->block);
+    delete mem;
+}
+
+static gpointer
+bucket_mem_map(GstMemory * memory, gsize maxsize, GstMapFlags flags)
+{
+    return reinterpret_cast<BucketMemory *>(memory)->block.data;
+}
+
+static void
+bucket_mem_unmap(GstMemory * memory)
+{
+}
+
+static GstMemory *
+bucket_mem_share(GstMemory * memory, gssize offset, gssize size)
+{
+    auto mem = reinterpret_cast<BucketMemory *>(memory);
+    GstMemory *parent = memory->parent ? memory->parent : memory;
+
+    if (size == -1)
+        size = memory->size - offset;
+
+    auto sub = new BucketMemory;
+    sub->block = mem->block;
+    gst_memory_init(GST_MEMORY_CAST(sub),
+        (GstMemoryFlags) (GST_MINI_OBJECT_FLAGS(parent) | GST_MINI_OBJECT_FLAG_LOCK_READONLY),
+        memory->allocator, parent, memory->maxsize, memory->align,
+        memory->offset + offset, size);
+    return GST_MEMORY_CAST(sub);
+}
+
+static void
+bucket_allocator_class_init(BucketAllocatorClass * klass)
+{
+    GstAllocatorClass *allocator_class = GST_ALLOCATOR_CLASS(klass);
+    allocator_class->alloc = bucket_alloc;
+    allocator_class->free = bucket_free;
+}
+
+static void
+bucket_allocator_init(BucketAllocator * self)
+{
+    GstAllocator *alloc = GST_ALLOCATOR_CAST(self);
+    alloc->mem_type = BUCKET_ALLOCATOR_NAME;
+    alloc->mem_map = bucket_mem_map;
+    alloc->mem_unmap = bucket_mem_unmap;
+    alloc->mem_share = bucket_mem_share;
+    /* Copies go through map, which is all plain memory needs */
+    GST_OBJECT_FLAG_SET(self, GST_ALLOCATOR_FLAG_CUSTOM_ALLOC);
+}
+
+static guint64
+resident_bytes()
+{
+#if defined(__linux__)
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f)
+        return 0;
+    unsigned long size = 0, resident = 0;
+    const int n = fscanf(f, "%lu %lu", &size, &resident);
+    fclose(f);
+    return n == 2 ? (guint64) resident * sysconf(_SC_PAGESIZE) : 0;
+#else
+    return 0;
+#endif
+}
+
+static guint64
+minor_faults()
+{
+#if defined(__linux__)
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? (guint64) usage.ru_minflt : 0;
+#else
+    return 0;
+#endif
+}
+
+static void
+collect_frame_pool_metrics(GString * out, gpointer unused)
+{
+    guint64 cached;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        cached = cached_bytes;
+    }
+
+    g_string_append_printf(out,
+        "# HELP media_receiver_frame_memory_allocations_total Frame blocks taken from the system\n"
+        "# TYPE media_receiver_frame_memory_allocations_total counter\n"
+        "media_receiver_frame_memory_allocations_total %" G_GUINT64_FORMAT "\n"
+        "# HELP media_receiver_frame_memory_reused_total Frame blocks recycled from the cache\n"
+        "# TYPE media_receiver_frame_memory_reused_total counter\n"
+        "media_receiver_frame_memory_reused_total %" G_GUINT64_FORMAT "\n"
+        "# HELP media_receiver_frame_memory_bytes Frame memory held from the system\n"
+        "# TYPE media_receiver_frame_memory_bytes gauge\n"
+        "media_receiver_frame_memory_bytes %" G_GUINT64_FORMAT "\n"
+        "# HELP media_receiver_frame_memory_cached_bytes Frame memory free for reuse\n"
+        "# TYPE media_receiver_frame_memory_cached_bytes gauge\n"
+        "media_receiver_frame_memory_cached_bytes %" G_GUINT64_FORMAT "\n"
+        "# HELP media_receiver_resident_bytes Resident set size of the process\n"
+        "# TYPE media_receiver_resident_bytes gauge\n"
+        "media_receiver_resident_bytes %" G_GUINT64_FORMAT "\n"
+        "# HELP media_receiver_minor_faults_total Minor page faults of the process\n"
+        "# TYPE media_receiver_minor_faults_total counter\n"
+        "media_receiver_minor_faults_total %" G_GUINT64_FORMAT "\n",
+        system_allocations.load(std::memory_order_relaxed),
+        reused_allocations.load(std::memory_order_relaxed),
+        system_bytes.load(std::memory_order_relaxed), cached,
+        resident_bytes(), minor_faults());
+}
+
+void
+frame_pools_init(FrameMemory memory, guint64 cache_bytes)
+{
+    GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "framepool", 0, "Shared frame memory");
+
+    backing = memory;
+    cache_limit = cache_bytes;
+    allocator = GST_ALLOCATOR(g_object_new(bucket_allocator_get_type(), NULL));
+    gst_object_ref_sink(allocator);
+
+    metrics_register_collector(collect_frame_pool_metrics, NULL);
+}
+
+/* One per watched pad: the pool follows the caps the branch negotiates */
+struct FramePoolSite {
+    GstBufferPool *pool = nullptr;
+    GstCaps *caps = nullptr;
+};
+
+static void
+frame_pool_site_free(gpointer user_data)
+{
+    auto site = static_cast<FramePoolSite *>(user_data);
+    if (site->pool) {
+        gst_buffer_pool_set_active(site->pool, FALSE);
+        gst_object_unref(site->pool);
+    }
+    if (site->caps)
+        gst_caps_unref(site->caps);
+    delete site;
+}
+
+static GstPadProbeReturn
+on_allocation_query(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    auto site = static_cast<FramePoolSite *>(user_data);
+    GstQuery *query = GST_PAD_PROBE_INFO_QUERY(info);
+
+    /* Only after downstream had its say */
+    if (GST_QUERY_TYPE(query) != GST_QUERY_ALLOCATION
+        || !(info->type & GST_PAD_PROBE_TYPE_PULL))
+        return GST_PAD_PROBE_OK;
+
+    /* Sinks proposing a pool usually hand out device memory; keep theirs */
+    if (gst_query_get_n_allocation_pools(query) > 0)
+        return GST_PAD_PROBE_OK;
+
+    GstCaps *caps;
+    gboolean need_pool;
+    gst_query_parse_allocation(query, &caps, &need_pool);
+
+    GstVideoInfo vinfo;
+    if (!caps || !gst_caps_is_fixed(caps)
+        || !gst_caps_features_is_equal(gst_caps_get_features(caps, 0),
+            GST_CAPS_FEATURES_MEMORY_SYSTEM_MEMORY)
+        || !gst_video_info_from_caps(&vinfo, caps))
+        return GST_PAD_PROBE_OK;
+
+    if (!site->caps || !gst_caps_is_equal(site->caps, caps)) {
+        /* An active pool can't be reconfigured, the producer drops the old one */
+        if (site->pool)
+            gst_object_unref(site->pool);
+        gst_caps_replace(&site->caps, caps);
+
+        GstAllocationParams params;
+        gst_allocation_params_init(&params);
+        site->pool = gst_video_buffer_pool_new();
+        GstStructure *config = gst_buffer_pool_get_config(site->pool);
+        gst_buffer_pool_config_set_params(config, caps, vinfo.size, kPreallocated, 0);
+        gst_buffer_pool_config_set_allocator(config, allocator, &params);
+        gst_buffer_pool_config_add_option(config, GST_BUFFER_POOL_OPTION_VIDEO_META);
+        gst_buffer_pool_set_config(site->pool, config);
+
+        GST_DEBUG_OBJECT(pad, "proposing a pool of %u x %" G_GSIZE_FORMAT " bytes",
+            kPreallocated, vinfo.size);
+    }
+
+    GstAllocationParams params;
+    gst_allocation_params_init(&params);
+    gst_query_add_allocation_param(query, allocator, &params);
+    gst_query_add_allocation_pool(query, site->pool, vinfo.size, kPreallocated, 0);
+    if (!gst_query_find_allocation_meta(query, GST_VIDEO_META_API_TYPE, NULL))
+        gst_query_add_allocation_meta(query, GST_VIDEO_META_API_TYPE, NULL);
+
+    return GST_PAD_PROBE_OK;
+}
+
+void
+frame_pools_watch(GstPad* srcpad)
+{
+    if (!allocator)
+        return;
+
+    gst_pad_add_probe(srcpad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM,
+        on_allocation_query, new FramePoolSite, frame_pool_site_free);
+}
+
+void
+frame_pools_print_summary(void)
+{
+    if (allocator) {
+        guint64 cached;
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            cached = cached_bytes;
+        }
+        gst_print("frame memory: %" G_GUINT64_FORMAT " system allocations, %"
+            G_GUINT64_FORMAT " reused, %.1f MB held, %.1f MB cached\n",
+            system_allocations.load(std::memory_order_relaxed),
+            reused_allocations.load(std::memory_order_relaxed),
+            system_bytes.load(std::memory_order_relaxed) / 1e6, cached / 1e6);
+    }
+
+    gst_print("process: %.1f MB resident, %" G_GUINT64_FORMAT " minor page faults\n",
+        resident_bytes() / 1e6, minor_faults());
+}
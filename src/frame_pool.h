@@ -0,0 +1,34 @@
+/*
+ * Preallocated pools for decoded and converted video frames, backed by a
+ * process-wide allocator that recycles size-bucketed, aligned blocks across
+ * sessions.
+ */
+
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <gst/gst.h>
+
+enum FrameMemory {
+    FRAME_MEMORY_HEAP,
+    FRAME_MEMORY_MEMFD,         /* Linux only, falls back to the heap elsewhere */
+    FRAME_MEMORY_HUGEPAGE,      /* hugetlbfs if reserved, transparent huge pages otherwise */
+};
+
+/*
+ * Once, before any pad is watched. Freed blocks are kept up to cache_bytes.
+ */
+void frame_pools_init(FrameMemory backing, guint64 cache_bytes);
+
+/*
+ * Answers allocation queries going out of this src pad with a preallocated
+ * pool on the shared allocator, unless downstream brought its own pool.
+ */
+void frame_pools_watch(GstPad* srcpad);
+
+/*
+ * Allocator counters, if initialised, and the process' RSS and page faults.
+ */
+void frame_pools_print_summary(void);
+
+#endif
@@ -0,0 +1,753 @@
+/*
+ * Admission control and load shedding across sessions.
+ *
+ * Once a second the governor samples the process CPU share and resident
+ * memory, and each session's decode CPU from probes around its decoders.
+ * A new session is admitted when the average running session's decode
+ * cost still fits the CPU budget and the other budgets have room; otherwise
+ * it waits in a short queue ordered by priority, and is refused when the
+ * queue is full or it waited too long.
+ *
+ * Over budget, running sessions are degraded lowest priority first (the
+ * most expensive first among equals), about as many steps per tick as
+ * there are sessions' worth of CPU over budget. A queued session also puts
+ * pressure on the less important running ones. With headroom, one step is
+ * restored per tick, most important first, and not right after degrading,
+ * so the two don't oscillate. The lower layer and bitrate steps are the
+ * caller's to apply; snapshot mode is done here, by dropping delta frames
+ * in front of the video decoders and asking for a keyframe every interval.
+ */
+
+#include "governor.h"
+#include "metrics.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define GST_CAT_DEFAULT governor_debug
+GST_DEBUG_CATEGORY_STATIC(GST_CAT_DEFAULT);
+
+/* Ticks to wait after degrading before restoring anything */
+#define RESTORE_HOLD_TICKS 3
+
+enum GovernorState {
+    GOVERNOR_STATE_NEW,
+    GOVERNOR_STATE_QUEUED,
+    GOVERNOR_STATE_RUNNING,
+    GOVERNOR_STATE_REFUSED,
+};
+
+struct GovernorDecoder {
+    GovernorSession *session;
+    GstElement *element;        /* not a ref; dropped with it in deep-element-removed */
+    GstPad *sinkpad;
+    GstPad *srcpad = NULL;
+    gulong sink_probe = 0;
+    gulong src_probe = 0;
+    gboolean video;
+
+    /* Streaming thread only */
+    gint64 chain_start_ns = -1;
+
+    std::atomic<bool> awaiting_keyframe{ false };
+    std::atomic<guint64> dropped{ 0 };
+};
+
+struct GovernorSession {
+    std::string name;
+    gint priority;
+    GovernorLevelFunc on_level;
+    gpointer user_data;
+
+    std::atomic<int> level{ GOVERNOR_FULL };
+    std::atomic<gint64> decode_cpu_ns{ 0 };
+
+    std::mutex mutex;           // guards the decoder list
+    std::vector<std::unique_ptr<GovernorDecoder>> decoders;
+
+    /* Main loop only */
+    GovernorState state = GOVERNOR_STATE_NEW;
+    GovernorAdmitFunc admit_func = NULL;
+    gpointer admit_data = NULL;
+    guint admit_idle_id = 0;
+    gint64 queued_at = 0;
+    gint64 last_decode_cpu_ns = 0;
+    double decode_load = 0;     /* share of all cores */
+    gint64 last_keyframe_request = 0;
+};
+
+static std::mutex registry_mutex;
+static std::vector<GovernorSession*> sessions;
+static GovernorConfig governor_config;
+static gboolean started = FALSE;
+
+/* Main loop only */
+static gint64 last_tick;
+static gint64 last_cpu_us;
+static guint ticks_since_degrade = RESTORE_HOLD_TICKS;
+static double cpu_load;
+static guint64 memory_bytes;
+
+static std::atomic<guint64> admitted_total{ 0 };
+static std::atomic<guint64> queued_total{ 0 };
+static std::atomic<guint64> refused_total{ 0 };
+static std::atomic<guint64> degraded_total{ 0 };
+static std::atomic<guint64> restored_total{ 0 };
+
+static const char *level_names[] = { "full", "lower-layer", "bitrate-cap", "snapshot" };
+
+const char*
+governor_level_name(GovernorLevel level)
+{
+    return level_names[CLAMP((int) level, 0, (int) GOVERNOR_SNAPSHOT)];
+}
+
+static gint64
+process_cpu_time_us()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        return 0;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (gint64) ((k.QuadPart + u.QuadPart) / 10);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return (gint64) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC
+        + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#endif
+}
+
+static gint64
+thread_cpu_time_ns()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+        return 0;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (gint64) (k.QuadPart + u.QuadPart) * 100;
+#else
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return (gint64) ts.tv_sec * GST_SECOND + ts.tv_nsec;
+#endif
+}
+
+/* Resident set size, 0 where it isn't known */
+static guint64
+resident_bytes()
+{
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/statm", "r");
+    unsigned long long size = 0, resident = 0;
+    if (!f)
+        return 0;
+    if (fscanf(f, "%llu %llu", &size, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return (guint64) resident * sysconf(_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
+
+/* rtpsession turns this into a PLI */
+static void
+request_keyframe(GstPad * sinkpad)
+{
+    GstStructure *s = gst_structure_new("GstForceKeyUnit",
+        "running-time", GST_TYPE_CLOCK_TIME, GST_CLOCK_TIME_NONE,
+        "all-headers", G_TYPE_BOOLEAN, TRUE,
+        "count", G_TYPE_UINT, 0, NULL);
+    gst_pad_push_event(sinkpad, gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM, s));
+}
+
+static void
+request_keyframes(GovernorSession * session, gboolean resume)
+{
+    std::lock_guard<std::mutex> lock(session->mutex);
+    for (const auto& decoder : session->decoders) {
+        if (!decoder->video)
+            continue;
+        if (resume)
+            decoder->awaiting_keyframe = true;
+        request_keyframe(decoder->sinkpad);
+    }
+    session->last_keyframe_request = g_get_monotonic_time();
+}
+
+static GstPadProbeReturn
+on_decoder_sink(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    auto decoder = static_cast<GovernorDecoder *>(user_data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    /* Delta frames would only decode against references that were dropped */
+    if (decoder->video) {
+        const bool snapshot = decoder->session->level.load(std::memory_order_relaxed)
+            == GOVERNOR_SNAPSHOT;
+        if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+            if (snapshot || decoder->awaiting_keyframe.load(std::memory_order_relaxed)) {
+                decoder->dropped.fetch_add(1, std::memory_order_relaxed);
+                return GST_PAD_PROBE_DROP;
+            }
+        }
+        else {
+            decoder->awaiting_keyframe.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    decoder->chain_start_ns = thread_cpu_time_ns();
+    return GST_PAD_PROBE_OK;
+}
+
+/* Pushed from within the chain function, so this closes the decode */
+static GstPadProbeReturn
+on_decoder_src(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    auto decoder = static_cast<GovernorDecoder *>(user_data);
+
+    if (decoder->chain_start_ns >= 0) {
+        decoder->session->decode_cpu_ns.fetch_add(thread_cpu_time_ns() - decoder->chain_start_ns,
+            std::memory_order_relaxed);
+        decoder->chain_start_ns = -1;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static void
+on_deep_element_added(GstBin * bin, GstBin * sub_bin, GstElement * element,
+    GovernorSession * session)
+{
+    GstElementFactory *factory = gst_element_get_factory(element);
+    if (!factory || GST_IS_BIN(element))
+        return;
+
+    const gchar *klass = gst_element_factory_get_metadata(factory, GST_ELEMENT_METADATA_KLASS);
+    if (!klass || !strstr(klass, "Decoder"))
+        return;
+
+    auto decoder = std::make_unique<GovernorDecoder>();
+    decoder->session = session;
+    decoder->element = element;
+    decoder->sinkpad = gst_element_get_static_pad(element, "sink");
+    decoder->video = strstr(klass, "Video") != NULL;
+    if (!decoder->sinkpad)
+        return;
+
+    decoder->sink_probe = gst_pad_add_probe(decoder->sinkpad, GST_PAD_PROBE_TYPE_BUFFER,
+        on_decoder_sink, decoder.get(), NULL);
+    decoder->srcpad = gst_element_get_static_pad(element, "src");
+    if (decoder->srcpad)
+        decoder->src_probe = gst_pad_add_probe(decoder->srcpad, GST_PAD_PROBE_TYPE_BUFFER,
+            on_decoder_src, decoder.get(), NULL);
+    GST_INFO("%s: accounting %s", session->name.c_str(), GST_ELEMENT_NAME(element));
+
+    std::lock_guard<std::mutex> lock(session->mutex);
+    session->decoders.push_back(std::move(decoder));
+}
+
+static void
+release_decoder(GovernorDecoder * decoder)
+{
+    gst_pad_remove_probe(decoder->sinkpad, decoder->sink_probe);
+    gst_object_unref(decoder->sinkpad);
+    if (decoder->srcpad) {
+        gst_pad_remove_probe(decoder->srcpad, decoder->src_probe);
+        gst_object_unref(decoder->srcpad);
+    }
+}
+
+/* Destroyed branches and decodebin's own reconfiguration leave the pipeline */
+static void
+on_deep_element_removed(GstBin * bin, GstBin * sub_bin, GstElement * element,
+    GovernorSession * session)
+{
+    std::lock_guard<std::mutex> lock(session->mutex);
+    for (auto it = session->decoders.begin(); it != session->decoders.end(); ++it) {
+        if ((*it)->element == element) {
+            GST_INFO("%s: no longer accounting %s", session->name.c_str(),
+                GST_ELEMENT_NAME(element));
+            release_decoder(it->get());
+            session->decoders.erase(it);
+            return;
+        }
+    }
+}
+
+static void
+set_level(GovernorSession * session, GovernorLevel level, const char* reason)
+{
+    const GovernorLevel old = (GovernorLevel) session->level.exchange(level);
+    if (old == level)
+        return;
+
+    gst_print("Governor: %s (priority %d) %s -> %s: %s\n", session->name.c_str(),
+        session->priority, governor_level_name(old), governor_level_name(level), reason);
+    if (level > old)
+        degraded_total.fetch_add(1, std::memory_order_relaxed);
+    else
+        restored_total.fetch_add(1, std::memory_order_relaxed);
+
+    if (level == GOVERNOR_SNAPSHOT)
+        request_keyframes(session, FALSE);
+    else if (old == GOVERNOR_SNAPSHOT)
+        request_keyframes(session, TRUE);
+
+    if (session->on_level)
+        session->on_level(session, level, session->user_data);
+}
+
+static gboolean
+complete_admission(gpointer user_data)
+{
+    auto session = static_cast<GovernorSession *>(user_data);
+
+    session->admit_idle_id = 0;
+    if (session->admit_func)
+        session->admit_func(session, session->state == GOVERNOR_STATE_RUNNING,
+            session->admit_data);
+    return G_SOURCE_REMOVE;
+}
+
+/* Called with the registry lock held, like everything below */
+static void
+finish_admission(GovernorSession * session, GovernorState state)
+{
+    session->state = state;
+    if (state == GOVERNOR_STATE_RUNNING)
+        admitted_total.fetch_add(1, std::memory_order_relaxed);
+    else
+        refused_total.fetch_add(1, std::memory_order_relaxed);
+    session->admit_idle_id = g_idle_add(complete_admission, session);
+}
+
+static void
+admit(GovernorSession * session, const char* how)
+{
+    /* Don't take more than an equally important session is allowed */
+    int level = GOVERNOR_FULL;
+    for (auto other : sessions) {
+        if (other->state == GOVERNOR_STATE_RUNNING && other->priority >= session->priority)
+            level = std::max(level, other->level.load());
+    }
+
+    gst_print("Governor: %s (priority %d) admitted %s\n", session->name.c_str(),
+        session->priority, how);
+    set_level(session, (GovernorLevel) std::min(level, (int) GOVERNOR_BITRATE_CAP),
+        "an equally important session is degraded");
+    finish_admission(session, GOVERNOR_STATE_RUNNING);
+}
+
+static void
+refuse(GovernorSession * session, const char* reason)
+{
+    gst_print("Governor: %s (priority %d) refused: %s\n", session->name.c_str(),
+        session->priority, reason);
+    finish_admission(session, GOVERNOR_STATE_REFUSED);
+}
+
+static guint
+count_state(GovernorState state)
+{
+    return (guint) std::count_if(sessions.begin(), sessions.end(),
+        [state](const GovernorSession *s) { return s->state == state; });
+}
+
+static double
+average_decode_load()
+{
+    double total = 0;
+    guint n = 0;
+    for (auto s : sessions) {
+        if (s->state == GOVERNOR_STATE_RUNNING) {
+            total += s->decode_load;
+            ++n;
+        }
+    }
+    return n ? total / n : 0;
+}
+
+/* NULL when there is room for one more session */
+static const char*
+over_budget(void)
+{
+    const GovernorConfig& config = governor_config;
+
+    if (config.max_sessions && count_state(GOVERNOR_STATE_RUNNING) >= config.max_sessions)
+        return "session limit";
+    if (config.memory_budget && memory_bytes >= config.memory_budget)
+        return "memory budget";
+    if (cpu_load + average_decode_load() > config.cpu_budget)
+        return "CPU budget";
+    return NULL;
+}
+
+static bool
+more_important(const GovernorSession* a, const GovernorSession* b)
+{
+    if (a->priority != b->priority)
+        return a->priority > b->priority;
+    return a->queued_at < b->queued_at;
+}
+
+static void
+admit_queued(gint64 now)
+{
+    std::vector<GovernorSession*> queued;
+    for (auto s : sessions) {
+        if (s->state == GOVERNOR_STATE_QUEUED)
+            queued.push_back(s);
+    }
+    std::sort(queued.begin(), queued.end(), more_important);
+
+    /* One per tick, so its cost shows up before the next is let in */
+    bool admitted = false;
+    for (auto s : queued) {
+        if (!admitted && !over_budget()) {
+            admit(s, "from the queue");
+            admitted = true;
+        }
+        else if (now - s->queued_at >= (gint64) governor_config.queue_timeout_ms * 1000) {
+            refuse(s, "waited too long");
+        }
+    }
+}
+
+/* Least important running session that can still give something up */
+static GovernorSession*
+degrade_candidate(gint below_priority)
+{
+    GovernorSession *best = NULL;
+    for (auto s : sessions) {
+        if (s->state != GOVERNOR_STATE_RUNNING || s->level.load() >= GOVERNOR_SNAPSHOT
+            || s->priority >= below_priority)
+            continue;
+        if (!best || s->priority < best->priority
+            || (s->priority == best->priority && s->decode_load > best->decode_load))
+            best = s;
+    }
+    return best;
+}
+
+static GovernorSession*
+restore_candidate(void)
+{
+    GovernorSession *best = NULL;
+    for (auto s : sessions) {
+        if (s->state != GOVERNOR_STATE_RUNNING || s->level.load() == GOVERNOR_FULL)
+            continue;
+        if (!best || s->priority > best->priority
+            || (s->priority == best->priority && s->decode_load < best->decode_load))
+            best = s;
+    }
+    return best;
+}
+
+static void
+shed_load(void)
+{
+    const GovernorConfig& config = governor_config;
+
+    const bool over_cpu = cpu_load > config.cpu_budget;
+    const bool over_memory = config.memory_budget && memory_bytes > config.memory_budget;
+
+    gint queued_priority = G_MININT;
+    for (auto s : sessions) {
+        if (s->state == GOVERNOR_STATE_QUEUED)
+            queued_priority = MAX(queued_priority, s->priority);
+    }
+
+    if (over_cpu || over_memory) {
+        const double per_session = average_decode_load();
+        guint steps = 1;
+        if (over_cpu && per_session > 0)
+            steps = (guint) MAX(1.0, std::ceil((cpu_load - config.cpu_budget) / per_session));
+        for (guint i = 0; i < steps; ++i) {
+            GovernorSession *s = degrade_candidate(G_MAXINT);
+            if (!s)
+                break;
+            set_level(s, (GovernorLevel) (s->level.load() + 1),
+                over_cpu ? "CPU over budget" : "memory over budget");
+        }
+        ticks_since_degrade = 0;
+        return;
+    }
+
+    /* Make room for a more important session that is waiting */
+    if (queued_priority != G_MININT) {
+        GovernorSession *s = degrade_candidate(queued_priority);
+        if (s) {
+            set_level(s, (GovernorLevel) (s->level.load() + 1), "a more important session is queued");
+            ticks_since_degrade = 0;
+            return;
+        }
+    }
+
+    if (++ticks_since_degrade < RESTORE_HOLD_TICKS || queued_priority != G_MININT)
+        return;
+    if (cpu_load >= config.cpu_recover
+        || (config.memory_budget && memory_bytes > config.memory_budget * 9 / 10))
+        return;
+
+    GovernorSession *s = restore_candidate();
+    if (s)
+        set_level(s, (GovernorLevel) (s->level.load() - 1), "headroom");
+}
+
+static gboolean
+governor_tick(gpointer unused)
+{
+    const gint64 now = g_get_monotonic_time();
+    const gint64 cpu_us = process_cpu_time_us();
+    const double seconds = (now - last_tick) / (double) G_USEC_PER_SEC;
+    if (seconds <= 0)
+        return G_SOURCE_CONTINUE;
+
+    const double cores = g_get_num_processors();
+    cpu_load = (cpu_us - last_cpu_us) / (seconds * G_USEC_PER_SEC) / cores;
+    memory_bytes = resident_bytes();
+    last_tick = now;
+    last_cpu_us = cpu_us;
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    for (auto s : sessions) {
+        const gint64 decode_ns = s->decode_cpu_ns.load(std::memory_order_relaxed);
+        s->decode_load = (decode_ns - s->last_decode_cpu_ns) / (seconds * GST_SECOND) / cores;
+        s->last_decode_cpu_ns = decode_ns;
+    }
+
+    admit_queued(now);
+    shed_load();
+
+    for (auto s : sessions) {
+        if (s->state == GOVERNOR_STATE_RUNNING && s->level.load() == GOVERNOR_SNAPSHOT
+            && now - s->last_keyframe_request
+                >= (gint64) governor_config.snapshot_interval_ms * 1000)
+            request_keyframes(s, FALSE);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+collect_governor_metrics(GString * out, gpointer unused)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    g_string_append_printf(out,
+        "# HELP media_receiver_governor_cpu_load Process share of all cores the governor last measured\n"
+        "# TYPE media_receiver_governor_cpu_load gauge\n"
+        "media_receiver_governor_cpu_load %.4f\n"
+        "# HELP media_receiver_governor_memory_bytes Resident memory the governor last measured\n"
+        "# TYPE media_receiver_governor_memory_bytes gauge\n"
+        "media_receiver_governor_memory_bytes %" G_GUINT64_FORMAT "\n",
+        cpu_load, memory_bytes);
+
+    g_string_append_printf(out,
+        "# HELP media_receiver_governor_sessions Sessions by admission state\n"
+        "# TYPE media_receiver_governor_sessions gauge\n"
+        "media_receiver_governor_sessions{state=\"running\"} %u\n"
+        "media_receiver_governor_sessions{state=\"queued\"} %u\n",
+        count_state(GOVERNOR_STATE_RUNNING), count_state(GOVERNOR_STATE_QUEUED));
+
+    g_string_append_printf(out,
+        "# HELP media_receiver_governor_admissions_total Admission decisions\n"
+        "# TYPE media_receiver_governor_admissions_total counter\n"
+        "media_receiver_governor_admissions_total{result=\"admitted\"} %" G_GUINT64_FORMAT "\n"
+        "media_receiver_governor_admissions_total{result=\"queued\"} %" G_GUINT64_FORMAT "\n"
+        "media_receiver_governor_admissions_total{result=\"refused\"} %" G_GUINT64_FORMAT "\n",
+        admitted_total.load(), queued_total.load(), refused_total.load());
+
+    g_string_append_printf(out,
+        "# HELP media_receiver_governor_steps_total Degradation steps taken and undone\n"
+        "# TYPE media_receiver_governor_steps_total counter\n"
+        "media_receiver_governor_steps_total{direction=\"degrade\"} %" G_GUINT64_FORMAT "\n"
+        "media_receiver_governor_steps_total{direction=\"restore\"} %" G_GUINT64_FORMAT "\n",
+        degraded_total.load(), restored_total.load());
+
+    g_string_append(out,
+        "# HELP media_receiver_governor_level Degradation level, 0 full to 3 snapshot\n"
+        "# TYPE media_receiver_governor_level gauge\n");
+    for (auto s : sessions) {
+        if (s->state == GOVERNOR_STATE_RUNNING) {
+            g_string_append_printf(out,
+                "media_receiver_governor_level{session=\"%s\",priority=\"%d\",level=\"%s\"} %d\n",
+                s->name.c_str(), s->priority,
+                governor_level_name((GovernorLevel) s->level.load()), s->level.load());
+        }
+    }
+
+    g_string_append(out,
+        "# HELP media_receiver_governor_decode_cpu_seconds_total CPU time spent in decoders\n"
+        "# TYPE media_receiver_governor_decode_cpu_seconds_total counter\n");
+    for (auto s : sessions) {
+        g_string_append_printf(out,
+            "media_receiver_governor_decode_cpu_seconds_total{session=\"%s\"} %g\n",
+            s->name.c_str(), s->decode_cpu_ns.load(std::memory_order_relaxed) / 1e9);
+    }
+
+    g_string_append(out,
+        "# HELP media_receiver_governor_snapshot_dropped_total Delta frames dropped in snapshot mode\n"
+        "# TYPE media_receiver_governor_snapshot_dropped_total counter\n");
+    for (auto s : sessions) {
+        guint64 dropped = 0;
+        std::lock_guard<std::mutex> session_lock(s->mutex);
+        for (const auto& decoder : s->decoders)
+            dropped += decoder->dropped.load(std::memory_order_relaxed);
+        g_string_append_printf(out,
+            "media_receiver_governor_snapshot_dropped_total{session=\"%s\"} %" G_GUINT64_FORMAT "\n",
+            s->name.c_str(), dropped);
+    }
+}
+
+void
+governor_start(const GovernorConfig& config)
+{
+    g_return_if_fail(!started);
+
+    GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "governor", 0, "Admission control and load shedding");
+    metrics_register_collector(collect_governor_metrics, NULL);
+
+    governor_config = config;
+    last_tick = g_get_monotonic_time();
+    last_cpu_us = process_cpu_time_us();
+    memory_bytes = resident_bytes();
+    g_timeout_add(MAX(config.interval_ms, 100), governor_tick, NULL);
+    started = TRUE;
+}
+
+GovernorSession*
+governor_session_new(const char* name, gint priority, GovernorLevelFunc on_level,
+    gpointer user_data)
+{
+    auto session = new GovernorSession;
+    session->name = name;
+    session->priority = priority;
+    session->on_level = on_level;
+    session->user_data = user_data;
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    sessions.push_back(session);
+    return session;
+}
+
+void
+governor_session_free(GovernorSession* session)
+{
+    if (!session)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        sessions.erase(std::remove(sessions.begin(), sessions.end(), session),
+            sessions.end());
+    }
+
+    if (session->admit_idle_id)
+        g_source_remove(session->admit_idle_id);
+    for (const auto& decoder : session->decoders)
+        release_decoder(decoder.get());
+    delete session;
+}
+
+void
+governor_session_admit(GovernorSession* session, GovernorAdmitFunc func,
+    gpointer user_data)
+{
+    g_return_if_fail(started && session->state == GOVERNOR_STATE_NEW);
+
+    session->admit_func = func;
+    session->admit_data = user_data;
+    session->queued_at = g_get_monotonic_time();
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    /* Nobody overtakes a waiting session that is at least as important */
+    bool waiting = false;
+    for (auto s : sessions) {
+        if (s->state == GOVERNOR_STATE_QUEUED && s->priority >= session->priority)
+            waiting = true;
+    }
+
+    const char *reason = waiting ? "sessions waiting" : over_budget();
+    if (!reason) {
+        admit(session, "at once");
+    }
+    else if (count_state(GOVERNOR_STATE_QUEUED) < governor_config.max_queued) {
+        gst_print("Governor: %s (priority %d) queued: %s\n", session->name.c_str(),
+            session->priority, reason);
+        session->state = GOVERNOR_STATE_QUEUED;
+        queued_total.fetch_add(1, std::memory_order_relaxed);
+    }
+    else {
+        refuse(session, reason);
+    }
+}
+
+void
+governor_session_attach(GovernorSession* session, GstBin* bin)
+{
+    g_signal_connect(bin, "deep-element-added",
+        G_CALLBACK(on_deep_element_added), session);
+    g_signal_connect(bin, "deep-element-removed",
+        G_CALLBACK(on_deep_element_removed), session);
+}
+
+GovernorLevel
+governor_session_get_level(GovernorSession* session)
+{
+    return (GovernorLevel) session->level.load();
+}
+
+void
+governor_print(void)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    for (auto s : sessions) {
+        guint64 dropped = 0;
+        {
+            std::lock_guard<std::mutex> session_lock(s->mutex);
+            for (const auto& decoder : s->decoders)
+                dropped += decoder->dropped.load(std::memory_order_relaxed);
+        }
+        gst_print("governor %s: priority %d, %s, %.2f s decode CPU, %" G_GUINT64_FORMAT
+            " frames dropped for snapshots\n", s->name.c_str(), s->priority,
+            governor_level_name((GovernorLevel) s->level.load()),
+            s->decode_cpu_ns.load(std::memory_order_relaxed) / 1e9, dropped);
+    }
+    gst_print("governor: %" G_GUINT64_FORMAT " admitted, %" G_GUINT64_FORMAT " queued, %"
+        G_GUINT64_FORMAT " refused, %" G_GUINT64_FORMAT " steps down, %" G_GUINT64_FORMAT
+        " back up\n", admitted_total.load(), queued_total.load(), refused_total.load(),
+        degraded_total.load(), restored_total.load());
+}
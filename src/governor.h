@@ -0,0 +1,82 @@
+/*
+ * Process-wide admission control and load shedding: new sessions are
+ * admitted, queued or refused against CPU, memory and session budgets, and
+ * under pressure the least important running sessions are degraded a step
+ * at a time.
+ */
+
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <gst/gst.h>
+
+/* Each level includes the ones before it */
+enum GovernorLevel {
+    GOVERNOR_FULL = 0,
+    GOVERNOR_LOWER_LAYER,       /* a lower simulcast layer */
+    GOVERNOR_BITRATE_CAP,       /* a lower bitrate, in the offer and for simulcast */
+    GOVERNOR_SNAPSHOT,          /* keyframes only, one every snapshot interval */
+};
+
+struct GovernorConfig {
+    double cpu_budget = 0.85;           /* process share of all cores */
+    double cpu_recover = 0.60;          /* restore a step below that */
+    guint64 memory_budget = 0;          /* resident bytes, 0 for none */
+    guint max_sessions = 0;             /* 0 for no limit */
+    guint max_queued = 4;               /* refused beyond that */
+    guint queue_timeout_ms = 10000;     /* refused after waiting that long */
+    guint snapshot_interval_ms = 5000;
+    guint interval_ms = 1000;
+};
+
+struct GovernorSession;
+
+typedef void (*GovernorLevelFunc)(GovernorSession* session, GovernorLevel level,
+    gpointer user_data);
+typedef void (*GovernorAdmitFunc)(GovernorSession* session, gboolean admitted,
+    gpointer user_data);
+
+const char* governor_level_name(GovernorLevel level);
+
+/*
+ * Once, before the first session; decisions run on the default main context.
+ */
+void governor_start(const GovernorConfig& config);
+
+/*
+ * Higher priorities are degraded last and restored first. on_level is
+ * called from the main context whenever the session's level changes.
+ */
+GovernorSession* governor_session_new(const char* name, gint priority,
+    GovernorLevelFunc on_level, gpointer user_data);
+
+/*
+ * Only once the pipeline it is attached to is in NULL state. Frees its
+ * place for queued sessions.
+ */
+void governor_session_free(GovernorSession* session);
+
+/*
+ * Calls func from the main context once the session is admitted, or with
+ * FALSE when it is refused. Admitted sessions start degraded, through
+ * on_level, when a session at least as important already is.
+ */
+void governor_session_admit(GovernorSession* session, GovernorAdmitFunc func,
+    gpointer user_data);
+
+/*
+ * Accounts decode CPU for decoders added anywhere below the bin, until
+ * they are removed from it, and drops delta frames ahead of video decoders
+ * in snapshot mode. Attach before adding children.
+ */
+void governor_session_attach(GovernorSession* session, GstBin* bin);
+
+GovernorLevel governor_session_get_level(GovernorSession* session);
+
+/*
+ * One line per session with its level and decode CPU, then the admission
+ * and degradation counts.
+ */
+void governor_print(void);
+
+#endif
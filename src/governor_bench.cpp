@@ -0,0 +1,370 @@
+/*
+ * Synthetic overload for the governor: more VP8 sessions than the cores can
+ * decode, arriving one every 250 ms, a quarter of them at high priority.
+ *
+ * governor-bench [SESSIONS [SECONDS]]
+ *
+ * Two layers (640x360 and 320x180) are encoded once, with a keyframe every
+ * second, and fed to each session's vp8dec at 30 fps. A session whose
+ * decoder falls two frames behind skips to the next keyframe, as a receiver
+ * whose jitterbuffer overflows would. The run is done without the governor
+ * and then with it; lower-layer and bitrate-cap sessions are fed the small
+ * layer, snapshot ones are left to the governor. Prints the rendered frame
+ * rate per priority over the second half of each run, and exits 1 unless
+ * every high-priority session kept at least KEEP_FPS while governed and, if
+ * the ungoverned run fell short of it, low-priority sessions were shed
+ * (degraded, queued or refused) to get there.
+ */
+
+#include "governor.h"
+
+#include <gst/gst.h>
+#include <gst/app/app.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define FPS 30
+#define HIGH_PRIORITY 10
+#define KEEP_FPS (0.9 * FPS)
+
+#define LAYER_PIPELINE \
+    "videotestsrc num-buffers=%d pattern=ball ! video/x-raw,width=%d,height=%d,framerate=30/1 " \
+    "! vp8enc deadline=1 threads=1 keyframe-max-dist=30 target-bitrate=%d " \
+    "! appsink name=sink sync=false"
+
+struct Layer {
+    GstCaps *caps = NULL;
+    std::vector<GstBuffer*> frames;
+};
+
+struct BenchSession {
+    int index;
+    gint priority;
+    GstElement *pipe = NULL;
+    GstElement *src = NULL;
+    GovernorSession *governor = NULL;
+
+    std::atomic<bool> playing{ false };
+    std::atomic<bool> refused{ false };
+    std::atomic<guint64> rendered{ 0 };
+
+    /* Feeder thread only */
+    int layer = 0;
+    bool skipping = false;
+    guint64 half_time_rendered = 0;
+};
+
+struct PrioritySummary {
+    int running = 0;
+    int refused = 0;
+    int waiting = 0;
+    int degraded = 0;
+    double mean = 0;
+    double lowest = 0;
+};
+
+struct Bench {
+    int sessions;
+    int seconds;
+    bool governed;
+    GMainLoop *loop;
+    std::vector<Layer> layers;
+    std::vector<BenchSession*> all;
+    int arrived = 0;
+    std::atomic<bool> feeding{ true };
+    PrioritySummary high, low;  /* the last run's */
+};
+
+static Layer
+encode_layer(int width, int height, int bitrate)
+{
+    Layer layer;
+    GError *error = NULL;
+
+    gchar *description = g_strdup_printf(LAYER_PIPELINE, FPS * 10, width, height, bitrate);
+    GstElement *pipe = gst_parse_launch(description, &error);
+    g_free(description);
+    if (!pipe) {
+        fprintf(stderr, "Can't build the encoder: %s\n", error->message);
+        g_clear_error(&error);
+        exit(1);
+    }
+
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipe), "sink");
+    gst_element_set_state(pipe, GST_STATE_PLAYING);
+    while (GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(sink))) {
+        if (!layer.caps)
+            layer.caps = gst_caps_ref(gst_sample_get_caps(sample));
+        layer.frames.push_back(gst_buffer_ref(gst_sample_get_buffer(sample)));
+        gst_sample_unref(sample);
+    }
+    gst_element_set_state(pipe, GST_STATE_NULL);
+    gst_object_unref(sink);
+    gst_object_unref(pipe);
+    return layer;
+}
+
+static GstPadProbeReturn
+on_rendered(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    static_cast<BenchSession *>(user_data)->rendered.fetch_add(1, std::memory_order_relaxed);
+    return GST_PAD_PROBE_OK;
+}
+
+static void
+build_session(BenchSession * session, const Layer& layer)
+{
+    session->pipe = gst_pipeline_new(NULL);
+    if (session->governor)
+        governor_session_attach(session->governor, GST_BIN(session->pipe));
+
+    session->src = gst_element_factory_make("appsrc", NULL);
+    g_object_set(session->src, "is-live", TRUE, "format", GST_FORMAT_TIME,
+        "do-timestamp", TRUE, "caps", layer.caps, NULL);
+    GstElement *dec = gst_element_factory_make("vp8dec", NULL);
+    g_object_set(dec, "threads", 1, NULL);
+    GstElement *sink = gst_element_factory_make("fakesink", NULL);
+    g_object_set(sink, "sync", FALSE, NULL);
+    gst_bin_add_many(GST_BIN(session->pipe), session->src, dec, sink, NULL);
+    gst_element_link_many(session->src, dec, sink, NULL);
+
+    GstPad *pad = gst_element_get_static_pad(sink, "sink");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_rendered, session, NULL);
+    gst_object_unref(pad);
+}
+
+static void
+on_admitted(GovernorSession * governor, gboolean admitted, gpointer user_data)
+{
+    auto session = static_cast<BenchSession *>(user_data);
+    if (!admitted) {
+        session->refused = true;
+        return;
+    }
+    gst_element_set_state(session->pipe, GST_STATE_PLAYING);
+    session->playing = true;
+}
+
+static gboolean
+on_arrival(gpointer user_data)
+{
+    auto bench = static_cast<Bench *>(user_data);
+    if (bench->arrived == bench->sessions)
+        return G_SOURCE_REMOVE;
+
+    auto session = bench->all[bench->arrived++];
+    if (bench->governed) {
+        gchar *name = g_strdup_printf("s%02d", session->index);
+        session->governor = governor_session_new(name, session->priority, NULL, NULL);
+        g_free(name);
+    }
+    build_session(session, bench->layers[0]);
+
+    if (session->governor) {
+        governor_session_admit(session->governor, on_admitted, session);
+    }
+    else {
+        gst_element_set_state(session->pipe, GST_STATE_PLAYING);
+        session->playing = true;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+/* A frame per session every 1/FPS, switching layers only on keyframes */
+static void
+feed(Bench * bench)
+{
+    const auto interval = std::chrono::microseconds(1000000 / FPS);
+    auto next = std::chrono::steady_clock::now();
+    const size_t frames = bench->layers[0].frames.size();
+
+    for (size_t i = 0; bench->feeding; i = (i + 1) % frames) {
+        for (auto session : bench->all) {
+            if (!session->playing)
+                continue;
+
+            const GovernorLevel level = session->governor
+                ? governor_session_get_level(session->governor) : GOVERNOR_FULL;
+            const int wanted = level >= GOVERNOR_LOWER_LAYER ? 1 : 0;
+            GstBuffer *frame = bench->layers[wanted].frames[i];
+            const bool keyframe = !GST_BUFFER_FLAG_IS_SET(frame, GST_BUFFER_FLAG_DELTA_UNIT);
+            if (wanted != session->layer && keyframe) {
+                session->layer = wanted;
+                gst_app_src_set_caps(GST_APP_SRC(session->src), bench->layers[wanted].caps);
+            }
+            frame = bench->layers[session->layer].frames[i];
+
+            guint64 queued = 0;
+            g_object_get(session->src, "current-level-bytes", &queued, NULL);
+            if (queued > 2 * gst_buffer_get_size(frame))
+                session->skipping = true;
+            if (session->skipping) {
+                if (GST_BUFFER_FLAG_IS_SET(frame, GST_BUFFER_FLAG_DELTA_UNIT) || queued > 0)
+                    continue;
+                session->skipping = false;
+            }
+
+            GstBuffer *copy = gst_buffer_copy(frame);
+            GST_BUFFER_PTS(copy) = GST_BUFFER_DTS(copy) = GST_CLOCK_TIME_NONE;
+            gst_app_src_push_buffer(GST_APP_SRC(session->src), copy);
+        }
+        next += interval;
+        std::this_thread::sleep_until(next);
+    }
+}
+
+static gboolean
+on_half_time(gpointer user_data)
+{
+    auto bench = static_cast<Bench *>(user_data);
+    for (auto session : bench->all)
+        session->half_time_rendered = session->rendered.load();
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+on_done(gpointer user_data)
+{
+    g_main_loop_quit(static_cast<Bench *>(user_data)->loop);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+report(Bench * bench)
+{
+    const double window = bench->seconds / 2.0;
+
+    for (gint priority : { HIGH_PRIORITY, 0 }) {
+        PrioritySummary& summary = priority ? bench->high : bench->low;
+        summary = PrioritySummary();
+        double total = 0, lowest = FPS;
+        int levels[GOVERNOR_SNAPSHOT + 1] = { 0 };
+        for (auto session : bench->all) {
+            if (session->priority != priority)
+                continue;
+            if (session->refused) {
+                ++summary.refused;
+                continue;
+            }
+            if (!session->playing) {
+                ++summary.waiting;
+                continue;
+            }
+            const double fps = (session->rendered.load() - session->half_time_rendered) / window;
+            total += fps;
+            lowest = std::min(lowest, fps);
+            ++summary.running;
+            if (session->governor)
+                levels[governor_session_get_level(session->governor)]++;
+        }
+        summary.degraded = summary.running - levels[GOVERNOR_FULL];
+        if (summary.running) {
+            summary.mean = total / summary.running;
+            summary.lowest = lowest;
+        }
+        printf("%-10s %-5s %3d running %3d refused %3d queued  %5.1f fps mean  %5.1f fps min",
+            bench->governed ? "governed" : "ungoverned", priority ? "high" : "low",
+            summary.running, summary.refused, summary.waiting, summary.mean, summary.lowest);
+        if (bench->governed) {
+            printf("  levels");
+            for (int l = GOVERNOR_FULL; l <= GOVERNOR_SNAPSHOT; ++l)
+                printf(" %s=%d", governor_level_name((GovernorLevel) l), levels[l]);
+        }
+        printf("\n");
+    }
+}
+
+static void
+run(Bench * bench)
+{
+    for (int i = 0; i < bench->sessions; ++i) {
+        auto session = new BenchSession;
+        session->index = i;
+        session->priority = i % 4 == 3 ? HIGH_PRIORITY : 0;
+        bench->all.push_back(session);
+    }
+
+    bench->loop = g_main_loop_new(NULL, FALSE);
+    std::thread feeder(feed, bench);
+    on_arrival(bench);
+    g_timeout_add(250, on_arrival, bench);
+    g_timeout_add(bench->seconds * 500, on_half_time, bench);
+    g_timeout_add(bench->seconds * 1000, on_done, bench);
+    g_main_loop_run(bench->loop);
+
+    bench->feeding = false;
+    feeder.join();
+    report(bench);
+
+    for (auto session : bench->all) {
+        if (session->pipe) {
+            gst_element_set_state(session->pipe, GST_STATE_NULL);
+            gst_object_unref(session->pipe);
+        }
+        governor_session_free(session->governor);
+        delete session;
+    }
+    bench->all.clear();
+    g_main_loop_unref(bench->loop);
+}
+
+int
+main(int argc, char *argv[])
+{
+    gst_init(&argc, &argv);
+
+    const int cores = (int) g_get_num_processors();
+    const int sessions = argc > 1 ? std::max(atoi(argv[1]), 1) : 16 * cores;
+    const int seconds = argc > 2 ? std::max(atoi(argv[2]), 4) : 30;
+
+    Bench bench;
+    bench.sessions = sessions;
+    bench.seconds = seconds;
+    bench.layers.push_back(encode_layer(640, 360, 800000));
+    bench.layers.push_back(encode_layer(320, 180, 250000));
+    if (bench.layers[0].frames.size() != bench.layers[1].frames.size()) {
+        fprintf(stderr, "The layers came out with different frame counts\n");
+        return 1;
+    }
+
+    printf("%d sessions on %d cores, %d s per run, every 4th at high priority\n",
+        sessions, cores, seconds);
+
+    bench.governed = false;
+    run(&bench);
+    const bool overloaded = bench.high.lowest < KEEP_FPS || bench.low.lowest < KEEP_FPS;
+
+    GovernorConfig config;
+    config.snapshot_interval_ms = 1000;
+    governor_start(config);
+    bench.governed = true;
+    bench.feeding = true;
+    bench.arrived = 0;
+    run(&bench);
+    governor_print();
+
+    bool ok = true;
+    if (bench.high.running == 0 || bench.high.lowest < KEEP_FPS) {
+        fprintf(stderr, "FAIL: high-priority sessions dropped to %.1f fps (%d running), "
+            "expected at least %.0f\n", bench.high.lowest, bench.high.running, KEEP_FPS);
+        ok = false;
+    }
+    const int shed = bench.low.degraded + bench.low.refused + bench.low.waiting;
+    if (overloaded && shed == 0) {
+        fprintf(stderr, "FAIL: the ungoverned run was overloaded but no low-priority "
+            "session was shed\n");
+        ok = false;
+    }
+    if (!overloaded)
+        printf("The ungoverned run kept %.0f fps; use more sessions to overload the "
+            "governor\n", KEEP_FPS);
+    return ok ? 0 : 1;
+}
@@ -10,6 +10,10 @@
 #include <thread>
 #include <chrono>
 #include <mutex>
+#include <condition_variable>
+#include <random>
+#include <algorithm>
+#include <vector>
 
 #define SSE_CLIENT_VERSION       "0.2"
 #define SSE_CLIENT_USERAGENT     "sse/" SSE_CLIENT_VERSION
@@ -17,12 +21,132 @@
 
 Options options{};
 
-static char curl_error_buf[CURL_ERROR_SIZE];
+/*
+ * All transfers run on one multi handle, driven by one thread, so that
+ * requests to the same origin share its connections. An HTTP/2 origin
+ * carries them all as streams of a single connection: PIPEWAIT makes
+ * concurrent requests wait for the first connection to say whether it
+ * multiplexes, rather than each opening its own. Data and progress
+ * callbacks therefore run on that thread and must not block.
+ */
+namespace {
+
+struct Transfer {
+  CURLcode result = CURLE_OK;
+  bool done = false;
+};
+
+class Multiplexer {
+public:
+  static Multiplexer& instance() {
+    static Multiplexer* multiplexer = new Multiplexer;
+    return *multiplexer;
+  }
+
+  /* Blocks until the transfer is done, like curl_easy_perform() */
+  CURLcode perform(CURL* curl) {
+    Transfer transfer;
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, &transfer);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.push_back(curl);
+    }
+    curl_multi_wakeup(multi_);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [&transfer] { return transfer.done; });
+    return transfer.result;
+  }
+
+private:
+  Multiplexer() {
+    multi_ = curl_multi_init();
+    curl_multi_setopt(multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    long max_connections = options.max_host_connections;
+    /*
+     * Over HTTP/1.1 an SSE stream keeps its connection for good, and with a
+     * single one allowed the POST would wait behind it forever. Whether TLS
+     * negotiates h2 is only known after the handshake, but PIPEWAIT keeps h2
+     * transfers on one connection whatever the cap, so 2 costs nothing there.
+     */
+    if(max_connections == 1 && (!options.h2_prior_knowledge || options.fresh_connections)) {
+      fprintf(stderr, "1 connection per origin can't carry a POST next to an SSE stream "
+          "without HTTP/2, allowing 2\n");
+      max_connections = 2;
+    }
+    if(max_connections > 0)
+      curl_multi_setopt(multi_, CURLMOPT_MAX_HOST_CONNECTIONS, max_connections);
+    thread_ = std::thread(&Multiplexer::run, this);
+
+    /* Runs before curl_global_cleanup, which was registered first */
+    atexit([] { instance().stop(); });
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    curl_multi_wakeup(multi_);
+    thread_.join();
+  }
+
+  void run() {
+    for(;;) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(stopping_)
+          break;
+        for(CURL* curl : pending_)
+          curl_multi_add_handle(multi_, curl);
+        pending_.clear();
+      }
+
+      int running = 0;
+      curl_multi_perform(multi_, &running);
+
+      CURLMsg* msg;
+      int queued;
+      while((msg = curl_multi_info_read(multi_, &queued))) {
+        if(msg->msg != CURLMSG_DONE)
+          continue;
+        CURL* curl = msg->easy_handle;
+        const CURLcode result = msg->data.result;
+        Transfer* transfer = nullptr;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char**) &transfer);
+        curl_multi_remove_handle(multi_, curl);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        transfer->result = result;
+        transfer->done = true;
+        done_.notify_all();
+      }
+
+      curl_multi_poll(multi_, nullptr, 0, 1000, nullptr);
+    }
+  }
+
+  CURLM* multi_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable done_;
+  std::vector<CURL*> pending_;
+  bool stopping_ = false;
+};
+
+}
+
+/*
+ * Retries connection failures with jittered exponential backoff, from
+ * 250 ms up to 4 s, so that a brief outage costs little and many clients
+ * don't come back in step.
+ */
+static bool curl_perform(CURL* curl, int retries, const char* error_buf) {
+  static thread_local std::mt19937 random(std::random_device{}());
+  long delay_ms = 250;
 
-static bool curl_perform(CURL* curl) {
-  int retries = 5;
   while(1) {
-    CURLcode res = curl_easy_perform(curl);
+    CURLcode res = Multiplexer::instance().perform(curl);
 
     switch(res) {
       case CURLE_OK:
@@ -31,15 +155,20 @@ static bool curl_perform(CURL* curl) {
       case CURLE_COULDNT_RESOLVE_PROXY:
       case CURLE_COULDNT_RESOLVE_HOST:
       case CURLE_COULDNT_CONNECT:
-        fprintf(stderr, "curl: %s\n", curl_error_buf);
+        fprintf(stderr, "curl: %s\n", error_buf);
         if(retries-- <= 0) 
           return false;
 
-        fprintf(stderr, "retrying...\n");
-        std::this_thread::sleep_for(std::chrono::seconds(3));
+        {
+          std::uniform_int_distribution<long> jitter(delay_ms / 2, delay_ms);
+          const long sleep_ms = jitter(random);
+          fprintf(stderr, "retrying in %ld ms...\n", sleep_ms);
+          std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
+        }
+        delay_ms = std::min(delay_ms * 2, 4000L);
         break;
       default:
-        fprintf(stderr, "curl: %s\n", curl_error_buf);
+        fprintf(stderr, "curl: %s\n", error_buf);
         return false;
     }
   }
@@ -128,7 +257,6 @@ static CURL* curl_handle(int /*index*/) {
 
   curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
   curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 10);
-  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_error_buf);
   
   /* === allow insecure connections? =============================== */
 
@@ -165,6 +293,23 @@ static CURL* curl_handle(int /*index*/) {
 
   // https://stackoverflow.com/questions/30098087/is-libcurl-really-thread-safe
   curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+
+  /* === HTTP/2 ==================================================== */
+
+  /*
+   * h2 where TLS negotiates it, HTTP/1.1 otherwise; cleartext h2 only
+   * when the server is known to speak it.
+   */
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, options.h2_prior_knowledge
+      ? CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE : CURL_HTTP_VERSION_2TLS);
+
+  if(options.fresh_connections) {
+    curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
+    curl_easy_setopt(curl, CURLOPT_FORBID_REUSE, 1L);
+  }
+  else {
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+  }
   
   return curl;
 }
@@ -198,7 +343,8 @@ bool http(HttpVerb verb,
   
   OnDataFunc    on_data,
   std::function<const char*(CURL*)> on_verify,
-  OnProgressFunc progress_callback)
+  OnProgressFunc progress_callback,
+  int           retries)
 {
   CURL *curl = curl_handle(verb);
   if (!curl)
@@ -208,6 +354,9 @@ bool http(HttpVerb verb,
   
   curl_easy_setopt(curl, CURLOPT_URL, url);
 
+  char error_buf[CURL_ERROR_SIZE] = "";
+  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error_buf);
+
   // -- set headers ---------------------------------------------------
   
   struct curl_slist *headers = NULL;
@@ -254,7 +403,7 @@ bool http(HttpVerb verb,
   
   // -- perform -------------------------------------------------------
   
-  bool result = curl_perform(curl);         /* Perform the request */ 
+  bool result = curl_perform(curl, retries, error_buf);         /* Perform the request */ 
 
   // -- log CURL result -----------------------------------------------
 
@@ -35,7 +35,8 @@ bool http(HttpVerb  verb,
 
   OnDataFunc    on_data = {},
   std::function<const char*(CURL*)> on_verify = {},
-  OnProgressFunc progress_callback = {}
+  OnProgressFunc progress_callback = {},
+  int           retries = 5     /* on connection failures */
 );
 
 
@@ -49,6 +50,9 @@ struct Options {
     int         allow_insecure; // allow insecure connections
     const char *ssl_cert;       // SSL cert file
     const char *ca_info;        // CA cert file
+    int         max_host_connections; // per origin, 0 for no limit
+    int         h2_prior_knowledge;   // cleartext HTTP/2 without upgrade
+    int         fresh_connections;    // a new connection per request, no multiplexing
 };
 
 extern Options options;
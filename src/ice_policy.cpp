@@ -0,0 +1,225 @@
+/*
+ * ICE setup for the receiving webrtcbin.
+ *
+ * webrtcbin takes one STUN server and any number of TURN servers. Only the
+ * relay-only policy can be enforced inside the ICE agent; the other type
+ * filters keep candidates out of what is signalled, so the peer only learns
+ * the allowed ones (it can still discover peer reflexive ones by itself).
+ * Interfaces are restricted by giving libnice its local addresses
+ * explicitly, which stops it from enumerating the rest.
+ *
+ * Each libnice agent owns its sockets, so sessions can't share a port;
+ * a port range only keeps them to a known, firewallable set. With
+ * max-bundle every session takes one port of it.
+ */
+
+#include "ice_policy.h"
+
+#define GST_USE_UNSTABLE_API
+#include <gst/webrtc/webrtc.h>
+
+#include <nice/nice.h>
+
+#include <string.h>
+
+#define GST_CAT_DEFAULT ice_policy_debug
+GST_DEBUG_CATEGORY_STATIC(GST_CAT_DEFAULT);
+
+static const struct {
+    const char *name;
+    guint type;
+} candidate_types[] = {
+    { "host", ICE_CANDIDATE_HOST },
+    { "srflx", ICE_CANDIDATE_SRFLX },
+    { "prflx", ICE_CANDIDATE_PRFLX },
+    { "relay", ICE_CANDIDATE_RELAY },
+};
+
+gboolean
+ice_parse_candidate_types(const char* text, guint* types)
+{
+    gboolean ok = TRUE;
+
+    *types = 0;
+    gchar **parts = g_strsplit(text, ",", -1);
+    for (gchar **part = parts; *part && ok; ++part) {
+        ok = FALSE;
+        for (const auto& t : candidate_types) {
+            if (g_ascii_strcasecmp(g_strstrip(*part), t.name) == 0) {
+                *types |= t.type;
+                ok = TRUE;
+            }
+        }
+    }
+    g_strfreev(parts);
+    return ok && *types;
+}
+
+gboolean
+ice_parse_port_range(const char* text, guint* min_port, guint* max_port)
+{
+    guint64 low, high;
+    gchar *end = NULL;
+
+    low = g_ascii_strtoull(text, &end, 10);
+    if (end == text)
+        return FALSE;
+    high = low;
+    if (*end == '-') {
+        const gchar *start = end + 1;
+        high = g_ascii_strtoull(start, &end, 10);
+        if (end == start)
+            return FALSE;
+    }
+    if (*end != '\0' || low == 0 || high < low || high > 65535)
+        return FALSE;
+
+    *min_port = (guint) low;
+    *max_port = (guint) high;
+    return TRUE;
+}
+
+/* "stun:host:port" is what browsers take, webrtcbin wants a URI with a host */
+static std::string
+normalize_server(const std::string& server)
+{
+    const size_t colon = server.find(':');
+    if (colon == std::string::npos || server.compare(colon, 3, "://") == 0)
+        return server;
+    return server.substr(0, colon) + "://" + server.substr(colon + 1);
+}
+
+static void
+restrict_interfaces(GstElement * webrtcbin, const std::vector<std::string>& interfaces)
+{
+    GObject *ice = NULL;
+    GObject *agent = NULL;
+
+    if (g_object_class_find_property(G_OBJECT_GET_CLASS(webrtcbin), "ice-agent"))
+        g_object_get(webrtcbin, "ice-agent", &ice, NULL);
+    if (ice && g_object_class_find_property(G_OBJECT_GET_CLASS(ice), "agent"))
+        g_object_get(ice, "agent", &agent, NULL);
+    if (!agent || !NICE_IS_AGENT(agent)) {
+        gst_printerr("This webrtcbin doesn't expose its libnice agent, "
+            "gathering on all interfaces\n");
+        g_clear_object(&agent);
+        g_clear_object(&ice);
+        return;
+    }
+
+    for (const auto& entry : interfaces) {
+        gchar *ip = g_hostname_is_ip_address(entry.c_str()) ? g_strdup(entry.c_str())
+            : nice_interfaces_get_ip_for_interface((gchar *) entry.c_str());
+        NiceAddress address;
+        nice_address_init(&address);
+        if (!ip || !nice_address_set_from_string(&address, ip)) {
+            gst_printerr("No address for interface '%s'\n", entry.c_str());
+        }
+        else if (nice_agent_add_local_address(NICE_AGENT(agent), &address)) {
+            GST_INFO("gathering on %s (%s)", ip, entry.c_str());
+        }
+        g_free(ip);
+    }
+
+    g_object_unref(agent);
+    g_object_unref(ice);
+}
+
+static void
+restrict_ports(GstElement * webrtcbin, guint min_port, guint max_port)
+{
+    GObject *ice = NULL;
+
+    if (g_object_class_find_property(G_OBJECT_GET_CLASS(webrtcbin), "ice-agent"))
+        g_object_get(webrtcbin, "ice-agent", &ice, NULL);
+    if (!ice || !g_object_class_find_property(G_OBJECT_GET_CLASS(ice), "min-rtp-port")) {
+        gst_printerr("This webrtcbin can't restrict its ports, using ephemeral ones\n");
+        g_clear_object(&ice);
+        return;
+    }
+
+    /* max first, so min is never above it in between */
+    g_object_set(ice, "max-rtp-port", max_port, "min-rtp-port", min_port, NULL);
+    GST_INFO("local ports %u-%u", min_port, max_port);
+    g_object_unref(ice);
+}
+
+void
+ice_policy_apply(GstElement* webrtcbin, const IcePolicy& policy)
+{
+    static gsize debug_initialized = 0;
+    if (g_once_init_enter(&debug_initialized)) {
+        GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "icepolicy", 0, "ICE setup");
+        g_once_init_leave(&debug_initialized, 1);
+    }
+
+    /* Without servers only host candidates are gathered, and at once */
+    bool have_stun = false;
+    for (const auto& entry : policy.servers) {
+        const std::string server = normalize_server(entry);
+        if (g_str_has_prefix(server.c_str(), "stun://")) {
+            if (have_stun) {
+                gst_printerr("Only one STUN server is used, ignoring %s\n", server.c_str());
+                continue;
+            }
+            g_object_set(webrtcbin, "stun-server", server.c_str(), NULL);
+            have_stun = true;
+        }
+        else if (g_str_has_prefix(server.c_str(), "turn://")
+            || g_str_has_prefix(server.c_str(), "turns://")) {
+            gboolean added = FALSE;
+            g_signal_emit_by_name(webrtcbin, "add-turn-server", server.c_str(), &added);
+            if (!added)
+                gst_printerr("Invalid TURN server %s\n", server.c_str());
+        }
+        else {
+            gst_printerr("Unknown ICE server %s\n", server.c_str());
+        }
+    }
+
+    if (policy.candidate_types == ICE_CANDIDATE_RELAY) {
+        g_object_set(webrtcbin, "ice-transport-policy",
+            GST_WEBRTC_ICE_TRANSPORT_POLICY_RELAY, NULL);
+    }
+
+    if (!policy.interfaces.empty())
+        restrict_interfaces(webrtcbin, policy.interfaces);
+
+    if (policy.min_port)
+        restrict_ports(webrtcbin, policy.min_port, policy.max_port);
+}
+
+gboolean
+ice_candidate_allowed(const char* candidate, guint types)
+{
+    if (types == ICE_CANDIDATE_ALL)
+        return TRUE;
+
+    const char *typ = strstr(candidate, " typ ");
+    if (!typ)
+        return FALSE;
+    typ += 5;
+
+    for (const auto& t : candidate_types) {
+        const size_t len = strlen(t.name);
+        if (strncmp(typ, t.name, len) == 0 && (typ[len] == ' ' || typ[len] == '\0'))
+            return (types & t.type) != 0;
+    }
+    return FALSE;
+}
+
+void
+ice_filter_sdp_candidates(GstSDPMessage* sdp, guint types)
+{
+    if (types == ICE_CANDIDATE_ALL)
+        return;
+
+    for (guint m = 0; m < gst_sdp_message_medias_len(sdp); ++m) {
+        GstSDPMedia *media = (GstSDPMedia *) gst_sdp_message_get_media(sdp, m);
+        for (guint i = gst_sdp_media_attributes_len(media); i-- > 0;) {
+            const GstSDPAttribute *a = gst_sdp_media_get_attribute(media, i);
+            if (g_str_equal(a->key, "candidate") && !ice_candidate_allowed(a->value, types))
+                gst_sdp_media_remove_attribute(media, i);
+        }
+    }
+}
@@ -0,0 +1,59 @@
+/*
+ * ICE setup for the receiving webrtcbin: which servers to gather from,
+ * which local interfaces to use, and which candidate types to advertise.
+ */
+
+#ifndef ICE_POLICY_H
+#define ICE_POLICY_H
+
+#include <gst/gst.h>
+#include <gst/sdp/sdp.h>
+
+#include <string>
+#include <vector>
+
+enum IceCandidateType {
+    ICE_CANDIDATE_HOST = 1 << 0,
+    ICE_CANDIDATE_SRFLX = 1 << 1,
+    ICE_CANDIDATE_PRFLX = 1 << 2,
+    ICE_CANDIDATE_RELAY = 1 << 3,
+    ICE_CANDIDATE_ALL = 0xf,
+};
+
+#define ICE_DEFAULT_STUN_SERVER "stun://stun.l.google.com:19302"
+
+struct IcePolicy {
+    std::vector<std::string> servers = { ICE_DEFAULT_STUN_SERVER };    /* stun://, turn(s)://; empty for none */
+    guint candidate_types = ICE_CANDIDATE_ALL;
+    std::vector<std::string> interfaces;        /* names or addresses; empty for all */
+    guint min_port = 0;                         /* local UDP ports; 0 for ephemeral */
+    guint max_port = 0;
+};
+
+/*
+ * Parses "PORT" or "MIN-MAX"; returns FALSE when out of range.
+ */
+gboolean ice_parse_port_range(const char* text, guint* min_port, guint* max_port);
+
+/*
+ * Parses "host,srflx,relay"; returns FALSE on unknown types.
+ */
+gboolean ice_parse_candidate_types(const char* text, guint* types);
+
+/*
+ * Before the first offer, so gathering already follows it.
+ */
+void ice_policy_apply(GstElement* webrtcbin, const IcePolicy& policy);
+
+/*
+ * Whether a candidate line ("candidate:..." with or without the "a=") is of
+ * an allowed type.
+ */
+gboolean ice_candidate_allowed(const char* candidate, guint types);
+
+/*
+ * Drops the a=candidate lines of other types from every m-section.
+ */
+void ice_filter_sdp_candidates(GstSDPMessage* sdp, guint types);
+
+#endif
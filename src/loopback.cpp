@@ -0,0 +1,332 @@
+/*
+ * In-process stand-in for the browser page: answers the receiver's offer
+ * from a live test source, so the receive path can be exercised and
+ * measured without a phone or a signalling server.
+ */
+
+#include "loopback.h"
+#include "capture_time.h"
+
+#include <gst/sdp/sdp.h>
+#include <gst/rtp/rtp.h>
+
+#define GST_USE_UNSTABLE_API
+#include <gst/webrtc/webrtc.h>
+
+#include <json-glib/json-glib.h>
+
+#include <string.h>
+
+#define GST_CAT_DEFAULT loopback_debug
+GST_DEBUG_CATEGORY_STATIC(GST_CAT_DEFAULT);
+
+#define SENDER_SOURCE \
+    "videotestsrc is-live=true pattern=ball ! video/x-raw,width=1280,height=720,framerate=30/1 "
+#define SENDER_WEBRTC \
+    "application/x-rtp,media=video,encoding-name=VP8,payload=96 " \
+    "! webrtcbin name=sendonly bundle-policy=max-bundle"
+#define SENDER_ENCODER \
+    "vp8enc deadline=1 keyframe-max-dist=60 target-bitrate=%u " \
+    "! rtpvp8pay name=pay%u picture-id-mode=15-bit "
+
+#define SENDER_AUDIO \
+    "  audiotestsrc is-live=true wave=ticks ! audio/x-raw,rate=48000,channels=2 " \
+    "! opusenc inband-fec=true dtx=true packet-loss-percentage=10 frame-size=20 " \
+    "! rtpopuspay ! application/x-rtp,media=audio,encoding-name=OPUS,payload=111 ! sendonly."
+
+/* Best layer first, as the receiver offers them */
+static const char *const layer_rids[] = { "h", "m", "l" };
+static const guint layer_bitrates[] = { 1500000, 500000, 150000 };
+
+struct LoopbackPeer;
+
+/* Touched by its payloader's streaming thread only */
+struct LoopbackStream {
+    LoopbackPeer *peer;
+    const char *rid;
+    guint32 last_rtp_ts;
+    bool have_rtp_ts;
+};
+
+struct LoopbackPeer {
+    LoopbackConfig config;
+    LoopbackStream streams[G_N_ELEMENTS(layer_rids)];
+
+    GstElement *pipe;
+    GstElement *webrtc;
+    GstElement *receiver;
+    gulong receiver_candidate_handler;
+    DataChannel *channel;
+};
+
+/* Nanoseconds to UQ32.32 seconds */
+static guint64
+ns_to_ntp64(guint64 ns)
+{
+    return ((ns / GST_SECOND) << 32) | (((ns % GST_SECOND) << 32) / GST_SECOND);
+}
+
+/*
+ * A single sending webrtcbin doesn't produce simulcast by itself, so it is
+ * one encoder per layer funnelled into the same sink pad, each payloader
+ * keeping its own SSRC.
+ */
+static std::string
+encoder_branch(guint layer)
+{
+    gchar *text = g_strdup_printf(SENDER_ENCODER, layer_bitrates[layer], layer);
+    std::string branch = text;
+    g_free(text);
+    return branch;
+}
+
+static std::string
+sender_pipeline(guint layers)
+{
+    if (layers == 1)
+        return SENDER_SOURCE "! " + encoder_branch(0) + "! " SENDER_WEBRTC;
+
+    std::string description = SENDER_SOURCE "! tee name=t  rtpfunnel name=funnel ! " SENDER_WEBRTC;
+    for (guint i = 0; i < layers; ++i) {
+        gchar *scale = g_strdup_printf("  t. ! queue ! videoscale ! video/x-raw,width=%u,height=%u ! ",
+            1280 >> i, 720 >> i);
+        description += scale + encoder_branch(i) + "! funnel.";
+        g_free(scale);
+    }
+    return description;
+}
+
+static void
+stamp_packet(LoopbackStream * stream, GstBuffer * buffer)
+{
+    LoopbackPeer *peer = stream->peer;
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    if (!gst_rtp_buffer_map(buffer, GST_MAP_READWRITE, &rtp))
+        return;
+
+    if (stream->rid && !gst_rtp_buffer_add_extension_onebyte_header(&rtp,
+        peer->config.rid_ext_id, stream->rid, strlen(stream->rid)))
+        GST_WARNING("can't add rid to packet");
+
+    /* One stamp per frame, the receiver interpolates the rest */
+    const guint32 rtp_ts = gst_rtp_buffer_get_timestamp(&rtp);
+    if (peer->config.capture_ext_id
+        && (!stream->have_rtp_ts || rtp_ts != stream->last_rtp_ts)) {
+        stream->have_rtp_ts = true;
+        stream->last_rtp_ts = rtp_ts;
+
+        const guint64 capture_ns = capture_time_ntp_now()
+            - (guint64) peer->config.capture_offset_ms * GST_MSECOND;
+        guint8 data[8];
+        GST_WRITE_UINT64_BE(data, ns_to_ntp64(capture_ns));
+        if (!gst_rtp_buffer_add_extension_onebyte_header(&rtp,
+            peer->config.capture_ext_id, data, sizeof(data)))
+            GST_WARNING("can't add abs-capture-time to packet");
+    }
+
+    gst_rtp_buffer_unmap(&rtp);
+}
+
+static GstPadProbeReturn
+on_payloader_src(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    auto stream = static_cast<LoopbackStream *>(user_data);
+
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+        GstBuffer *buffer = gst_buffer_make_writable(GST_PAD_PROBE_INFO_BUFFER(info));
+        stamp_packet(stream, buffer);
+        GST_PAD_PROBE_INFO_DATA(info) = buffer;
+    }
+    else if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList *list =
+            gst_buffer_list_make_writable(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+        const guint n = gst_buffer_list_length(list);
+        for (guint i = 0; i < n; ++i)
+            stamp_packet(stream, gst_buffer_list_get_writable(list, i));
+        GST_PAD_PROBE_INFO_DATA(info) = list;
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+static void
+on_sender_ice_candidate(GstElement * webrtc, guint mlineindex,
+    gchar * candidate, LoopbackPeer * peer)
+{
+    g_signal_emit_by_name(peer->receiver, "add-ice-candidate", mlineindex, candidate);
+}
+
+static void
+on_receiver_ice_candidate(GstElement * webrtc, guint mlineindex,
+    gchar * candidate, LoopbackPeer * peer)
+{
+    if (ice_candidate_allowed(candidate, peer->config.candidate_types))
+        g_signal_emit_by_name(peer->webrtc, "add-ice-candidate", mlineindex, candidate);
+}
+
+static gboolean
+start_data_bench(gpointer user_data)
+{
+    auto peer = static_cast<LoopbackPeer *>(user_data);
+    data_bench_send(peer->config.data_bench, peer->channel);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+on_sender_data_channel(GstElement * webrtc, GObject * object, LoopbackPeer * peer)
+{
+    if (peer->channel)
+        return;
+
+    peer->channel = data_channel_wrap(object, DataChannelConfig());
+    if (peer->config.data_bench)
+        g_idle_add(start_data_bench, peer);
+}
+
+LoopbackPeer*
+loopback_peer_new(GstElement* receiver, const LoopbackConfig& config)
+{
+    GError *error = NULL;
+
+    static gsize debug_initialized = 0;
+    if (g_once_init_enter(&debug_initialized)) {
+        GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "loopback", 0,
+            "In-process sending peer");
+        g_once_init_leave(&debug_initialized, 1);
+    }
+
+    const guint layers = CLAMP(config.simulcast_layers, 1, G_N_ELEMENTS(layer_rids));
+    std::string description = sender_pipeline(layers);
+    if (config.audio)
+        description += SENDER_AUDIO;
+    GstElement *pipe = gst_parse_launch(description.c_str(), &error);
+    if (!pipe) {
+        gst_printerr("Failed to create loopback sender: %s\n", error->message);
+        g_clear_error(&error);
+        return nullptr;
+    }
+
+    auto peer = new LoopbackPeer{};
+    peer->config = config;
+    peer->pipe = pipe;
+    peer->webrtc = gst_bin_get_by_name(GST_BIN(pipe), "sendonly");
+    peer->receiver = GST_ELEMENT(gst_object_ref(receiver));
+
+    for (guint i = 0; i < layers; ++i) {
+        LoopbackStream *stream = &peer->streams[i];
+        stream->peer = peer;
+        stream->rid = layers > 1 && config.rid_ext_id ? layer_rids[i] : NULL;
+        if (!stream->rid && !config.capture_ext_id)
+            continue;
+
+        gchar *name = g_strdup_printf("pay%u", i);
+        GstElement *pay = gst_bin_get_by_name(GST_BIN(pipe), name);
+        GstPad *srcpad = gst_element_get_static_pad(pay, "src");
+        gst_pad_add_probe(srcpad,
+            (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+            on_payloader_src, stream, NULL);
+        gst_object_unref(srcpad);
+        gst_object_unref(pay);
+        g_free(name);
+    }
+
+    g_signal_connect(peer->webrtc, "on-ice-candidate",
+        G_CALLBACK(on_sender_ice_candidate), peer);
+    g_signal_connect(peer->webrtc, "on-data-channel",
+        G_CALLBACK(on_sender_data_channel), peer);
+    peer->receiver_candidate_handler = g_signal_connect(receiver,
+        "on-ice-candidate", G_CALLBACK(on_receiver_ice_candidate), peer);
+
+    if (gst_element_set_state(pipe, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        gst_printerr("Failed to start loopback sender\n");
+        loopback_peer_free(peer);
+        return nullptr;
+    }
+
+    return peer;
+}
+
+void
+loopback_peer_free(LoopbackPeer* peer)
+{
+    if (!peer)
+        return;
+
+    g_signal_handler_disconnect(peer->receiver, peer->receiver_candidate_handler);
+    gst_element_set_state(peer->pipe, GST_STATE_NULL);
+    data_channel_free(peer->channel);
+    gst_object_unref(peer->webrtc);
+    gst_object_unref(peer->pipe);
+    gst_object_unref(peer->receiver);
+    delete peer;
+}
+
+std::string
+loopback_peer_negotiate(LoopbackPeer* peer, const char* offer_json)
+{
+    std::string result;
+
+    JsonParser *parser = json_parser_new();
+    if (!json_parser_load_from_data(parser, offer_json, -1, NULL)
+        || !JSON_NODE_HOLDS_OBJECT(json_parser_get_root(parser))) {
+        g_object_unref(parser);
+        return result;
+    }
+
+    auto object = json_node_get_object(json_parser_get_root(parser));
+    GstSDPMessage *sdp;
+    if (!json_object_has_member(object, "sdp")
+        || gst_sdp_message_new_from_text(
+            json_object_get_string_member(object, "sdp"), &sdp) != GST_SDP_OK) {
+        g_object_unref(parser);
+        return result;
+    }
+    g_object_unref(parser);
+
+    auto offer = gst_webrtc_session_description_new(GST_WEBRTC_SDP_TYPE_OFFER, sdp);
+    GstPromise *promise = gst_promise_new();
+    g_signal_emit_by_name(peer->webrtc, "set-remote-description", offer, promise);
+    gst_promise_wait(promise);
+    gst_promise_unref(promise);
+    gst_webrtc_session_description_free(offer);
+
+    promise = gst_promise_new();
+    g_signal_emit_by_name(peer->webrtc, "create-answer", NULL, promise);
+    if (gst_promise_wait(promise) != GST_PROMISE_RESULT_REPLIED) {
+        gst_promise_unref(promise);
+        return result;
+    }
+
+    GstWebRTCSessionDescription *answer = NULL;
+    gst_structure_get(gst_promise_get_reply(promise), "answer",
+        GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &answer, NULL);
+    gst_promise_unref(promise);
+    if (!answer)
+        return result;
+
+    promise = gst_promise_new();
+    g_signal_emit_by_name(peer->webrtc, "set-local-description", answer, promise);
+    gst_promise_interrupt(promise);
+    gst_promise_unref(promise);
+
+    gchar *text = gst_sdp_message_as_text(answer->sdp);
+    gst_webrtc_session_description_free(answer);
+
+    JsonObject *reply = json_object_new();
+    json_object_set_string_member(reply, "type", "answer");
+    json_object_set_string_member(reply, "sdp", text);
+    g_free(text);
+
+    JsonNode *root = json_node_init_object(json_node_alloc(), reply);
+    JsonGenerator *generator = json_generator_new();
+    json_generator_set_root(generator, root);
+    text = json_generator_to_data(generator, NULL);
+    result = text;
+
+    g_free(text);
+    g_object_unref(generator);
+    json_node_free(root);
+    json_object_unref(reply);
+
+    return result;
+}
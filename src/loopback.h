@@ -0,0 +1,41 @@
+/*
+ * In-process stand-in for the browser page: answers the receiver's offer
+ * from a live test source, so the receive path can be exercised and
+ * measured without a phone or a signalling server.
+ */
+
+#ifndef LOOPBACK_H
+#define LOOPBACK_H
+
+#include <gst/gst.h>
+
+#include "data_bench.h"
+#include "ice_policy.h"
+
+#include <string>
+
+struct LoopbackConfig {
+    guint capture_ext_id = 0;       /* stamp abs-capture-time with this id, 0 disables */
+    gint capture_offset_ms = 0;     /* pretend frames were captured that much earlier */
+    guint simulcast_layers = 1;     /* encode that many halving resolutions, at most 3 */
+    guint rid_ext_id = 0;           /* stamp each layer's rid with this id, 0 disables */
+    bool audio = false;             /* also send Opus with in-band FEC and DTX */
+    DataBench *data_bench = nullptr; /* run it over the receiver's data channel */
+    guint candidate_types = ICE_CANDIDATE_ALL; /* receiver candidates to trickle */
+};
+
+struct LoopbackPeer;
+
+/*
+ * Starts the sending pipeline and trickles ICE candidates both ways.
+ */
+LoopbackPeer* loopback_peer_new(GstElement* receiver, const LoopbackConfig& config);
+void loopback_peer_free(LoopbackPeer* peer);
+
+/*
+ * Takes the offer in the same JSON form the signalling server relays and
+ * returns the answer the same way. Blocks until the answer is ready.
+ */
+std::string loopback_peer_negotiate(LoopbackPeer* peer, const char* offer_json);
+
+#endif
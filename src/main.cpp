@@ -8,6 +8,26 @@
  */
 
 #include "http.h"
+#include "sse.h"
+#include "metrics.h"
+#include "tracing.h"
+#include "capture_time.h"
+#include "loopback.h"
+#include "flight_recorder.h"
+#include "rtp_capture.h"
+#include "sdp_policy.h"
+#include "simulcast.h"
+#include "audio.h"
+#include "data_channel.h"
+#include "data_bench.h"
+#include "task_pool.h"
+#include "frame_pool.h"
+#include "analysis.h"
+#include "ice_policy.h"
+#include "srtp.h"
+#include "startup.h"
+#include "governor.h"
+#include "branch_pool.h"
 
 #include <gst/gst.h>
 #include <gst/sdp/sdp.h>
@@ -19,11 +39,17 @@
  /* For signalling */
 #include <json-glib/json-glib.h>
 
+#ifndef _WIN32
+#include <glib-unix.h>
+#include <signal.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <iostream>
 #include <string>
-#include <sstream>
 #include <vector>
 #include <numeric>
 #include <algorithm>
@@ -58,56 +84,213 @@ static const gboolean remote_is_offerer = FALSE;
 
 static std::string connection_id;
 
+static MetricsSession *metrics1;
+static TraceSession *trace1;
+static CaptureTimeSession *capture1;
+static LoopbackPeer *loopback1;
+static FlightRecorder *recorder1;
+static RtpRecorder *rtp_recorder1;
+static RtpReplay *replay1;
+static SimulcastReceiver *simulcast1;
+static AudioSession *audio1;
+static std::vector<DataChannel*> data_channels;
+static DataBench *bench1;
+static TaskPoolSet *pools1;
+static TaskPoolConfig task_pool_config;
+static AnalysisSession *analysis1;
+static AnalysisConfig analysis_config;
+static IcePolicy ice_policy;
+static SrtpSession *srtp1;
+static std::vector<SrtpProfile> srtp_preference;
+static GovernorSession *governor1;
+static BranchPool *pool1;
+/* Set while the offer waits for gathering to finish */
+static std::atomic<bool> offer_pending{ false };
+static gint64 setup_start_us;
+static std::atomic<bool> first_frame_rendered{ false };
+
+static gint stats_interval = 100;
+static gint metrics_port = 0;
+static gint trace_interval = 0;
+static gchar *trace_output = NULL;
+static gboolean loopback = FALSE;
+static gint loopback_capture_offset = 0;
+static gchar *flight_recorder_dir = NULL;
+static gint stall_threshold = 2000;
+static gchar *record_rtp = NULL;
+static gchar *replay_path = NULL;
+static gboolean replay_fast = FALSE;
+static gint replay_jitterbuffer_latency = 200;
+static gint video_bitrate = 500;
+static gboolean sdp_tias = FALSE;
+static gboolean simulcast = FALSE;
+static gint display_height = 0;
+static gint max_video_kbps = 0;
+static gboolean audio = FALSE;
+static gint audio_buffer = 40;
+static gint audio_period = 10;
+static gboolean offer_data_channel = FALSE;
+static gboolean data_unordered = FALSE;
+static gint data_max_retransmits = -1;
+static gint data_max_lifetime = -1;
+static gchar *data_bench = NULL;
+static gint data_bench_seconds = 5;
+static gboolean pin_threads = FALSE;
+static gchar *network_cores = NULL;
+static gchar *decode_cores = NULL;
+static gchar *output_cores = NULL;
+static gchar *thread_nice = NULL;
+static gboolean frame_pools = FALSE;
+static gchar *frame_memory = NULL;
+static gint frame_cache = 64;
+static gchar *analysis = NULL;
+static gchar *analysis_size = NULL;
+static gboolean motion_gate = FALSE;
+static gdouble motion_threshold = 0.2;
+static gint motion_heartbeat = 1000;
+static gchar **ice_servers = NULL;
+static gchar *ice_candidates = NULL;
+static gchar *ice_interfaces = NULL;
+static gint ice_gathering_timeout = 2000;
+static gchar *ice_ports = NULL;
+static gchar *srtp_profiles = NULL;
+static gint signalling_connections = 0;
+static gboolean exit_when_ready = FALSE;
+static gint priority = 0;
+static gint cpu_budget = 0;
+static gint memory_budget = 0;
+static gint max_sessions = 0;
+static gint admission_timeout = 10000;
+static gint degraded_bitrate = 150;
+static gint snapshot_interval = 5000;
+
+static GOptionEntry entries[] = {
+    {"stats-interval", 0, 0, G_OPTION_ARG_INT, &stats_interval,
+        "Interval between webrtcbin stats polls in milliseconds", "MS"},
+    {"metrics-port", 0, 0, G_OPTION_ARG_INT, &metrics_port,
+        "Serve Prometheus metrics on localhost at this port (0 disables)", "PORT"},
+    {"trace-interval", 0, 0, G_OPTION_ARG_INT, &trace_interval,
+        "Trace per-element latency and streaming thread CPU, reporting every that many seconds (0 disables)",
+        "SECONDS"},
+    {"trace-output", 0, 0, G_OPTION_ARG_FILENAME, &trace_output,
+        "Append trace reports to this file instead of stdout", "FILE"},
+    {"loopback", 0, 0, G_OPTION_ARG_NONE, &loopback,
+        "Receive from an in-process test sender instead of a browser", NULL},
+    {"loopback-capture-offset", 0, 0, G_OPTION_ARG_INT, &loopback_capture_offset,
+        "Make the loopback sender stamp capture times that many milliseconds in the past",
+        "MS"},
+    {"flight-recorder-dir", 0, 0, G_OPTION_ARG_FILENAME, &flight_recorder_dir,
+        "Write flight recorder dumps here instead of the temp directory", "DIR"},
+    {"stall-threshold", 0, 0, G_OPTION_ARG_INT, &stall_threshold,
+        "Dump the flight recorder when no frame was rendered for that long (0 disables)",
+        "MS"},
+    {"record-rtp", 0, 0, G_OPTION_ARG_FILENAME, &record_rtp,
+        "Record decrypted incoming RTP to PREFIX-<pad>.mrtp", "PREFIX"},
+    {"replay", 0, 0, G_OPTION_ARG_FILENAME, &replay_path,
+        "Feed a recording into the receive chain instead of negotiating", "FILE"},
+    {"replay-fast", 0, 0, G_OPTION_ARG_NONE, &replay_fast,
+        "Replay as fast as possible into fake sinks instead of at recorded pace", NULL},
+    {"replay-jitterbuffer-latency", 0, 0, G_OPTION_ARG_INT, &replay_jitterbuffer_latency,
+        "Jitterbuffer latency for paced replay", "MS"},
+    {"video-bitrate", 0, 0, G_OPTION_ARG_INT, &video_bitrate,
+        "Bandwidth to ask the sender for in the video m-section (negative leaves it out)",
+        "KBPS"},
+    {"sdp-tias", 0, 0, G_OPTION_ARG_NONE, &sdp_tias,
+        "Signal the bandwidth as b=TIAS too, not just b=AS", NULL},
+    {"simulcast", 0, 0, G_OPTION_ARG_NONE, &simulcast,
+        "Ask for three simulcast layers and forward the one that fits", NULL},
+    {"display-height", 0, 0, G_OPTION_ARG_INT, &display_height,
+        "Pick the lowest simulcast layer at least that tall (0 for the full size)", "PX"},
+    {"max-video-kbps", 0, 0, G_OPTION_ARG_INT, &max_video_kbps,
+        "Never forward a simulcast layer above that bitrate (0 for no cap)", "KBPS"},
+    {"audio", 0, 0, G_OPTION_ARG_NONE, &audio,
+        "Also receive Opus audio, with in-band FEC and DTX", NULL},
+    {"audio-buffer", 0, 0, G_OPTION_ARG_INT, &audio_buffer,
+        "Audio sink buffer in milliseconds", "MS"},
+    {"audio-period", 0, 0, G_OPTION_ARG_INT, &audio_period,
+        "Audio sink period in milliseconds", "MS"},
+    {"data-channel", 0, 0, G_OPTION_ARG_NONE, &offer_data_channel,
+        "Offer a binary data channel", NULL},
+    {"data-unordered", 0, 0, G_OPTION_ARG_NONE, &data_unordered,
+        "Let the data channel deliver out of order", NULL},
+    {"data-max-retransmits", 0, 0, G_OPTION_ARG_INT, &data_max_retransmits,
+        "Give up on data channel messages after that many retransmissions (-1 for reliable)",
+        "N"},
+    {"data-max-lifetime", 0, 0, G_OPTION_ARG_INT, &data_max_lifetime,
+        "Give up on data channel messages after that long (-1 for reliable)", "MS"},
+    {"data-bench", 0, 0, G_OPTION_ARG_STRING, &data_bench,
+        "With --loopback, measure data channel throughput and latency for these message sizes",
+        "SIZE,..."},
+    {"data-bench-seconds", 0, 0, G_OPTION_ARG_INT, &data_bench_seconds,
+        "How long to send each message size for", "SECONDS"},
+    {"pin-threads", 0, 0, G_OPTION_ARG_NONE, &pin_threads,
+        "Run streaming threads from per-role task pools with core affinity and priority", NULL},
+    {"network-cores", 0, 0, G_OPTION_ARG_STRING, &network_cores,
+        "Cores for network and jitterbuffer threads (default all)", "0-3,6"},
+    {"decode-cores", 0, 0, G_OPTION_ARG_STRING, &decode_cores,
+        "Cores for decoder threads (default all)", "0-3,6"},
+    {"output-cores", 0, 0, G_OPTION_ARG_STRING, &output_cores,
+        "Cores for conversion and sink threads (default all)", "0-3,6"},
+    {"thread-nice", 0, 0, G_OPTION_ARG_STRING, &thread_nice,
+        "Nice values for network, decode and output threads (default 0,4,2)", "N,N,N"},
+    {"frame-pools", 0, 0, G_OPTION_ARG_NONE, &frame_pools,
+        "Offer preallocated video frame pools on memory shared between sessions", NULL},
+    {"frame-memory", 0, 0, G_OPTION_ARG_STRING, &frame_memory,
+        "Back frame pools with heap, memfd or hugepage memory (default heap)", "KIND"},
+    {"frame-cache", 0, 0, G_OPTION_ARG_INT, &frame_cache,
+        "Keep up to that much released frame memory for reuse", "MB"},
+    {"analysis", 0, 0, G_OPTION_ARG_STRING, &analysis,
+        "Downscale decoded video to gray or rgb analysis frames", "FORMAT"},
+    {"analysis-size", 0, 0, G_OPTION_ARG_STRING, &analysis_size,
+        "Analysis frame size (default 160x90)", "WxH"},
+    {"motion-gate", 0, 0, G_OPTION_ARG_NONE, &motion_gate,
+        "Only analyse frames whose luma changed since the last analysed one", NULL},
+    {"motion-threshold", 0, 0, G_OPTION_ARG_DOUBLE, &motion_threshold,
+        "Percentage of the picture that must change to count as motion", "PERCENT"},
+    {"motion-heartbeat", 0, 0, G_OPTION_ARG_INT, &motion_heartbeat,
+        "Analyse a frame at least that often, motion or not", "MS"},
+    {"ice-server", 0, 0, G_OPTION_ARG_STRING_ARRAY, &ice_servers,
+        "STUN or TURN server, repeatable; 'none' for host candidates only (default "
+        ICE_DEFAULT_STUN_SERVER ")", "URL"},
+    {"ice-candidates", 0, 0, G_OPTION_ARG_STRING, &ice_candidates,
+        "Candidate types to advertise (default all)", "host,srflx,relay"},
+    {"ice-interfaces", 0, 0, G_OPTION_ARG_STRING, &ice_interfaces,
+        "Only gather on these interfaces or addresses (default all)", "NAME,..."},
+    {"ice-ports", 0, 0, G_OPTION_ARG_STRING, &ice_ports,
+        "Bind ICE sockets only to these local UDP ports, one per session (default ephemeral)",
+        "MIN-MAX"},
+    {"ice-gathering-timeout", 0, 0, G_OPTION_ARG_INT, &ice_gathering_timeout,
+        "Send the offer with the candidates gathered by then (0 sends it right away, without any)",
+        "MS"},
+    {"srtp-profiles", 0, 0, G_OPTION_ARG_STRING, &srtp_profiles,
+        "SRTP profiles in order of preference, checked against the negotiated one (default "
+        SRTP_DEFAULT_PROFILES ")", "PROFILE,..."},
+    {"signalling-connections", 0, 0, G_OPTION_ARG_INT, &signalling_connections,
+        "At most that many connections to the signalling server, 0 for no limit "
+        "(at least 2 without HTTP/2)", "N"},
+    {"exit-when-ready", 0, 0, G_OPTION_ARG_NONE, &exit_when_ready,
+        "Print the startup phases and exit where the Id would be asked for", NULL},
+    {"cpu-budget", 0, 0, G_OPTION_ARG_INT, &cpu_budget,
+        "Admit sessions and shed load to keep the process under that share of all cores (0 disables)",
+        "PERCENT"},
+    {"memory-budget", 0, 0, G_OPTION_ARG_INT, &memory_budget,
+        "Admit sessions and shed load to keep resident memory under that (0 disables)", "MB"},
+    {"max-sessions", 0, 0, G_OPTION_ARG_INT, &max_sessions,
+        "Admit at most that many sessions at once (0 for no limit)", "N"},
+    {"priority", 0, 0, G_OPTION_ARG_INT, &priority,
+        "Session priority; higher ones are degraded last and restored first", "N"},
+    {"admission-timeout", 0, 0, G_OPTION_ARG_INT, &admission_timeout,
+        "Refuse a session that waited that long for admission", "MS"},
+    {"degraded-bitrate", 0, 0, G_OPTION_ARG_INT, &degraded_bitrate,
+        "Bitrate to ask for and forward once a session's bitrate is capped", "KBPS"},
+    {"snapshot-interval", 0, 0, G_OPTION_ARG_INT, &snapshot_interval,
+        "Keyframe interval for sessions degraded to snapshots", "MS"},
+    {NULL},
+};
+
 const char send_offer_url[] = "https://ntfy.sh/mediaReceiverSendOffer_%s";
 const char get_answer_url[] = "https://ntfy.sh/mediaReceiverGetAnswer_%s/sse";
 
-// https://webrtchacks.com/limit-webrtc-bandwidth-sdp/
-static std::string setMediaBitrate(const std::string& sdp, const std::string& media, int bitrate)
-{
-    std::istringstream ss(sdp);
-
-    std::vector<std::string> lines;
-
-    std::string buffer;
-    while (std::getline(ss, buffer))
-        lines.push_back(buffer);
-
-    auto it = std::find_if(lines.begin(), lines.end(), [&media](const std::string& v) { return v.find("m=" + media) == 0; });
-
-    if (it == lines.end())
-        return sdp;
-
-    ++it;
-
-    it = std::find_if(it, lines.end(), [](const std::string& v) { return v.find("i=") != 0 && v.find("c=") != 0; });
-
-    const auto b_line = "b=AS:" + std::to_string(bitrate);
-    if (it != lines.end() && it->find("b") == 0)
-    {
-        *it = b_line;
-    }
-    else
-    {
-        lines.insert(it, b_line);
-    }
-
-    //return std::accumulate(std::next(lines.begin()), lines.end(), lines[0],
-    //    [](std::string a, const std::string& b) { return std::move(a) + '\n' + b; });
-
-    std::string result;
-    for (auto& v : lines)
-    {
-        if (!v.empty())
-        {
-            result += v;
-            result += '\n';
-        }
-    }
-
-    return result;
-}
-
-
 static gboolean
 cleanup_and_quit_loop(const gchar * msg, enum AppState state)
 {
@@ -125,6 +308,20 @@ cleanup_and_quit_loop(const gchar * msg, enum AppState state)
     return G_SOURCE_REMOVE;
 }
 
+/* The summaries are printed once the loop is left */
+static gboolean
+on_quit_signal(gpointer user_data)
+{
+    cleanup_and_quit_loop("Interrupted, stopping", APP_STATE_UNKNOWN);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+on_data_bench_done(DataBench * bench, gpointer user_data)
+{
+    cleanup_and_quit_loop(NULL, APP_STATE_UNKNOWN);
+}
+
 static gchar *
 get_string_from_json_object(JsonObject * object)
 {
@@ -144,112 +341,108 @@ get_string_from_json_object(JsonObject * object)
     return text;
 }
 
-static void
-handle_media_stream(GstPad * pad, GstElement * pipe, const char *convert_name,
-    const char *sink_name)
-{
-    GstPad *qpad;
-    GstElement *q, *conv, *resample, *sink;
-    GstPadLinkReturn ret;
-
-    gst_println("Trying to handle stream with %s ! %s", convert_name, sink_name);
-
-    q = gst_element_factory_make("queue", NULL);
-    g_assert_nonnull(q);
-    conv = gst_element_factory_make(convert_name, NULL);
-    g_assert_nonnull(conv);
-    sink = gst_element_factory_make(sink_name, NULL);
-    g_assert_nonnull(sink);
-
-    if (g_strcmp0(convert_name, "audioconvert") == 0) {
-        /* Might also need to resample, so add it just in case.
-         * Will be a no-op if it's not required. */
-        resample = gst_element_factory_make("audioresample", NULL);
-        g_assert_nonnull(resample);
-        gst_bin_add_many(GST_BIN(pipe), q, conv, resample, sink, NULL);
-        gst_element_sync_state_with_parent(q);
-        gst_element_sync_state_with_parent(conv);
-        gst_element_sync_state_with_parent(resample);
-        gst_element_sync_state_with_parent(sink);
-        gst_element_link_many(q, conv, resample, sink, NULL);
-    }
-    else {
-        gst_bin_add_many(GST_BIN(pipe), q, conv, sink, NULL);
-        gst_element_sync_state_with_parent(q);
-        gst_element_sync_state_with_parent(conv);
-        gst_element_sync_state_with_parent(sink);
-        gst_element_link_many(q, conv, sink, NULL);
-    }
-
-    qpad = gst_element_get_static_pad(q, "sink");
+static double
+setup_elapsed_ms(void)
+{
+    return (g_get_monotonic_time() - setup_start_us) / 1000.0;
+}
 
-    ret = gst_pad_link(pad, qpad);
-    g_assert_cmphex(ret, == , GST_PAD_LINK_OK);
+static GstPadProbeReturn
+on_video_frame_rendered(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    metrics_session_count_frame(static_cast<MetricsSession *>(user_data));
+    if (setup_start_us && !first_frame_rendered.exchange(true))
+        gst_print("Setup: first frame after %.0f ms\n", setup_elapsed_ms());
+    return GST_PAD_PROBE_OK;
 }
 
+/* Decoded frames, and converted ones when conversion isn't passthrough */
 static void
-on_incoming_decodebin_stream(GstElement * decodebin, GstPad * pad,
-    GstElement * pipe)
+on_branch_output(const char *media, GstElement * q, GstElement * conv,
+    GstElement * sink, gpointer user_data)
 {
-    GstCaps *caps;
-    const gchar *name;
-
-    if (!gst_pad_has_current_caps(pad)) {
-        gst_printerr("Pad '%s' has no caps, can't do anything, ignoring\n",
-            GST_PAD_NAME(pad));
+    if (!g_str_equal(media, "video"))
         return;
-    }
 
-    caps = gst_pad_get_current_caps(pad);
-    name = gst_structure_get_name(gst_caps_get_structure(caps, 0));
+    GstPad *srcpad = gst_element_get_static_pad(q, "src");
+    frame_pools_watch(srcpad);
+    if (analysis1)
+        analysis_session_watch(analysis1, srcpad);
+    gst_object_unref(srcpad);
+    if (conv) {
+        srcpad = gst_element_get_static_pad(conv, "src");
+        frame_pools_watch(srcpad);
+        gst_object_unref(srcpad);
+    }
 
-    if (g_str_has_prefix(name, "video")) {
-        handle_media_stream(pad, pipe, "videoconvert", "autovideosink");
+    if (metrics1) {
+        GstPad *sinkpad = gst_element_get_static_pad(sink, "sink");
+        gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER,
+            on_video_frame_rendered, metrics1, NULL);
+        gst_object_unref(sinkpad);
     }
-    else if (g_str_has_prefix(name, "audio")) {
-        handle_media_stream(pad, pipe, "audioconvert", "autoaudiosink");
+
+    if (capture1) {
+        GstPad *sinkpad = gst_element_get_static_pad(sink, "sink");
+        capture_time_watch_render(capture1, sinkpad);
+        gst_object_unref(sinkpad);
     }
-    else {
-        gst_printerr("Unknown pad %s, ignoring", GST_PAD_NAME(pad));
+
+    if (recorder1) {
+        GstPad *sinkpad = gst_element_get_static_pad(sink, "sink");
+        flight_recorder_watch_render(recorder1, sinkpad);
+        gst_object_unref(sinkpad);
     }
 }
 
+static gboolean
+pad_is_video(GstPad * pad)
+{
+    GstCaps *caps = gst_pad_query_caps(pad, NULL);
+    const GstStructure *s =
+        gst_caps_get_size(caps) > 0 ? gst_caps_get_structure(caps, 0) : NULL;
+    gboolean ret = s && g_strcmp0(gst_structure_get_string(s, "media"), "video") == 0;
+    gst_caps_unref(caps);
+    return ret;
+}
+
 static void
 on_incoming_stream(GstElement * webrtc, GstPad * pad, GstElement * pipe)
 {
-    GstElement *decodebin;
-    GstPad *sinkpad;
+    GstPad *selected = NULL;
 
     if (GST_PAD_DIRECTION(pad) != GST_PAD_SRC)
         return;
 
-    decodebin = gst_element_factory_make("decodebin", NULL);
-    g_signal_connect(decodebin, "pad-added",
-        G_CALLBACK(on_incoming_decodebin_stream), pipe);
-    gst_bin_add(GST_BIN(pipe), decodebin);
-    gst_element_sync_state_with_parent(decodebin);
-
-    sinkpad = gst_element_get_static_pad(decodebin, "sink");
-    gst_pad_link(pad, sinkpad);
-    gst_object_unref(sinkpad);
-}
-
-
-static const char* verify_sse_response(CURL* curl) {
-#define EXPECTED_CONTENT_TYPE "text/event-stream"
-
-    static const char expected_content_type[] = EXPECTED_CONTENT_TYPE;
+    /* Simulcast layers share one decoder behind the selector */
+    if (simulcast1 && pad_is_video(pad)) {
+        selected = simulcast_receiver_add_layer(simulcast1, pad);
+        if (!selected)
+            return;
+        pad = selected;
+    }
 
-    const char* content_type;
-    curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type);
-    if (!content_type) content_type = "";
+    if (capture1)
+        capture_time_watch_rtp(capture1, pad);
+    if (recorder1)
+        flight_recorder_watch_rtp(recorder1, pad);
+    if (rtp_recorder1)
+        rtp_recorder_watch(rtp_recorder1, pad);
 
-    if (!strncmp(content_type, expected_content_type, strlen(expected_content_type)))
-        return 0;
+    if (!branch_pool_acquire(pool1, pad))
+        gst_printerr("Can't decode stream from %s\n", GST_PAD_NAME(pad));
 
-    return "Invalid content_type, should be '" EXPECTED_CONTENT_TYPE "'.";
+    if (selected)
+        gst_object_unref(selected);
 }
 
+/* The branch goes back to the pool for the next stream of its format */
+static void
+on_stream_removed(GstElement * webrtc, GstPad * pad, gpointer user_data)
+{
+    if (GST_PAD_DIRECTION(pad) == GST_PAD_SRC)
+        branch_pool_release(pool1, pad);
+}
 
 
 static auto getRemoteEcho()
@@ -269,70 +462,44 @@ static auto getRemoteEcho()
                 NULL
             };
 
-            bool requestInterrupted = false;
-
-            auto on_data = [&startedPromise, &responsePromise, &requestInterrupted](char *ptr, size_t size, size_t nmemb)->size_t {
-                try {
-                    const auto ptrEnd = ptr + size * nmemb;
-
-                    const char watch[] = "data:";
-
-                    auto pData = std::search(ptr, ptrEnd, std::begin(watch), std::prev(std::end(watch)));
-                    if (pData != ptrEnd) do {
-                        pData += sizeof(watch) / sizeof(watch[0]) - 1;
+            /* Reconnects repeat ntfy's open event; the answer comes once by id */
+            bool started = false;
+            bool answered = false;
 
-                        JsonParser *parser = json_parser_new();
-                        if (!json_parser_load_from_data(parser, pData, ptrEnd - pData, NULL)) {
-                            //gst_printerr("Unknown message '%s', ignoring\n", text);
-                            g_object_unref(parser);
-                            break; //goto out;
-                        }
-
-                        auto root = json_parser_get_root(parser);
-                        if (!JSON_NODE_HOLDS_OBJECT(root)) {
-                            //gst_printerr("Unknown json message '%s', ignoring\n", text);
-                            g_object_unref(parser);
-                            break; //goto out;
-                        }
-
-                        auto child = json_node_get_object(root);
-
-                        if (!json_object_has_member(child, "event")) {
-                            g_object_unref(parser);
-                            break; //goto out;
-                        }
-
-                        auto sdptype = json_object_get_string_member(child, "event");
-                        if (g_str_equal(sdptype, "open")) {
-                            startedPromise.set_value(true);
-                        }
-                        else if (g_str_equal(sdptype, "message")) {
-                            auto text = json_object_get_string_member(child, "message");
-                            responsePromise.set_value(text);
-                            requestInterrupted = true;
-                        }
-
-                        g_object_unref(parser);
+            auto on_event = [&startedPromise, &responsePromise, &started, &answered](const SseEvent& event)->bool {
+                JsonParser *parser = json_parser_new();
+                if (!json_parser_load_from_data(parser, event.data.c_str(), event.data.size(), NULL)
+                    || !JSON_NODE_HOLDS_OBJECT(json_parser_get_root(parser))) {
+                    g_object_unref(parser);
+                    return true;
+                }
 
-                    } while (false);
+                auto child = json_node_get_object(json_parser_get_root(parser));
+                const char *type = json_object_has_member(child, "event")
+                    ? json_object_get_string_member(child, "event") : "";
+                if (g_str_equal(type, "open") && !started) {
+                    started = true;
+                    startedPromise.set_value(true);
                 }
-                catch (const std::exception&) {
-                    startedPromise.set_value(false);
-                    requestInterrupted = true;
+                else if (g_str_equal(type, "message") && json_object_has_member(child, "message")) {
+                    answered = true;
+                    responsePromise.set_value(json_object_get_string_member(child, "message"));
                 }
-                return size * nmemb;
-            };
 
-            auto progress_callback = [&requestInterrupted](curl_off_t dltotal,
-                curl_off_t dlnow,
-                curl_off_t ultotal,
-                curl_off_t ulnow)->size_t {
-                    return requestInterrupted;
+                g_object_unref(parser);
+                return !answered;
             };
 
             char buffer[1024];
             sprintf(buffer, get_answer_url, connection_id.c_str());
-            http(HTTP_GET, buffer, headers, 0, 0, on_data, verify_sse_response, progress_callback);
+            SseConfig config;
+            if (!sse_subscribe(buffer, headers, config, on_event))
+                std::cerr << "Gave up on the SSE stream.\n";
+
+            if (!started)
+                startedPromise.set_value(false);
+            if (!answered)
+                responsePromise.set_value(std::string());
     };
 
     // https://stackoverflow.com/a/23454840/10472202
@@ -351,9 +518,28 @@ send_sdp_to_peer(GstWebRTCSessionDescription * desc)
         return;
     }
 
-    auto text = gst_sdp_message_as_text(desc->sdp);
-    auto correctedText = setMediaBitrate(text, "video", 500);
+    // https://webrtchacks.com/limit-webrtc-bandwidth-sdp/
+    std::vector<SdpMediaPolicy> policies(1);
+    policies[0].media = "video";
+    policies[0].bitrate_kbps = video_bitrate;
+    policies[0].tias = sdp_tias;
+    /* Admitted under pressure, so it asks for less from the start */
+    if (governor1 && governor_session_get_level(governor1) >= GOVERNOR_BITRATE_CAP
+        && degraded_bitrate > 0) {
+        policies[0].bitrate_kbps = video_bitrate < 0 ? degraded_bitrate
+            : MIN(video_bitrate, degraded_bitrate);
+    }
+    if (simulcast)
+        policies[0].recv_rids = { "h", "m", "l" };
+
+    GstSDPMessage *corrected;
+    gst_sdp_message_copy(desc->sdp, &corrected);
+    sdp_apply_policies(corrected, policies);
+    ice_filter_sdp_candidates(corrected, ice_policy.candidate_types);
+    auto text = gst_sdp_message_as_text(corrected);
+    std::string correctedText = text;
     g_free(text);
+    gst_sdp_message_free(corrected);
 
     auto sdp = json_object_new();
 
@@ -386,6 +572,14 @@ send_sdp_to_peer(GstWebRTCSessionDescription * desc)
 
 #else
 
+    std::string s;
+
+    if (loopback1) {
+        s = loopback_peer_negotiate(loopback1, text);
+        g_free(text);
+    }
+    else {
+
     auto[startedResult, responseResult] = getRemoteEcho();
 
     if (!startedResult.get()) {
@@ -399,7 +593,14 @@ send_sdp_to_peer(GstWebRTCSessionDescription * desc)
 
     g_free(text);
 
-    std::string s = responseResult.get();
+    s = responseResult.get();
+    if (s.empty()) {
+        cleanup_and_quit_loop("ERROR: no answer from the signalling server",
+            PEER_CALL_ERROR);
+        return;
+    }
+
+    }
 
 #endif
 
@@ -462,6 +663,36 @@ send_sdp_to_peer(GstWebRTCSessionDescription * desc)
     g_object_unref(parser);
 }
 
+/* webrtcbin adds candidates to the local description as they are gathered */
+static void
+send_gathered_offer(const char *when)
+{
+    if (!offer_pending.exchange(false) || !webrtc1)
+        return;
+
+    GstWebRTCSessionDescription *offer = NULL;
+    g_object_get(webrtc1, "local-description", &offer, NULL);
+    if (!offer) {
+        cleanup_and_quit_loop("ERROR: no local description to send", PEER_CALL_ERROR);
+        return;
+    }
+
+    gst_print("Setup: offer sent %s, after %.0f ms\n", when, setup_elapsed_ms());
+    /* The exchange blocks until the answer, neither webrtcbin's thread nor
+     * the main loop can wait that long */
+    std::thread([offer] {
+        send_sdp_to_peer(offer);
+        gst_webrtc_session_description_free(offer);
+    }).detach();
+}
+
+static gboolean
+on_gathering_deadline(gpointer user_data)
+{
+    send_gathered_offer("at the gathering deadline");
+    return G_SOURCE_REMOVE;
+}
+
 /* Offer created by our pipeline, to be sent to the peer */
 static void
 on_offer_created(GstPromise * promise, gpointer user_data)
@@ -477,13 +708,23 @@ on_offer_created(GstPromise * promise, gpointer user_data)
         GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &offer, NULL);
     gst_promise_unref(promise);
 
+    /* Gathering starts with the local description, the flag has to be up first */
+    offer_pending = ice_gathering_timeout > 0;
+
     promise = gst_promise_new();
     g_signal_emit_by_name(webrtc1, "set-local-description", offer, promise);
     gst_promise_interrupt(promise);
     gst_promise_unref(promise);
 
-    /* Send offer to peer */
-    send_sdp_to_peer(offer);
+    if (ice_gathering_timeout > 0) {
+        /* Sent once gathered, see send_gathered_offer() */
+        g_timeout_add(ice_gathering_timeout, on_gathering_deadline, NULL);
+    }
+    else {
+        gst_print("Setup: offer sent without candidates, after %.0f ms\n", setup_elapsed_ms());
+        /* Send offer to peer */
+        send_sdp_to_peer(offer);
+    }
     gst_webrtc_session_description_free(offer);
 }
 
@@ -504,7 +745,6 @@ on_negotiation_needed(GstElement * element, gpointer user_data)
     }
 }
 
-#define STUN_SERVER " stun-server=stun://stun.l.google.com:19302 "
 #define RTP_CAPS_OPUS "application/x-rtp,media=audio,encoding-name=OPUS,payload="
 #define RTP_CAPS_VP8 "application/x-rtp,media=video,encoding-name=VP8,payload="
 
@@ -536,6 +776,13 @@ data_channel_on_message_string(GObject * dc, gchar * str, gpointer user_data)
     gst_print("Received data channel message: %s\n", str);
 }
 
+static void
+data_channel_on_message_data(GBytes * message, gpointer user_data)
+{
+    GST_LOG("Received %" G_GSIZE_FORMAT " bytes on the data channel",
+        g_bytes_get_size(message));
+}
+
 static void
 connect_data_channel_signals(GObject * data_channel)
 {
@@ -555,6 +802,10 @@ on_data_channel(GstElement * webrtc, GObject * data_channel,
 {
     connect_data_channel_signals(data_channel);
     receive_channel = data_channel;
+
+    DataChannel *channel = data_channel_wrap(data_channel, DataChannelConfig());
+    data_channel_add_consumer(channel, data_channel_on_message_data, NULL);
+    data_channels.push_back(channel);
 }
 
 static void
@@ -577,9 +828,24 @@ on_ice_gathering_state_notify(GstElement * webrtcbin, GParamSpec * pspec,
         break;
     }
     gst_print("ICE gathering state changed to %s\n", new_state);
+
+    if (ice_gather_state == GST_WEBRTC_ICE_GATHERING_STATE_COMPLETE)
+        send_gathered_offer("with all candidates");
 }
 
-static gboolean webrtcbin_get_stats(GstElement * webrtcbin);
+static void
+on_ice_connection_state_notify(GstElement * webrtcbin, GParamSpec * pspec,
+    gpointer user_data)
+{
+    static std::atomic<bool> connected{ false };
+    GstWebRTCICEConnectionState state;
+
+    g_object_get(webrtcbin, "ice-connection-state", &state, NULL);
+    if ((state == GST_WEBRTC_ICE_CONNECTION_STATE_CONNECTED
+            || state == GST_WEBRTC_ICE_CONNECTION_STATE_COMPLETED)
+        && !connected.exchange(true))
+        gst_print("Setup: ICE connected after %.0f ms\n", setup_elapsed_ms());
+}
 
 static gboolean
 on_webrtcbin_stat(GQuark field_id, const GValue * value, gpointer unused)
@@ -596,17 +862,24 @@ on_webrtcbin_stat(GQuark field_id, const GValue * value, gpointer unused)
     return TRUE;
 }
 
+/* Set while a get-stats request is outstanding, so a slow reply is never stacked */
+static std::atomic<bool> stats_pending{ false };
+
 static void
 on_webrtcbin_get_stats(GstPromise * promise, GstElement * webrtcbin)
 {
     const GstStructure *stats;
 
+    stats_pending = false;
+
     g_return_if_fail(gst_promise_wait(promise) == GST_PROMISE_RESULT_REPLIED);
 
     stats = gst_promise_get_reply(promise);
-    gst_structure_foreach(stats, on_webrtcbin_stat, NULL);
+    if (metrics1)
+        metrics_session_update(metrics1, stats);
 
-    g_timeout_add(100, (GSourceFunc)webrtcbin_get_stats, webrtcbin);
+    if (gst_debug_category_get_threshold(GST_CAT_DEFAULT) >= GST_LEVEL_DEBUG)
+        gst_structure_foreach(stats, on_webrtcbin_stat, NULL);
 }
 
 static gboolean
@@ -614,6 +887,9 @@ webrtcbin_get_stats(GstElement * webrtcbin)
 {
     GstPromise *promise;
 
+    if (stats_pending.exchange(true))
+        return G_SOURCE_CONTINUE;
+
     promise =
         gst_promise_new_with_change_func(
         (GstPromiseChangeFunc)on_webrtcbin_get_stats, webrtcbin, NULL);
@@ -622,10 +898,102 @@ webrtcbin_get_stats(GstElement * webrtcbin)
     g_signal_emit_by_name(webrtcbin, "get-stats", NULL, promise);
     gst_promise_unref(promise);
 
-    return G_SOURCE_REMOVE;
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+on_bus_message(GstBus * bus, GstMessage * message, gpointer user_data)
+{
+    if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR) {
+        GError *err = NULL;
+        gchar *debug = NULL;
+
+        gst_message_parse_error(message, &err, &debug);
+        gst_printerr("Error from %s: %s\n", GST_OBJECT_NAME(GST_MESSAGE_SRC(message)),
+            err->message);
+        GST_DEBUG("%s", GST_STR_NULL(debug));
+
+        if (recorder1) {
+            flight_recorder_record(recorder1, FLIGHT_EVENT_ERROR, err->code, 0);
+            flight_recorder_dump(recorder1, "error");
+        }
+
+        g_clear_error(&err);
+        g_free(debug);
+    }
+    else if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_EOS) {
+        if (replay1) {
+            rtp_replay_print_summary(replay1);
+            if (metrics1)
+                gst_print("Rendered %" G_GUINT64_FORMAT " frames\n",
+                    metrics_session_get_frames_rendered(metrics1));
+            frame_pools_print_summary();
+        }
+        cleanup_and_quit_loop("End of stream", APP_STATE_UNKNOWN);
+    }
+
+    return G_SOURCE_CONTINUE;
 }
 
 #define RTP_TWCC_URI "http://www.ietf.org/id/draft-holmer-rmcat-transport-wide-cc-extensions-01"
+#define SDES_MID_EXTMAP_ID 3
+#define SDES_RID_EXTMAP_ID 4
+#define ABS_CAPTURE_TIME_EXTMAP_ID 5
+
+/* Must run before anything is added to pipe1 */
+static void
+instrument_pipeline(const char *session_name)
+{
+    if (trace_interval > 0) {
+        trace1 = trace_session_new(session_name);
+        trace_session_attach(trace1, GST_BIN(pipe1));
+    }
+
+    recorder1 = flight_recorder_new(session_name);
+    flight_recorder_attach(recorder1, GST_BIN(pipe1));
+
+    metrics1 = metrics_session_new(session_name);
+
+    if (pin_threads) {
+        pools1 = task_pools_new(session_name, task_pool_config);
+        task_pools_attach(pools1, GST_PIPELINE(pipe1));
+    }
+
+    if (audio) {
+        AudioConfig config;
+        config.buffer_ms = MAX(audio_buffer, 1);
+        config.period_ms = CLAMP(audio_period, 1, (gint) config.buffer_ms);
+        audio1 = audio_session_new(session_name, config);
+        audio_session_attach(audio1, GST_BIN(pipe1));
+    }
+    if (analysis)
+        analysis1 = analysis_session_new(session_name, analysis_config);
+    srtp1 = srtp_session_new(session_name, srtp_preference);
+    srtp_session_attach(srtp1, GST_BIN(pipe1));
+    if (governor1)
+        governor_session_attach(governor1, GST_BIN(pipe1));
+    capture1 = capture_time_session_new(session_name, ABS_CAPTURE_TIME_EXTMAP_ID);
+
+    /* Last, so the modules above see the branches' elements */
+    BranchPoolConfig pool_config;
+    if (replay_fast)
+        pool_config.video_sink = pool_config.audio_sink = "fakesink";
+    pool1 = branch_pool_new(session_name, GST_BIN(pipe1), pool_config, on_branch_output, NULL);
+
+    GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(pipe1));
+    gst_bus_add_watch(bus, on_bus_message, NULL);
+    gst_object_unref(bus);
+}
+
+/* Snapshot mode is the governor's own; the layer and bitrate steps are ours */
+static void
+on_governor_level(GovernorSession * session, GovernorLevel level, gpointer unused)
+{
+    if (!simulcast1)
+        return;
+    simulcast_receiver_restrict(simulcast1, level >= GOVERNOR_LOWER_LAYER ? 1 : 0,
+        level >= GOVERNOR_BITRATE_CAP ? (guint) MAX(degraded_bitrate, 0) : 0);
+}
 
 static gboolean
 start_pipeline(gboolean create_offer)
@@ -633,25 +1001,65 @@ start_pipeline(gboolean create_offer)
     GstStateChangeReturn ret;
     GError *error = NULL;
 
+    setup_start_us = g_get_monotonic_time();
     webrtc1 = gst_element_factory_make("webrtcbin", "recvonly");
     g_object_set(webrtc1, "bundle-policy", GST_WEBRTC_BUNDLE_POLICY_MAX_BUNDLE, nullptr);
 
 
     pipe1 = gst_pipeline_new(nullptr);
 
+    instrument_pipeline(GST_ELEMENT_NAME(webrtc1));
+    flight_recorder_watch_webrtcbin(recorder1, webrtc1);
+
+    if (record_rtp)
+        rtp_recorder1 = rtp_recorder_new(record_rtp);
+
+    if (simulcast) {
+        SimulcastConfig config;
+        config.display_height = MAX(display_height, 0);
+        config.max_kbps = MAX(max_video_kbps, 0);
+        simulcast1 = simulcast_receiver_new(GST_ELEMENT_NAME(webrtc1), GST_BIN(pipe1),
+            config, metrics1);
+
+        /* Admitted degraded before there was a receiver to restrict */
+        if (governor1)
+            on_governor_level(governor1, governor_session_get_level(governor1), NULL);
+    }
+
     gst_bin_add_many(GST_BIN(pipe1),
         webrtc1,
         nullptr);
 
-    g_object_set(webrtc1, "stun-server", "stun:stun.l.google.com:19302", nullptr);
+    ice_policy_apply(webrtc1, ice_policy);
 
     {
         GstWebRTCRTPTransceiver *trans;
         //auto video_caps = gst_caps_from_string("application/x-rtp,media=video,encoding-name=vp8,clock-rate=90000,ssrc=1,payload=98,fec-type=ulp-red,do-nack=true");
         auto video_caps = gst_caps_from_string(RTP_CAPS_VP8 "96");
+        gst_caps_set_simple(video_caps,
+            "extmap-" G_STRINGIFY(ABS_CAPTURE_TIME_EXTMAP_ID), G_TYPE_STRING,
+            ABS_CAPTURE_TIME_URI, NULL);
+        if (simulcast) {
+            gst_caps_set_simple(video_caps,
+                "extmap-" G_STRINGIFY(SDES_MID_EXTMAP_ID), G_TYPE_STRING, SDES_MID_URI,
+                "extmap-" G_STRINGIFY(SDES_RID_EXTMAP_ID), G_TYPE_STRING, SDES_RID_URI,
+                NULL);
+        }
         g_signal_emit_by_name(webrtc1, "add-transceiver", GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_RECVONLY, video_caps, &trans);
+        branch_pool_prebuild(pool1, video_caps, 1);
         gst_caps_unref(video_caps);
         gst_object_unref(trans);
+
+        if (audio) {
+            /* Unknown caps fields end up in the fmtp line */
+            auto audio_caps = gst_caps_from_string(RTP_CAPS_OPUS "111,clock-rate=48000,"
+                "encoding-params=(string)2,useinbandfec=(string)1,usedtx=(string)1");
+            g_signal_emit_by_name(webrtc1, "add-transceiver",
+                GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_RECVONLY, audio_caps, &trans);
+            branch_pool_prebuild(pool1, audio_caps, 1);
+            gst_caps_unref(audio_caps);
+            gst_object_unref(trans);
+        }
     }
 
     /* This is the gstwebrtc entry point where we create the offer and so on. It
@@ -664,18 +1072,54 @@ start_pipeline(gboolean create_offer)
 
     g_signal_connect(webrtc1, "notify::ice-gathering-state",
         G_CALLBACK(on_ice_gathering_state_notify), NULL);
+    g_signal_connect(webrtc1, "notify::ice-connection-state",
+        G_CALLBACK(on_ice_connection_state_notify), NULL);
 
     gst_element_set_state(pipe1, GST_STATE_READY);
 
+    /* Data channels have to exist before the offer to be part of it */
+    if (offer_data_channel || bench1) {
+        DataChannelConfig config;
+        config.ordered = !data_unordered;
+        config.max_retransmits = data_max_retransmits;
+        config.max_packet_lifetime = data_max_lifetime;
+
+        DataChannel *channel = data_channel_create(webrtc1, "data", config);
+        if (!channel)
+            goto err;
+        connect_data_channel_signals(data_channel_get_object(channel));
+        data_channel_add_consumer(channel, bench1 ? data_bench_receive
+            : data_channel_on_message_data, bench1);
+        data_channels.push_back(channel);
+    }
+
     g_signal_connect(webrtc1, "on-data-channel", G_CALLBACK(on_data_channel),
         NULL);
     /* Incoming streams will be exposed via this signal */
     g_signal_connect(webrtc1, "pad-added", G_CALLBACK(on_incoming_stream),
         pipe1);
+    g_signal_connect(webrtc1, "pad-removed", G_CALLBACK(on_stream_removed),
+        NULL);
     /* Lifetime is the same as the pipeline itself */
     gst_object_unref(webrtc1);
 
-    g_timeout_add(100, (GSourceFunc)webrtcbin_get_stats, webrtc1);
+    if (loopback) {
+        LoopbackConfig config;
+        config.capture_ext_id = ABS_CAPTURE_TIME_EXTMAP_ID;
+        config.capture_offset_ms = loopback_capture_offset;
+        if (simulcast) {
+            config.simulcast_layers = 3;
+            config.rid_ext_id = SDES_RID_EXTMAP_ID;
+        }
+        config.audio = audio;
+        config.data_bench = bench1;
+        config.candidate_types = ice_policy.candidate_types;
+        loopback1 = loopback_peer_new(webrtc1, config);
+        if (!loopback1)
+            goto err;
+    }
+
+    g_timeout_add(MAX(stats_interval, 10), (GSourceFunc)webrtcbin_get_stats, webrtc1);
 
     gst_print("Starting pipeline\n");
     ret = gst_element_set_state(GST_ELEMENT(pipe1), GST_STATE_PLAYING);
@@ -692,6 +1136,52 @@ err:
     return FALSE;
 }
 
+/* Runs the receive chain from a recording, without webrtcbin */
+static gboolean
+start_replay_pipeline(void)
+{
+    GstElement *source, *jitterbuffer = NULL;
+    GstPad *srcpad;
+    GError *error = NULL;
+
+    replay1 = rtp_replay_new(replay_path, replay_fast, &error);
+    if (!replay1) {
+        gst_printerr("%s\n", error->message);
+        g_clear_error(&error);
+        return FALSE;
+    }
+
+    pipe1 = gst_pipeline_new(nullptr);
+    instrument_pipeline("replay");
+
+    source = rtp_replay_get_source(replay1);
+    gst_bin_add(GST_BIN(pipe1), source);
+
+    /* Recordings are taken behind webrtcbin's jitterbuffer, so the losses are
+     * in there but the reordering and timing recovery is not; paced replay
+     * puts a jitterbuffer back to try its settings against the trace. */
+    if (!replay_fast) {
+        jitterbuffer = gst_element_factory_make("rtpjitterbuffer", NULL);
+        g_object_set(jitterbuffer, "latency", replay_jitterbuffer_latency,
+            "do-lost", TRUE, NULL);
+        gst_bin_add(GST_BIN(pipe1), jitterbuffer);
+        gst_element_link(source, jitterbuffer);
+    }
+
+    srcpad = gst_element_get_static_pad(jitterbuffer ? jitterbuffer : source, "src");
+    on_incoming_stream(NULL, srcpad, pipe1);
+    gst_object_unref(srcpad);
+
+    gst_print("Replaying %s%s\n", replay_path, replay_fast ? " as fast as possible" : "");
+    if (gst_element_set_state(pipe1, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        g_clear_object(&pipe1);
+        return FALSE;
+    }
+
+    rtp_replay_start(replay1);
+    return TRUE;
+}
+
 /* Answer created by our pipeline, to be sent to the peer */
 static void
 on_answer_created(GstPromise * promise, gpointer user_data)
@@ -742,24 +1232,59 @@ on_offer_received(GstSDPMessage * sdp)
     gst_webrtc_session_description_free(offer);
 }
 
+/* With the loopback sender the injected offset is known, so this checks the measurement */
+static gboolean
+print_capture_latency(gpointer unused)
+{
+    double p50, p95, p99;
+
+    if (capture1 && capture_time_get_percentiles(capture1, &p50, &p95, &p99)) {
+        gst_print("capture-to-render p50 %.1f ms, p95 %.1f ms, p99 %.1f ms "
+            "(injected offset %d ms)\n", p50, p95, p99, loopback_capture_offset);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+on_admitted(GovernorSession * session, gboolean admitted, gpointer unused)
+{
+    if (!admitted) {
+        cleanup_and_quit_loop("ERROR: session refused, over budget", PEER_CALL_ERROR);
+        return;
+    }
+
+    if (!start_pipeline(TRUE))
+        cleanup_and_quit_loop("ERROR: failed to start pipeline", PEER_CALL_ERROR);
+}
+
+/* Only what this run can't do without; the rest is checked while loading */
 static gboolean
 check_plugins(void)
 {
-    //int i;
     gboolean ret;
     GstPlugin *plugin;
     GstRegistry *registry;
-    const gchar *needed[] = { 
-        "opus", "vpx", "nice", "webrtc", "dtls", "srtp",
-        "rtpmanager", "videotestsrc", "audiotestsrc", NULL
-    };
+    std::vector<const gchar *> needed = { "rtpmanager", "vpx" };
+
+    if (!replay_path) {
+        for (auto name : { "webrtc", "nice", "dtls", "srtp" })
+            needed.push_back(name);
+    }
+    if (audio)
+        needed.push_back("opus");
+    if (loopback) {
+        needed.push_back("videotestsrc");
+        if (audio)
+            needed.push_back("audiotestsrc");
+    }
 
     registry = gst_registry_get();
     ret = TRUE;
-    for (unsigned int i = 0; i < g_strv_length((gchar **)needed); i++) {
-        plugin = gst_registry_find_plugin(registry, needed[i]);
+    for (auto name : needed) {
+        plugin = gst_registry_find_plugin(registry, name);
         if (!plugin) {
-            gst_print("Required gstreamer plugin '%s' not found\n", needed[i]);
+            gst_print("Required gstreamer plugin '%s' not found\n", name);
             ret = FALSE;
             continue;
         }
@@ -768,45 +1293,333 @@ check_plugins(void)
     return ret;
 }
 
+/* Elements the first streams will make, loaded while waiting for an Id */
+static void
+preload_factories(void)
+{
+    std::vector<const char *> factories = {
+        "decodebin", "rtpvp8depay", "vp8dec", "queue", "videoconvert", "autovideosink",
+    };
+
+    if (!replay_path) {
+        for (auto name : { "webrtcbin", "rtpbin", "dtlssrtpdec", "dtlssrtpenc", "nicesrc", "nicesink" })
+            factories.push_back(name);
+    }
+    if (audio) {
+        for (auto name : { "rtpopusdepay", "opusdec", "autoaudiosink" })
+            factories.push_back(name);
+    }
+    if (loopback) {
+        for (auto name : { "videotestsrc", "vp8enc", "rtpvp8pay" })
+            factories.push_back(name);
+        if (audio) {
+            for (auto name : { "audiotestsrc", "opusenc", "rtpopuspay" })
+                factories.push_back(name);
+        }
+    }
+    factories.push_back(NULL);
+
+    startup_preload(factories.data());
+}
+
+static gboolean
+parse_task_pool_config(void)
+{
+    const gchar *cores[THREAD_ROLE_COUNT] = { network_cores, decode_cores, output_cores };
+    for (int role = 0; role < THREAD_ROLE_COUNT; ++role) {
+        if (cores[role] && !task_pools_parse_cores(cores[role],
+            &task_pool_config.cores[role])) {
+            gst_printerr("Invalid core list '%s'\n", cores[role]);
+            return FALSE;
+        }
+    }
+
+    if (thread_nice) {
+        gchar **values = g_strsplit(thread_nice, ",", -1);
+        const gboolean ok = g_strv_length(values) == THREAD_ROLE_COUNT;
+        for (int role = 0; ok && role < THREAD_ROLE_COUNT; ++role)
+            task_pool_config.nice[role] = CLAMP(atoi(values[role]), -20, 19);
+        g_strfreev(values);
+        if (!ok) {
+            gst_printerr("Expected three nice values, got '%s'\n", thread_nice);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean
+parse_ice_policy(void)
+{
+    if (ice_servers) {
+        ice_policy.servers.clear();
+        for (gchar **server = ice_servers; *server; ++server) {
+            if (g_strcmp0(*server, "none") != 0)
+                ice_policy.servers.push_back(*server);
+        }
+    }
+
+    if (ice_candidates && !ice_parse_candidate_types(ice_candidates,
+            &ice_policy.candidate_types)) {
+        gst_printerr("Invalid candidate types '%s'\n", ice_candidates);
+        return FALSE;
+    }
+
+    if (ice_interfaces) {
+        gchar **names = g_strsplit(ice_interfaces, ",", -1);
+        for (gchar **name = names; *name; ++name) {
+            if (**name)
+                ice_policy.interfaces.push_back(*name);
+        }
+        g_strfreev(names);
+    }
+
+    if (ice_ports && !ice_parse_port_range(ice_ports, &ice_policy.min_port,
+            &ice_policy.max_port)) {
+        gst_printerr("Invalid port range '%s'\n", ice_ports);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+parse_analysis_config(void)
+{
+    if (g_strcmp0(analysis, "gray") == 0) {
+        analysis_config.format = DOWNSCALE_GRAY8;
+    }
+    else if (g_strcmp0(analysis, "rgb") == 0) {
+        analysis_config.format = DOWNSCALE_RGB;
+    }
+    else {
+        gst_printerr("Unknown analysis format '%s'\n", analysis);
+        return FALSE;
+    }
+
+    if (analysis_size && (sscanf(analysis_size, "%dx%d", &analysis_config.width,
+                &analysis_config.height) != 2 || analysis_config.width <= 0
+            || analysis_config.height <= 0)) {
+        gst_printerr("Invalid analysis size '%s'\n", analysis_size);
+        return FALSE;
+    }
+
+    analysis_config.motion_gate = motion_gate;
+    analysis_config.motion.area_threshold = CLAMP(motion_threshold, 0.0, 100.0) / 100.0;
+    analysis_config.motion.heartbeat = (GstClockTime) MAX(motion_heartbeat, 0) * GST_MSECOND;
+
+    return TRUE;
+}
+
 int
 main(int argc, char *argv[])
 {
+    GOptionContext *context;
     GError *error = NULL;
     int ret_code = -1;
-
-    gst_init(&argc, &argv);
+    gboolean registry_trusted;
+
+    startup_begin();
+    registry_trusted = startup_registry_prepare();
+
+    context = g_option_context_new("- gstreamer webrtc receiver");
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_option_context_add_group(context, gst_init_get_option_group());
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        gst_printerr("Error initializing: %s\n", error->message);
+        g_clear_error(&error);
+        return -1;
+    }
+    g_option_context_free(context);
 
     GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "webrtc-sendrecv", 0,
         "WebRTC Sending and Receiving example");
+    startup_mark(registry_trusted ? "gst_init (cached registry)" : "gst_init");
+    if (!registry_trusted)
+        startup_registry_save();
 
     if (!check_plugins()) {
         goto out;
     }
+    preload_factories();
+    startup_mark("plugin check");
 
-    std::cout << "Enter Id: ";
-    std::cin >> connection_id;
+    if (metrics_port > 0 && !metrics_server_start(metrics_port, &error)) {
+        gst_printerr("Failed to serve metrics on port %d: %s\n", metrics_port,
+            error->message);
+        g_clear_error(&error);
+        goto out;
+    }
 
-    ret_code = 0;
+    if (trace_interval > 0)
+        trace_start_reporting(trace_interval, trace_output);
 
-    app_state = PEER_CONNECTED;
-    /* Start negotiation (exchange SDP and ICE candidates) */
-    if (!start_pipeline(TRUE))
-        cleanup_and_quit_loop("ERROR: failed to start pipeline",
-            PEER_CALL_ERROR);
+    flight_recorder_start(flight_recorder_dir, MAX(stall_threshold, 0));
+
+    if (pin_threads && !parse_task_pool_config()) {
+        goto out;
+    }
+
+    /* Before the first request, which sets up the shared connections */
+    options.max_host_connections = MAX(signalling_connections, 0);
+
+    if (!parse_ice_policy()) {
+        goto out;
+    }
+
+    if (!srtp_parse_profiles(srtp_profiles ? srtp_profiles : SRTP_DEFAULT_PROFILES,
+            &srtp_preference)) {
+        gst_printerr("Invalid SRTP profiles '%s'\n", srtp_profiles);
+        goto out;
+    }
+
+    if (motion_gate && !analysis) {
+        gst_printerr("--motion-gate needs --analysis\n");
+        goto out;
+    }
+
+    if (analysis && !parse_analysis_config()) {
+        goto out;
+    }
+
+    if (frame_pools) {
+        FrameMemory backing = FRAME_MEMORY_HEAP;
+        if (g_strcmp0(frame_memory, "memfd") == 0) {
+            backing = FRAME_MEMORY_MEMFD;
+        }
+        else if (g_strcmp0(frame_memory, "hugepage") == 0) {
+            backing = FRAME_MEMORY_HUGEPAGE;
+        }
+        else if (frame_memory && g_strcmp0(frame_memory, "heap") != 0) {
+            gst_printerr("Unknown frame memory '%s'\n", frame_memory);
+            goto out;
+        }
+        frame_pools_init(backing, (guint64) MAX(frame_cache, 0) * 1024 * 1024);
+    }
+
+    if (data_bench) {
+        /* Latency is measured against the sender's clock */
+        if (!loopback) {
+            gst_printerr("--data-bench needs --loopback\n");
+            goto out;
+        }
+        bench1 = data_bench_new(data_bench_parse_sizes(data_bench),
+            MAX(data_bench_seconds, 1), on_data_bench_done, NULL);
+    }
+
+    if (cpu_budget > 0 || memory_budget > 0 || max_sessions > 0) {
+        GovernorConfig config;
+        config.cpu_budget = cpu_budget > 0 ? cpu_budget / 100.0 : 1e9;
+        config.cpu_recover = config.cpu_budget * 0.7;
+        config.memory_budget = (guint64) MAX(memory_budget, 0) * 1024 * 1024;
+        config.max_sessions = MAX(max_sessions, 0);
+        config.queue_timeout_ms = MAX(admission_timeout, 0);
+        config.snapshot_interval_ms = MAX(snapshot_interval, 100);
+        governor_start(config);
+    }
+
+    startup_mark("services");
+    startup_print();
+    if (exit_when_ready) {
+        ret_code = 0;
+        goto out;
+    }
+
+    if (replay_path) {
+        if (!start_replay_pipeline())
+            goto out;
+    }
+    else {
+        if (loopback) {
+            g_timeout_add_seconds(5, print_capture_latency, NULL);
+        }
+        else {
+            std::cout << "Enter Id: ";
+            std::cin >> connection_id;
+        }
+
+        app_state = PEER_CONNECTED;
+        if (cpu_budget > 0 || memory_budget > 0 || max_sessions > 0) {
+            /* As the webrtcbin will be named; negotiation starts once admitted */
+            governor1 = governor_session_new("recvonly", priority, on_governor_level, NULL);
+            governor_session_admit(governor1, on_admitted, NULL);
+        }
+        /* Start negotiation (exchange SDP and ICE candidates) */
+        else if (!start_pipeline(TRUE)) {
+            cleanup_and_quit_loop("ERROR: failed to start pipeline",
+                PEER_CALL_ERROR);
+        }
+    }
+
+    ret_code = 0;
 
     loop = g_main_loop_new(NULL, FALSE);
 
+#ifndef _WIN32
+    /* Not before the Id is read, so Ctrl-C still interrupts that */
+    g_unix_signal_add(SIGINT, on_quit_signal, NULL);
+    g_unix_signal_add(SIGTERM, on_quit_signal, NULL);
+#endif
+
     g_main_loop_run(loop);
 
     if (loop)
         g_main_loop_unref(loop);
 
+    if (bench1)
+        data_bench_print(bench1);
+    /* Before the loopback peer, whose channel it sends on */
+    data_bench_free(bench1);
+    bench1 = NULL;
+
+    loopback_peer_free(loopback1);
+    loopback1 = NULL;
+
+    if (audio1)
+        audio_session_print(audio1);
+    if (analysis1)
+        analysis_session_print(analysis1);
+    if (governor1)
+        governor_print();
+
     if (pipe1) {
         gst_element_set_state(GST_ELEMENT(pipe1), GST_STATE_NULL);
         gst_print("Pipeline stopped\n");
         gst_object_unref(pipe1);
     }
 
+    rtp_replay_free(replay1);
+    replay1 = NULL;
+    rtp_recorder_free(rtp_recorder1);
+    rtp_recorder1 = NULL;
+    simulcast_receiver_free(simulcast1);
+    simulcast1 = NULL;
+    for (auto channel : data_channels)
+        data_channel_free(channel);
+    data_channels.clear();
+    task_pools_free(pools1);
+    pools1 = NULL;
+    analysis_session_free(analysis1);
+    analysis1 = NULL;
+    srtp_session_free(srtp1);
+    srtp1 = NULL;
+    governor_session_free(governor1);
+    governor1 = NULL;
+    branch_pool_free(pool1);
+    pool1 = NULL;
+
+    metrics_session_free(metrics1);
+    metrics1 = NULL;
+    trace_session_free(trace1);
+    trace1 = NULL;
+    capture_time_session_free(capture1);
+    capture1 = NULL;
+    audio_session_free(audio1);
+    audio1 = NULL;
+    flight_recorder_free(recorder1);
+    recorder1 = NULL;
+
 out:
     return ret_code;
 }
@@ -0,0 +1,329 @@
+/*
+ * Typed per-session metrics derived from webrtcbin "get-stats" replies,
+ * exposed in Prometheus text format.
+ */
+
+#include "metrics.h"
+
+#define GST_USE_UNSTABLE_API
+#include <gst/webrtc/webrtc.h>
+
+#include <libsoup/soup.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Values as of the last poll. Counters are summed over all inbound RTP
+ * streams of the session, gauges are taken from the worst stream.
+ */
+struct MetricsValues {
+    double packets_received;
+    double bytes_received;
+    double packets_lost;
+    double nack_count;
+    double pli_count;
+    double fir_count;
+    double frames_rendered;
+    double jitter_seconds;
+    double rtt_seconds;
+    double bitrate_bps;
+    double fps;
+    double loss_fraction;
+};
+
+struct MetricsSession {
+    std::string name;
+
+    std::atomic<guint64> frames_rendered{ 0 };
+
+    std::mutex mutex;           // guards everything below
+    MetricsValues values{};
+    gint64 last_poll_time = 0;
+};
+
+static std::mutex registry_mutex;
+static std::vector<MetricsSession*> sessions;
+static std::vector<std::pair<MetricsCollectFunc, gpointer>> collectors;
+
+/* Interned once, so the per-poll lookups neither hash strings nor allocate. */
+static GQuark q_type, q_packets_received, q_bytes_received, q_packets_lost,
+    q_nack_count, q_pli_count, q_fir_count, q_jitter, q_round_trip_time,
+    q_current_round_trip_time;
+
+static void
+init_quarks()
+{
+    static std::once_flag once;
+    std::call_once(once, [] {
+        q_type = g_quark_from_static_string("type");
+        q_packets_received = g_quark_from_static_string("packets-received");
+        q_bytes_received = g_quark_from_static_string("bytes-received");
+        q_packets_lost = g_quark_from_static_string("packets-lost");
+        q_nack_count = g_quark_from_static_string("nack-count");
+        q_pli_count = g_quark_from_static_string("pli-count");
+        q_fir_count = g_quark_from_static_string("fir-count");
+        q_jitter = g_quark_from_static_string("jitter");
+        q_round_trip_time = g_quark_from_static_string("round-trip-time");
+        q_current_round_trip_time =
+            g_quark_from_static_string("current-round-trip-time");
+    });
+}
+
+/*
+ * The integer types of the stats fields differ between GStreamer releases,
+ * so accept whatever numeric type we are handed.
+ */
+static double
+value_as_double(const GValue * value)
+{
+    if (!value)
+        return 0;
+
+    const GType type = G_VALUE_TYPE(value);
+    if (type == G_TYPE_DOUBLE)
+        return g_value_get_double(value);
+    if (type == G_TYPE_UINT64)
+        return (double) g_value_get_uint64(value);
+    if (type == G_TYPE_INT64)
+        return (double) std::max<gint64>(g_value_get_int64(value), 0);
+    if (type == G_TYPE_UINT)
+        return g_value_get_uint(value);
+    if (type == G_TYPE_INT)
+        return std::max(g_value_get_int(value), 0);
+    return 0;
+}
+
+static double
+field(const GstStructure * s, GQuark quark)
+{
+    return value_as_double(gst_structure_id_get_value(s, quark));
+}
+
+/* Counters may restart when a stream is replaced; never report negative rates. */
+static double
+delta(double now, double before)
+{
+    return now > before ? now - before : 0;
+}
+
+MetricsSession*
+metrics_session_new(const char* name)
+{
+    init_quarks();
+
+    auto session = new MetricsSession;
+    session->name = name;
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    sessions.push_back(session);
+    return session;
+}
+
+void
+metrics_session_free(MetricsSession* session)
+{
+    if (!session)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        sessions.erase(std::remove(sessions.begin(), sessions.end(), session),
+            sessions.end());
+    }
+    delete session;
+}
+
+void
+metrics_session_count_frame(MetricsSession* session)
+{
+    session->frames_rendered.fetch_add(1, std::memory_order_relaxed);
+}
+
+guint64
+metrics_session_get_frames_rendered(MetricsSession* session)
+{
+    return session->frames_rendered.load(std::memory_order_relaxed);
+}
+
+double
+metrics_session_get_loss_fraction(MetricsSession* session)
+{
+    std::lock_guard<std::mutex> lock(session->mutex);
+    return session->values.loss_fraction;
+}
+
+void
+metrics_session_update(MetricsSession* session, const GstStructure* stats)
+{
+    MetricsValues current{};
+
+    const gint n_fields = gst_structure_n_fields(stats);
+    for (gint i = 0; i < n_fields; ++i) {
+        const GValue *value = gst_structure_get_nth_field_value(stats, i);
+        if (!GST_VALUE_HOLDS_STRUCTURE(value))
+            continue;
+
+        const GstStructure *s = gst_value_get_structure(value);
+        const GValue *type_value = gst_structure_id_get_value(s, q_type);
+        if (!type_value || !G_VALUE_HOLDS_ENUM(type_value))
+            continue;
+
+        switch (g_value_get_enum(type_value)) {
+        case GST_WEBRTC_STATS_INBOUND_RTP:
+            current.packets_received += field(s, q_packets_received);
+            current.bytes_received += field(s, q_bytes_received);
+            current.packets_lost += field(s, q_packets_lost);
+            current.nack_count += field(s, q_nack_count);
+            current.pli_count += field(s, q_pli_count);
+            current.fir_count += field(s, q_fir_count);
+            current.jitter_seconds =
+                std::max(current.jitter_seconds, field(s, q_jitter));
+            break;
+        case GST_WEBRTC_STATS_REMOTE_INBOUND_RTP:
+        case GST_WEBRTC_STATS_REMOTE_OUTBOUND_RTP:
+            current.rtt_seconds =
+                std::max(current.rtt_seconds, field(s, q_round_trip_time));
+            break;
+        case GST_WEBRTC_STATS_CANDIDATE_PAIR:
+            current.rtt_seconds =
+                std::max(current.rtt_seconds, field(s, q_current_round_trip_time));
+            break;
+        default:
+            break;
+        }
+    }
+
+    current.frames_rendered =
+        (double) session->frames_rendered.load(std::memory_order_relaxed);
+
+    const gint64 now = g_get_monotonic_time();
+
+    std::lock_guard<std::mutex> lock(session->mutex);
+    const MetricsValues& previous = session->values;
+
+    if (session->last_poll_time) {
+        const double seconds = (now - session->last_poll_time) / (double) G_USEC_PER_SEC;
+        if (seconds > 0) {
+            current.bitrate_bps =
+                delta(current.bytes_received, previous.bytes_received) * 8 / seconds;
+            current.fps =
+                delta(current.frames_rendered, previous.frames_rendered) / seconds;
+        }
+
+        const double lost = delta(current.packets_lost, previous.packets_lost);
+        const double received =
+            delta(current.packets_received, previous.packets_received);
+        current.loss_fraction =
+            lost + received > 0 ? lost / (lost + received) : previous.loss_fraction;
+    }
+
+    session->values = current;
+    session->last_poll_time = now;
+}
+
+void
+metrics_register_collector(MetricsCollectFunc func, gpointer user_data)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    collectors.emplace_back(func, user_data);
+}
+
+struct MetricDescriptor {
+    const char *name;
+    const char *type;
+    const char *help;
+    double MetricsValues::*member;
+};
+
+static const MetricDescriptor descriptors[] = {
+    { "media_receiver_rtp_packets_received_total", "counter",
+        "RTP packets received", &MetricsValues::packets_received },
+    { "media_receiver_rtp_bytes_received_total", "counter",
+        "RTP payload bytes received", &MetricsValues::bytes_received },
+    { "media_receiver_rtp_packets_lost_total", "counter",
+        "RTP packets reported lost", &MetricsValues::packets_lost },
+    { "media_receiver_nack_sent_total", "counter",
+        "Generic NACKs sent", &MetricsValues::nack_count },
+    { "media_receiver_pli_sent_total", "counter",
+        "Picture loss indications sent", &MetricsValues::pli_count },
+    { "media_receiver_fir_sent_total", "counter",
+        "Full intra requests sent", &MetricsValues::fir_count },
+    { "media_receiver_frames_rendered_total", "counter",
+        "Video frames delivered to the sink", &MetricsValues::frames_rendered },
+    { "media_receiver_jitter_seconds", "gauge",
+        "Interarrival jitter of the worst inbound stream", &MetricsValues::jitter_seconds },
+    { "media_receiver_rtt_seconds", "gauge",
+        "Round trip time to the remote peer", &MetricsValues::rtt_seconds },
+    { "media_receiver_bitrate_bps", "gauge",
+        "Received bitrate over the last poll interval", &MetricsValues::bitrate_bps },
+    { "media_receiver_fps", "gauge",
+        "Rendered frame rate over the last poll interval", &MetricsValues::fps },
+    { "media_receiver_loss_fraction", "gauge",
+        "Fraction of packets lost over the last poll interval", &MetricsValues::loss_fraction },
+};
+
+void
+metrics_render(GString* out)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    std::vector<std::pair<const MetricsSession*, MetricsValues>> snapshot;
+    snapshot.reserve(sessions.size());
+    for (auto session : sessions) {
+        std::lock_guard<std::mutex> session_lock(session->mutex);
+        snapshot.emplace_back(session, session->values);
+    }
+
+    for (const auto& d : descriptors) {
+        g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n",
+            d.name, d.help, d.name, d.type);
+        for (const auto& entry : snapshot) {
+            g_string_append_printf(out, "%s{session=\"%s\"} %.17g\n",
+                d.name, entry.first->name.c_str(), entry.second.*d.member);
+        }
+    }
+
+    for (const auto& collector : collectors)
+        collector.first(out, collector.second);
+}
+
+static void
+metrics_handler(SoupServer * server, SoupMessage * msg, const char *path,
+    GHashTable * query, SoupClientContext * client, gpointer user_data)
+{
+    if (msg->method != SOUP_METHOD_GET) {
+        soup_message_set_status(msg, SOUP_STATUS_NOT_IMPLEMENTED);
+        return;
+    }
+
+    GString *out = g_string_sized_new(4096);
+    metrics_render(out);
+
+    const gsize len = out->len;
+    soup_message_set_response(msg, "text/plain; version=0.0.4",
+        SOUP_MEMORY_TAKE, g_string_free(out, FALSE), len);
+    soup_message_set_status(msg, SOUP_STATUS_OK);
+}
+
+gboolean
+metrics_server_start(guint port, GError** error)
+{
+    SoupServer *server = soup_server_new(SOUP_SERVER_SERVER_HEADER,
+        "media-receiver", NULL);
+
+    soup_server_add_handler(server, "/metrics", metrics_handler, NULL, NULL);
+
+    if (!soup_server_listen_local(server, port, SOUP_SERVER_LISTEN_IPV4_ONLY,
+        error)) {
+        g_object_unref(server);
+        return FALSE;
+    }
+
+    /* Lives for the rest of the process */
+    return TRUE;
+}
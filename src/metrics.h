@@ -0,0 +1,51 @@
+/*
+ * Typed per-session metrics derived from webrtcbin "get-stats" replies,
+ * exposed in Prometheus text format.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <gst/gst.h>
+
+struct MetricsSession;
+
+/*
+ * Sessions are registered process-wide, so a single scrape covers all of them.
+ */
+MetricsSession* metrics_session_new(const char* name);
+void metrics_session_free(MetricsSession* session);
+
+/*
+ * Feeds one reply of webrtcbin's "get-stats" into the session and recomputes
+ * derived rates against the previous poll. Does not allocate.
+ */
+void metrics_session_update(MetricsSession* session, const GstStructure* stats);
+
+/*
+ * Called from a streaming thread for every rendered video frame.
+ */
+void metrics_session_count_frame(MetricsSession* session);
+
+guint64 metrics_session_get_frames_rendered(MetricsSession* session);
+
+/*
+ * Loss over the last poll interval, for policies that react to it.
+ */
+double metrics_session_get_loss_fraction(MetricsSession* session);
+
+/*
+ * Other modules may append their own series to every scrape.
+ */
+typedef void (*MetricsCollectFunc)(GString* out, gpointer user_data);
+
+void metrics_register_collector(MetricsCollectFunc func, gpointer user_data);
+
+void metrics_render(GString* out);
+
+/*
+ * Serves "/metrics" on the loopback interface from the default main context.
+ */
+gboolean metrics_server_start(guint port, GError** error);
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ * Motion gating.
+ *
+ * Every row_step-th luma row is compared against the same row of the last
+ * frame let through, in tiles 32 pixels wide and 8 sampled rows tall. A
+ * tile changed when its mean absolute difference is over pixel_threshold,
+ * which keeps coding noise from adding up over a whole static frame while a
+ * small object moving still trips its tiles. Only the sampled rows of the
+ * reference are kept.
+ */
+
+#include "motion.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL 1
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNEL 1
+#endif
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+static const gint kTileWidth = 32;
+static const gint kTileRows = 8;
+
+struct MotionGate {
+    MotionConfig config;
+
+    gint width = 0;
+    gint height = 0;
+    std::vector<guint8> reference;      /* the sampled rows, packed */
+    std::vector<guint32> tiles;         /* SAD per tile of the current band */
+    GstClockTime last_pass = GST_CLOCK_TIME_NONE;
+};
+
+/* Adds the SAD of each 32 byte span of a and b to its tile */
+typedef void (*SadFunc)(const guint8 *a, const guint8 *b, gint n, guint32 *tiles);
+
+static void
+sad_scalar(const guint8 * a, const guint8 * b, gint n, guint32 * tiles)
+{
+    for (gint i = 0; i < n; ++i)
+        tiles[i / kTileWidth] += (guint32) ABS((gint) a[i] - (gint) b[i]);
+}
+
+#ifdef HAVE_AVX2_KERNEL
+__attribute__((target("avx2")))
+static void
+sad_avx2(const guint8 * a, const guint8 * b, gint n, guint32 * tiles)
+{
+    gint i = 0;
+    for (; i + kTileWidth <= n; i += kTileWidth) {
+        const __m256i s = _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *) (a + i)),
+            _mm256_loadu_si256((const __m256i *) (b + i)));
+        const __m128i t = _mm_add_epi64(_mm256_castsi256_si128(s),
+            _mm256_extracti128_si256(s, 1));
+        tiles[i / kTileWidth] += (guint32) (_mm_cvtsi128_si32(t) + _mm_extract_epi32(t, 2));
+    }
+    sad_scalar(a + i, b + i, n - i, tiles + i / kTileWidth);
+}
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+static void
+sad_neon(const guint8 * a, const guint8 * b, gint n, guint32 * tiles)
+{
+    gint i = 0;
+    for (; i + kTileWidth <= n; i += kTileWidth) {
+        uint16x8_t s = vpaddlq_u8(vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+        s = vpadalq_u8(s, vabdq_u8(vld1q_u8(a + i + 16), vld1q_u8(b + i + 16)));
+        tiles[i / kTileWidth] += vaddlvq_u16(s);
+    }
+    sad_scalar(a + i, b + i, n - i, tiles + i / kTileWidth);
+}
+#endif
+
+static SadFunc sad;
+static const char *kernel_name;
+
+static void
+select_kernel()
+{
+    static gsize once = 0;
+    if (!g_once_init_enter(&once))
+        return;
+
+    sad = sad_scalar;
+    kernel_name = "scalar";
+#if defined(HAVE_AVX2_KERNEL)
+    if (__builtin_cpu_supports("avx2")) {
+        sad = sad_avx2;
+        kernel_name = "avx2";
+    }
+#elif defined(HAVE_NEON_KERNEL)
+    sad = sad_neon;
+    kernel_name = "neon";
+#endif
+    g_once_init_leave(&once, 1);
+}
+
+MotionGate*
+motion_gate_new(const MotionConfig& config)
+{
+    select_kernel();
+
+    auto gate = new MotionGate;
+    gate->config = config;
+    gate->config.row_step = MAX(config.row_step, 1);
+    return gate;
+}
+
+void
+motion_gate_free(MotionGate* gate)
+{
+    delete gate;
+}
+
+static void
+keep_reference(MotionGate * gate, const guint8 * luma, gint stride)
+{
+    guint8 *dst = gate->reference.data();
+    for (gint y = 0; y < gate->height; y += gate->config.row_step) {
+        memcpy(dst, luma + (gsize) y * stride, gate->width);
+        dst += gate->width;
+    }
+}
+
+static bool
+moved(MotionGate * gate, const guint8 * luma, gint stride)
+{
+    const gint n_tiles = (gate->width + kTileWidth - 1) / kTileWidth;
+    const gint last_width = gate->width - (n_tiles - 1) * kTileWidth;
+    const guint8 *ref = gate->reference.data();
+
+    guint changed = 0, total = 0;
+    gint band_rows = 0;
+    std::fill(gate->tiles.begin(), gate->tiles.end(), 0);
+
+    for (gint y = 0; y < gate->height; y += gate->config.row_step) {
+        sad(luma + (gsize) y * stride, ref, gate->width, gate->tiles.data());
+        ref += gate->width;
+
+        const bool last_row = y + (gint) gate->config.row_step >= gate->height;
+        if (++band_rows < kTileRows && !last_row)
+            continue;
+
+        for (gint t = 0; t < n_tiles; ++t) {
+            const guint32 area = (guint32) (t == n_tiles - 1 ? last_width : kTileWidth) * band_rows;
+            if (gate->tiles[t] > gate->config.pixel_threshold * area)
+                ++changed;
+        }
+        total += n_tiles;
+        band_rows = 0;
+        std::fill(gate->tiles.begin(), gate->tiles.end(), 0);
+    }
+
+    return changed > gate->config.area_threshold * total;
+}
+
+gboolean
+motion_gate_check(MotionGate* gate, const guint8* luma, gint stride, gint width,
+    gint height, GstClockTime pts)
+{
+    const GstClockTime now = GST_CLOCK_TIME_IS_VALID(pts) ? pts
+        : (GstClockTime) g_get_monotonic_time() * GST_USECOND;
+
+    bool pass;
+    if (width != gate->width || height != gate->height) {
+        gate->width = width;
+        gate->height = height;
+        gate->reference.resize((gsize) width
+            * ((height + gate->config.row_step - 1) / gate->config.row_step));
+        gate->tiles.resize((width + kTileWidth - 1) / kTileWidth);
+        pass = true;
+    }
+    else {
+        pass = !GST_CLOCK_TIME_IS_VALID(gate->last_pass) || now < gate->last_pass
+            || now - gate->last_pass >= gate->config.heartbeat || moved(gate, luma, stride);
+    }
+
+    if (pass) {
+        keep_reference(gate, luma, stride);
+        gate->last_pass = now;
+    }
+    return pass;
+}
+
+const char*
+motion_kernel(void)
+{
+    select_kernel();
+    return kernel_name;
+}
@@ -0,0 +1,37 @@
+/*
+ * Motion gating: a subsampled luma SAD against the last frame let through,
+ * with AVX2 and NEON kernels and a scalar fallback.
+ */
+
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <gst/gst.h>
+
+struct MotionConfig {
+    guint row_step = 4;                 /* compare every that many rows */
+    guint pixel_threshold = 10;         /* mean difference for a tile to count as changed */
+    double area_threshold = 0.002;      /* fraction of tiles that must change */
+    GstClockTime heartbeat = GST_SECOND;        /* let a frame through at least that often */
+};
+
+struct MotionGate;
+
+MotionGate* motion_gate_new(const MotionConfig& config);
+
+void motion_gate_free(MotionGate* gate);
+
+/*
+ * TRUE when the frame should go on: enough of it changed since the last
+ * frame let through, the heartbeat is due, or the size changed. pts may be
+ * GST_CLOCK_TIME_NONE, then the heartbeat runs on the monotonic clock.
+ */
+gboolean motion_gate_check(MotionGate* gate, const guint8* luma, gint stride, gint width,
+    gint height, GstClockTime pts);
+
+/*
+ * "avx2", "neon" or "scalar".
+ */
+const char* motion_kernel(void);
+
+#endif
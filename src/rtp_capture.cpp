@@ -0,0 +1,298 @@
+/*
+ * Recording of decrypted RTP as it leaves webrtcbin, and deterministic
+ * replay of such recordings into the receive chain.
+ */
+
+#include "rtp_capture.h"
+
+#include <gst/app/gstappsrc.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define RTP_CAPTURE_MAGIC   "MRTP"
+#define RTP_CAPTURE_VERSION 2
+
+/* u64 arrival + u16 size; u32 arrival in version 1 */
+static const gsize kRecordHeader = 10;
+static const gsize kRecordHeaderV1 = 6;
+
+struct RtpRecordFile {
+    FILE *file;
+    GstClockTime start;         /* arrival of the first packet */
+    bool have_caps;
+};
+
+struct RtpRecorder {
+    std::string prefix;
+
+    std::mutex mutex;           // guards files
+    std::vector<std::unique_ptr<RtpRecordFile>> files;
+};
+
+static void
+write_packet(RtpRecordFile * record, GstBuffer * buffer, GstClockTime now)
+{
+    GstMapInfo map;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+        return;
+
+    if (map.size <= G_MAXUINT16) {
+        if (!GST_CLOCK_TIME_IS_VALID(record->start))
+            record->start = now;
+
+        guint8 header[kRecordHeader];
+        GST_WRITE_UINT64_LE(header, (now - record->start) / GST_USECOND);
+        GST_WRITE_UINT16_LE(header + 8, (guint16) map.size);
+        fwrite(header, sizeof(header), 1, record->file);
+        fwrite(map.data, map.size, 1, record->file);
+    }
+
+    gst_buffer_unmap(buffer, &map);
+}
+
+static GstPadProbeReturn
+on_record_probe(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    auto record = static_cast<RtpRecordFile *>(user_data);
+
+    if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS && !record->have_caps) {
+            GstCaps *caps;
+            gst_event_parse_caps(event, &caps);
+            gchar *text = gst_caps_to_string(caps);
+            const gsize len = MIN(strlen(text), (gsize) G_MAXUINT16);
+
+            guint8 header[8];
+            memcpy(header, RTP_CAPTURE_MAGIC, 4);
+            GST_WRITE_UINT16_LE(header + 4, RTP_CAPTURE_VERSION);
+            GST_WRITE_UINT16_LE(header + 6, (guint16) len);
+            fwrite(header, sizeof(header), 1, record->file);
+            fwrite(text, len, 1, record->file);
+            g_free(text);
+
+            record->have_caps = true;
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    /* Packets ahead of the caps could not be replayed anyway */
+    if (!record->have_caps)
+        return GST_PAD_PROBE_OK;
+
+    const GstClockTime now = gst_util_get_timestamp();
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+        write_packet(record, GST_PAD_PROBE_INFO_BUFFER(info), now);
+    }
+    else if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        const guint n = gst_buffer_list_length(list);
+        for (guint i = 0; i < n; ++i)
+            write_packet(record, gst_buffer_list_get(list, i), now);
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+RtpRecorder*
+rtp_recorder_new(const char* prefix)
+{
+    auto recorder = new RtpRecorder;
+    recorder->prefix = prefix;
+    return recorder;
+}
+
+void
+rtp_recorder_free(RtpRecorder* recorder)
+{
+    if (!recorder)
+        return;
+
+    for (auto& record : recorder->files)
+        fclose(record->file);
+    delete recorder;
+}
+
+void
+rtp_recorder_watch(RtpRecorder* recorder, GstPad* pad)
+{
+    gchar *path = g_strdup_printf("%s-%s.mrtp", recorder->prefix.c_str(),
+        GST_PAD_NAME(pad));
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        gst_printerr("Can't record RTP to '%s'\n", path);
+        g_free(path);
+        return;
+    }
+    /* Keep the streaming thread off the disk most of the time */
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    gst_print("Recording RTP to %s\n", path);
+    g_free(path);
+
+    auto record = std::make_unique<RtpRecordFile>();
+    record->file = file;
+    record->start = GST_CLOCK_TIME_NONE;
+    record->have_caps = false;
+
+    gst_pad_add_probe(pad,
+        (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST
+            | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+        on_record_probe, record.get(), NULL);
+
+    std::lock_guard<std::mutex> lock(recorder->mutex);
+    recorder->files.push_back(std::move(record));
+}
+
+struct RtpReplay {
+    GMappedFile *file;
+    const guint8 *packets;      /* first record */
+    const guint8 *end;
+    gsize record_header;        /* by version */
+    gboolean fast;
+
+    GstElement *appsrc;
+    std::thread feeder;
+    std::atomic<bool> stopping{ false };
+
+    guint64 packets_pushed = 0;
+    guint64 bytes_pushed = 0;
+    gint64 started = 0;
+    gint64 finished = 0;
+};
+
+RtpReplay*
+rtp_replay_new(const char* path, gboolean fast, GError** error)
+{
+    GMappedFile *file = g_mapped_file_new(path, FALSE, error);
+    if (!file)
+        return nullptr;
+
+    const guint8 *data = (const guint8 *) g_mapped_file_get_contents(file);
+    const gsize size = g_mapped_file_get_length(file);
+    const guint16 version = size >= 8 ? GST_READ_UINT16_LE(data + 4) : 0;
+    if (size < 8 || memcmp(data, RTP_CAPTURE_MAGIC, 4) != 0
+        || (version != RTP_CAPTURE_VERSION && version != 1)
+        || size < 8u + GST_READ_UINT16_LE(data + 6)) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+            "'%s' is not an RTP recording", path);
+        g_mapped_file_unref(file);
+        return nullptr;
+    }
+
+    const gsize caps_len = GST_READ_UINT16_LE(data + 6);
+    gchar *caps_text = g_strndup((const gchar *) data + 8, caps_len);
+    GstCaps *caps = gst_caps_from_string(caps_text);
+    g_free(caps_text);
+    if (!caps) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+            "'%s' has unreadable caps", path);
+        g_mapped_file_unref(file);
+        return nullptr;
+    }
+
+    auto replay = new RtpReplay;
+    replay->file = file;
+    replay->packets = data + 8 + caps_len;
+    replay->end = data + size;
+    replay->record_header = version == 1 ? kRecordHeaderV1 : kRecordHeader;
+    replay->fast = fast;
+
+    replay->appsrc = gst_element_factory_make("appsrc", "replay");
+    gst_object_ref_sink(replay->appsrc);
+    g_object_set(replay->appsrc,
+        "caps", caps,
+        "format", GST_FORMAT_TIME,
+        "is-live", !fast,
+        "do-timestamp", !fast,
+        "block", TRUE,
+        "max-bytes", (guint64) 4 << 20,
+        NULL);
+    gst_caps_unref(caps);
+
+    return replay;
+}
+
+static void
+feed(RtpReplay * replay)
+{
+    using clock = std::chrono::steady_clock;
+    const auto start = clock::now();
+    replay->started = g_get_monotonic_time();
+
+    const guint8 *p = replay->packets;
+    const gsize header = replay->record_header;
+    while (!replay->stopping && p + header <= replay->end) {
+        const guint64 arrival_us = header == kRecordHeaderV1
+            ? GST_READ_UINT32_LE(p) : GST_READ_UINT64_LE(p);
+        const guint16 size = GST_READ_UINT16_LE(p + header - 2);
+        const guint8 *data = p + header;
+        if (data + size > replay->end)
+            break;      /* truncated recording */
+        p = data + size;
+
+        if (!replay->fast)
+            std::this_thread::sleep_until(start + std::chrono::microseconds(arrival_us));
+
+        /* Zero copy, the buffer keeps the mapping alive */
+        GstBuffer *buffer = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY,
+            (gpointer) data, size, 0, size, g_mapped_file_ref(replay->file),
+            (GDestroyNotify) g_mapped_file_unref);
+        if (replay->fast)
+            GST_BUFFER_PTS(buffer) = (GstClockTime) arrival_us * GST_USECOND;
+
+        if (gst_app_src_push_buffer(GST_APP_SRC(replay->appsrc), buffer) != GST_FLOW_OK)
+            break;
+
+        ++replay->packets_pushed;
+        replay->bytes_pushed += size;
+    }
+
+    replay->finished = g_get_monotonic_time();
+    gst_app_src_end_of_stream(GST_APP_SRC(replay->appsrc));
+}
+
+GstElement*
+rtp_replay_get_source(RtpReplay* replay)
+{
+    return replay->appsrc;
+}
+
+void
+rtp_replay_start(RtpReplay* replay)
+{
+    replay->feeder = std::thread(feed, replay);
+}
+
+void
+rtp_replay_print_summary(RtpReplay* replay)
+{
+    const double seconds =
+        (replay->finished - replay->started) / (double) G_USEC_PER_SEC;
+    gst_print("Replayed %" G_GUINT64_FORMAT " packets (%" G_GUINT64_FORMAT
+        " bytes) in %.3f s, %.0f packets/s\n", replay->packets_pushed,
+        replay->bytes_pushed, seconds,
+        seconds > 0 ? replay->packets_pushed / seconds : 0);
+}
+
+void
+rtp_replay_free(RtpReplay* replay)
+{
+    if (!replay)
+        return;
+
+    replay->stopping = true;
+    if (replay->feeder.joinable())
+        replay->feeder.join();
+
+    gst_object_unref(replay->appsrc);
+    g_mapped_file_unref(replay->file);
+    delete replay;
+}
@@ -0,0 +1,53 @@
+/*
+ * Recording of decrypted RTP as it leaves webrtcbin, and deterministic
+ * replay of such recordings into the receive chain.
+ *
+ * File layout, little endian:
+ *   "MRTP", u16 version, u16 caps length, caps string
+ *   then per packet: u64 arrival in us since the first packet, u16 size, data
+ * Version 1 had a u32 arrival, which wraps after 71 minutes; it is still
+ * replayed.
+ */
+
+#ifndef RTP_CAPTURE_H
+#define RTP_CAPTURE_H
+
+#include <gst/gst.h>
+
+struct RtpRecorder;
+
+/*
+ * Each watched pad is written to "<prefix>-<pad name>.mrtp".
+ */
+RtpRecorder* rtp_recorder_new(const char* prefix);
+
+/*
+ * Closes the files; the watched pipeline must be in NULL state.
+ */
+void rtp_recorder_free(RtpRecorder* recorder);
+
+void rtp_recorder_watch(RtpRecorder* recorder, GstPad* pad);
+
+struct RtpReplay;
+
+/*
+ * Paced replay reproduces the recorded arrival times; fast replay pushes
+ * everything as quickly as downstream accepts it, for throughput benchmarks.
+ */
+RtpReplay* rtp_replay_new(const char* path, gboolean fast, GError** error);
+void rtp_replay_free(RtpReplay* replay);
+
+/*
+ * The appsrc to link into the receive chain; owned by the replay until
+ * added to a bin.
+ */
+GstElement* rtp_replay_get_source(RtpReplay* replay);
+
+/*
+ * Starts feeding once the pipeline is PLAYING; ends with EOS.
+ */
+void rtp_replay_start(RtpReplay* replay);
+
+void rtp_replay_print_summary(RtpReplay* replay);
+
+#endif
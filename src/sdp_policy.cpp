@@ -0,0 +1,292 @@
+/*
+ * Rewrites SDP in place on a GstSDPMessage according to per-media policies.
+ *
+ * Working on the parsed message rather than on text means every m-section
+ * is reachable, nothing gets lost on the way back to text, and the only
+ * allocations are for the attributes actually changed.
+ */
+
+#include "sdp_policy.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <set>
+
+/* Payload type a "rtpmap"/"fmtp"/"rtcp-fb" value starts with, -1 if none */
+static int
+leading_pt(const gchar * value)
+{
+    if (!value || !g_ascii_isdigit(*value))
+        return -1;
+    return (int) strtol(value, NULL, 10);
+}
+
+static std::string
+encoding_name(const GstSDPMedia * media, int pt)
+{
+    const guint n = gst_sdp_media_attributes_len(media);
+    for (guint i = 0; i < n; ++i) {
+        const GstSDPAttribute *a = gst_sdp_media_get_attribute(media, i);
+        if (g_str_equal(a->key, "rtpmap") && leading_pt(a->value) == pt) {
+            const gchar *name = strchr(a->value, ' ');
+            if (!name)
+                break;
+            ++name;
+            const gchar *slash = strchr(name, '/');
+            return slash ? std::string(name, slash - name) : std::string(name);
+        }
+    }
+    return std::string();
+}
+
+/* Payload type an RTX format repairs, from "fmtp:<pt> apt=<n>" */
+static int
+rtx_apt(const GstSDPMedia * media, int pt)
+{
+    const guint n = gst_sdp_media_attributes_len(media);
+    for (guint i = 0; i < n; ++i) {
+        const GstSDPAttribute *a = gst_sdp_media_get_attribute(media, i);
+        if (g_str_equal(a->key, "fmtp") && leading_pt(a->value) == pt) {
+            const gchar *apt = strstr(a->value, "apt=");
+            return apt ? (int) strtol(apt + 4, NULL, 10) : -1;
+        }
+    }
+    return -1;
+}
+
+static bool
+name_in(const std::string& name, const std::vector<std::string>& names)
+{
+    return std::any_of(names.begin(), names.end(), [&name](const std::string& v) {
+        return g_ascii_strcasecmp(v.c_str(), name.c_str()) == 0;
+    });
+}
+
+static void
+set_bandwidth(GstSDPMedia * media, int kbps, bool tias)
+{
+    for (guint i = gst_sdp_media_bandwidths_len(media); i-- > 0;) {
+        const GstSDPBandwidth *bw = gst_sdp_media_get_bandwidth(media, i);
+        if (g_str_equal(bw->bwtype, GST_SDP_BWTYPE_AS)
+            || g_str_equal(bw->bwtype, GST_SDP_BWTYPE_TIAS))
+            gst_sdp_media_remove_bandwidth(media, i);
+    }
+
+    gst_sdp_media_add_bandwidth(media, GST_SDP_BWTYPE_AS, kbps);
+    if (tias)
+        gst_sdp_media_add_bandwidth(media, GST_SDP_BWTYPE_TIAS, kbps * 1000);
+}
+
+static void
+strip_codecs(GstSDPMedia * media, const std::vector<std::string>& names)
+{
+    std::set<int> stripped;
+    const guint n_formats = gst_sdp_media_formats_len(media);
+    for (guint i = 0; i < n_formats; ++i) {
+        const int pt = leading_pt(gst_sdp_media_get_format(media, i));
+        if (name_in(encoding_name(media, pt), names))
+            stripped.insert(pt);
+    }
+    if (stripped.empty())
+        return;
+
+    /* RTX for a removed codec would dangle */
+    for (guint i = 0; i < n_formats; ++i) {
+        const int pt = leading_pt(gst_sdp_media_get_format(media, i));
+        if (g_ascii_strcasecmp(encoding_name(media, pt).c_str(), "rtx") == 0
+            && stripped.count(rtx_apt(media, pt)))
+            stripped.insert(pt);
+    }
+
+    for (guint i = n_formats; i-- > 0;) {
+        if (stripped.count(leading_pt(gst_sdp_media_get_format(media, i))))
+            gst_sdp_media_remove_format(media, i);
+    }
+
+    for (guint i = gst_sdp_media_attributes_len(media); i-- > 0;) {
+        const GstSDPAttribute *a = gst_sdp_media_get_attribute(media, i);
+        if ((g_str_equal(a->key, "rtpmap") || g_str_equal(a->key, "fmtp")
+                || g_str_equal(a->key, "rtcp-fb"))
+            && stripped.count(leading_pt(a->value)))
+            gst_sdp_media_remove_attribute(media, i);
+    }
+}
+
+static void
+order_codecs(GstSDPMedia * media, const std::vector<std::string>& order)
+{
+    struct Format {
+        std::string pt;
+        size_t rank;
+    };
+
+    std::vector<Format> formats;
+    const guint n = gst_sdp_media_formats_len(media);
+    for (guint i = 0; i < n; ++i) {
+        const gchar *pt = gst_sdp_media_get_format(media, i);
+        const std::string name = encoding_name(media, leading_pt(pt));
+        size_t rank = order.size();
+        for (size_t r = 0; r < order.size(); ++r) {
+            if (g_ascii_strcasecmp(order[r].c_str(), name.c_str()) == 0) {
+                rank = r;
+                break;
+            }
+        }
+        formats.push_back({ pt, rank });
+    }
+
+    std::stable_sort(formats.begin(), formats.end(),
+        [](const Format& a, const Format& b) { return a.rank < b.rank; });
+
+    for (guint i = 0; i < n; ++i)
+        gst_sdp_media_replace_format(media, i, formats[i].pt.c_str());
+}
+
+/* "<id>[/<direction>] <uri> [attributes]" */
+static bool
+parse_extmap(const gchar * value, int * id, std::string * uri)
+{
+    if (!value || !g_ascii_isdigit(*value))
+        return false;
+    *id = (int) strtol(value, NULL, 10);
+    const gchar *space = strchr(value, ' ');
+    if (!space)
+        return false;
+    const gchar *end = strchr(space + 1, ' ');
+    *uri = end ? std::string(space + 1, end - space - 1) : std::string(space + 1);
+    return true;
+}
+
+/* Header extension ids are shared by all bundled m-sections, so look at all of them */
+static int
+extmap_id(const GstSDPMessage * sdp, const std::string& wanted)
+{
+    std::set<int> used;
+    for (guint m = 0; m < gst_sdp_message_medias_len(sdp); ++m) {
+        const GstSDPMedia *media = gst_sdp_message_get_media(sdp, m);
+        for (guint i = 0; i < gst_sdp_media_attributes_len(media); ++i) {
+            const GstSDPAttribute *a = gst_sdp_media_get_attribute(media, i);
+            int id;
+            std::string uri;
+            if (g_str_equal(a->key, "extmap") && parse_extmap(a->value, &id, &uri)) {
+                if (uri == wanted)
+                    return id;
+                used.insert(id);
+            }
+        }
+    }
+
+    /* One-byte header ids */
+    for (int id = 1; id <= 14; ++id) {
+        if (!used.count(id))
+            return id;
+    }
+    return -1;
+}
+
+static void
+add_extmaps(GstSDPMessage * sdp, GstSDPMedia * media,
+    const std::vector<std::string>& uris)
+{
+    for (const auto& wanted : uris) {
+        bool present = false;
+        for (guint i = 0; i < gst_sdp_media_attributes_len(media) && !present; ++i) {
+            const GstSDPAttribute *a = gst_sdp_media_get_attribute(media, i);
+            int id;
+            std::string uri;
+            present = g_str_equal(a->key, "extmap")
+                && parse_extmap(a->value, &id, &uri) && uri == wanted;
+        }
+        if (present)
+            continue;
+
+        const int id = extmap_id(sdp, wanted);
+        if (id < 0)
+            continue;
+        const std::string value = std::to_string(id) + ' ' + wanted;
+        gst_sdp_media_add_attribute(media, "extmap", value.c_str());
+    }
+}
+
+static void
+add_rtcp_fb(GstSDPMedia * media, const std::vector<std::string>& feedback)
+{
+    const guint n = gst_sdp_media_formats_len(media);
+    for (guint f = 0; f < n; ++f) {
+        const gchar *pt = gst_sdp_media_get_format(media, f);
+        const std::string name = encoding_name(media, leading_pt(pt));
+        /* Feedback belongs to the media codecs, not their repair streams */
+        if (name.empty() || name_in(name, { "rtx", "red", "ulpfec", "flexfec-03" }))
+            continue;
+
+        for (const auto& fb : feedback) {
+            const std::string value = std::string(pt) + ' ' + fb;
+            bool present = false;
+            for (guint i = 0; i < gst_sdp_media_attributes_len(media) && !present; ++i) {
+                const GstSDPAttribute *a = gst_sdp_media_get_attribute(media, i);
+                present = g_str_equal(a->key, "rtcp-fb") && value == a->value;
+            }
+            if (!present)
+                gst_sdp_media_add_attribute(media, "rtcp-fb", value.c_str());
+        }
+    }
+}
+
+static bool
+has_attribute(const GstSDPMedia * media, const gchar * key, const std::string& prefix)
+{
+    for (guint i = 0; i < gst_sdp_media_attributes_len(media); ++i) {
+        const GstSDPAttribute *a = gst_sdp_media_get_attribute(media, i);
+        if (g_str_equal(a->key, key) && a->value
+            && g_str_has_prefix(a->value, prefix.c_str()))
+            return true;
+    }
+    return false;
+}
+
+/* RFC 8853: "a=rid:<id> recv" per layer and "a=simulcast:recv <id>;<id>..." */
+static void
+add_recv_rids(GstSDPMedia * media, const std::vector<std::string>& rids)
+{
+    std::string simulcast = "recv ";
+    for (const auto& rid : rids) {
+        if (!has_attribute(media, "rid", rid + ' '))
+            gst_sdp_media_add_attribute(media, "rid", (rid + " recv").c_str());
+        if (&rid != &rids.front())
+            simulcast += ';';
+        simulcast += rid;
+    }
+
+    if (!has_attribute(media, "simulcast", ""))
+        gst_sdp_media_add_attribute(media, "simulcast", simulcast.c_str());
+}
+
+void
+sdp_apply_policies(GstSDPMessage* sdp, const std::vector<SdpMediaPolicy>& policies)
+{
+    for (guint m = 0; m < gst_sdp_message_medias_len(sdp); ++m) {
+        /* The message owns its media array; the API only hands out const */
+        GstSDPMedia *media = (GstSDPMedia *) gst_sdp_message_get_media(sdp, m);
+
+        for (const auto& policy : policies) {
+            if (!policy.media.empty()
+                && g_strcmp0(gst_sdp_media_get_media(media), policy.media.c_str()) != 0)
+                continue;
+
+            if (!policy.strip_codecs.empty())
+                strip_codecs(media, policy.strip_codecs);
+            if (!policy.codec_order.empty())
+                order_codecs(media, policy.codec_order);
+            if (!policy.extmaps.empty())
+                add_extmaps(sdp, media, policy.extmaps);
+            if (!policy.rtcp_fb.empty())
+                add_rtcp_fb(media, policy.rtcp_fb);
+            if (!policy.recv_rids.empty())
+                add_recv_rids(media, policy.recv_rids);
+            if (policy.bitrate_kbps >= 0)
+                set_bandwidth(media, policy.bitrate_kbps, policy.tias);
+        }
+    }
+}
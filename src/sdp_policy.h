@@ -0,0 +1,29 @@
+/*
+ * Rewrites SDP in place on a GstSDPMessage according to per-media policies.
+ */
+
+#ifndef SDP_POLICY_H
+#define SDP_POLICY_H
+
+#include <gst/sdp/sdp.h>
+
+#include <string>
+#include <vector>
+
+struct SdpMediaPolicy {
+    std::string media;                      /* "video", "audio", ...; empty matches all */
+    int bitrate_kbps = -1;                  /* b=AS, negative leaves bandwidth alone */
+    bool tias = false;                      /* also add b=TIAS */
+    std::vector<std::string> codec_order;   /* encoding names to move to the front */
+    std::vector<std::string> strip_codecs;  /* encoding names to remove, with their RTX */
+    std::vector<std::string> extmaps;       /* header extension URIs to offer */
+    std::vector<std::string> rtcp_fb;       /* e.g. "nack", "nack pli", "transport-cc" */
+    std::vector<std::string> recv_rids;     /* simulcast layers to ask for, best first */
+};
+
+/*
+ * Applies every matching policy to every m-section, in order.
+ */
+void sdp_apply_policies(GstSDPMessage* sdp, const std::vector<SdpMediaPolicy>& policies);
+
+#endif
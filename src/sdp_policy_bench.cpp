@@ -0,0 +1,238 @@
+/*
+ * Golden-file check and microbenchmark for the SDP policy engine, on
+ * synthetic offers laid out the way Chrome, Firefox and Safari write them.
+ *
+ * sdp-policy-bench [--update] [DIR [ROUNDS]]
+ *
+ * Every <browser>.offer.sdp in DIR (tests/sdp by default) is rewritten with
+ * the policies below and compared line by line with <browser>.expected.sdp,
+ * itself parsed and serialized by GstSDP first so only content can differ;
+ * exits 1 on the first difference. --update writes the rewrites as the new
+ * expected files instead. With ROUNDS > 0 (10000 by default) it then times
+ * the rewrite the way send_sdp_to_peer does it, copy, policies and
+ * serialization, against the line-vector setMediaBitrate it replaced.
+ */
+
+#include "sdp_policy.h"
+
+#include <gst/gst.h>
+#include <gst/sdp/sdp.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static const char *const browsers[] = { "chrome", "firefox", "safari" };
+
+/* What a simulcast receiver asks for, plus stripping and reordering */
+static std::vector<SdpMediaPolicy>
+golden_policies()
+{
+    std::vector<SdpMediaPolicy> policies(2);
+    policies[0].media = "video";
+    policies[0].bitrate_kbps = 500;
+    policies[0].tias = true;
+    policies[0].codec_order = { "VP8" };
+    policies[0].strip_codecs = { "H264" };
+    policies[0].extmaps = { "http://www.webrtc.org/experiments/rtp-hdrext/abs-capture-time" };
+    policies[0].rtcp_fb = { "nack", "nack pli", "transport-cc" };
+    policies[0].recv_rids = { "h", "m", "l" };
+    policies[1].media = "audio";
+    policies[1].bitrate_kbps = 64;
+    policies[1].codec_order = { "opus" };
+    policies[1].strip_codecs = { "G722" };
+    return policies;
+}
+
+/* The line-vector rewrite main.cpp used before the policy engine */
+static std::string
+set_media_bitrate(const std::string& sdp, const std::string& media, int bitrate)
+{
+    std::istringstream ss(sdp);
+    std::vector<std::string> lines;
+    std::string buffer;
+    while (std::getline(ss, buffer))
+        lines.push_back(buffer);
+
+    auto it = std::find_if(lines.begin(), lines.end(),
+        [&media](const std::string& v) { return v.find("m=" + media) == 0; });
+    if (it == lines.end())
+        return sdp;
+    ++it;
+    it = std::find_if(it, lines.end(),
+        [](const std::string& v) { return v.find("i=") != 0 && v.find("c=") != 0; });
+
+    const auto b_line = "b=AS:" + std::to_string(bitrate);
+    if (it != lines.end() && it->find("b") == 0)
+        *it = b_line;
+    else
+        lines.insert(it, b_line);
+
+    std::string result;
+    for (auto& v : lines) {
+        if (!v.empty()) {
+            result += v;
+            result += '\n';
+        }
+    }
+    return result;
+}
+
+static std::string
+without_cr(const gchar * text)
+{
+    std::string out;
+    for (const gchar *p = text; *p; ++p) {
+        if (*p != '\r')
+            out += *p;
+    }
+    return out;
+}
+
+static GstSDPMessage *
+load_sdp(const std::string& path)
+{
+    gchar *text = NULL;
+    gsize length = 0;
+    GError *error = NULL;
+    if (!g_file_get_contents(path.c_str(), &text, &length, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_clear_error(&error);
+        return NULL;
+    }
+
+    GstSDPMessage *sdp;
+    gst_sdp_message_new(&sdp);
+    if (gst_sdp_message_parse_buffer((const guint8 *) text, length, sdp) != GST_SDP_OK) {
+        fprintf(stderr, "%s: not SDP\n", path.c_str());
+        gst_sdp_message_free(sdp);
+        sdp = NULL;
+    }
+    g_free(text);
+    return sdp;
+}
+
+static std::string
+rewrite(const GstSDPMessage * offer, const std::vector<SdpMediaPolicy>& policies)
+{
+    GstSDPMessage *copy;
+    gst_sdp_message_copy(offer, &copy);
+    sdp_apply_policies(copy, policies);
+    gchar *text = gst_sdp_message_as_text(copy);
+    std::string out = text;
+    g_free(text);
+    gst_sdp_message_free(copy);
+    return out;
+}
+
+static bool
+update_golden(const char *browser, const GstSDPMessage * offer, const std::string& path)
+{
+    const std::string text = rewrite(offer, golden_policies());
+    GError *error = NULL;
+    if (!g_file_set_contents(path.c_str(), text.c_str(), text.size(), &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_clear_error(&error);
+        return false;
+    }
+    printf("%-8s wrote %s\n", browser, path.c_str());
+    return true;
+}
+
+static bool
+check_golden(const char *browser, const GstSDPMessage * offer, const std::string& path)
+{
+    GstSDPMessage *expected = load_sdp(path);
+    if (!expected)
+        return false;
+    gchar *expected_text = gst_sdp_message_as_text(expected);
+    gst_sdp_message_free(expected);
+
+    std::istringstream got(without_cr(rewrite(offer, golden_policies()).c_str()));
+    std::istringstream want(without_cr(expected_text));
+    g_free(expected_text);
+
+    std::string got_line, want_line;
+    for (int line = 1;; ++line) {
+        const bool more_got = (bool) std::getline(got, got_line);
+        const bool more_want = (bool) std::getline(want, want_line);
+        if (!more_got && !more_want)
+            break;
+        if (!more_got || !more_want || got_line != want_line) {
+            fprintf(stderr, "%s: line %d differs\n  expected: %s\n  got:      %s\n", browser,
+                line, more_want ? want_line.c_str() : "(end)",
+                more_got ? got_line.c_str() : "(end)");
+            return false;
+        }
+    }
+    printf("%-8s matches %s\n", browser, path.c_str());
+    return true;
+}
+
+static void
+bench(const char *browser, const GstSDPMessage * offer, gint rounds)
+{
+    const std::vector<SdpMediaPolicy> policies = golden_policies();
+    std::vector<SdpMediaPolicy> bitrate_only(1);
+    bitrate_only[0].media = "video";
+    bitrate_only[0].bitrate_kbps = 500;
+    gsize sink = 0;
+
+    gint64 start = g_get_monotonic_time();
+    for (gint i = 0; i < rounds; ++i) {
+        gchar *text = gst_sdp_message_as_text(offer);
+        sink += set_media_bitrate(text, "video", 500).size();
+        g_free(text);
+    }
+    const double lines_us = (g_get_monotonic_time() - start) / (double) rounds;
+
+    start = g_get_monotonic_time();
+    for (gint i = 0; i < rounds; ++i)
+        sink += rewrite(offer, bitrate_only).size();
+    const double bitrate_us = (g_get_monotonic_time() - start) / (double) rounds;
+
+    start = g_get_monotonic_time();
+    for (gint i = 0; i < rounds; ++i)
+        sink += rewrite(offer, policies).size();
+    const double full_us = (g_get_monotonic_time() - start) / (double) rounds;
+
+    printf("%-8s setMediaBitrate %6.1f us  engine, b=AS only %6.1f us  engine, all policies "
+        "%6.1f us  (%" G_GSIZE_FORMAT " bytes)\n", browser, lines_us, bitrate_us, full_us,
+        sink / (3 * rounds));
+}
+
+int
+main(int argc, char *argv[])
+{
+    gst_init(&argc, &argv);
+
+    const bool update = argc > 1 && g_str_equal(argv[1], "--update");
+    if (update) {
+        argv++;
+        argc--;
+    }
+    const std::string dir = argc > 1 ? argv[1] : "tests/sdp";
+    const gint rounds = argc > 2 ? MAX(atoi(argv[2]), 0) : 10000;
+    bool ok = true;
+
+    for (const char *browser : browsers) {
+        GstSDPMessage *offer = load_sdp(dir + "/" + browser + ".offer.sdp");
+        if (!offer) {
+            ok = false;
+            continue;
+        }
+        const std::string expected = dir + "/" + browser + ".expected.sdp";
+        if (update)
+            ok = update_golden(browser, offer, expected) && ok;
+        else
+            ok = check_golden(browser, offer, expected) && ok;
+        if (rounds > 0 && !update)
+            bench(browser, offer, rounds);
+        gst_sdp_message_free(offer);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,460 @@
+/*
+ * Counts sockets, handshakes and setup time of concurrent negotiations
+ * against a local HTTP/2 stand-in for the ntfy relay.
+ *
+ * signalling-bench [SESSIONS,... [MAX_CONNECTIONS]]
+ *
+ * Each negotiation does what send_sdp_to_peer() does: subscribe to its
+ * answer topic over SSE, wait for the open event, POST the offer and wait
+ * for the answer, which the stand-in publishes as soon as the offer is in.
+ * Every count of sessions (1, 50 and 200 by default) runs twice, with a
+ * fresh connection per request and multiplexed over shared connections.
+ * The stand-in speaks cleartext h2, so each connection costs one TCP
+ * handshake here where ntfy.sh also needs a TLS one.
+ */
+
+#include "http.h"
+#include "sse.h"
+
+#include <nghttp2/nghttp2.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct StandIn;
+
+struct Stream {
+    std::string method;
+    std::string path;
+    std::string pending;        /* event stream bytes not yet sent */
+    bool deferred = false;
+};
+
+struct Connection {
+    StandIn *server;
+    int fd;
+    int wake[2];
+    nghttp2_session *session = nullptr;
+    std::vector<std::pair<int32_t, std::string>> inbox;    /* guarded by server->mutex */
+};
+
+struct StandIn {
+    int listener = -1;
+    int port = 0;
+
+    std::mutex mutex;
+    std::map<std::string, std::vector<std::pair<Connection*, int32_t>>> subscribers;
+    std::vector<Connection*> connections;
+    bool stopping = false;
+    std::vector<std::thread> threads;
+
+    std::atomic<int> accepted{ 0 };
+    std::atomic<int> streams{ 0 };
+    std::atomic<int> open_now{ 0 };
+    std::atomic<int> open_peak{ 0 };
+};
+
+/* Runs on any connection's thread; the subscriber's own thread sends it */
+static void
+publish(StandIn * server, const std::string& topic, const std::string& event)
+{
+    std::lock_guard<std::mutex> lock(server->mutex);
+    for (auto& subscriber : server->subscribers[topic]) {
+        subscriber.first->inbox.emplace_back(subscriber.second, event);
+        if (write(subscriber.first->wake[1], "", 1) < 0)
+            perror("signalling-bench: wake");
+    }
+}
+
+static ssize_t
+on_send(nghttp2_session * session, const uint8_t * data, size_t length, int flags,
+    void *user_data)
+{
+    Connection *connection = static_cast<Connection *>(user_data);
+    size_t sent = 0;
+    while (sent < length) {
+        const ssize_t n = send(connection->fd, data + sent, length - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return NGHTTP2_ERR_CALLBACK_FAILURE;
+        sent += n;
+    }
+    return (ssize_t) length;
+}
+
+static ssize_t
+read_events(nghttp2_session * session, int32_t stream_id, uint8_t * buf, size_t length,
+    uint32_t * data_flags, nghttp2_data_source * source, void *user_data)
+{
+    Stream *stream = static_cast<Stream *>(source->ptr);
+    if (stream->pending.empty()) {
+        stream->deferred = true;
+        return NGHTTP2_ERR_DEFERRED;
+    }
+    const size_t n = std::min(length, stream->pending.size());
+    memcpy(buf, stream->pending.data(), n);
+    stream->pending.erase(0, n);
+    return (ssize_t) n;
+}
+
+static int
+on_begin_headers(nghttp2_session * session, const nghttp2_frame * frame, void *user_data)
+{
+    if (frame->hd.type == NGHTTP2_HEADERS && frame->headers.cat == NGHTTP2_HCAT_REQUEST) {
+        nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, new Stream);
+        static_cast<Connection *>(user_data)->server->streams++;
+    }
+    return 0;
+}
+
+static int
+on_header(nghttp2_session * session, const nghttp2_frame * frame, const uint8_t * name,
+    size_t namelen, const uint8_t * value, size_t valuelen, uint8_t flags, void *user_data)
+{
+    Stream *stream = static_cast<Stream *>(
+        nghttp2_session_get_stream_user_data(session, frame->hd.stream_id));
+    if (!stream)
+        return 0;
+    const std::string key((const char *) name, namelen);
+    if (key == ":method")
+        stream->method.assign((const char *) value, valuelen);
+    else if (key == ":path")
+        stream->path.assign((const char *) value, valuelen);
+    return 0;
+}
+
+/* GET /answer_N/sse subscribes, POST /offer_N answers on answer_N */
+static void
+handle_request(Connection * connection, int32_t stream_id, Stream * stream)
+{
+    StandIn *server = connection->server;
+
+    if (stream->method == "GET" && stream->path.size() > 4
+        && stream->path.compare(stream->path.size() - 4, 4, "/sse") == 0) {
+        const std::string topic = stream->path.substr(1, stream->path.size() - 5);
+        {
+            std::lock_guard<std::mutex> lock(server->mutex);
+            server->subscribers[topic].emplace_back(connection, stream_id);
+        }
+        stream->pending = "event: open\ndata: {\"event\":\"open\"}\n\n";
+
+        const nghttp2_nv headers[] = {
+            { (uint8_t *) ":status", (uint8_t *) "200", 7, 3, NGHTTP2_NV_FLAG_NONE },
+            { (uint8_t *) "content-type", (uint8_t *) "text/event-stream", 12, 17,
+                NGHTTP2_NV_FLAG_NONE },
+        };
+        nghttp2_data_provider provider;
+        provider.source.ptr = stream;
+        provider.read_callback = read_events;
+        nghttp2_submit_response(connection->session, stream_id, headers, 2, &provider);
+        return;
+    }
+
+    const nghttp2_nv headers[] = {
+        { (uint8_t *) ":status", (uint8_t *) "200", 7, 3, NGHTTP2_NV_FLAG_NONE },
+    };
+    nghttp2_submit_response(connection->session, stream_id, headers, 1, NULL);
+
+    if (stream->method == "POST" && stream->path.compare(0, 7, "/offer_") == 0) {
+        const std::string n = stream->path.substr(7);
+        publish(server, "answer_" + n, "id: a" + n
+            + "\ndata: {\"id\":\"a" + n + "\",\"event\":\"message\",\"message\":\"answer\"}\n\n");
+    }
+}
+
+static int
+on_frame_recv(nghttp2_session * session, const nghttp2_frame * frame, void *user_data)
+{
+    if ((frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA)
+        || !(frame->hd.flags & NGHTTP2_FLAG_END_STREAM))
+        return 0;
+
+    Stream *stream = static_cast<Stream *>(
+        nghttp2_session_get_stream_user_data(session, frame->hd.stream_id));
+    if (stream)
+        handle_request(static_cast<Connection *>(user_data), frame->hd.stream_id, stream);
+    return 0;
+}
+
+static void
+unsubscribe(StandIn * server, Connection * connection, int32_t stream_id)
+{
+    std::lock_guard<std::mutex> lock(server->mutex);
+    for (auto& topic : server->subscribers) {
+        auto& list = topic.second;
+        list.erase(std::remove_if(list.begin(), list.end(), [&](const std::pair<Connection*, int32_t>& s) {
+            return s.first == connection && (stream_id < 0 || s.second == stream_id);
+        }), list.end());
+    }
+}
+
+static int
+on_stream_close(nghttp2_session * session, int32_t stream_id, uint32_t error_code,
+    void *user_data)
+{
+    Connection *connection = static_cast<Connection *>(user_data);
+    delete static_cast<Stream *>(nghttp2_session_get_stream_user_data(session, stream_id));
+    nghttp2_session_set_stream_user_data(session, stream_id, NULL);
+    unsubscribe(connection->server, connection, stream_id);
+    return 0;
+}
+
+static void
+serve(Connection * connection)
+{
+    StandIn *server = connection->server;
+
+    nghttp2_session_callbacks *callbacks;
+    nghttp2_session_callbacks_new(&callbacks);
+    nghttp2_session_callbacks_set_send_callback(callbacks, on_send);
+    nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, on_begin_headers);
+    nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, on_frame_recv);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, on_stream_close);
+    nghttp2_session_server_new(&connection->session, callbacks, connection);
+    nghttp2_session_callbacks_del(callbacks);
+
+    const nghttp2_settings_entry settings[] = {
+        { NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 1000 },
+    };
+    nghttp2_submit_settings(connection->session, NGHTTP2_FLAG_NONE, settings, 1);
+
+    uint8_t buf[16384];
+    for (;;) {
+        if (nghttp2_session_send(connection->session) != 0)
+            break;
+        if (!nghttp2_session_want_read(connection->session)
+            && !nghttp2_session_want_write(connection->session))
+            break;
+
+        struct pollfd fds[2] = { { connection->fd, POLLIN, 0 }, { connection->wake[0], POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0)
+            break;
+
+        if (fds[1].revents & POLLIN) {
+            if (read(connection->wake[0], buf, sizeof(buf)) < 0)
+                break;
+            std::vector<std::pair<int32_t, std::string>> inbox;
+            {
+                std::lock_guard<std::mutex> lock(server->mutex);
+                if (server->stopping)
+                    break;
+                inbox.swap(connection->inbox);
+            }
+            for (auto& item : inbox) {
+                Stream *stream = static_cast<Stream *>(
+                    nghttp2_session_get_stream_user_data(connection->session, item.first));
+                if (!stream)
+                    continue;
+                stream->pending += item.second;
+                if (stream->deferred) {
+                    stream->deferred = false;
+                    nghttp2_session_resume_data(connection->session, item.first);
+                }
+            }
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            const ssize_t n = recv(connection->fd, buf, sizeof(buf), 0);
+            if (n <= 0 || nghttp2_session_mem_recv(connection->session, buf, n) < 0)
+                break;
+        }
+    }
+
+    unsubscribe(server, connection, -1);
+    nghttp2_session_del(connection->session);
+    connection->session = nullptr;
+    close(connection->fd);
+    server->open_now--;
+}
+
+static void
+accept_loop(StandIn * server)
+{
+    for (;;) {
+        const int fd = accept(server->listener, NULL, NULL);
+        if (fd < 0)
+            return;
+        const int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        const int open = ++server->open_now;
+        server->accepted++;
+        int peak = server->open_peak.load();
+        while (open > peak && !server->open_peak.compare_exchange_weak(peak, open)) {
+        }
+
+        Connection *connection = new Connection;
+        connection->server = server;
+        connection->fd = fd;
+        if (pipe(connection->wake) != 0) {
+            close(fd);
+            delete connection;
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(server->mutex);
+        server->connections.push_back(connection);
+        server->threads.emplace_back(serve, connection);
+    }
+}
+
+static bool
+stand_in_start(StandIn * server)
+{
+    server->listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (bind(server->listener, (struct sockaddr *) &address, sizeof(address)) != 0
+        || listen(server->listener, 1024) != 0
+        || getsockname(server->listener, (struct sockaddr *) &address, &length) != 0) {
+        perror("signalling-bench: listen");
+        return false;
+    }
+    server->port = ntohs(address.sin_port);
+    server->threads.emplace_back(accept_loop, server);
+    return true;
+}
+
+static void
+stand_in_stop(StandIn * server)
+{
+    shutdown(server->listener, SHUT_RDWR);
+    close(server->listener);
+    {
+        std::lock_guard<std::mutex> lock(server->mutex);
+        server->stopping = true;
+        for (auto connection : server->connections) {
+            if (write(connection->wake[1], "", 1) < 0)
+                perror("signalling-bench: wake");
+        }
+    }
+    /* The acceptor is first, and no thread is added once it has ended */
+    server->threads.front().join();
+    for (size_t i = 1; i < server->threads.size(); ++i)
+        server->threads[i].join();
+    for (auto connection : server->connections) {
+        close(connection->wake[0]);
+        close(connection->wake[1]);
+        delete connection;
+    }
+}
+
+/* What send_sdp_to_peer() does, returning the setup time in milliseconds */
+static double
+negotiate(int port, int index)
+{
+    const auto start = std::chrono::steady_clock::now();
+    std::promise<bool> started_promise;
+    std::promise<bool> answer_promise;
+    auto started = started_promise.get_future();
+    auto answer = answer_promise.get_future();
+
+    char url[128];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/answer_%d/sse", port, index);
+    std::thread subscriber([&, url_copy = std::string(url)] {
+        const char *headers[] = { "Accept: text/event-stream", NULL };
+        bool opened = false, answered = false;
+        SseConfig config;
+        sse_subscribe(url_copy.c_str(), headers, config, [&](const SseEvent& event) {
+            if (!opened && event.data.find("\"open\"") != std::string::npos) {
+                opened = true;
+                started_promise.set_value(true);
+            }
+            else if (event.data.find("\"message\"") != std::string::npos) {
+                answered = true;
+                answer_promise.set_value(true);
+            }
+            return !answered;
+        });
+        if (!opened)
+            started_promise.set_value(false);
+        if (!answered)
+            answer_promise.set_value(false);
+    });
+
+    double ms = -1;
+    if (started.get()) {
+        static const char offer[] = "{\"type\":\"offer\",\"sdp\":\"v=0\"}";
+        snprintf(url, sizeof(url), "http://127.0.0.1:%d/offer_%d", port, index);
+        http(HTTP_POST, url, nullptr, offer, strlen(offer));
+        if (answer.get()) {
+            ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count();
+        }
+    }
+    subscriber.join();
+    return ms;
+}
+
+static bool
+run(const char* mode, int sessions)
+{
+    StandIn server;
+    if (!stand_in_start(&server))
+        return false;
+
+    std::vector<double> times(sessions);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < sessions; ++i)
+        threads.emplace_back([&times, &server, i] { times[i] = negotiate(server.port, i); });
+    for (auto& thread : threads)
+        thread.join();
+
+    stand_in_stop(&server);
+
+    const int failed = (int) std::count(times.begin(), times.end(), -1.0);
+    std::sort(times.begin(), times.end());
+    printf("%-12s %8d %12d %10d %10d %10.1f %10.1f %7d\n", mode, sessions,
+        server.accepted.load(), server.open_peak.load(), server.streams.load(),
+        times[sessions / 2], times[std::min(sessions - 1, sessions * 95 / 100)], failed);
+    return failed == 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    std::vector<int> counts = { 1, 50, 200 };
+    if (argc > 1) {
+        counts.clear();
+        for (const char *p = argv[1]; *p;) {
+            counts.push_back(std::max(atoi(p), 1));
+            p = strchr(p, ',');
+            if (!p)
+                break;
+            ++p;
+        }
+    }
+    options.max_host_connections = argc > 2 ? atoi(argv[2]) : 0;
+    options.h2_prior_knowledge = 1;
+
+    printf("%-12s %8s %12s %10s %10s %10s %10s %7s\n", "mode", "sessions",
+        "connections", "peak open", "streams", "median ms", "p95 ms", "failed");
+
+    int status = 0;
+    for (int sessions : counts) {
+        options.fresh_connections = 1;
+        if (!run("per-request", sessions))
+            status = 1;
+        options.fresh_connections = 0;
+        if (!run("multiplexed", sessions))
+            status = 1;
+    }
+    return status;
+}
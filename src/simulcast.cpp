@@ -0,0 +1,502 @@
+/*
+ * Simulcast receive with layer switching.
+ *
+ * All layers keep arriving, so switching is a matter of asking the new
+ * layer for a keyframe and changing the selector's active pad once it
+ * starts; the decoder only ever sees one stream, and never the new layer's
+ * delta frames against the old layer's references. Layers are told apart
+ * by measured bitrate rather than by rid, which also covers senders that
+ * don't stamp it.
+ */
+
+#include "simulcast.h"
+#include "metrics.h"
+
+#include <gst/rtp/rtp.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define GST_CAT_DEFAULT simulcast_debug
+GST_DEBUG_CATEGORY_STATIC(GST_CAT_DEFAULT);
+
+enum SimulcastCodec {
+    SIMULCAST_CODEC_OTHER,      /* switched without waiting for a keyframe */
+    SIMULCAST_CODEC_VP8,
+    SIMULCAST_CODEC_VP9,
+    SIMULCAST_CODEC_H264,
+};
+
+struct SimulcastReceiver;
+
+struct SimulcastLayer {
+    SimulcastReceiver *receiver;
+    GstPad *pad;                /* webrtcbin's */
+    GstPad *selector_pad;
+    SimulcastCodec codec;
+    std::atomic<guint64> bytes{ 0 };
+    std::atomic<bool> awaiting_keyframe{ false };   /* dropping up to its first keyframe */
+
+    /* Main loop only */
+    guint64 last_bytes = 0;
+    double kbps = 0;
+};
+
+struct SimulcastReceiver {
+    std::string name;
+    SimulcastConfig config;
+    MetricsSession *metrics;
+    GstElement *selector;
+    guint timeout_id;
+
+    std::mutex mutex;           // guards the layer list and the active layer
+    std::vector<SimulcastLayer*> layers;
+    SimulcastLayer *active = nullptr;
+    int active_rank = -1;
+    int pending_rank = -1;
+    const char *pending_reason = nullptr;
+    guint skip_layers = 0;      /* load shedding restrictions */
+    guint restrict_kbps = 0;
+
+    /* Main loop only */
+    gint64 last_tick = 0;
+    gint64 last_cpu_us = 0;
+    gint64 last_switch = 0;
+    double cpu_load = 0;
+
+    /* Switched to on its next keyframe; read by the layers' streaming threads */
+    std::atomic<SimulcastLayer*> pending{ nullptr };
+
+    std::atomic<guint64> switches{ 0 };
+};
+
+static std::mutex registry_mutex;
+static std::vector<SimulcastReceiver*> receivers;
+
+static gint64
+process_cpu_time_us()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        return 0;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (gint64) ((k.QuadPart + u.QuadPart) / 10);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return (gint64) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC
+        + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#endif
+}
+
+static SimulcastCodec
+pad_codec(GstPad * pad)
+{
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    if (!caps)
+        return SIMULCAST_CODEC_OTHER;
+
+    SimulcastCodec codec = SIMULCAST_CODEC_OTHER;
+    const gchar *name = gst_structure_get_string(gst_caps_get_structure(caps, 0),
+        "encoding-name");
+    if (name && g_ascii_strcasecmp(name, "VP8") == 0)
+        codec = SIMULCAST_CODEC_VP8;
+    else if (name && g_ascii_strcasecmp(name, "VP9") == 0)
+        codec = SIMULCAST_CODEC_VP9;
+    else if (name && g_ascii_strcasecmp(name, "H264") == 0)
+        codec = SIMULCAST_CODEC_H264;
+    gst_caps_unref(caps);
+    return codec;
+}
+
+/* Whether the packet opens a frame that decodes on its own */
+static gboolean
+starts_keyframe(SimulcastCodec codec, GstBuffer * buffer)
+{
+    if (codec == SIMULCAST_CODEC_OTHER)
+        return TRUE;
+
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+        return FALSE;
+    const guint8 *p = (const guint8 *) gst_rtp_buffer_get_payload(&rtp);
+    const guint size = gst_rtp_buffer_get_payload_len(&rtp);
+
+    gboolean keyframe = FALSE;
+    switch (codec) {
+    case SIMULCAST_CODEC_VP8: {
+        /* RFC 7741: start of partition 0, then the payload header's P bit */
+        if (size < 1 || !(p[0] & 0x10) || (p[0] & 0x07) != 0)
+            break;
+        guint offset = 1;
+        if (p[0] & 0x80) {
+            if (size < 2)
+                break;
+            const guint8 x = p[1];
+            offset = 2;
+            if (x & 0x80)
+                offset += size > offset && (p[offset] & 0x80) ? 2 : 1;
+            if (x & 0x40)
+                offset++;
+            if (x & 0x30)
+                offset++;
+        }
+        keyframe = size > offset && !(p[offset] & 0x01);
+        break;
+    }
+    case SIMULCAST_CODEC_VP9:
+        /* Start of a frame (B) that is not inter-predicted (P) */
+        keyframe = size >= 1 && (p[0] & 0x08) && !(p[0] & 0x40);
+        break;
+    case SIMULCAST_CODEC_H264: {
+        /* SPS or IDR, alone, first in a STAP-A, or starting an FU-A */
+        if (size < 1)
+            break;
+        guint8 type = p[0] & 0x1f;
+        if (type == 24 && size >= 4)
+            type = p[3] & 0x1f;
+        else if (type == 28 && size >= 2)
+            type = (p[1] & 0x80) ? (p[1] & 0x1f) : 0;
+        keyframe = type == 5 || type == 7;
+        break;
+    }
+    default:
+        break;
+    }
+
+    gst_rtp_buffer_unmap(&rtp);
+    return keyframe;
+}
+
+/* From the layer's streaming thread, ahead of the selector */
+static void
+complete_switch(SimulcastLayer * layer)
+{
+    SimulcastReceiver *receiver = layer->receiver;
+
+    std::lock_guard<std::mutex> lock(receiver->mutex);
+    if (receiver->pending.load() != layer)
+        return;
+
+    GST_INFO("%s: forwarding layer %d (%.0f kbps) instead of %d: %s",
+        receiver->name.c_str(), receiver->pending_rank, layer->kbps, receiver->active_rank,
+        receiver->pending_reason);
+    g_object_set(receiver->selector, "active-pad", layer->selector_pad, NULL);
+    receiver->active = layer;
+    receiver->active_rank = receiver->pending_rank;
+    receiver->pending = nullptr;
+    receiver->switches.fetch_add(1, std::memory_order_relaxed);
+}
+
+static GstPadProbeReturn
+on_layer_data(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    auto layer = static_cast<SimulcastLayer *>(user_data);
+    const bool pending = layer->receiver->pending.load(std::memory_order_acquire) == layer;
+    const bool awaiting = layer->awaiting_keyframe.load(std::memory_order_relaxed);
+    bool keyframe = false;
+
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+        GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+        layer->bytes.fetch_add(gst_buffer_get_size(buffer), std::memory_order_relaxed);
+        keyframe = (pending || awaiting) && starts_keyframe(layer->codec, buffer);
+    }
+    else if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        layer->bytes.fetch_add(gst_buffer_list_calculate_size(list),
+            std::memory_order_relaxed);
+        const guint n = pending || awaiting ? gst_buffer_list_length(list) : 0;
+        for (guint i = 0; i < n && !keyframe; ++i)
+            keyframe = starts_keyframe(layer->codec, gst_buffer_list_get(list, i));
+    }
+
+    if (pending && keyframe)
+        complete_switch(layer);
+    if (awaiting) {
+        if (!keyframe)
+            return GST_PAD_PROBE_DROP;
+        layer->awaiting_keyframe = false;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+/* rtpsession turns this into a PLI for the layer's SSRC */
+static void
+request_keyframe(GstPad * pad)
+{
+    GstStructure *s = gst_structure_new("GstForceKeyUnit",
+        "running-time", GST_TYPE_CLOCK_TIME, GST_CLOCK_TIME_NONE,
+        "all-headers", G_TYPE_BOOLEAN, TRUE,
+        "count", G_TYPE_UINT, 0, NULL);
+    gst_pad_send_event(pad, gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM, s));
+}
+
+/*
+ * Called with the mutex held. The old layer stays active until the new one
+ * delivers a keyframe, which on_layer_data() watches for.
+ */
+static void
+switch_to(SimulcastReceiver * receiver, SimulcastLayer * layer, int rank,
+    const char *reason)
+{
+    if (receiver->pending.load() != layer)
+        GST_DEBUG("%s: waiting for a keyframe on layer %d", receiver->name.c_str(), rank);
+
+    receiver->pending_rank = rank;
+    receiver->pending_reason = reason;
+    receiver->pending.store(layer, std::memory_order_release);
+    request_keyframe(layer->pad);
+    receiver->last_switch = g_get_monotonic_time();
+}
+
+static gboolean
+simulcast_tick(gpointer user_data)
+{
+    auto receiver = static_cast<SimulcastReceiver *>(user_data);
+    const SimulcastConfig& config = receiver->config;
+
+    const gint64 now = g_get_monotonic_time();
+    const gint64 cpu_us = process_cpu_time_us();
+    const double seconds = (now - receiver->last_tick) / (double) G_USEC_PER_SEC;
+    if (seconds <= 0)
+        return G_SOURCE_CONTINUE;
+
+    receiver->cpu_load = (cpu_us - receiver->last_cpu_us)
+        / (seconds * G_USEC_PER_SEC) / g_get_num_processors();
+    receiver->last_tick = now;
+    receiver->last_cpu_us = cpu_us;
+
+    const double loss = receiver->metrics
+        ? metrics_session_get_loss_fraction(receiver->metrics) : 0;
+
+    std::lock_guard<std::mutex> lock(receiver->mutex);
+
+    /* Highest bitrate first; layers the sender paused don't count */
+    std::vector<SimulcastLayer*> flowing;
+    for (auto layer : receiver->layers) {
+        const guint64 bytes = layer->bytes.load(std::memory_order_relaxed);
+        layer->kbps = (bytes - layer->last_bytes) * 8 / seconds / 1000;
+        layer->last_bytes = bytes;
+        if (layer->kbps > 0)
+            flowing.push_back(layer);
+    }
+    if (flowing.empty())
+        return G_SOURCE_CONTINUE;
+
+    std::sort(flowing.begin(), flowing.end(),
+        [](const SimulcastLayer *a, const SimulcastLayer *b) { return a->kbps > b->kbps; });
+
+    const int n = (int) flowing.size();
+    const auto it = std::find(flowing.begin(), flowing.end(), receiver->active);
+    const int current = it != flowing.end() ? (int) (it - flowing.begin()) : -1;
+
+    /* Lowest layer that still fills the display */
+    int need = 0;
+    if (config.display_height) {
+        while (need + 1 < n && (config.full_height >> (need + 1)) >= config.display_height)
+            ++need;
+    }
+
+    int target;
+    const char *reason;
+    if (current < 0) {
+        target = need;
+        reason = "active layer stopped";
+    }
+    else if (receiver->cpu_load > config.cpu_high || loss > config.loss_high) {
+        target = std::max(need, std::min(current + 1, n - 1));
+        reason = receiver->cpu_load > config.cpu_high ? "CPU load" : "loss";
+    }
+    else if (receiver->cpu_load < config.cpu_low && loss < config.loss_high / 2) {
+        target = std::max(need, current - 1);
+        reason = "headroom";
+    }
+    else {
+        target = std::max(need, current);
+        reason = "display size";
+    }
+
+    while (config.max_kbps && target + 1 < n && flowing[target]->kbps > config.max_kbps) {
+        ++target;
+        reason = "bitrate cap";
+    }
+
+    /* Load shedding overrides the policy and the switch interval */
+    bool restricted = false;
+    if (target < std::min((int) receiver->skip_layers, n - 1)) {
+        target = std::min((int) receiver->skip_layers, n - 1);
+        restricted = true;
+    }
+    while (receiver->restrict_kbps && target + 1 < n
+        && flowing[target]->kbps > receiver->restrict_kbps) {
+        ++target;
+        restricted = true;
+    }
+    if (restricted)
+        reason = "load shedding";
+
+    /* Ranks move as bitrates wobble, so keep them current for the metrics */
+    if (current >= 0)
+        receiver->active_rank = current;
+
+    if (target == current) {
+        receiver->pending = nullptr;
+        return G_SOURCE_CONTINUE;
+    }
+
+    /* Still waiting for its keyframe; ask again, as the last PLI may be lost */
+    if (receiver->pending.load() == flowing[target]) {
+        switch_to(receiver, flowing[target], target, reason);
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (current >= 0 && !restricted && now - receiver->last_switch
+        < (gint64) config.min_switch_interval_ms * G_USEC_PER_SEC / 1000)
+        return G_SOURCE_CONTINUE;
+
+    switch_to(receiver, flowing[target], target, reason);
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+collect_simulcast_metrics(GString * out, gpointer unused)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    g_string_append(out,
+        "# HELP media_receiver_simulcast_layers Simulcast layers being received\n"
+        "# TYPE media_receiver_simulcast_layers gauge\n");
+    for (auto receiver : receivers) {
+        std::lock_guard<std::mutex> receiver_lock(receiver->mutex);
+        g_string_append_printf(out, "media_receiver_simulcast_layers{session=\"%s\"} %u\n",
+            receiver->name.c_str(), (guint) receiver->layers.size());
+    }
+
+    g_string_append(out,
+        "# HELP media_receiver_simulcast_active_layer Forwarded layer, 0 being the highest bitrate\n"
+        "# TYPE media_receiver_simulcast_active_layer gauge\n");
+    for (auto receiver : receivers) {
+        std::lock_guard<std::mutex> receiver_lock(receiver->mutex);
+        g_string_append_printf(out, "media_receiver_simulcast_active_layer{session=\"%s\"} %d\n",
+            receiver->name.c_str(), receiver->active_rank);
+    }
+
+    g_string_append(out,
+        "# HELP media_receiver_simulcast_switches_total Layer switches\n"
+        "# TYPE media_receiver_simulcast_switches_total counter\n");
+    for (auto receiver : receivers) {
+        g_string_append_printf(out,
+            "media_receiver_simulcast_switches_total{session=\"%s\"} %" G_GUINT64_FORMAT "\n",
+            receiver->name.c_str(), receiver->switches.load(std::memory_order_relaxed));
+    }
+}
+
+SimulcastReceiver*
+simulcast_receiver_new(const char* name, GstBin* pipe, const SimulcastConfig& config,
+    MetricsSession* metrics)
+{
+    static std::once_flag once;
+    std::call_once(once, [] {
+        GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "simulcast", 0, "Simulcast layer switching");
+        metrics_register_collector(collect_simulcast_metrics, NULL);
+    });
+
+    auto receiver = new SimulcastReceiver;
+    receiver->name = name;
+    receiver->config = config;
+    receiver->metrics = metrics;
+
+    /* Inactive layers must be dropped right away, not held back to stay in sync */
+    receiver->selector = gst_element_factory_make("input-selector", NULL);
+    g_object_set(receiver->selector, "sync-streams", FALSE, "cache-buffers", FALSE, NULL);
+    gst_bin_add(pipe, GST_ELEMENT(gst_object_ref(receiver->selector)));
+    gst_element_sync_state_with_parent(receiver->selector);
+
+    receiver->last_tick = g_get_monotonic_time();
+    receiver->last_cpu_us = process_cpu_time_us();
+    receiver->timeout_id = g_timeout_add_seconds(1, simulcast_tick, receiver);
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    receivers.push_back(receiver);
+    return receiver;
+}
+
+void
+simulcast_receiver_free(SimulcastReceiver* receiver)
+{
+    if (!receiver)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        receivers.erase(std::remove(receivers.begin(), receivers.end(), receiver),
+            receivers.end());
+    }
+
+    g_source_remove(receiver->timeout_id);
+    for (auto layer : receiver->layers) {
+        gst_object_unref(layer->pad);
+        gst_object_unref(layer->selector_pad);
+        delete layer;
+    }
+    gst_object_unref(receiver->selector);
+    delete receiver;
+}
+
+GstPad*
+simulcast_receiver_add_layer(SimulcastReceiver* receiver, GstPad* pad)
+{
+    auto layer = new SimulcastLayer;
+    layer->receiver = receiver;
+    layer->pad = GST_PAD(gst_object_ref(pad));
+    layer->codec = pad_codec(pad);
+    layer->awaiting_keyframe = layer->codec != SIMULCAST_CODEC_OTHER;
+    layer->selector_pad = gst_element_request_pad_simple(receiver->selector, "sink_%u");
+
+    gst_pad_add_probe(pad,
+        (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+        on_layer_data, layer, NULL);
+    if (gst_pad_link(pad, layer->selector_pad) != GST_PAD_LINK_OK)
+        GST_WARNING("%s: can't link layer %" GST_PTR_FORMAT, receiver->name.c_str(), pad);
+
+    std::lock_guard<std::mutex> lock(receiver->mutex);
+    receiver->layers.push_back(layer);
+    GST_INFO("%s: layer %u on %" GST_PTR_FORMAT, receiver->name.c_str(),
+        (guint) receiver->layers.size(), pad);
+
+    if (receiver->layers.size() > 1)
+        return NULL;
+
+    /* The first layer is forwarded until the policy has measured the others,
+     * from its first keyframe on */
+    g_object_set(receiver->selector, "active-pad", layer->selector_pad, NULL);
+    request_keyframe(layer->pad);
+    receiver->active = layer;
+    receiver->active_rank = 0;
+    return gst_element_get_static_pad(receiver->selector, "src");
+}
+
+void
+simulcast_receiver_restrict(SimulcastReceiver* receiver, guint skip_layers, guint max_kbps)
+{
+    std::lock_guard<std::mutex> lock(receiver->mutex);
+    receiver->skip_layers = skip_layers;
+    receiver->restrict_kbps = max_kbps;
+    GST_INFO("%s: skipping %u layers, cap %u kbps", receiver->name.c_str(), skip_layers,
+        max_kbps);
+}
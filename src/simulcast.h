@@ -0,0 +1,56 @@
+/*
+ * Simulcast receive: every layer arrives on its own webrtcbin src pad, one
+ * of them is forwarded to the decoder through an input-selector, and a
+ * policy picks which one from display size, CPU load, loss and bitrate.
+ */
+
+#ifndef SIMULCAST_H
+#define SIMULCAST_H
+
+#include <gst/gst.h>
+
+#define SDES_MID_URI "urn:ietf:params:rtp-hdrext:sdes:mid"
+#define SDES_RID_URI "urn:ietf:params:rtp-hdrext:sdes:rtp-stream-id"
+
+struct MetricsSession;
+
+struct SimulcastConfig {
+    guint full_height = 720;        /* height of the top layer, each lower one halves it */
+    guint display_height = 0;       /* smallest height worth decoding, 0 for full */
+    guint max_kbps = 0;             /* bitrate cap for the forwarded layer, 0 for none */
+    double cpu_high = 0.85;         /* process share of all cores to step down at */
+    double cpu_low = 0.50;          /* and to step back up below */
+    double loss_high = 0.05;        /* loss fraction to step down at */
+    guint min_switch_interval_ms = 3000;
+};
+
+struct SimulcastReceiver;
+
+/*
+ * Adds the selector to the pipeline. The metrics session, if any, provides
+ * the loss fraction.
+ */
+SimulcastReceiver* simulcast_receiver_new(const char* name, GstBin* pipe,
+    const SimulcastConfig& config, MetricsSession* metrics);
+
+/*
+ * Only once the pipeline is in NULL state.
+ */
+void simulcast_receiver_free(SimulcastReceiver* receiver);
+
+/*
+ * Links another layer's pad. Returns the selector's src pad (transfer full)
+ * for the first layer, to be linked to the decoder, and NULL afterwards.
+ */
+GstPad* simulcast_receiver_add_layer(SimulcastReceiver* receiver, GstPad* pad);
+
+/*
+ * For load shedding: skips that many of the top layers and caps the
+ * forwarded bitrate (0 for no cap) on top of the configuration. Applied on
+ * the next tick, without waiting out the switch interval; the new layer is
+ * forwarded from its next keyframe.
+ */
+void simulcast_receiver_restrict(SimulcastReceiver* receiver, guint skip_layers,
+    guint max_kbps);
+
+#endif
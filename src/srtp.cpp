@@ -0,0 +1,203 @@
+/*
+ * SRTP protection profiles.
+ *
+ * The DTLS agent behind webrtcbin's dtlsdec/dtlsenc keeps its list of
+ * use_srtp profiles to itself: there is no property to reorder it, and as
+ * the DTLS server (the browser answers a=setup:active) the receiver's list
+ * order is what picks the profile. What the elements do expose is the
+ * outcome, as the srtp-cipher and srtp-auth of the keys dtlsdec hands to
+ * srtpdec. That is reported here and held against the configured
+ * preference, so a build that can't negotiate GCM shows up in the metrics
+ * and on the console rather than as unexplained decrypt CPU.
+ */
+
+#include "srtp.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#define GST_CAT_DEFAULT srtp_debug
+GST_DEBUG_CATEGORY_STATIC(GST_CAT_DEFAULT);
+
+/* GstDtlsSrtpCipher and GstDtlsSrtpAuth values of dtlsdec's properties */
+enum {
+    DTLS_SRTP_CIPHER_AES_128_ICM = 1,
+    DTLS_SRTP_CIPHER_AES_128_GCM = 2,
+    DTLS_SRTP_CIPHER_AES_256_GCM = 3,
+};
+enum {
+    DTLS_SRTP_AUTH_HMAC_SHA1_32 = 1,
+    DTLS_SRTP_AUTH_HMAC_SHA1_80 = 2,
+};
+
+static const struct {
+    const char *name;
+    SrtpProfile profile;
+} profile_names[] = {
+    { "aes-128-gcm", SRTP_PROFILE_AES_128_GCM },
+    { "aes-256-gcm", SRTP_PROFILE_AES_256_GCM },
+    { "aes-128-cm-sha1-80", SRTP_PROFILE_AES_128_CM_SHA1_80 },
+    { "aes-128-cm-sha1-32", SRTP_PROFILE_AES_128_CM_SHA1_32 },
+};
+
+struct SrtpSession {
+    std::string name;
+    std::vector<SrtpProfile> preference;
+    std::atomic<int> profile{ SRTP_PROFILE_UNKNOWN };
+};
+
+static std::mutex registry_mutex;
+static std::vector<SrtpSession*> sessions;
+
+const char*
+srtp_profile_name(SrtpProfile profile)
+{
+    for (const auto& p : profile_names) {
+        if (p.profile == profile)
+            return p.name;
+    }
+    return "unknown";
+}
+
+gboolean
+srtp_parse_profiles(const char* text, std::vector<SrtpProfile>* profiles)
+{
+    gboolean ok = TRUE;
+
+    profiles->clear();
+    gchar **parts = g_strsplit(text, ",", -1);
+    for (gchar **part = parts; *part && ok; ++part) {
+        ok = FALSE;
+        for (const auto& p : profile_names) {
+            if (g_ascii_strcasecmp(g_strstrip(*part), p.name) == 0) {
+                profiles->push_back(p.profile);
+                ok = TRUE;
+            }
+        }
+    }
+    g_strfreev(parts);
+    return ok && !profiles->empty();
+}
+
+static SrtpProfile
+profile_from_dtls(guint cipher, guint auth)
+{
+    switch (cipher) {
+    case DTLS_SRTP_CIPHER_AES_128_GCM:
+        return SRTP_PROFILE_AES_128_GCM;
+    case DTLS_SRTP_CIPHER_AES_256_GCM:
+        return SRTP_PROFILE_AES_256_GCM;
+    case DTLS_SRTP_CIPHER_AES_128_ICM:
+        if (auth == DTLS_SRTP_AUTH_HMAC_SHA1_80)
+            return SRTP_PROFILE_AES_128_CM_SHA1_80;
+        if (auth == DTLS_SRTP_AUTH_HMAC_SHA1_32)
+            return SRTP_PROFILE_AES_128_CM_SHA1_32;
+        break;
+    }
+    return SRTP_PROFILE_UNKNOWN;
+}
+
+/* Emitted from the DTLS handshake's thread */
+static void
+on_key_received(GstElement * dtlsdec, SrtpSession * session)
+{
+    guint cipher = 0, auth = 0;
+    g_object_get(dtlsdec, "srtp-cipher", &cipher, "srtp-auth", &auth, NULL);
+
+    const SrtpProfile profile = profile_from_dtls(cipher, auth);
+    session->profile = profile;
+
+    const auto& preference = session->preference;
+    const auto it = std::find(preference.begin(), preference.end(), profile);
+    if (it == preference.begin()) {
+        gst_print("SRTP profile: %s\n", srtp_profile_name(profile));
+    }
+    else if (it != preference.end()) {
+        gst_print("SRTP profile: %s, choice %d of %d; the DTLS elements don't offer %s\n",
+            srtp_profile_name(profile), (int) (it - preference.begin()) + 1,
+            (int) preference.size(), srtp_profile_name(preference.front()));
+    }
+    else {
+        gst_printerr("SRTP profile %s (cipher %u, auth %u) is not in the preference list\n",
+            srtp_profile_name(profile), cipher, auth);
+    }
+}
+
+static void
+on_deep_element_added(GstBin * bin, GstBin * sub_bin, GstElement * element,
+    SrtpSession * session)
+{
+    GstElementFactory *factory = gst_element_get_factory(element);
+    if (!factory || !g_str_equal(GST_OBJECT_NAME(factory), "dtlsdec"))
+        return;
+
+    if (!g_object_class_find_property(G_OBJECT_GET_CLASS(element), "srtp-cipher")) {
+        GST_WARNING_OBJECT(element, "doesn't report its SRTP cipher");
+        return;
+    }
+    g_signal_connect(element, "on-key-received", G_CALLBACK(on_key_received), session);
+}
+
+static void
+collect_srtp_metrics(GString * out, gpointer unused)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    g_string_append(out,
+        "# HELP media_receiver_srtp_profile SRTP protection profile negotiated by DTLS\n"
+        "# TYPE media_receiver_srtp_profile gauge\n");
+    for (auto session : sessions) {
+        const SrtpProfile profile = (SrtpProfile) session->profile.load();
+        if (profile == SRTP_PROFILE_UNKNOWN)
+            continue;
+        g_string_append_printf(out,
+            "media_receiver_srtp_profile{session=\"%s\",profile=\"%s\"} 1\n",
+            session->name.c_str(), srtp_profile_name(profile));
+    }
+}
+
+SrtpSession*
+srtp_session_new(const char* name, const std::vector<SrtpProfile>& preference)
+{
+    static std::once_flag once;
+    std::call_once(once, [] {
+        GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "srtp", 0, "SRTP profiles");
+        metrics_register_collector(collect_srtp_metrics, NULL);
+    });
+
+    auto session = new SrtpSession;
+    session->name = name;
+    session->preference = preference;
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    sessions.push_back(session);
+    return session;
+}
+
+void
+srtp_session_free(SrtpSession* session)
+{
+    if (!session)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        sessions.erase(std::remove(sessions.begin(), sessions.end(), session), sessions.end());
+    }
+    delete session;
+}
+
+void
+srtp_session_attach(SrtpSession* session, GstBin* bin)
+{
+    g_signal_connect(bin, "deep-element-added", G_CALLBACK(on_deep_element_added), session);
+}
+
+SrtpProfile
+srtp_session_get_profile(SrtpSession* session)
+{
+    return (SrtpProfile) session->profile.load();
+}
@@ -0,0 +1,51 @@
+/*
+ * SRTP protection profiles: which one DTLS negotiated for a session, and
+ * whether it is the one we would rather have.
+ */
+
+#ifndef SRTP_H
+#define SRTP_H
+
+#include <gst/gst.h>
+
+#include <vector>
+
+enum SrtpProfile {
+    SRTP_PROFILE_UNKNOWN,
+    SRTP_PROFILE_AES_128_GCM,           /* AEAD_AES_128_GCM */
+    SRTP_PROFILE_AES_256_GCM,           /* AEAD_AES_256_GCM */
+    SRTP_PROFILE_AES_128_CM_SHA1_80,
+    SRTP_PROFILE_AES_128_CM_SHA1_32,
+};
+
+/* Best first where AES-NI makes GCM cheaper than CM plus HMAC-SHA1 */
+#define SRTP_DEFAULT_PROFILES "aes-128-gcm,aes-256-gcm,aes-128-cm-sha1-80,aes-128-cm-sha1-32"
+
+/*
+ * "aes-128-gcm", ..., or "unknown".
+ */
+const char* srtp_profile_name(SrtpProfile profile);
+
+/*
+ * Parses a comma separated list of profile names; FALSE on unknown names.
+ */
+gboolean srtp_parse_profiles(const char* text, std::vector<SrtpProfile>* profiles);
+
+struct SrtpSession;
+
+SrtpSession* srtp_session_new(const char* name, const std::vector<SrtpProfile>& preference);
+
+/*
+ * Only once the pipeline it is attached to is in NULL state.
+ */
+void srtp_session_free(SrtpSession* session);
+
+/*
+ * Watches the DTLS decoders webrtcbin creates below the bin for the
+ * profile of the keys they export. Attach before adding children.
+ */
+void srtp_session_attach(SrtpSession* session, GstBin* bin);
+
+SrtpProfile srtp_session_get_profile(SrtpSession* session);
+
+#endif
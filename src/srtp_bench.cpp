@@ -0,0 +1,262 @@
+/*
+ * Times SRTP decryption per profile, on the packets the loopback sender
+ * would put on the wire.
+ *
+ * srtp-bench [PROFILE,... [FRAMES [ROUNDS]]]
+ *
+ * The frames are encoded once with the loopback sender's VP8 settings, then
+ * every profile protects and unprotects the same packets through srtpenc
+ * and srtpdec. Only the thread CPU time spent inside srtpdec is counted, and
+ * it is reported per megabit of protected RTP. Exits 1 when a profile is
+ * unavailable or loses packets.
+ */
+
+#include <gst/gst.h>
+#include <gst/app/app.h>
+#include <gst/rtp/rtp.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+/* As in loopback.cpp, at the top simulcast layer's rate */
+#define SENDER_PACKETS \
+    "videotestsrc num-buffers=%d pattern=ball ! video/x-raw,width=1280,height=720,framerate=30/1 " \
+    "! vp8enc deadline=1 keyframe-max-dist=60 target-bitrate=1500000 " \
+    "! rtpvp8pay picture-id-mode=15-bit ! appsink name=sink sync=false"
+
+#define SRTP_PIPELINE \
+    "appsrc name=src format=time block=true caps=application/x-rtp,media=video,clock-rate=90000," \
+    "encoding-name=VP8,payload=96 ! srtpenc name=enc ! srtpdec name=dec ! fakesink name=sink"
+
+static const struct {
+    const char *name;
+    const char *cipher;         /* srtpenc/srtpdec nicks */
+    const char *auth;
+    gsize key_size;             /* master key and salt */
+} profiles[] = {
+    { "aes-128-gcm", "aes-128-gcm", "null", 16 + 12 },
+    { "aes-256-gcm", "aes-256-gcm", "null", 32 + 12 },
+    { "aes-128-cm-sha1-80", "aes-128-icm", "hmac-sha1-80", 16 + 14 },
+    { "aes-128-cm-sha1-32", "aes-128-icm", "hmac-sha1-32", 16 + 14 },
+};
+
+struct DecryptTiming {
+    gint64 start_ns = 0;
+    gint64 cpu_ns = 0;
+    guint64 bytes = 0;
+    guint packets = 0;
+};
+
+static gint64
+thread_cpu_time_ns()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return (gint64) ts.tv_sec * GST_SECOND + ts.tv_nsec;
+}
+
+static std::vector<GstBuffer*>
+encode_packets(gint frames)
+{
+    std::vector<GstBuffer*> packets;
+    GError *error = NULL;
+
+    gchar *description = g_strdup_printf(SENDER_PACKETS, frames);
+    GstElement *pipe = gst_parse_launch(description, &error);
+    g_free(description);
+    if (!pipe) {
+        fprintf(stderr, "Can't build the sender: %s\n", error->message);
+        g_clear_error(&error);
+        return packets;
+    }
+
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipe), "sink");
+    gst_element_set_state(pipe, GST_STATE_PLAYING);
+    while (GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(sink))) {
+        packets.push_back(gst_buffer_ref(gst_sample_get_buffer(sample)));
+        gst_sample_unref(sample);
+    }
+    gst_element_set_state(pipe, GST_STATE_NULL);
+    gst_object_unref(sink);
+    gst_object_unref(pipe);
+    return packets;
+}
+
+/* Encrypted packets enter srtpdec and decrypted ones leave on the same thread */
+static GstPadProbeReturn
+on_decrypt_in(GstPad * pad, GstPadProbeInfo * info, DecryptTiming * timing)
+{
+    timing->bytes += gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+    timing->start_ns = thread_cpu_time_ns();
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+on_decrypt_out(GstPad * pad, GstPadProbeInfo * info, DecryptTiming * timing)
+{
+    timing->cpu_ns += thread_cpu_time_ns() - timing->start_ns;
+    timing->packets++;
+    return GST_PAD_PROBE_OK;
+}
+
+static GstCaps *
+on_request_key(GstElement * dec, guint ssrc, GstCaps * caps)
+{
+    return gst_caps_ref(caps);
+}
+
+static void
+add_probe(GstElement * element, const char *pad_name, GstPadProbeCallback callback,
+    DecryptTiming * timing)
+{
+    GstPad *pad = gst_element_get_static_pad(element, pad_name);
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, callback, timing, NULL);
+    gst_object_unref(pad);
+}
+
+static gboolean
+run_profile(guint index, const std::vector<GstBuffer*>& packets, gint rounds,
+    DecryptTiming * timing)
+{
+    GError *error = NULL;
+    GstElement *pipe = gst_parse_launch(SRTP_PIPELINE, &error);
+    if (!pipe) {
+        fprintf(stderr, "Can't build the SRTP pipeline: %s\n", error->message);
+        g_clear_error(&error);
+        return FALSE;
+    }
+
+    GstElement *src = gst_bin_get_by_name(GST_BIN(pipe), "src");
+    GstElement *enc = gst_bin_get_by_name(GST_BIN(pipe), "enc");
+    GstElement *dec = gst_bin_get_by_name(GST_BIN(pipe), "dec");
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipe), "sink");
+
+    GstBuffer *key = gst_buffer_new_allocate(NULL, profiles[index].key_size, NULL);
+    GstMapInfo map;
+    gst_buffer_map(key, &map, GST_MAP_WRITE);
+    for (gsize i = 0; i < map.size; ++i)
+        map.data[i] = (guint8) g_random_int();
+    gst_buffer_unmap(key, &map);
+
+    g_object_set(enc, "key", key, NULL);
+    gst_util_set_object_arg(G_OBJECT(enc), "rtp-cipher", profiles[index].cipher);
+    gst_util_set_object_arg(G_OBJECT(enc), "rtp-auth", profiles[index].auth);
+    gst_util_set_object_arg(G_OBJECT(enc), "rtcp-cipher", profiles[index].cipher);
+    gst_util_set_object_arg(G_OBJECT(enc), "rtcp-auth", profiles[index].auth);
+    g_object_set(sink, "sync", FALSE, NULL);
+
+    GstCaps *key_caps = gst_caps_new_simple("application/x-srtp",
+        "srtp-key", GST_TYPE_BUFFER, key,
+        "srtp-cipher", G_TYPE_STRING, profiles[index].cipher,
+        "srtp-auth", G_TYPE_STRING, profiles[index].auth,
+        "srtcp-cipher", G_TYPE_STRING, profiles[index].cipher,
+        "srtcp-auth", G_TYPE_STRING, profiles[index].auth, NULL);
+    g_signal_connect(dec, "request-key", G_CALLBACK(on_request_key), key_caps);
+    gst_buffer_unref(key);
+
+    add_probe(dec, "rtp_sink", (GstPadProbeCallback) on_decrypt_in, timing);
+    add_probe(dec, "rtp_src", (GstPadProbeCallback) on_decrypt_out, timing);
+
+    gst_element_set_state(pipe, GST_STATE_PLAYING);
+
+    /* Fresh sequence numbers each round, or libsrtp refuses them as replays */
+    guint16 seq = 0;
+    for (gint round = 0; round < rounds; ++round) {
+        for (auto packet : packets) {
+            GstBuffer *copy = gst_buffer_copy_deep(packet);
+            GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+            if (gst_rtp_buffer_map(copy, GST_MAP_WRITE, &rtp)) {
+                gst_rtp_buffer_set_seq(&rtp, seq++);
+                gst_rtp_buffer_unmap(&rtp);
+            }
+            gst_app_src_push_buffer(GST_APP_SRC(src), copy);
+        }
+    }
+    gst_app_src_end_of_stream(GST_APP_SRC(src));
+
+    GstBus *bus = gst_element_get_bus(pipe);
+    GstMessage *msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE,
+        (GstMessageType) (GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+    const gboolean ok = GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS;
+    if (!ok) {
+        gst_message_parse_error(msg, &error, NULL);
+        fprintf(stderr, "%s: %s\n", profiles[index].name, error->message);
+        g_clear_error(&error);
+    }
+    gst_message_unref(msg);
+    gst_object_unref(bus);
+
+    gst_element_set_state(pipe, GST_STATE_NULL);
+    gst_caps_unref(key_caps);
+    gst_object_unref(src);
+    gst_object_unref(enc);
+    gst_object_unref(dec);
+    gst_object_unref(sink);
+    gst_object_unref(pipe);
+    return ok;
+}
+
+int
+main(int argc, char *argv[])
+{
+    gst_init(&argc, &argv);
+
+    std::vector<guint> selected;
+    if (argc > 1) {
+        gchar **names = g_strsplit(argv[1], ",", -1);
+        for (gchar **name = names; *name; ++name) {
+            guint i = 0;
+            while (i < G_N_ELEMENTS(profiles) && g_strcmp0(*name, profiles[i].name) != 0)
+                ++i;
+            if (i == G_N_ELEMENTS(profiles)) {
+                fprintf(stderr, "Unknown profile '%s'\n", *name);
+                return 2;
+            }
+            selected.push_back(i);
+        }
+        g_strfreev(names);
+    }
+    else {
+        for (guint i = 0; i < G_N_ELEMENTS(profiles); ++i)
+            selected.push_back(i);
+    }
+    const gint frames = argc > 2 ? MAX(atoi(argv[2]), 1) : 300;
+    const gint rounds = argc > 3 ? MAX(atoi(argv[3]), 1) : 20;
+
+    std::vector<GstBuffer*> packets = encode_packets(frames);
+    if (packets.empty())
+        return 1;
+
+    guint64 bytes = 0;
+    for (auto packet : packets)
+        bytes += gst_buffer_get_size(packet);
+    printf("%zu packets, %.1f kB per round from %d frames, %d rounds\n",
+        packets.size(), bytes / 1000.0, frames, rounds);
+
+    int status = 0;
+    for (auto index : selected) {
+        DecryptTiming timing;
+        if (!run_profile(index, packets, rounds, &timing)) {
+            status = 1;
+            continue;
+        }
+
+        const guint expected = (guint) packets.size() * rounds;
+        const double mbit = timing.bytes * 8 / 1e6;
+        const double us_per_mbit = mbit > 0 ? timing.cpu_ns / 1e3 / mbit : 0.0;
+        printf("%-20s %8.1f us CPU per Mbit  %8.0f Mbps per core  %u/%u packets\n",
+            profiles[index].name, us_per_mbit, us_per_mbit > 0 ? 1e6 / us_per_mbit : 0.0,
+            timing.packets, expected);
+        if (timing.packets != expected)
+            status = 1;
+    }
+
+    for (auto packet : packets)
+        gst_buffer_unref(packet);
+    return status;
+}
@@ -0,0 +1,232 @@
+/*
+ * Server-sent event subscriptions that survive dropped connections.
+ *
+ * Each connection is parsed from scratch, so an event cut off by the drop
+ * is never dispatched; the server resends it on the resumed stream, which
+ * asks for everything after the last id seen (Last-Event-ID for servers
+ * that follow the spec, since= for ntfy). Ids already delivered are
+ * filtered out, since a timestamp resume can overlap.
+ */
+
+#include "sse.h"
+#include "http.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+
+void
+SseParser::feed(const char* data, size_t size, const std::function<void(const SseEvent&)>& dispatch)
+{
+    for (size_t i = 0; i < size; ++i) {
+        const char c = data[i];
+        if (skip_lf_) {
+            skip_lf_ = false;
+            if (c == '\n')
+                continue;
+        }
+        if (c == '\r' || c == '\n') {
+            skip_lf_ = c == '\r';
+            line(buffer_, dispatch);
+            buffer_.clear();
+        }
+        else {
+            buffer_ += c;
+        }
+    }
+}
+
+void
+SseParser::reset()
+{
+    buffer_.clear();
+    skip_lf_ = false;
+    event_.clear();
+    data_.clear();
+    have_data_ = false;
+    event_id_.clear();
+    have_event_id_ = false;
+    id_buffer_ = last_id_;
+}
+
+void
+SseParser::line(const std::string& text, const std::function<void(const SseEvent&)>& dispatch)
+{
+    if (text.empty()) {
+        /* An id only counts once its event is complete */
+        last_id_ = id_buffer_;
+        if (have_data_) {
+            SseEvent event;
+            event.id = have_event_id_ ? event_id_ : std::string();
+            event.event = event_.empty() ? "message" : event_;
+            event.data = data_.substr(0, data_.size() - 1);
+            dispatch(event);
+        }
+        event_.clear();
+        data_.clear();
+        have_data_ = false;
+        event_id_.clear();
+        have_event_id_ = false;
+        return;
+    }
+    if (text[0] == ':')
+        return;
+
+    const size_t colon = text.find(':');
+    const std::string name = text.substr(0, colon);
+    std::string value;
+    if (colon != std::string::npos) {
+        value = text.substr(colon + 1);
+        if (!value.empty() && value[0] == ' ')
+            value.erase(0, 1);
+    }
+
+    if (name == "event") {
+        event_ = value;
+    }
+    else if (name == "data") {
+        data_ += value;
+        data_ += '\n';
+        have_data_ = true;
+    }
+    else if (name == "id") {
+        if (value.find('\0') == std::string::npos) {
+            id_buffer_ = value;
+            event_id_ = value;
+            have_event_id_ = !value.empty();
+        }
+    }
+    else if (name == "retry") {
+        if (!value.empty() && value.find_first_not_of("0123456789") == std::string::npos)
+            retry_ms_ = strtol(value.c_str(), NULL, 10);
+    }
+}
+
+static const char*
+verify_event_stream(CURL* curl)
+{
+    static const char expected_content_type[] = "text/event-stream";
+
+    const char* content_type;
+    curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type);
+    if (!content_type) content_type = "";
+
+    if (!strncmp(content_type, expected_content_type, strlen(expected_content_type)))
+        return 0;
+
+    return "Invalid content_type, should be 'text/event-stream'.";
+}
+
+static std::string
+escape_query(const std::string& text)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    std::string escaped;
+
+    for (unsigned char c : text) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+            escaped += (char) c;
+        }
+        else {
+            escaped += '%';
+            escaped += hex[c >> 4];
+            escaped += hex[c & 0xf];
+        }
+    }
+    return escaped;
+}
+
+bool
+sse_subscribe(const char* url, const char** headers, const SseConfig& config,
+    SseEventFunc on_event)
+{
+    using namespace std::chrono;
+
+    const long long started = duration_cast<seconds>(system_clock::now().time_since_epoch()).count();
+    std::mt19937 random(std::random_device{}());
+    std::set<std::string> seen;
+    SseParser parser;
+    int failures = 0;
+    bool stop = false;
+
+    for (int attempt = 0;; ++attempt) {
+        std::string target = url;
+        if (attempt > 0 && config.since_param) {
+            target += strchr(url, '?') ? '&' : '?';
+            target += config.since_param;
+            target += '=';
+            target += parser.last_id().empty() ? std::to_string(started)
+                : escape_query(parser.last_id());
+        }
+
+        std::vector<const char*> request_headers;
+        while (headers && *headers)
+            request_headers.push_back(*headers++);
+        const std::string last_event_id = "Last-Event-ID: " + parser.last_id();
+        if (!parser.last_id().empty())
+            request_headers.push_back(last_event_id.c_str());
+        request_headers.push_back(NULL);
+
+        /* Only new ids count as progress: ntfy opens every stream with an
+         * id-less event, which says nothing about whether we are stuck */
+        bool progressed = false;
+        auto dispatch = [&](const SseEvent& event) {
+            if (stop)
+                return;
+            if (!event.id.empty()) {
+                if (!seen.insert(event.id).second)
+                    return;
+                progressed = true;
+            }
+            if (!on_event(event))
+                stop = true;
+        };
+        auto on_data = [&](char* ptr, size_t size, size_t nmemb) -> size_t {
+            parser.feed(ptr, size * nmemb, dispatch);
+            return size * nmemb;
+        };
+        auto progress_callback = [&stop](curl_off_t, curl_off_t, curl_off_t, curl_off_t) -> size_t {
+            return stop;
+        };
+
+        parser.reset();
+        const auto connected = steady_clock::now();
+        http(HTTP_GET, target.c_str(), request_headers.data(), 0, 0, on_data,
+            verify_event_stream, progress_callback, 0);
+        if (stop)
+            return true;
+
+        /* A stream that stayed up a while merely ended; reconnect at once */
+        if (progressed || steady_clock::now() - connected >= config.max_delay)
+            failures = 0;
+        else if (++failures > config.max_failures)
+            return false;
+
+        milliseconds delay{ 0 };
+        /* The server's retry: is untrusted; capped before it is doubled */
+        const milliseconds base = parser.retry_ms() >= 0
+            ? milliseconds(std::min<long long>(parser.retry_ms(), config.max_delay.count()))
+            : config.initial_delay;
+        if (failures == 0) {
+            if (parser.retry_ms() >= 0)
+                delay = base;
+        }
+        else {
+            delay = std::min(base * (1 << std::min(failures - 1, 16)), config.max_delay);
+            /* Jitter over the upper half, so a fleet doesn't reconnect in step */
+            std::uniform_int_distribution<long long> jitter(delay.count() / 2, delay.count());
+            delay = milliseconds(jitter(random));
+        }
+
+        fprintf(stderr, "SSE stream ended, resuming after '%s' in %lld ms\n",
+            parser.last_id().c_str(), (long long) delay.count());
+        std::this_thread::sleep_for(delay);
+    }
+}
@@ -0,0 +1,73 @@
+/*
+ * Server-sent event subscriptions that survive dropped connections.
+ */
+
+#ifndef SSE_H
+#define SSE_H
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+struct SseEvent {
+    std::string id;             /* empty unless the event carried its own id */
+    std::string event;          /* "message" unless the server named it */
+    std::string data;
+};
+
+struct SseConfig {
+    /* Backoff after a failed attempt, doubled per failure up to max_delay.
+     * A retry: field from the server replaces initial_delay, capped at
+     * max_delay. */
+    std::chrono::milliseconds initial_delay{ 100 };
+    std::chrono::milliseconds max_delay{ 5000 };
+    int max_failures = 8;       /* attempts in a row without an event */
+    /* Query parameter taking the last event id, or the subscription's start
+     * in unix seconds before any id was seen (ntfy's since=); NULL for none */
+    const char *since_param = "since";
+};
+
+/*
+ * Called once per event id, however often a resumed stream repeats it.
+ * Events without an id are passed on every time. Return false to stop.
+ */
+typedef std::function<bool(const SseEvent&)> SseEventFunc;
+
+/*
+ * Splits a byte stream into events. Partial events at the end of a
+ * connection are dropped, as the spec asks.
+ */
+class SseParser {
+public:
+    void feed(const char* data, size_t size, const std::function<void(const SseEvent&)>& dispatch);
+    void reset();
+
+    const std::string& last_id() const { return last_id_; }
+    long retry_ms() const { return retry_ms_; }    /* -1 until the server sets it */
+
+private:
+    void line(const std::string& text, const std::function<void(const SseEvent&)>& dispatch);
+
+    std::string buffer_;
+    bool skip_lf_ = false;
+    std::string event_;
+    std::string data_;
+    bool have_data_ = false;
+    std::string event_id_;
+    bool have_event_id_ = false;
+    std::string id_buffer_;
+    std::string last_id_;
+    long retry_ms_ = -1;
+};
+
+/*
+ * Reads the stream at url until on_event returns false, reconnecting with
+ * Last-Event-ID and the since parameter whenever the connection ends.
+ * The first reconnect after a stream that delivered events is immediate
+ * (or after the server's retry: time), later ones back off with jitter.
+ * Blocks; returns false when it gave up.
+ */
+bool sse_subscribe(const char* url, const char** headers, const SseConfig& config,
+    SseEventFunc on_event);
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * Runs an SSE subscription against a local stand-in for ntfy that cuts
+ * every connection after a random number of bytes, and checks that each
+ * published message arrives exactly once and in order.
+ *
+ * sse-chaos [MESSAGES [TRIALS]]
+ *
+ * The server speaks ntfy's dialect: an id-less open event first, then
+ * "id:" plus JSON data per message, resumable with since=<id>,
+ * since=<unix time> or Last-Event-ID. Every other trial it also sends a
+ * retry: field. Exits 1 when a message is lost, repeated or reordered, or
+ * when the subscription gives up.
+ */
+
+#include "sse.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Message {
+    std::string id;
+    long long time;
+    std::string data;
+};
+
+struct StandIn {
+    int listener = -1;
+    int port = 0;
+    bool send_retry = false;
+    std::mt19937 random;
+
+    std::mutex mutex;
+    std::condition_variable published;
+    std::vector<Message> messages;
+    bool subscribed = false;
+    bool finished = false;
+    std::atomic<int> connections{ 0 };
+    std::vector<std::thread> threads;
+};
+
+static long long
+unix_seconds()
+{
+    return (long long) time(NULL);
+}
+
+static std::string
+query_value(const std::string& target, const char* name)
+{
+    const std::string key = std::string(name) + "=";
+    size_t pos = target.find('?');
+    while (pos != std::string::npos) {
+        ++pos;
+        if (target.compare(pos, key.size(), key) == 0) {
+            const size_t end = target.find('&', pos);
+            return target.substr(pos + key.size(), end == std::string::npos ? end : end - pos - key.size());
+        }
+        pos = target.find('&', pos);
+    }
+    return std::string();
+}
+
+/* Index of the first message to replay for a since= value or Last-Event-ID */
+static size_t
+resume_index(StandIn * server, const std::string& since)
+{
+    if (since.empty())
+        return server->messages.size();
+
+    for (size_t i = 0; i < server->messages.size(); ++i) {
+        if (server->messages[i].id == since)
+            return i + 1;
+    }
+    if (since.find_first_not_of("0123456789") == std::string::npos) {
+        const long long when = atoll(since.c_str());
+        for (size_t i = 0; i < server->messages.size(); ++i) {
+            if (server->messages[i].time >= when)
+                return i;
+        }
+        return server->messages.size();
+    }
+    return 0;
+}
+
+/* Writes until the connection's byte budget runs out; false once cut */
+static bool
+write_limited(int fd, const std::string& text, long *budget)
+{
+    const size_t n = std::min<size_t>(text.size(), (size_t) std::max(*budget, 0L));
+    if (n > 0 && send(fd, text.data(), n, MSG_NOSIGNAL) < 0)
+        return false;
+    *budget -= (long) n;
+    return n == text.size();
+}
+
+static void
+serve(StandIn * server, int fd, long budget, bool reset)
+{
+    std::string request;
+    char chunk[1024];
+    while (request.find("\r\n\r\n") == std::string::npos) {
+        const ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+            close(fd);
+            return;
+        }
+        request.append(chunk, n);
+    }
+
+    const size_t space = request.find(' ');
+    const std::string target = request.substr(space + 1, request.find(' ', space + 1) - space - 1);
+    std::string since = query_value(target, "since");
+    const size_t header = request.find("\r\nLast-Event-ID: ");
+    if (header != std::string::npos) {
+        const size_t start = header + strlen("\r\nLast-Event-ID: ");
+        since = request.substr(start, request.find("\r\n", start) - start);
+    }
+
+    std::string head = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\nConnection: close\r\n\r\n";
+    if (server->send_retry)
+        head += "retry: 20\n\n";
+    head += "event: open\ndata: {\"id\":\"open\",\"event\":\"open\"}\n\n";
+
+    std::unique_lock<std::mutex> lock(server->mutex);
+    size_t next = resume_index(server, since);
+    server->subscribed = true;
+    server->published.notify_all();
+    bool alive = write_limited(fd, head, &budget);
+    while (alive) {
+        while (alive && next < server->messages.size()) {
+            const Message& m = server->messages[next++];
+            alive = write_limited(fd, "id: " + m.id + "\ndata: " + m.data + "\n\n", &budget);
+        }
+        if (!alive || server->finished)
+            break;
+        server->published.wait_for(lock, std::chrono::milliseconds(100));
+    }
+    lock.unlock();
+
+    /* A reset rather than a clean close now and then */
+    if (budget == 0 && reset) {
+        struct linger hard = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &hard, sizeof(hard));
+    }
+    close(fd);
+}
+
+static void
+accept_loop(StandIn * server)
+{
+    std::uniform_int_distribution<long> budget(1, 700);
+
+    for (;;) {
+        const int fd = accept(server->listener, NULL, NULL);
+        if (fd < 0)
+            return;
+        server->connections++;
+        std::lock_guard<std::mutex> lock(server->mutex);
+        server->threads.emplace_back(serve, server, fd, budget(server->random),
+            server->random() % 2 == 0);
+    }
+}
+
+static bool
+run_trial(int trial, int count)
+{
+    StandIn server;
+    server.send_retry = trial % 2 == 1;
+    server.random.seed(trial + 1);
+
+    server.listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (bind(server.listener, (struct sockaddr *) &address, sizeof(address)) != 0
+        || listen(server.listener, 16) != 0
+        || getsockname(server.listener, (struct sockaddr *) &address, &length) != 0) {
+        perror("sse-chaos: listen");
+        return false;
+    }
+    server.port = ntohs(address.sin_port);
+    std::thread acceptor(accept_loop, &server);
+
+    /* As with ntfy, only what is published after subscribing is sent */
+    std::thread publisher([&server, count] {
+        {
+            std::unique_lock<std::mutex> lock(server.mutex);
+            server.published.wait(lock, [&server] { return server.subscribed; });
+        }
+        for (int i = 0; i < count; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(15));
+            char id[16];
+            snprintf(id, sizeof(id), "m%04d", i);
+            std::lock_guard<std::mutex> lock(server.mutex);
+            server.messages.push_back({ id, unix_seconds(),
+                std::string("{\"id\":\"") + id + "\",\"event\":\"message\",\"message\":\"" + id + "\"}" });
+            server.published.notify_all();
+        }
+    });
+
+    char url[128];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/topic/sse", server.port);
+    const char *headers[] = { "Accept: text/event-stream", NULL };
+    SseConfig config;
+    config.initial_delay = std::chrono::milliseconds(10);
+    config.max_delay = std::chrono::milliseconds(200);
+    config.max_failures = 50;
+
+    std::vector<std::string> received;
+    const bool ok = sse_subscribe(url, headers, config, [&](const SseEvent& event) {
+        if (event.id.empty())
+            return true;
+        received.push_back(event.id);
+        return (int) received.size() < count;
+    });
+
+    publisher.join();
+    {
+        std::lock_guard<std::mutex> lock(server.mutex);
+        server.finished = true;
+        server.published.notify_all();
+    }
+    shutdown(server.listener, SHUT_RDWR);
+    close(server.listener);
+    acceptor.join();
+    for (auto& thread : server.threads)
+        thread.join();
+
+    bool exact = ok && (int) received.size() == count;
+    for (int i = 0; exact && i < count; ++i)
+        exact = received[i] == server.messages[i].id;
+
+    printf("trial %d: %zu/%d messages over %d connections%s: %s\n", trial, received.size(),
+        count, server.connections.load(), server.send_retry ? " with retry" : "",
+        exact ? "ok" : ok ? "lost, repeated or reordered" : "gave up");
+    return exact;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const int count = argc > 1 ? std::max(atoi(argv[1]), 1) : 40;
+    const int trials = argc > 2 ? std::max(atoi(argv[2]), 1) : 10;
+
+    int status = 0;
+    for (int trial = 0; trial < trials; ++trial) {
+        if (!run_trial(trial, count))
+            status = 1;
+    }
+    return status;
+}
@@ -0,0 +1,342 @@
+/*
+ * Cold start.
+ *
+ * gst_init() reads the registry cache and then, to validate it, stats
+ * every plugin file on the plugin path. The cache is only stale when a
+ * plugin directory changed, and package managers replace files by renaming,
+ * which moves the directory's mtime. So a stamp of the directories' mtimes
+ * is kept next to the cache; when it still matches, GST_REGISTRY_UPDATE=no
+ * skips GStreamer's own scan. A missing or unreadable cache is rescanned by
+ * GStreamer regardless. The cache is per user and shared with every other
+ * GStreamer program, which may rewrite it for other plugin paths, so the
+ * stamp also holds the cache file's mtime and size.
+ *
+ * GStreamer already maps plugins lazily, on the first element made from
+ * them. The preload thread only moves that first dlopen() and plugin_init
+ * from the first negotiation to the time spent waiting for an Id.
+ */
+
+#include "startup.h"
+#include "metrics.h"
+
+#include <glib/gstdio.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define GST_CAT_DEFAULT startup_debug
+GST_DEBUG_CATEGORY_STATIC(GST_CAT_DEFAULT);
+
+struct StartupPhase {
+    std::string name;
+    double ms;
+};
+
+static std::mutex phases_mutex;
+static std::vector<StartupPhase> phases;
+static double exec_to_main_ms = -1;
+static gint64 phase_start_us;
+
+/* From the kernel's start time of the process, to a clock tick (10 ms) */
+static double
+ms_since_exec()
+{
+#ifdef __linux__
+    gchar *stat = NULL;
+    if (!g_file_get_contents("/proc/self/stat", &stat, NULL, NULL))
+        return -1;
+
+    /* starttime is the 22nd field, the 20th after the command's ')' */
+    const char *p = strrchr(stat, ')');
+    unsigned long long start_ticks = 0;
+    gboolean found = FALSE;
+    for (int field = 2; p && *p && field < 22; ++field)
+        p = strchr(p + 1, ' ');
+    if (p)
+        found = sscanf(p + 1, "%llu", &start_ticks) == 1;
+    g_free(stat);
+
+    struct timespec now;
+    if (!found || clock_gettime(CLOCK_BOOTTIME, &now) != 0)
+        return -1;
+    const double start_ms = start_ticks * 1000.0 / sysconf(_SC_CLK_TCK);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6 - start_ms;
+#else
+    return -1;
+#endif
+}
+
+static void
+collect_startup_metrics(GString * out, gpointer unused)
+{
+    std::lock_guard<std::mutex> lock(phases_mutex);
+
+    g_string_append(out,
+        "# HELP media_receiver_startup_seconds Time spent in each phase of process start\n"
+        "# TYPE media_receiver_startup_seconds gauge\n");
+    if (exec_to_main_ms >= 0) {
+        g_string_append_printf(out, "media_receiver_startup_seconds{phase=\"exec\"} %.4f\n",
+            exec_to_main_ms / 1000.0);
+    }
+    for (const auto& phase : phases) {
+        g_string_append_printf(out, "media_receiver_startup_seconds{phase=\"%s\"} %.4f\n",
+            phase.name.c_str(), phase.ms / 1000.0);
+    }
+}
+
+void
+startup_begin(void)
+{
+    exec_to_main_ms = ms_since_exec();
+    phase_start_us = g_get_monotonic_time();
+    metrics_register_collector(collect_startup_metrics, NULL);
+}
+
+void
+startup_mark(const char* phase)
+{
+    const gint64 now = g_get_monotonic_time();
+
+    std::lock_guard<std::mutex> lock(phases_mutex);
+    phases.push_back({ phase, (now - phase_start_us) / 1000.0 });
+    phase_start_us = now;
+}
+
+void
+startup_print(void)
+{
+    std::lock_guard<std::mutex> lock(phases_mutex);
+
+    double total = MAX(exec_to_main_ms, 0.0);
+    if (exec_to_main_ms >= 0)
+        gst_print("Startup: exec to main %.0f ms\n", exec_to_main_ms);
+    for (const auto& phase : phases) {
+        gst_print("Startup: %s %.1f ms\n", phase.name.c_str(), phase.ms);
+        total += phase.ms;
+    }
+    gst_print("Startup: ready after %.0f ms\n", total);
+}
+
+/* Only once gst_init() has run */
+static void
+init_debug_category(void)
+{
+    static gsize debug_initialized = 0;
+    if (g_once_init_enter(&debug_initialized)) {
+        GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "startup", 0, "Cold start");
+        g_once_init_leave(&debug_initialized, 1);
+    }
+}
+
+static gchar *
+stamp_path(void)
+{
+    const gchar *registry = g_getenv("GST_REGISTRY");
+    if (registry)
+        return g_strconcat(registry, ".media-receiver", NULL);
+    return g_build_filename(g_get_user_cache_dir(), "gstreamer-1.0",
+        "media-receiver-registry.stamp", NULL);
+}
+
+/* Where gst_init() reads and writes the cache, as gstregistry.c finds it */
+static std::string
+registry_cache_path(void)
+{
+    for (const char *var : { "GST_REGISTRY_1_0", "GST_REGISTRY" }) {
+        if (g_getenv(var))
+            return g_getenv(var);
+    }
+
+#if defined(__x86_64__)
+    const char *cpu = "x86_64";
+#elif defined(__i386__)
+    const char *cpu = "x86";
+#elif defined(__aarch64__)
+    const char *cpu = "aarch64";
+#elif defined(__arm__)
+    const char *cpu = "arm";
+#elif defined(__powerpc64__)
+    const char *cpu = "ppc64";
+#elif defined(__riscv) && __riscv_xlen == 64
+    const char *cpu = "riscv64";
+#else
+    const char *cpu = NULL;
+#endif
+    gchar *dir = g_build_filename(g_get_user_cache_dir(), "gstreamer-1.0", NULL);
+    std::string path;
+    if (cpu) {
+        gchar *name = g_strdup_printf("registry.%s.bin", cpu);
+        gchar *full = g_build_filename(dir, name, NULL);
+        path = full;
+        g_free(full);
+        g_free(name);
+    }
+    else {
+        /* The one cache there is, when the CPU name isn't known here */
+        GDir *listing = g_dir_open(dir, 0, NULL);
+        for (const gchar *name; listing && (name = g_dir_read_name(listing));) {
+            if (g_str_has_prefix(name, "registry.") && g_str_has_suffix(name, ".bin")) {
+                gchar *full = g_build_filename(dir, name, NULL);
+                path = full;
+                g_free(full);
+                break;
+            }
+        }
+        if (listing)
+            g_dir_close(listing);
+    }
+    g_free(dir);
+    return path;
+}
+
+static long long
+mtime_ns(const GStatBuf& st)
+{
+#ifdef __linux__
+    return (long long) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+    return (long long) st.st_mtime * 1000000000;
+#endif
+}
+
+/* Everything that invalidates the cache, one line each */
+static std::string
+describe_plugin_path(const std::set<std::string>& dirs)
+{
+    guint major, minor, micro, nano;
+    gst_version(&major, &minor, &micro, &nano);
+
+    gchar *head = g_strdup_printf("version %u.%u.%u.%u\nGST_PLUGIN_PATH=%s\n"
+        "GST_PLUGIN_SYSTEM_PATH=%s\n", major, minor, micro, nano,
+        g_getenv("GST_PLUGIN_PATH") ? g_getenv("GST_PLUGIN_PATH") : "",
+        g_getenv("GST_PLUGIN_SYSTEM_PATH") ? g_getenv("GST_PLUGIN_SYSTEM_PATH") : "");
+    std::string text = head;
+    g_free(head);
+
+    /* Rewritten by another program, the cache may lack plugins only ours has */
+    const std::string cache = registry_cache_path();
+    GStatBuf st;
+    if (!cache.empty() && g_stat(cache.c_str(), &st) == 0)
+        text += "cache " + std::to_string(mtime_ns(st)) + " " + std::to_string((long long) st.st_size)
+            + " " + cache + "\n";
+    else
+        text += "cache none " + cache + "\n";
+
+    for (const auto& dir : dirs) {
+        if (g_stat(dir.c_str(), &st) != 0)
+            continue;
+        text += "dir " + std::to_string(mtime_ns(st)) + " " + dir + "\n";
+    }
+    return text;
+}
+
+gboolean
+startup_registry_prepare(void)
+{
+    /* Whoever set it knows better */
+    if (g_getenv("GST_REGISTRY_UPDATE"))
+        return FALSE;
+
+    gchar *path = stamp_path();
+    gchar *stamp = NULL;
+    const gboolean have_stamp = g_file_get_contents(path, &stamp, NULL, NULL);
+    g_free(path);
+    if (!have_stamp)
+        return FALSE;
+
+    std::set<std::string> dirs;
+    gchar **lines = g_strsplit(stamp, "\n", -1);
+    for (gchar **line = lines; *line; ++line) {
+        if (g_str_has_prefix(*line, "dir ")) {
+            const char *name = strchr(*line + 4, ' ');
+            if (name)
+                dirs.insert(name + 1);
+        }
+    }
+    g_strfreev(lines);
+
+    const gboolean valid = describe_plugin_path(dirs) == stamp;
+    g_free(stamp);
+    if (valid)
+        g_setenv("GST_REGISTRY_UPDATE", "no", TRUE);
+    return valid;
+}
+
+void
+startup_registry_save(void)
+{
+    init_debug_category();
+
+    std::set<std::string> dirs;
+    for (const char *var : { "GST_PLUGIN_PATH", "GST_PLUGIN_SYSTEM_PATH" }) {
+        if (!g_getenv(var))
+            continue;
+        gchar **parts = g_strsplit(g_getenv(var), G_SEARCHPATH_SEPARATOR_S, -1);
+        for (gchar **part = parts; *part; ++part) {
+            if (**part)
+                dirs.insert(*part);
+        }
+        g_strfreev(parts);
+    }
+
+    GList *plugins = gst_registry_get_plugin_list(gst_registry_get());
+    for (GList *l = plugins; l; l = l->next) {
+        const gchar *filename = gst_plugin_get_filename(GST_PLUGIN(l->data));
+        if (filename) {
+            gchar *dir = g_path_get_dirname(filename);
+            dirs.insert(dir);
+            g_free(dir);
+        }
+    }
+    gst_plugin_list_free(plugins);
+
+    gchar *path = stamp_path();
+    gchar *parent = g_path_get_dirname(path);
+    g_mkdir_with_parents(parent, 0755);
+    const std::string text = describe_plugin_path(dirs);
+    GError *error = NULL;
+    if (!g_file_set_contents(path, text.c_str(), text.size(), &error)) {
+        GST_WARNING("can't write %s: %s", path, error->message);
+        g_clear_error(&error);
+    }
+    g_free(parent);
+    g_free(path);
+}
+
+void
+startup_preload(const char* const* factories)
+{
+    init_debug_category();
+
+    std::vector<std::string> names;
+    for (; *factories; ++factories)
+        names.push_back(*factories);
+
+    std::thread([names] {
+        const gint64 start = g_get_monotonic_time();
+        for (const auto& name : names) {
+            GstElementFactory *factory = gst_element_factory_find(name.c_str());
+            if (!factory) {
+                gst_printerr("Element '%s' not found, streams that need it will fail\n",
+                    name.c_str());
+                continue;
+            }
+            GstPluginFeature *loaded = gst_plugin_feature_load(GST_PLUGIN_FEATURE(factory));
+            if (!loaded)
+                gst_printerr("Can't load the plugin of '%s'\n", name.c_str());
+            else
+                gst_object_unref(loaded);
+            gst_object_unref(factory);
+        }
+        GST_INFO("preloaded %zu factories in %.1f ms", names.size(),
+            (g_get_monotonic_time() - start) / 1000.0);
+    }).detach();
+}
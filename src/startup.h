@@ -0,0 +1,45 @@
+/*
+ * Cold start: per-phase timing from exec to ready, a cheaply validated
+ * plugin registry cache, and plugin loading off the critical path.
+ */
+
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <gst/gst.h>
+
+/*
+ * First thing in main(); also accounts for the time since exec.
+ */
+void startup_begin(void);
+
+/*
+ * Ends the current phase under that name.
+ */
+void startup_mark(const char* phase);
+
+/*
+ * One "Startup:" line per phase and the total.
+ */
+void startup_print(void);
+
+/*
+ * Before gst_init(). When the plugin directories are unchanged since the
+ * registry cache was last validated, tells GStreamer to trust the cache
+ * instead of stat'ing every plugin file. Returns whether it did.
+ */
+gboolean startup_registry_prepare(void);
+
+/*
+ * After gst_init(), when prepare returned FALSE: records the plugin
+ * directories the fresh registry came from.
+ */
+void startup_registry_save(void);
+
+/*
+ * Loads the plugins behind these factories on a background thread, so the
+ * first pipeline doesn't wait for dlopen(), and warns about missing ones.
+ */
+void startup_preload(const char* const* factories);
+
+#endif
@@ -0,0 +1,315 @@
+/*
+ * Streaming thread placement.
+ *
+ * GstTask asks the bus for a pool when it is created; the sync handler
+ * answers with the pool of the role its element plays, and that pool starts
+ * each thread with the role's affinity and nice value before running the
+ * task. A thread gets a single core: the session's slot picks where in the
+ * role's core set its first thread lands, later ones follow round robin, so
+ * sessions spread evenly instead of all starting on the first core.
+ */
+
+#include "task_pool.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+#include <errno.h>
+
+#include <mutex>
+#include <set>
+#include <string>
+
+#define GST_CAT_DEFAULT task_pool_debug
+GST_DEBUG_CATEGORY_STATIC(GST_CAT_DEFAULT);
+
+static const char *const role_names[THREAD_ROLE_COUNT] = { "net", "dec", "out" };
+
+/* GstTaskPool subclass, one instance per session and role */
+typedef struct {
+    GstTaskPool parent;
+
+    ThreadRole role;
+    std::vector<int> *cores;    /* owned by the TaskPoolSet */
+    int nice;
+    guint slot;
+    gint threads;
+} RoleTaskPool;
+
+typedef struct {
+    GstTaskPoolClass parent_class;
+} RoleTaskPoolClass;
+
+GType role_task_pool_get_type(void);
+G_DEFINE_TYPE(RoleTaskPool, role_task_pool, GST_TYPE_TASK_POOL)
+
+struct TaskPoolSet {
+    std::string name;
+    TaskPoolConfig config;
+    guint slot;
+    RoleTaskPool *pools[THREAD_ROLE_COUNT];
+};
+
+static std::mutex slots_mutex;
+static std::set<guint> used_slots;
+
+struct PoolJob {
+    RoleTaskPool *pool;
+    int core;
+    GstTaskPoolFunction func;
+    gpointer data;
+};
+
+static void
+place_current_thread(ThreadRole role, int core, int nice)
+{
+#if defined(__linux__)
+    if (core >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core, &set);
+        const int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err)
+            GST_WARNING("can't pin %s thread to core %d: %s", role_names[role], core,
+                g_strerror(err));
+    }
+    /* Linux applies a tid's nice value to that thread alone */
+    if (nice && setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), nice) != 0)
+        GST_WARNING("can't set %s thread nice to %d: %s", role_names[role], nice,
+            g_strerror(errno));
+#elif defined(_WIN32)
+    if (core >= 0 && core < 64)
+        SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << core);
+    if (nice)
+        SetThreadPriority(GetCurrentThread(), nice < 0 ? THREAD_PRIORITY_ABOVE_NORMAL
+            : THREAD_PRIORITY_BELOW_NORMAL);
+#else
+    GST_FIXME("no thread placement on this platform");
+#endif
+}
+
+static gpointer
+run_job(gpointer user_data)
+{
+    auto job = static_cast<PoolJob *>(user_data);
+
+    place_current_thread(job->pool->role, job->core, job->pool->nice);
+    GST_DEBUG("%s thread of slot %u on core %d", role_names[job->pool->role],
+        job->pool->slot, job->core);
+
+    job->func(job->data);
+    delete job;
+    return NULL;
+}
+
+static gpointer
+role_task_pool_push(GstTaskPool * pool, GstTaskPoolFunction func, gpointer data,
+    GError ** error)
+{
+    auto self = reinterpret_cast<RoleTaskPool *>(pool);
+
+    auto job = new PoolJob{ self, -1, func, data };
+    const std::vector<int>& cores = *self->cores;
+    if (!cores.empty()) {
+        const guint n = (guint) g_atomic_int_add(&self->threads, 1);
+        job->core = cores[(self->slot + n) % cores.size()];
+    }
+
+    gchar *name = g_strdup_printf("%s%u", role_names[self->role], self->slot);
+    GThread *thread = g_thread_try_new(name, run_job, job, error);
+    g_free(name);
+    if (!thread)
+        delete job;
+    return thread;
+}
+
+static void
+role_task_pool_join(GstTaskPool * pool, gpointer id)
+{
+    g_thread_join(static_cast<GThread *>(id));
+}
+
+/* Nothing to set up: threads are created per task and joined by it */
+static void
+role_task_pool_prepare(GstTaskPool * pool, GError ** error)
+{
+}
+
+static void
+role_task_pool_cleanup(GstTaskPool * pool)
+{
+}
+
+static void
+role_task_pool_class_init(RoleTaskPoolClass * klass)
+{
+    GstTaskPoolClass *pool_class = GST_TASK_POOL_CLASS(klass);
+    pool_class->prepare = role_task_pool_prepare;
+    pool_class->cleanup = role_task_pool_cleanup;
+    pool_class->push = role_task_pool_push;
+    pool_class->join = role_task_pool_join;
+}
+
+static void
+role_task_pool_init(RoleTaskPool * pool)
+{
+}
+
+static bool
+has_ancestor(GstElement * element, const char *factory_name)
+{
+    for (GstObject *parent = GST_OBJECT_PARENT(element); parent;
+        parent = GST_OBJECT_PARENT(parent)) {
+        if (!GST_IS_ELEMENT(parent))
+            continue;
+        GstElementFactory *factory = gst_element_get_factory(GST_ELEMENT(parent));
+        if (factory && g_str_equal(GST_OBJECT_NAME(factory), factory_name))
+            return true;
+    }
+    return false;
+}
+
+/* -1 for threads left on the default pool */
+static int
+classify(GstElement * element)
+{
+    if (has_ancestor(element, "webrtcbin"))
+        return THREAD_ROLE_NETWORK;
+    if (has_ancestor(element, "decodebin"))
+        return THREAD_ROLE_DECODE;
+
+    GstElementFactory *factory = gst_element_get_factory(element);
+    if (!factory)
+        return -1;
+
+    const gchar *name = GST_OBJECT_NAME(factory);
+    /* Ahead of the decoder in recycled branches */
+    if (g_str_equal(name, "multiqueue"))
+        return THREAD_ROLE_DECODE;
+    /* The replay source and jitterbuffer stand in for webrtcbin */
+    if (g_str_equal(name, "appsrc") || g_str_equal(name, "rtpjitterbuffer"))
+        return THREAD_ROLE_NETWORK;
+    if (g_str_equal(name, "queue") || g_str_equal(name, "input-selector")
+        || GST_OBJECT_FLAG_IS_SET(element, GST_ELEMENT_FLAG_SINK))
+        return THREAD_ROLE_OUTPUT;
+    return -1;
+}
+
+static GstBusSyncReply
+on_sync_message(GstBus * bus, GstMessage * message, gpointer user_data)
+{
+    auto pools = static_cast<TaskPoolSet *>(user_data);
+
+    if (GST_MESSAGE_TYPE(message) != GST_MESSAGE_STREAM_STATUS)
+        return GST_BUS_PASS;
+
+    GstStreamStatusType type;
+    GstElement *owner;
+    gst_message_parse_stream_status(message, &type, &owner);
+    if (type != GST_STREAM_STATUS_TYPE_CREATE)
+        return GST_BUS_PASS;
+
+    const GValue *value = gst_message_get_stream_status_object(message);
+    if (!value || G_VALUE_TYPE(value) != GST_TYPE_TASK)
+        return GST_BUS_PASS;
+
+    const int role = classify(owner);
+    if (role < 0)
+        return GST_BUS_PASS;
+
+    GST_DEBUG_OBJECT(owner, "%s: task goes to the %s pool", pools->name.c_str(),
+        role_names[role]);
+    gst_task_set_pool(GST_TASK(g_value_get_object(value)),
+        GST_TASK_POOL(pools->pools[role]));
+    return GST_BUS_PASS;
+}
+
+TaskPoolSet*
+task_pools_new(const char* name, const TaskPoolConfig& config)
+{
+    static std::once_flag once;
+    std::call_once(once, [] {
+        GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "taskpool", 0, "Streaming thread placement");
+    });
+
+    auto pools = new TaskPoolSet;
+    pools->name = name;
+    pools->config = config;
+
+    {
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        guint slot = 0;
+        while (used_slots.count(slot))
+            ++slot;
+        used_slots.insert(slot);
+        pools->slot = slot;
+    }
+
+    for (int role = 0; role < THREAD_ROLE_COUNT; ++role) {
+        auto pool = static_cast<RoleTaskPool *>(g_object_new(role_task_pool_get_type(), NULL));
+        pool->role = (ThreadRole) role;
+        pool->cores = &pools->config.cores[role];
+        pool->nice = config.nice[role];
+        pool->slot = pools->slot;
+        gst_task_pool_prepare(GST_TASK_POOL(pool), NULL);
+        pools->pools[role] = pool;
+    }
+
+    return pools;
+}
+
+void
+task_pools_free(TaskPoolSet* pools)
+{
+    if (!pools)
+        return;
+
+    for (auto pool : pools->pools) {
+        gst_task_pool_cleanup(GST_TASK_POOL(pool));
+        gst_object_unref(pool);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        used_slots.erase(pools->slot);
+    }
+    delete pools;
+}
+
+void
+task_pools_attach(TaskPoolSet* pools, GstPipeline* pipeline)
+{
+    GstBus *bus = gst_pipeline_get_bus(pipeline);
+    gst_bus_set_sync_handler(bus, on_sync_message, pools, NULL);
+    gst_object_unref(bus);
+}
+
+gboolean
+task_pools_parse_cores(const char* text, std::vector<int>* cores)
+{
+    const int n_cores = (int) g_get_num_processors();
+    gboolean ok = TRUE;
+
+    cores->clear();
+    gchar **parts = g_strsplit(text, ",", -1);
+    for (gchar **part = parts; *part && ok; ++part) {
+        gchar *end;
+        const gint64 first = g_ascii_strtoll(*part, &end, 10);
+        gint64 last = first;
+        if (*end == '-')
+            last = g_ascii_strtoll(end + 1, &end, 10);
+
+        ok = end != *part && *end == '\0' && first >= 0 && first <= last && last < n_cores;
+        for (gint64 core = first; ok && core <= last; ++core)
+            cores->push_back((int) core);
+    }
+    g_strfreev(parts);
+    return ok;
+}
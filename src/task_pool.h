@@ -0,0 +1,50 @@
+/*
+ * Streaming thread placement: each session pipeline gets one task pool per
+ * thread role, whose threads are pinned to that role's cores and run at its
+ * priority.
+ */
+
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <gst/gst.h>
+
+#include <vector>
+
+enum ThreadRole {
+    THREAD_ROLE_NETWORK,        /* ICE, DTLS/SRTP, rtpbin and the jitterbuffer */
+    THREAD_ROLE_DECODE,         /* decodebin, or a pooled branch's multiqueue, onwards */
+    THREAD_ROLE_OUTPUT,         /* the branch queues feeding conversion and sinks */
+    THREAD_ROLE_COUNT
+};
+
+struct TaskPoolConfig {
+    std::vector<int> cores[THREAD_ROLE_COUNT];  /* empty for all cores */
+    int nice[THREAD_ROLE_COUNT] = { 0, 4, 2 };  /* lowering needs CAP_SYS_NICE */
+};
+
+struct TaskPoolSet;
+
+/*
+ * Sessions are given distinct slots, so their threads start on different
+ * cores of each set.
+ */
+TaskPoolSet* task_pools_new(const char* name, const TaskPoolConfig& config);
+
+/*
+ * Only once the pipeline is in NULL state.
+ */
+void task_pools_free(TaskPoolSet* pools);
+
+/*
+ * Installs the bus sync handler that hands new tasks their pool. Streaming
+ * threads that are not GstTasks, like libnice's, are left alone.
+ */
+void task_pools_attach(TaskPoolSet* pools, GstPipeline* pipeline);
+
+/*
+ * Parses "0-3,6"; returns FALSE on malformed input.
+ */
+gboolean task_pools_parse_cores(const char* text, std::vector<int>* cores);
+
+#endif
@@ -0,0 +1,542 @@
+/*
+ * Per-element latency and per-streaming-thread CPU accounting for the
+ * receive pipeline, built on pad probes.
+ *
+ * The sink pad probe of an element stamps each buffer's arrival in a small
+ * table keyed by PTS (by sequence number for RTP elements which retimestamp),
+ * and the src pad probe looks up the matching entry when the buffer leaves.
+ * The difference goes into a log2 histogram. Sinks have no src pad, so for
+ * them we record how late frames arrive against their running time instead.
+ *
+ * Everything on the streaming threads is fixed-size and lock-free.
+ */
+
+#include "tracing.h"
+#include "metrics.h"
+
+#include <json-glib/json-glib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum TraceMode
+{
+    TRACE_NONE,
+    TRACE_BY_PTS,       /* latency, buffers keep their PTS */
+    TRACE_BY_SEQNUM,    /* latency, RTP buffers get retimestamped */
+    TRACE_LATENESS,     /* sinks: arrival against running time */
+};
+
+/* Bucket i counts values in [2^i, 2^(i+1)) microseconds */
+static const int kBuckets = 24;
+static const int kSlots = 64;
+static const int kThreads = 32;
+/* Thread CPU time is sampled every that many buffers */
+static const guint kCpuSampleMask = 31;
+
+struct TraceHistogram {
+    std::atomic<guint64> buckets[kBuckets];
+    std::atomic<guint64> count{ 0 };
+    std::atomic<guint64> sum_us{ 0 };
+
+    TraceHistogram() { for (auto& b : buckets) b = 0; }
+
+    void add(guint64 us)
+    {
+        int i = us ? (int) g_bit_storage(us) - 1 : 0;
+        buckets[std::min(i, kBuckets - 1)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum_us.fetch_add(us, std::memory_order_relaxed);
+    }
+};
+
+struct TraceElement {
+    TraceSession *session;
+    std::string name;
+    std::string factory;
+    TraceMode mode;
+
+    struct Slot {
+        std::atomic<guint64> key{ 0 };     /* 0 marks an empty slot */
+        std::atomic<GstClockTime> time{ 0 };
+    } slots[kSlots];
+
+    TraceHistogram histogram;
+    std::atomic<guint32> buffers{ 0 };
+
+    /* Touched by the reporter only */
+    guint64 reported[kBuckets] = {};
+};
+
+struct TraceThread {
+    std::atomic<gpointer> thread{ nullptr };
+    std::atomic<gint64> cpu_ns{ 0 };
+    std::atomic<TraceElement*> element{ nullptr };
+
+    /* Touched by the reporter only */
+    gint64 reported_cpu_ns = 0;
+};
+
+struct TraceSession {
+    std::string name;
+
+    std::mutex mutex;           // guards elements
+    std::vector<std::unique_ptr<TraceElement>> elements;
+
+    TraceThread threads[kThreads];
+    gint64 reported_time = 0;
+};
+
+static std::mutex registry_mutex;
+static std::vector<TraceSession*> sessions;
+static FILE *report_file;
+
+static gint64
+thread_cpu_time_ns()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+        return 0;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (gint64) (k.QuadPart + u.QuadPart) * 100;
+#else
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return (gint64) ts.tv_sec * GST_SECOND + ts.tv_nsec;
+#endif
+}
+
+static void
+sample_thread_cpu(TraceElement * element)
+{
+    if ((element->buffers.fetch_add(1, std::memory_order_relaxed) & kCpuSampleMask) != 0)
+        return;
+
+    gpointer self = g_thread_self();
+    for (auto& t : element->session->threads) {
+        gpointer current = t.thread.load(std::memory_order_acquire);
+        if (current != self) {
+            if (current || !t.thread.compare_exchange_strong(current, self))
+                continue;
+        }
+        t.cpu_ns.store(thread_cpu_time_ns(), std::memory_order_relaxed);
+        t.element.store(element, std::memory_order_relaxed);
+        return;
+    }
+}
+
+static guint64
+buffer_key(TraceMode mode, GstBuffer * buffer)
+{
+    if (mode == TRACE_BY_SEQNUM) {
+        guint8 header[4];
+        if (gst_buffer_extract(buffer, 0, header, sizeof(header)) != sizeof(header))
+            return 0;
+        return ((guint64) header[2] << 8 | header[3]) + 1;
+    }
+
+    const GstClockTime pts = GST_BUFFER_PTS(buffer);
+    return GST_CLOCK_TIME_IS_VALID(pts) ? pts + 1 : 0;
+}
+
+static void
+on_buffer_in(TraceElement * element, GstBuffer * buffer, GstClockTime now)
+{
+    const guint64 key = buffer_key(element->mode, buffer);
+    if (!key)
+        return;
+
+    auto& slot = element->slots[key % kSlots];
+    /* Keep the first arrival when several packets make up one frame */
+    if (slot.key.load(std::memory_order_relaxed) == key)
+        return;
+    slot.time.store(now, std::memory_order_relaxed);
+    slot.key.store(key, std::memory_order_release);
+}
+
+static void
+on_buffer_out(TraceElement * element, GstBuffer * buffer, GstClockTime now)
+{
+    const guint64 key = buffer_key(element->mode, buffer);
+    if (!key)
+        return;
+
+    auto& slot = element->slots[key % kSlots];
+    guint64 expected = key;
+    const GstClockTime in = slot.time.load(std::memory_order_relaxed);
+    if (!slot.key.compare_exchange_strong(expected, 0, std::memory_order_acq_rel))
+        return;
+
+    if (now > in)
+        element->histogram.add((now - in) / GST_USECOND);
+}
+
+static void
+on_sink_buffer(TraceElement * element, GstPad * pad, GstBuffer * buffer)
+{
+    const GstClockTime pts = GST_BUFFER_PTS(buffer);
+    if (!GST_CLOCK_TIME_IS_VALID(pts))
+        return;
+
+    GstEvent *event = gst_pad_get_sticky_event(pad, GST_EVENT_SEGMENT, 0);
+    if (!event)
+        return;
+
+    const GstSegment *segment;
+    gst_event_parse_segment(event, &segment);
+    const GstClockTime deadline =
+        gst_segment_to_running_time(segment, GST_FORMAT_TIME, pts);
+    gst_event_unref(event);
+
+    const GstClockTime now =
+        gst_element_get_current_running_time(GST_PAD_PARENT(pad));
+    if (GST_CLOCK_TIME_IS_VALID(deadline) && GST_CLOCK_TIME_IS_VALID(now)
+        && now > deadline)
+        element->histogram.add((now - deadline) / GST_USECOND);
+    else
+        element->histogram.add(0);
+}
+
+static void
+handle_probe(TraceElement * element, GstPad * pad, GstPadProbeInfo * info)
+{
+    const GstClockTime now = gst_util_get_timestamp();
+    const bool in = GST_PAD_IS_SINK(pad);
+
+    auto handle = [&](GstBuffer * buffer) {
+        if (element->mode == TRACE_LATENESS)
+            on_sink_buffer(element, pad, buffer);
+        else if (in)
+            on_buffer_in(element, buffer, now);
+        else
+            on_buffer_out(element, buffer, now);
+    };
+
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+        handle(GST_PAD_PROBE_INFO_BUFFER(info));
+    }
+    else if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        const guint n = gst_buffer_list_length(list);
+        for (guint i = 0; i < n; ++i)
+            handle(gst_buffer_list_get(list, i));
+    }
+
+    if (!in || element->mode == TRACE_LATENESS)
+        sample_thread_cpu(element);
+}
+
+static GstPadProbeReturn
+on_trace_probe(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    handle_probe(static_cast<TraceElement *>(user_data), pad, info);
+    return GST_PAD_PROBE_OK;
+}
+
+static TraceMode
+classify(GstElement * element)
+{
+    if (GST_IS_BIN(element))
+        return TRACE_NONE;
+
+    GstElementFactory *factory = gst_element_get_factory(element);
+    if (!factory)
+        return TRACE_NONE;
+
+    const gchar *name = GST_OBJECT_NAME(factory);
+    if (g_str_equal(name, "rtpjitterbuffer"))
+        return TRACE_BY_SEQNUM;
+    if (g_str_equal(name, "queue"))
+        return TRACE_BY_PTS;
+
+    const gchar *klass =
+        gst_element_factory_get_metadata(factory, GST_ELEMENT_METADATA_KLASS);
+    if (!klass)
+        return TRACE_NONE;
+    if (strstr(klass, "Depayloader") || strstr(klass, "Decoder")
+        || strstr(klass, "Converter") || strstr(klass, "Scaler"))
+        return TRACE_BY_PTS;
+    if (strstr(klass, "Sink") && !strstr(klass, "Network"))
+        return TRACE_LATENESS;
+
+    return TRACE_NONE;
+}
+
+static void
+add_probe(GstElement * element, const char *pad_name, TraceElement * trace)
+{
+    GstPad *pad = gst_element_get_static_pad(element, pad_name);
+    if (!pad)
+        return;
+    gst_pad_add_probe(pad,
+        (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+        on_trace_probe, trace, NULL);
+    gst_object_unref(pad);
+}
+
+static void
+on_deep_element_added(GstBin * bin, GstBin * sub_bin, GstElement * element,
+    TraceSession * session)
+{
+    const TraceMode mode = classify(element);
+    if (mode == TRACE_NONE)
+        return;
+
+    auto trace = std::make_unique<TraceElement>();
+    trace->session = session;
+    trace->name = GST_ELEMENT_NAME(element);
+    trace->factory = GST_OBJECT_NAME(gst_element_get_factory(element));
+    trace->mode = mode;
+
+    add_probe(element, "sink", trace.get());
+    if (mode != TRACE_LATENESS)
+        add_probe(element, "src", trace.get());
+
+    GST_DEBUG_OBJECT(element, "tracing %s", trace->factory.c_str());
+
+    std::lock_guard<std::mutex> lock(session->mutex);
+    session->elements.push_back(std::move(trace));
+}
+
+TraceSession*
+trace_session_new(const char* name)
+{
+    auto session = new TraceSession;
+    session->name = name;
+    session->reported_time = g_get_monotonic_time();
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    sessions.push_back(session);
+    return session;
+}
+
+void
+trace_session_free(TraceSession* session)
+{
+    if (!session)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        sessions.erase(std::remove(sessions.begin(), sessions.end(), session),
+            sessions.end());
+    }
+    delete session;
+}
+
+void
+trace_session_attach(TraceSession* session, GstBin* bin)
+{
+    g_signal_connect(bin, "deep-element-added",
+        G_CALLBACK(on_deep_element_added), session);
+}
+
+/* Upper bound of the bucket holding the given quantile of the counts */
+static guint64
+percentile_us(const guint64 * counts, guint64 total, double quantile)
+{
+    if (!total)
+        return 0;
+
+    const guint64 rank = (guint64) (quantile * (total - 1)) + 1;
+    guint64 seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+        seen += counts[i];
+        if (seen >= rank)
+            return (guint64) 2 << i;
+    }
+    return (guint64) 2 << (kBuckets - 1);
+}
+
+static const char *
+mode_name(TraceMode mode)
+{
+    return mode == TRACE_LATENESS ? "lateness" : "latency";
+}
+
+static void
+report_session(TraceSession * session, JsonBuilder * builder)
+{
+    const gint64 now = g_get_monotonic_time();
+    const gint64 wall_ns = (now - session->reported_time) * 1000;
+    session->reported_time = now;
+
+    json_builder_begin_object(builder);
+    json_builder_set_member_name(builder, "session");
+    json_builder_add_string_value(builder, session->name.c_str());
+    json_builder_set_member_name(builder, "time");
+    json_builder_add_int_value(builder, g_get_real_time());
+
+    json_builder_set_member_name(builder, "elements");
+    json_builder_begin_array(builder);
+    {
+        std::lock_guard<std::mutex> lock(session->mutex);
+        for (auto& e : session->elements) {
+            guint64 counts[kBuckets], total = 0;
+            for (int i = 0; i < kBuckets; ++i) {
+                const guint64 c = e->histogram.buckets[i].load(std::memory_order_relaxed);
+                counts[i] = c - e->reported[i];
+                e->reported[i] = c;
+                total += counts[i];
+            }
+
+            json_builder_begin_object(builder);
+            json_builder_set_member_name(builder, "name");
+            json_builder_add_string_value(builder, e->name.c_str());
+            json_builder_set_member_name(builder, "factory");
+            json_builder_add_string_value(builder, e->factory.c_str());
+            json_builder_set_member_name(builder, "kind");
+            json_builder_add_string_value(builder, mode_name(e->mode));
+            json_builder_set_member_name(builder, "count");
+            json_builder_add_int_value(builder, total);
+            json_builder_set_member_name(builder, "p50_us");
+            json_builder_add_int_value(builder, percentile_us(counts, total, 0.50));
+            json_builder_set_member_name(builder, "p95_us");
+            json_builder_add_int_value(builder, percentile_us(counts, total, 0.95));
+            json_builder_set_member_name(builder, "p99_us");
+            json_builder_add_int_value(builder, percentile_us(counts, total, 0.99));
+            json_builder_set_member_name(builder, "buckets");
+            json_builder_begin_array(builder);
+            for (int i = 0; i < kBuckets; ++i)
+                json_builder_add_int_value(builder, counts[i]);
+            json_builder_end_array(builder);
+            json_builder_end_object(builder);
+        }
+    }
+    json_builder_end_array(builder);
+
+    json_builder_set_member_name(builder, "threads");
+    json_builder_begin_array(builder);
+    for (auto& t : session->threads) {
+        gpointer thread = t.thread.load(std::memory_order_acquire);
+        if (!thread)
+            continue;
+
+        TraceElement *element = t.element.load(std::memory_order_relaxed);
+        const gint64 cpu_ns = t.cpu_ns.load(std::memory_order_relaxed);
+        const gint64 used_ns = cpu_ns - t.reported_cpu_ns;
+        t.reported_cpu_ns = cpu_ns;
+
+        gchar id[32];
+        g_snprintf(id, sizeof(id), "%p", thread);
+
+        json_builder_begin_object(builder);
+        json_builder_set_member_name(builder, "thread");
+        json_builder_add_string_value(builder, id);
+        json_builder_set_member_name(builder, "element");
+        json_builder_add_string_value(builder, element ? element->name.c_str() : "");
+        json_builder_set_member_name(builder, "cpu_ns");
+        json_builder_add_int_value(builder, cpu_ns);
+        json_builder_set_member_name(builder, "cpu_percent");
+        json_builder_add_double_value(builder,
+            wall_ns > 0 ? 100.0 * used_ns / wall_ns : 0);
+        json_builder_end_object(builder);
+    }
+    json_builder_end_array(builder);
+
+    json_builder_end_object(builder);
+}
+
+static gboolean
+trace_report(gpointer unused)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    for (auto session : sessions) {
+        JsonBuilder *builder = json_builder_new();
+        report_session(session, builder);
+
+        JsonGenerator *generator = json_generator_new();
+        JsonNode *root = json_builder_get_root(builder);
+        json_generator_set_root(generator, root);
+        gchar *text = json_generator_to_data(generator, NULL);
+
+        fprintf(report_file ? report_file : stdout, "%s\n", text);
+
+        g_free(text);
+        json_node_unref(root);
+        g_object_unref(generator);
+        g_object_unref(builder);
+    }
+    fflush(report_file ? report_file : stdout);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+collect_trace_metrics(GString * out, gpointer unused)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    g_string_append(out,
+        "# HELP media_receiver_element_latency_seconds Time buffers spend in an element, or how late they reach a sink\n"
+        "# TYPE media_receiver_element_latency_seconds histogram\n");
+    for (auto session : sessions) {
+        std::lock_guard<std::mutex> session_lock(session->mutex);
+        for (auto& e : session->elements) {
+            guint64 cumulative = 0;
+            for (int i = 0; i < kBuckets; ++i) {
+                cumulative += e->histogram.buckets[i].load(std::memory_order_relaxed);
+                g_string_append_printf(out,
+                    "media_receiver_element_latency_seconds_bucket{session=\"%s\",element=\"%s\",kind=\"%s\",le=\"%g\"} %"
+                    G_GUINT64_FORMAT "\n", session->name.c_str(), e->name.c_str(),
+                    mode_name(e->mode), ((guint64) 2 << i) / 1e6, cumulative);
+            }
+            g_string_append_printf(out,
+                "media_receiver_element_latency_seconds_bucket{session=\"%s\",element=\"%s\",kind=\"%s\",le=\"+Inf\"} %"
+                G_GUINT64_FORMAT "\n"
+                "media_receiver_element_latency_seconds_sum{session=\"%s\",element=\"%s\",kind=\"%s\"} %g\n"
+                "media_receiver_element_latency_seconds_count{session=\"%s\",element=\"%s\",kind=\"%s\"} %"
+                G_GUINT64_FORMAT "\n",
+                session->name.c_str(), e->name.c_str(), mode_name(e->mode), cumulative,
+                session->name.c_str(), e->name.c_str(), mode_name(e->mode),
+                e->histogram.sum_us.load(std::memory_order_relaxed) / 1e6,
+                session->name.c_str(), e->name.c_str(), mode_name(e->mode), cumulative);
+        }
+    }
+
+    g_string_append(out,
+        "# HELP media_receiver_thread_cpu_seconds_total CPU time of streaming threads\n"
+        "# TYPE media_receiver_thread_cpu_seconds_total counter\n");
+    for (auto session : sessions) {
+        for (auto& t : session->threads) {
+            gpointer thread = t.thread.load(std::memory_order_acquire);
+            if (!thread)
+                continue;
+            TraceElement *element = t.element.load(std::memory_order_relaxed);
+            g_string_append_printf(out,
+                "media_receiver_thread_cpu_seconds_total{session=\"%s\",thread=\"%p\",element=\"%s\"} %g\n",
+                session->name.c_str(), thread, element ? element->name.c_str() : "",
+                t.cpu_ns.load(std::memory_order_relaxed) / 1e9);
+        }
+    }
+}
+
+void
+trace_start_reporting(guint interval_seconds, const char* path)
+{
+    if (path && !(report_file = fopen(path, "a")))
+        gst_printerr("Can't open trace output '%s', using stdout\n", path);
+
+    metrics_register_collector(collect_trace_metrics, NULL);
+    g_timeout_add_seconds(interval_seconds, trace_report, NULL);
+}
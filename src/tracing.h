@@ -0,0 +1,32 @@
+/*
+ * Per-element latency and per-streaming-thread CPU accounting for the
+ * receive pipeline, built on pad probes.
+ */
+
+#ifndef TRACING_H
+#define TRACING_H
+
+#include <gst/gst.h>
+
+struct TraceSession;
+
+TraceSession* trace_session_new(const char* name);
+
+/*
+ * Must only be freed once the pipeline it is attached to is in NULL state.
+ */
+void trace_session_free(TraceSession* session);
+
+/*
+ * Instruments the jitterbuffer, depayloaders, decoders, converters and sinks
+ * as they get added anywhere below the bin. Attach before adding children.
+ */
+void trace_session_attach(TraceSession* session, GstBin* bin);
+
+/*
+ * Appends one JSON line per session to the file (stdout when NULL) every
+ * interval, and adds the histograms to the metrics endpoint.
+ */
+void trace_start_reporting(guint interval_seconds, const char* path);
+
+#endif